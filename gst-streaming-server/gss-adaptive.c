@@ -36,6 +36,8 @@
 #include "gss-soup.h"
 #include "gss-content.h"
 #include "gss-isom.h"
+#include "gss-log.h"
+#include "gss-mpegts.h"
 #include "gss-playready.h"
 #include "gss-sglist.h"
 #include "gss-utils.h"
@@ -73,7 +75,10 @@ static void gss_adaptive_resource_get_manifest (GssTransaction * t,
     GssAdaptive * adaptive);
 static void gss_adaptive_resource_get_content (GssTransaction * t,
     GssAdaptive * adaptive);
-static void load_file (GssAdaptive * adaptive, const char *filename);
+static void load_file (GssAdaptiveMedia * media, const char *filename);
+static void gss_level_from_track (GssAdaptive * adaptive,
+    GssIsomTrack * track, GssIsomMovie * movie, const char *filename,
+    int fd, gboolean is_video, const char *license_url);
 static void gss_adaptive_async_assemble_chunk (GssTransaction * t,
     gpointer priv);
 static void gss_adaptive_async_assemble_chunk_finish (GssTransaction * t,
@@ -81,27 +86,30 @@ static void gss_adaptive_async_assemble_chunk_finish (GssTransaction * t,
 static void gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv);
 static void gss_adaptive_dash_range_async_finish (GssTransaction * t,
     gpointer priv);
+static void gss_adaptive_async_assemble_chunked (GssTransaction * t,
+    gpointer priv);
+static void gss_adaptive_async_assemble_chunked_finish (GssTransaction * t,
+    gpointer priv);
+static void gss_adaptive_async_assemble_ts_segment (GssTransaction * t,
+    gpointer priv);
+static void gss_adaptive_async_assemble_ts_segment_finish (GssTransaction * t,
+    gpointer priv);
 
+/* isoff-ondemand ranges larger than this are queued at low priority */
+#define GSS_ADAPTIVE_BULK_RANGE_SIZE (8 * 1024 * 1024)
 
+/* Reads the mdat of a fragment, encrypting it on the way in if
+ * @encrypt is set and the adaptive stream has DRM. */
 static guint8 *
-gss_adaptive_assemble_chunk (GssTransaction * t, GssAdaptive * adaptive,
-    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+gss_adaptive_load_mdat (GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomFragment * fragment, gboolean encrypt, GError ** error)
 {
-  GError *error = NULL;
   guint8 *mdat_data;
-  int fd;
   gboolean ret;
 
-  g_return_val_if_fail (t != NULL, NULL);
-  g_return_val_if_fail (adaptive != NULL, NULL);
-  g_return_val_if_fail (level != NULL, NULL);
-  g_return_val_if_fail (fragment != NULL, NULL);
-
-  fd = open (level->filename, O_RDONLY);
-  if (fd < 0) {
-    GST_WARNING ("failed to open \"%s\", error=\"%s\", broken manifest?",
-        level->filename, g_strerror (errno));
-    gss_transaction_error_not_found (t,
+  if (level->fd < 0) {
+    GST_WARNING ("\"%s\" is not open, broken manifest?", level->filename);
+    g_set_error (error, _gss_error_quark, GSS_ERROR_FILE_READ,
         "failed to open file (broken manifest?)");
     return NULL;
   }
@@ -111,20 +119,191 @@ gss_adaptive_assemble_chunk (GssTransaction * t, GssAdaptive * adaptive,
   GST_WRITE_UINT32_BE (mdat_data, fragment->mdat_size);
   GST_WRITE_UINT32_LE (mdat_data + 4, GST_MAKE_FOURCC ('m', 'd', 'a', 't'));
 
-  ret = gss_sglist_load (fragment->sglist, fd, mdat_data + 8, &error);
+  ret = gss_playready_load_fragment (adaptive->server->playready, fragment,
+      level->fd, NULL, mdat_data,
+      (encrypt && adaptive->drm_type != GSS_DRM_CLEAR) ?
+      adaptive->content_key : NULL, error);
   if (!ret) {
-    gss_transaction_error_not_found (t, error->message);
-    g_error_free (error);
     g_free (mdat_data);
-    close (fd);
     return NULL;
   }
 
-  close (fd);
+  return mdat_data;
+}
+
+static guint8 *
+gss_adaptive_assemble_chunk (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment, gboolean encrypt)
+{
+  GError *error = NULL;
+  guint8 *mdat_data;
+
+  g_return_val_if_fail (t != NULL, NULL);
+  g_return_val_if_fail (adaptive != NULL, NULL);
+  g_return_val_if_fail (level != NULL, NULL);
+  g_return_val_if_fail (fragment != NULL, NULL);
+
+  mdat_data = gss_adaptive_load_mdat (adaptive, level, fragment, encrypt,
+      &error);
+  if (mdat_data == NULL) {
+    gss_transaction_error_not_found (t, error->message);
+    g_error_free (error);
+  }
 
   return mdat_data;
 }
 
+/* Everything that determines the encrypted bytes of a fragment.  The
+ * content key is included so that changing the key seed does not
+ * serve stale fragments; the store only keeps a hash of the key.
+ * Likewise the file identity, for media files replaced on disk. */
+static char *
+gss_adaptive_get_store_key (GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomFragment * fragment)
+{
+  char *content_key;
+  char *key;
+
+  content_key = gss_hex_encode (adaptive->content_key,
+      GSS_ADAPTIVE_KEY_LENGTH);
+  key = g_strdup_printf ("%s/%s/%s/%s@%" G_GUINT64_FORMAT ".%"
+      G_GINT64_FORMAT ":%d/%d/%s", adaptive->content_id, adaptive->version,
+      gss_drm_get_drm_name (adaptive->drm_type), level->filename,
+      level->inode, level->mtime, level->track_id, fragment->index,
+      content_key);
+  g_free (content_key);
+
+  return key;
+}
+
+/* Returns the mdat of a whole fragment, encrypted if the stream has
+ * DRM.  Encrypted fragments are served from the fragment store when
+ * present, and added to it otherwise. */
+static SoupBuffer *
+gss_adaptive_lookup_mdat_buffer (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment, const char *key)
+{
+  GMappedFile *mapped;
+
+  mapped = gss_fragment_store_lookup (adaptive->store, key);
+  if (mapped && g_mapped_file_get_length (mapped) == fragment->mdat_size) {
+    const guint8 *data = (const guint8 *) g_mapped_file_get_contents (mapped);
+    gsize length = g_mapped_file_get_length (mapped);
+    volatile guint8 sum = 0;
+    gsize i;
+
+    /* fault the file in here, so that writing the response does not
+     * block the loop on the disk */
+    for (i = 0; i < length; i += 4096) {
+      sum += data[i];
+    }
+
+    return soup_buffer_new_with_owner (data, length, mapped,
+        (GDestroyNotify) g_mapped_file_unref);
+  }
+  if (mapped) {
+    GST_WARNING ("stored fragment has wrong size, ignoring");
+    g_mapped_file_unref (mapped);
+  }
+
+  return NULL;
+}
+
+static SoupBuffer *
+gss_adaptive_get_mdat_buffer (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+{
+  SoupBuffer *buffer;
+  guint8 *mdat_data;
+  char *key;
+
+  if (adaptive->store == NULL || adaptive->drm_type == GSS_DRM_CLEAR) {
+    mdat_data = gss_adaptive_assemble_chunk (t, adaptive, level, fragment,
+        TRUE);
+    if (mdat_data == NULL)
+      return NULL;
+    return soup_buffer_new (SOUP_MEMORY_TAKE, mdat_data, fragment->mdat_size);
+  }
+
+  key = gss_adaptive_get_store_key (adaptive, level, fragment);
+  buffer = gss_adaptive_lookup_mdat_buffer (adaptive, level, fragment, key);
+  if (buffer) {
+    g_free (key);
+    return buffer;
+  }
+
+  mdat_data = gss_adaptive_assemble_chunk (t, adaptive, level, fragment, TRUE);
+  if (mdat_data == NULL) {
+    g_free (key);
+    return NULL;
+  }
+  gss_fragment_store_add (adaptive->store, key, mdat_data,
+      fragment->mdat_size);
+  g_free (key);
+
+  return soup_buffer_new (SOUP_MEMORY_TAKE, mdat_data, fragment->mdat_size);
+}
+
+static void
+gss_adaptive_fill_level (GssAdaptive * adaptive, GssAdaptiveLevel * level)
+{
+  int i;
+
+  for (i = 0; i < level->track->n_fragments; i++) {
+    GssIsomFragment *fragment = level->track->fragments[i];
+    GError *error = NULL;
+    guint8 *mdat_data;
+    char *key;
+
+    key = gss_adaptive_get_store_key (adaptive, level, fragment);
+    if (gss_fragment_store_contains (adaptive->store, key)) {
+      g_free (key);
+      continue;
+    }
+
+    mdat_data = gss_adaptive_load_mdat (adaptive, level, fragment, TRUE,
+        &error);
+    if (mdat_data == NULL) {
+      GST_WARNING ("failed to fill store for %s: %s", adaptive->content_id,
+          error->message);
+      g_error_free (error);
+      g_free (key);
+      return;
+    }
+    gss_fragment_store_add (adaptive->store, key, mdat_data,
+        fragment->mdat_size);
+    g_free (mdat_data);
+    g_free (key);
+  }
+}
+
+/**
+ * gss_adaptive_fill_store:
+ * @adaptive: a #GssAdaptive with a fragment store
+ *
+ * Encrypts every fragment of @adaptive that is not yet in its fragment
+ * store and adds it.  This reads and encrypts the whole title, so it
+ * is meant to be run from a background thread to warm up popular
+ * content before it is requested.
+ */
+void
+gss_adaptive_fill_store (GssAdaptive * adaptive)
+{
+  int i;
+
+  g_return_if_fail (adaptive != NULL);
+
+  if (adaptive->store == NULL || adaptive->drm_type == GSS_DRM_CLEAR)
+    return;
+
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    gss_adaptive_fill_level (adaptive, &adaptive->video_levels[i]);
+  }
+  for (i = 0; i < adaptive->n_audio_levels; i++) {
+    gss_adaptive_fill_level (adaptive, &adaptive->audio_levels[i]);
+  }
+}
+
 
 typedef struct _ManifestQuery ManifestQuery;
 struct _ManifestQuery
@@ -264,15 +443,18 @@ gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
   GSS_A ("  </StreamIndex>\n");
   if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
     char *prot_header_base64;
+    char *license_url;
 
     GSS_A ("<Protection>\n");
     GSS_A ("  <ProtectionHeader "
         "SystemID=\"9a04f079-9840-4286-ab92-e65be0885f95\">");
 
+    license_url = gss_playready_get_license_url (t->server->playready);
     prot_header_base64 = gss_playready_get_protection_header_base64 (adaptive,
-        t->server->playready->license_url, mq.auth_token);
+        license_url, mq.auth_token);
     GSS_P ("%s", prot_header_base64);
     g_free (prot_header_base64);
+    g_free (license_url);
 
     GSS_A ("</ProtectionHeader>\n");
     GSS_A ("</Protection>\n");
@@ -281,6 +463,16 @@ gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
 
 }
 
+static char *
+format_key_id_uuid (GssAdaptive * adaptive)
+{
+  const guint8 *k = adaptive->kid;
+
+  return g_strdup_printf ("%02x%02x%02x%02x-%02x%02x-%02x%02x-"
+      "%02x%02x-%02x%02x%02x%02x%02x%02x", k[0], k[1], k[2], k[3], k[4],
+      k[5], k[6], k[7], k[8], k[9], k[10], k[11], k[12], k[13], k[14], k[15]);
+}
+
 static void
 append_content_protection (GssTransaction * t, GssAdaptive * adaptive,
     const char *auth_token)
@@ -289,16 +481,27 @@ append_content_protection (GssTransaction * t, GssAdaptive * adaptive,
 
   if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
     char *prot_header_base64;
+    char *license_url;
     GSS_A ("      <ContentProtection schemeIdUri=\"urn:mpeg:dash:"
         "mp4protection:2011\" value=\"cenc\"/>\n");
     GSS_A ("      <ContentProtection "
         "schemeIdUri=\"urn:uuid:9a04f079-9840-4286-ab92-e65be0885f95\">\n");
+    license_url = gss_playready_get_license_url (t->server->playready);
     prot_header_base64 =
         gss_playready_get_protection_header_base64 (adaptive,
-        t->server->playready->license_url, auth_token);
+        license_url, auth_token);
     GSS_P ("        <mspr:pro>%s</mspr:pro>\n", prot_header_base64);
     g_free (prot_header_base64);
+    g_free (license_url);
     GSS_A ("      </ContentProtection>\n");
+  } else if (adaptive->drm_type == GSS_DRM_CBCS) {
+    char *kid;
+
+    kid = format_key_id_uuid (adaptive);
+    GSS_P ("      <ContentProtection schemeIdUri=\"urn:mpeg:dash:"
+        "mp4protection:2011\" value=\"cbcs\" cenc:default_KID=\"%s\"/>\n",
+        kid);
+    g_free (kid);
   }
 
 }
@@ -322,6 +525,8 @@ gss_adaptive_resource_get_dash_range_mpd (GssTransaction * t,
       "  xmlns=\"urn:mpeg:dash:schema:mpd:2011\"\n");
   if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
     GSS_A ("  xmlns:mspr=\"urn:microsoft:playready\"\n");
+  } else if (adaptive->drm_type == GSS_DRM_CBCS) {
+    GSS_A ("  xmlns:cenc=\"urn:mpeg:cenc:2013\"\n");
   }
   GSS_P ("  xsi:schemaLocation=\"urn:mpeg:dash:schema:mpd:2011 DASH-MPD.xsd\"\n"
       "  type=\"static\"\n"
@@ -502,6 +707,15 @@ gss_adaptive_resource_get_dash_range_fragment (GssTransaction * t,
   {
     GssAdaptiveQuery *query;
 
+    /* whole-file downloads must not hold up players fetching segments */
+    if (end - start > GSS_ADAPTIVE_BULK_RANGE_SIZE) {
+      gss_transaction_set_priority (t, GSS_TRANSACTION_PRIORITY_LOW);
+    }
+    if (!gss_transaction_admit (t)) {
+      gss_transaction_shed (t);
+      return;
+    }
+
     soup_server_pause_message (t->soupserver, t->msg);
 
     query = g_malloc0 (sizeof (GssAdaptiveQuery));
@@ -536,7 +750,7 @@ gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv)
 
   for (i = 0; i < level->track->n_fragments; i++) {
     GssIsomFragment *fragment = level->track->fragments[i];
-    guint8 *mdat_data;
+    SoupBuffer *mdat_buffer;
 
     if (offset + n_bytes <= fragment->offset)
       break;
@@ -550,18 +764,16 @@ gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv)
 
     if (ranges_overlap (offset, n_bytes, header_size + fragment->offset +
             fragment->moof_size, fragment->mdat_size)) {
-      mdat_data = gss_adaptive_assemble_chunk (t, query->adaptive, level,
+      mdat_buffer = gss_adaptive_get_mdat_buffer (t, query->adaptive, level,
           fragment);
-      if (query->adaptive->drm_type != GSS_DRM_CLEAR) {
-        gss_playready_encrypt_samples (fragment, mdat_data,
-            query->adaptive->content_key);
-      }
+      if (mdat_buffer == NULL)
+        return;
 
       gss_soup_message_body_append_clipped (t->msg->response_body,
-          SOUP_MEMORY_COPY, mdat_data + 8,
+          SOUP_MEMORY_COPY, mdat_buffer->data + 8,
           offset, n_bytes, header_size + fragment->offset + fragment->moof_size,
           fragment->mdat_size - 8);
-      g_free (mdat_data);
+      soup_buffer_free (mdat_buffer);
     }
   }
 
@@ -573,7 +785,7 @@ gss_adaptive_dash_range_async_finish (GssTransaction * t, gpointer priv)
   GssAdaptiveQuery *query = priv;
 
   soup_message_body_complete (t->msg->response_body);
-  soup_server_unpause_message (t->soupserver, t->msg);
+  gss_transaction_unpause (t);
   g_free (query);
 }
 
@@ -597,6 +809,8 @@ gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
       "  xmlns=\"urn:mpeg:dash:schema:mpd:2011\"\n");
   if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
     GSS_A ("  xmlns:mspr=\"urn:microsoft:playready\"\n");
+  } else if (adaptive->drm_type == GSS_DRM_CBCS) {
+    GSS_A ("  xmlns:cenc=\"urn:mpeg:cenc:2013\"\n");
   }
   GSS_P ("  xsi:schemaLocation=\"urn:mpeg:dash:schema:mpd:2011 DASH-MPD.xsd\"\n"
       "  type=\"static\"\n"
@@ -680,6 +894,206 @@ gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
 
 }
 
+static void
+append_hls_key (GssTransaction * t, GssAdaptive * adaptive,
+    const char *auth_token)
+{
+  GString *s = t->s;
+
+  if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
+    char *prot_header_base64;
+    char *license_url;
+
+    license_url = gss_playready_get_license_url (t->server->playready);
+    prot_header_base64 =
+        gss_playready_get_protection_header_base64 (adaptive,
+        license_url, auth_token);
+    g_free (license_url);
+    GSS_P ("#EXT-X-KEY:METHOD=SAMPLE-AES-CTR,"
+        "KEYFORMAT=\"com.microsoft.playready\",KEYFORMATVERSIONS=\"1\","
+        "URI=\"data:text/plain;charset=UTF-16;base64,%s\"\n",
+        prot_header_base64);
+    g_free (prot_header_base64);
+  } else if (adaptive->drm_type == GSS_DRM_CBCS) {
+    char *kid;
+
+    /* Key delivery is left to the player, FairPlay style */
+    kid = gss_hex_encode (adaptive->kid, 16);
+    GSS_P ("#EXT-X-KEY:METHOD=SAMPLE-AES,URI=\"skd://%s\","
+        "KEYFORMAT=\"com.apple.streamingkeydelivery\","
+        "KEYFORMATVERSIONS=\"1\"\n", kid);
+    g_free (kid);
+  }
+}
+
+static GssAdaptiveLevel *
+get_audio_level_for_video_level (GssAdaptive * adaptive,
+    GssAdaptiveLevel * video_level)
+{
+  int i;
+
+  /* fragment boundaries only line up within a file, so prefer the audio
+   * track stored next to the video */
+  for (i = 0; i < adaptive->n_audio_levels; i++) {
+    if (strcmp (adaptive->audio_levels[i].filename,
+            video_level->filename) == 0) {
+      return &adaptive->audio_levels[i];
+    }
+  }
+  if (adaptive->n_audio_levels > 0) {
+    return &adaptive->audio_levels[0];
+  }
+  return NULL;
+}
+
+static void
+gss_adaptive_resource_get_hls_master_playlist (GssTransaction * t,
+    GssAdaptive * adaptive)
+{
+  GString *s = g_string_new ("");
+  int i;
+  ManifestQuery mq;
+  gboolean is_ts;
+  int audio_bitrate;
+
+  parse_manifest_query (&mq, t);
+
+  t->s = s;
+
+  soup_message_headers_replace (t->msg->response_headers, "Content-Type",
+      "application/vnd.apple.mpegurl");
+
+  /* TS segments carry audio muxed with the video, fMP4 uses a separate
+   * audio rendition */
+  is_ts = (adaptive->stream_type == GSS_ADAPTIVE_STREAM_HLS_TS);
+
+  GSS_A ("#EXTM3U\n");
+  GSS_P ("#EXT-X-VERSION:%d\n", is_ts ? 3 : 7);
+  GSS_A ("#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+  /* every audio level is a rendition in the group, and a variant may
+   * be played with any of them, so its bandwidth counts the largest */
+  audio_bitrate = 0;
+  for (i = 0; i < adaptive->n_audio_levels && !is_ts; i++) {
+    GssAdaptiveLevel *audio_level = &adaptive->audio_levels[i];
+
+    GSS_P ("#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",NAME=\"a%d\","
+        "LANGUAGE=\"en\",DEFAULT=%s,AUTOSELECT=YES,URI=\"a%d.m3u8\"\n",
+        i, (i == 0) ? "YES" : "NO", i);
+    audio_bitrate = MAX (audio_bitrate, audio_level->bitrate);
+  }
+
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    GssAdaptiveLevel *level = &adaptive->video_levels[i];
+
+    if (manifest_query_check_video (&mq, level)) {
+      if (adaptive->n_audio_levels > 0) {
+        GssAdaptiveLevel *audio_level;
+
+        /* TS segments carry the audio level muxed with this one */
+        audio_level = get_audio_level_for_video_level (adaptive, level);
+        GSS_P ("#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"%s,%s\","
+            "RESOLUTION=%dx%d%s\n",
+            level->bitrate + (is_ts ? audio_level->bitrate : audio_bitrate),
+            level->codec, audio_level->codec, level->video_width,
+            level->video_height, is_ts ? "" : ",AUDIO=\"audio\"");
+      } else {
+        GSS_P ("#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"%s\","
+            "RESOLUTION=%dx%d\n", level->bitrate, level->codec,
+            level->video_width, level->video_height);
+      }
+      GSS_P ("v%d.m3u8\n", i);
+    }
+  }
+}
+
+static void
+gss_adaptive_resource_get_hls_media_playlist (GssTransaction * t,
+    GssAdaptive * adaptive, const char *path)
+{
+  GString *s;
+  GssAdaptiveLevel *level;
+  const char *stream;
+  guint64 max_duration;
+  char *end;
+  int index;
+  int i;
+  ManifestQuery mq;
+  gboolean is_ts;
+
+  is_ts = (adaptive->stream_type == GSS_ADAPTIVE_STREAM_HLS_TS);
+
+  if (path[0] != 'v' && (path[0] != 'a' || is_ts)) {
+    gss_transaction_error_not_found (t, "bad playlist name");
+    return;
+  }
+  index = strtoul (path + 1, &end, 10);
+  if (end == path + 1 || strcmp (end, ".m3u8") != 0) {
+    gss_transaction_error_not_found (t, "bad playlist name");
+    return;
+  }
+
+  level = NULL;
+  if (path[0] == 'a') {
+    if (index < adaptive->n_audio_levels) {
+      level = &adaptive->audio_levels[index];
+    }
+    stream = "audio";
+  } else {
+    if (index < adaptive->n_video_levels) {
+      level = &adaptive->video_levels[index];
+    }
+    stream = "video";
+  }
+  if (level == NULL) {
+    gss_transaction_error_not_found (t, "level not found for playlist");
+    return;
+  }
+
+  parse_manifest_query (&mq, t);
+
+  s = g_string_new ("");
+  t->s = s;
+
+  soup_message_headers_replace (t->msg->response_headers, "Content-Type",
+      "application/vnd.apple.mpegurl");
+
+  max_duration = 0;
+  for (i = 0; i < level->n_fragments; i++) {
+    GssIsomFragment *fragment;
+    fragment = gss_isom_track_get_fragment (level->track, i);
+    max_duration = MAX (max_duration, fragment->duration);
+  }
+
+  GSS_A ("#EXTM3U\n");
+  GSS_P ("#EXT-X-VERSION:%d\n", is_ts ? 3 : 7);
+  GSS_P ("#EXT-X-TARGETDURATION:%d\n",
+      (int) ((max_duration + GSS_ISM_SECOND - 1) / GSS_ISM_SECOND));
+  GSS_A ("#EXT-X-MEDIA-SEQUENCE:0\n");
+  GSS_A ("#EXT-X-PLAYLIST-TYPE:VOD\n");
+  if (!is_ts) {
+    append_hls_key (t, adaptive, mq.auth_token);
+    GSS_P ("#EXT-X-MAP:URI=\"content?stream=%s&bitrate=%d&start_time=init\"\n",
+        stream, level->bitrate);
+  }
+
+  /* For fMP4, the segments are the same moof/mdat pairs that the Smooth
+   * and DASH live paths serve, signalling encryption with saiz/saio
+   * rather than the PIFF box, so they go through the same content
+   * handler.  TS segments are packaged from the same fragments on
+   * request. */
+  for (i = 0; i < level->n_fragments; i++) {
+    GssIsomFragment *fragment;
+    fragment = gss_isom_track_get_fragment (level->track, i);
+    GSS_P ("#EXTINF:%.3f,\n", (double) fragment->duration / GSS_ISM_SECOND);
+    GSS_P ("%s?stream=%s&bitrate=%d&start_time=%" G_GUINT64_FORMAT "\n",
+        is_ts ? "segment" : "content", stream, level->bitrate,
+        fragment->timestamp);
+  }
+
+  GSS_A ("#EXT-X-ENDLIST\n");
+}
+
 static gboolean
 parse_guint64 (const char *s, guint64 * value)
 {
@@ -698,6 +1112,85 @@ parse_guint64 (const char *s, guint64 * value)
   return TRUE;
 }
 
+/* Responds with @fragment, whose mdat is in @buffer */
+static void
+gss_adaptive_append_fragment (GssTransaction * t, GssIsomFragment * fragment,
+    SoupBuffer * buffer)
+{
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+  /* strip off mdat header at end of moof_data */
+  soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
+      fragment->moof_data, fragment->moof_size - 8);
+  soup_message_body_append_buffer (t->msg->response_body, buffer);
+}
+
+static void
+gss_adaptive_async_read_stored (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+  char *key;
+
+  key = gss_adaptive_get_store_key (query->adaptive, query->level,
+      query->fragment);
+  query->buffer = gss_adaptive_lookup_mdat_buffer (query->adaptive,
+      query->level, query->fragment, key);
+  g_free (key);
+}
+
+static void
+gss_adaptive_async_read_stored_finish (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+
+  if (query->buffer) {
+    gss_transaction_count_degraded (t);
+    gss_adaptive_append_fragment (t, query->fragment, query->buffer);
+    soup_buffer_free (query->buffer);
+  } else {
+    /* evicted from the store meanwhile */
+    gss_transaction_shed (t);
+  }
+  gss_transaction_unpause (t);
+  g_free (query);
+}
+
+/* Serves @fragment if its encrypted mdat is in the fragment store.  The
+ * file is read on the I/O threads, without going through the worker
+ * queues. */
+static gboolean
+gss_adaptive_serve_stored_fragment (GssTransaction * t,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomFragment * fragment)
+{
+  GssAdaptiveQuery *query;
+  gboolean stored;
+  char *key;
+
+  if (adaptive->store == NULL || adaptive->drm_type == GSS_DRM_CLEAR)
+    return FALSE;
+
+  key = gss_adaptive_get_store_key (adaptive, level, fragment);
+  stored = gss_fragment_store_contains (adaptive->store, key);
+  g_free (key);
+  if (!stored)
+    return FALSE;
+
+  query = g_malloc0 (sizeof (GssAdaptiveQuery));
+  query->adaptive = adaptive;
+  query->level = level;
+  query->fragment = fragment;
+
+  soup_server_pause_message (t->soupserver, t->msg);
+  if (!gss_transaction_process_io (t, gss_adaptive_async_read_stored,
+          gss_adaptive_async_read_stored_finish, query)) {
+    soup_server_unpause_message (t->soupserver, t->msg);
+    g_free (query);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 static void
 gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
 {
@@ -709,6 +1202,7 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
   gboolean is_init;
   GssAdaptiveLevel *level;
   GssIsomFragment *fragment;
+  gboolean chunked;
   gboolean ret;
 
   //GST_ERROR ("content request");
@@ -768,7 +1262,11 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
   soup_message_headers_replace (t->msg->response_headers, "Content-Type",
       (stream[0] == 'v') ? "video/mp4" : "audio/mp4");
 
-  if (is_init) {
+  if (is_init && adaptive->stream_type == GSS_ADAPTIVE_STREAM_HLS_FMP4) {
+    /* without the sidx that follows it */
+    soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
+        level->track->dash_header_data, level->track->dash_header_size);
+  } else if (is_init) {
     soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
         level->track->ccff_header_data, level->track->ccff_header_size);
   } else {
@@ -783,6 +1281,24 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
     //GST_ERROR ("frag %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
     //    level->filename, fragment->offset, fragment->size);
 
+    /* chunking needs one sglist entry per sample */
+    chunked = adaptive->chunk_duration > 0 &&
+        adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_LIVE &&
+        fragment->sglist->n_chunks == fragment->trun.sample_count;
+    if (chunked) {
+      /* low-latency clients are waiting at the live edge */
+      gss_transaction_set_priority (t, GSS_TRANSACTION_PRIORITY_HIGH);
+    }
+    if (!gss_transaction_admit (t)) {
+      /* while overloaded, only fragments that are already encrypted are
+       * served, without waiting for a worker */
+      if (!gss_adaptive_serve_stored_fragment (t, adaptive, level,
+              fragment)) {
+        gss_transaction_shed (t);
+      }
+      return;
+    }
+
     soup_server_pause_message (t->soupserver, t->msg);
 
     query = g_malloc0 (sizeof (GssAdaptiveQuery));
@@ -790,8 +1306,16 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
     query->level = level;
     query->fragment = fragment;
 
-    gss_transaction_process_async (t, gss_adaptive_async_assemble_chunk,
-        gss_adaptive_async_assemble_chunk_finish, query);
+    if (chunked) {
+      soup_message_set_status (t->msg, SOUP_STATUS_OK);
+      soup_message_headers_set_encoding (t->msg->response_headers,
+          SOUP_ENCODING_CHUNKED);
+      gss_transaction_process_async (t, gss_adaptive_async_assemble_chunked,
+          gss_adaptive_async_assemble_chunked_finish, query);
+    } else {
+      gss_transaction_process_async (t, gss_adaptive_async_assemble_chunk,
+          gss_adaptive_async_assemble_chunk_finish, query);
+    }
   }
 }
 
@@ -800,12 +1324,8 @@ gss_adaptive_async_assemble_chunk (GssTransaction * t, gpointer priv)
 {
   GssAdaptiveQuery *query = priv;
 
-  query->data = gss_adaptive_assemble_chunk (t,
+  query->buffer = gss_adaptive_get_mdat_buffer (t,
       query->adaptive, query->level, query->fragment);
-  if (query->adaptive->drm_type != GSS_DRM_CLEAR) {
-    gss_playready_encrypt_samples (query->fragment, query->data,
-        query->adaptive->content_key);
-  }
 }
 
 static void
@@ -813,25 +1333,332 @@ gss_adaptive_async_assemble_chunk_finish (GssTransaction * t, gpointer priv)
 {
   GssAdaptiveQuery *query = priv;
 
-  soup_message_set_status (t->msg, SOUP_STATUS_OK);
-  /* strip off mdat header at end of moof_data */
-  soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
-      query->fragment->moof_data, query->fragment->moof_size - 8);
-  soup_message_body_append (t->msg->response_body, SOUP_MEMORY_TAKE,
-      query->data, query->fragment->mdat_size);
-  soup_server_unpause_message (t->soupserver, t->msg);
+  if (query->buffer) {
+    gss_adaptive_append_fragment (t, query->fragment, query->buffer);
+    soup_buffer_free (query->buffer);
+  }
+  gss_transaction_unpause (t);
   g_free (query);
 }
 
-GssAdaptive *
-gss_adaptive_new (void)
+static void
+gss_adaptive_resource_get_ts_segment (GssTransaction * t,
+    GssAdaptive * adaptive)
 {
-  GssAdaptive *adaptive;
+  const char *start_time_str;
+  const char *bitrate_str;
+  guint64 start_time;
+  guint64 bitrate;
+  GssAdaptiveLevel *level;
+  GssIsomFragment *fragment;
+  GssAdaptiveQuery *query;
+  gboolean ret;
+
+  if (t->query == NULL) {
+    gss_transaction_error_not_found (t, "no segment query");
+    return;
+  }
+
+  start_time_str = g_hash_table_lookup (t->query, "start_time");
+  bitrate_str = g_hash_table_lookup (t->query, "bitrate");
+
+  ret = parse_guint64 (bitrate_str, &bitrate);
+  if (!ret) {
+    gss_transaction_error_not_found (t, "missing or bad bitrate parameter");
+    return;
+  }
+  ret = parse_guint64 (start_time_str, &start_time);
+  if (!ret) {
+    gss_transaction_error_not_found (t,
+        "missing or bad start_time parameter");
+    return;
+  }
+
+  level = gss_adaptive_get_level (adaptive, TRUE, bitrate);
+  if (level == NULL) {
+    gss_transaction_error_not_found (t, "level not found for bitrate");
+    return;
+  }
+
+  fragment = gss_isom_track_get_fragment_by_timestamp (level->track,
+      start_time);
+  if (fragment == NULL) {
+    gss_transaction_error_not_found (t, "fragment not found for start_time");
+    return;
+  }
+
+  soup_message_headers_replace (t->msg->response_headers, "Content-Type",
+      "video/mp2t");
+
+  if (!gss_transaction_admit (t)) {
+    gss_transaction_shed (t);
+    return;
+  }
+
+  soup_server_pause_message (t->soupserver, t->msg);
+
+  query = g_malloc0 (sizeof (GssAdaptiveQuery));
+  query->adaptive = adaptive;
+  query->level = level;
+  query->fragment = fragment;
+  query->audio_level = get_audio_level_for_video_level (adaptive, level);
+  if (query->audio_level) {
+    query->audio_fragment =
+        gss_isom_track_get_fragment (query->audio_level->track,
+        fragment->index);
+  }
+
+  gss_transaction_process_async (t, gss_adaptive_async_assemble_ts_segment,
+      gss_adaptive_async_assemble_ts_segment_finish, query);
+}
+
+static void
+gss_adaptive_async_assemble_ts_segment (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+  guint8 *video_data;
+  guint8 *audio_data = NULL;
+
+  video_data = gss_adaptive_assemble_chunk (t, query->adaptive, query->level,
+      query->fragment, FALSE);
+  if (video_data == NULL)
+    return;
+
+  if (query->audio_fragment) {
+    audio_data = gss_adaptive_assemble_chunk (t, query->adaptive,
+        query->audio_level, query->audio_fragment, FALSE);
+    if (audio_data == NULL) {
+      g_free (video_data);
+      return;
+    }
+  }
+
+  /* skip the mdat headers */
+  query->data = gss_mpegts_mux_fragments (query->level->track,
+      query->fragment, video_data + 8,
+      query->audio_fragment ? query->audio_level->track : NULL,
+      query->audio_fragment, audio_data ? audio_data + 8 : NULL, &query->size);
+
+  g_free (video_data);
+  g_free (audio_data);
+}
+
+static void
+gss_adaptive_async_assemble_ts_segment_finish (GssTransaction * t,
+    gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+
+  if (query->data) {
+    soup_message_set_status (t->msg, SOUP_STATUS_OK);
+    soup_message_body_append (t->msg->response_body, SOUP_MEMORY_TAKE,
+        query->data, query->size);
+  } else if (t->msg->status_code != SOUP_STATUS_NOT_FOUND) {
+    soup_message_set_status (t->msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+  }
+  gss_transaction_unpause (t);
+  g_free (query);
+}
+
+typedef struct _ChunkDelivery ChunkDelivery;
+struct _ChunkDelivery
+{
+  /* kept until the finish function, which runs after this */
+  GssTransaction *t;
+  SoupMessage *msg;
+  guint8 *moof_data;
+  gsize moof_size;
+  guint8 *mdat_data;
+  gsize mdat_size;
+};
+
+static gboolean
+gss_adaptive_deliver_chunk (gpointer priv)
+{
+  ChunkDelivery *delivery = priv;
+
+  soup_message_body_append (delivery->msg->response_body, SOUP_MEMORY_TAKE,
+      delivery->moof_data, delivery->moof_size);
+  soup_message_body_append (delivery->msg->response_body, SOUP_MEMORY_TAKE,
+      delivery->mdat_data, delivery->mdat_size);
+  gss_transaction_unpause (delivery->t);
+  g_object_unref (delivery->msg);
+  g_free (delivery);
+
+  return FALSE;
+}
+
+/* The status and headers have already been sent, so the only way to
+ * tell the client that the fragment is incomplete is to close the
+ * connection. */
+static gboolean
+gss_adaptive_abort_chunked (gpointer priv)
+{
+  GssTransaction *t = priv;
+
+  if (!t->done) {
+    t->debug_message = "failed to read fragment";
+    soup_socket_disconnect (soup_client_context_get_socket (t->client));
+  }
+
+  return FALSE;
+}
+
+/* Chunks are numbered after their first sample in the track, so that
+ * their sequence numbers keep increasing across fragments. */
+static guint32
+gss_adaptive_get_first_sample_number (GssIsomTrack * track,
+    GssIsomFragment * fragment)
+{
+  guint32 n = 1;
+  int i;
+
+  for (i = 0; i < fragment->index && i < track->n_fragments; i++) {
+    n += track->fragments[i]->trun.sample_count;
+  }
+
+  return n;
+}
+
+/* Splits the fragment into runs of samples of about chunk_duration,
+ * and hands each moof/mdat pair to the loop that owns the transaction
+ * as soon as it is ready, ahead of the finish function, so the client
+ * can start decoding before the whole fragment has been read and
+ * encrypted. */
+static void
+gss_adaptive_async_assemble_chunked (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+  GssIsomFragment *fragment = query->fragment;
+  gboolean is_video;
+  guint32 sequence_number;
+  int first_sample;
+
+  is_video = gss_isom_track_is_video (query->level->track);
+  sequence_number = gss_adaptive_get_first_sample_number (query->level->track,
+      fragment);
+
+  first_sample = 0;
+  while (first_sample < fragment->trun.sample_count) {
+    GssIsomFragment *chunk;
+    ChunkDelivery *delivery;
+    GError *error = NULL;
+    guint8 *mdat_data;
+    int n_samples;
+
+    n_samples = gss_isom_fragment_get_chunk_length (fragment, first_sample,
+        query->adaptive->chunk_duration);
+    chunk = gss_isom_fragment_new_chunk (fragment, first_sample, n_samples);
+    chunk->mfhd.sequence_number = sequence_number + first_sample;
+
+    /* earlier chunks may be in the hands of the loop, so errors are
+     * reported there rather than on the message */
+    mdat_data = gss_adaptive_load_mdat (query->adaptive, query->level, chunk,
+        TRUE, &error);
+    if (mdat_data == NULL) {
+      GST_WARNING ("failed to read chunk: %s", error->message);
+      g_error_free (error);
+      gss_isom_fragment_free_chunk (chunk);
+      query->failed = TRUE;
+      gss_transaction_invoke (t, gss_adaptive_abort_chunked, t);
+      break;
+    }
+    gss_isom_fragment_serialize (chunk, &chunk->moof_data, &chunk->moof_size,
+        is_video);
+
+    delivery = g_malloc0 (sizeof (ChunkDelivery));
+    delivery->t = t;
+    delivery->msg = g_object_ref (t->msg);
+    /* strip off mdat header at end of moof_data */
+    delivery->moof_data = chunk->moof_data;
+    delivery->moof_size = chunk->moof_size - 8;
+    chunk->moof_data = NULL;
+    delivery->mdat_data = mdat_data;
+    delivery->mdat_size = chunk->mdat_size;
+    gss_transaction_invoke (t, gss_adaptive_deliver_chunk, delivery);
+
+    gss_isom_fragment_free_chunk (chunk);
+
+    first_sample += n_samples;
+  }
+}
+
+static void
+gss_adaptive_async_assemble_chunked_finish (GssTransaction * t,
+    gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+
+  if (!query->failed) {
+    soup_message_body_complete (t->msg->response_body);
+  }
+  gss_transaction_unpause (t);
+  g_free (query);
+}
+
+GssAdaptive *
+gss_adaptive_new (void)
+{
+  GssAdaptive *adaptive;
 
   adaptive = g_malloc0 (sizeof (GssAdaptive));
+  adaptive->refcount = 1;
+
+  return adaptive;
+
+}
+
+GssAdaptive *
+gss_adaptive_ref (GssAdaptive * adaptive)
+{
+  g_return_val_if_fail (adaptive != NULL, NULL);
+
+  g_atomic_int_inc (&adaptive->refcount);
 
   return adaptive;
+}
+
+/* Transactions and fill tasks hold references, so that an adaptive
+ * stream evicted from the cache stays alive until they are done. */
+void
+gss_adaptive_unref (GssAdaptive * adaptive)
+{
+  g_return_if_fail (adaptive != NULL);
+
+  if (g_atomic_int_dec_and_test (&adaptive->refcount)) {
+    gss_adaptive_free (adaptive);
+  }
+}
+
+/**
+ * gss_adaptive_get_memory_size:
+ * @adaptive: a #GssAdaptive
+ *
+ * Returns: the approximate number of bytes of memory used by the
+ *   variant state of @adaptive, not counting its shared media
+ */
+gsize
+gss_adaptive_get_memory_size (GssAdaptive * adaptive)
+{
+  gsize size;
+  int i;
+
+  g_return_val_if_fail (adaptive != NULL, 0);
 
+  size = sizeof (GssAdaptive);
+  size += adaptive->drm_info.data_len;
+  size += (adaptive->n_audio_levels + adaptive->n_video_levels) *
+      sizeof (GssAdaptiveLevel);
+  for (i = 0; i < adaptive->n_audio_levels; i++) {
+    size += gss_isom_track_get_variant_memory_size
+        (adaptive->audio_levels[i].track);
+  }
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    size += gss_isom_track_get_variant_memory_size
+        (adaptive->video_levels[i].track);
+  }
+
+  return size;
 }
 
 void
@@ -841,18 +1668,14 @@ gss_adaptive_free (GssAdaptive * adaptive)
 
   g_return_if_fail (adaptive != NULL);
 
-  for (i = 0; i < adaptive->n_parsers; i++) {
-    gss_isom_parser_free (adaptive->parsers[i]);
-  }
-
   for (i = 0; i < adaptive->n_audio_levels; i++) {
-    adaptive->audio_levels[i].track = NULL;
+    gss_isom_track_free_variant (adaptive->audio_levels[i].track);
     g_free (adaptive->audio_levels[i].codec_data);
     g_free (adaptive->audio_levels[i].filename);
     g_free (adaptive->audio_levels[i].codec);
   }
   for (i = 0; i < adaptive->n_video_levels; i++) {
-    adaptive->video_levels[i].track = NULL;
+    gss_isom_track_free_variant (adaptive->video_levels[i].track);
     g_free (adaptive->video_levels[i].codec_data);
     g_free (adaptive->video_levels[i].filename);
     g_free (adaptive->video_levels[i].codec);
@@ -861,7 +1684,11 @@ gss_adaptive_free (GssAdaptive * adaptive)
   g_free (adaptive->audio_levels);
   g_free (adaptive->video_levels);
   g_free (adaptive->content_id);
+  g_free (adaptive->version);
   g_free (adaptive->kid);
+  if (adaptive->media) {
+    gss_adaptive_media_unref (adaptive->media);
+  }
   g_free (adaptive);
 }
 
@@ -911,7 +1738,7 @@ create_key_id (const char *key_string)
 }
 
 static gboolean
-parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
+parse_json (GssAdaptiveMedia * media, JsonParser * parser, const char *dir,
     const char *requested_version)
 {
   JsonNode *node;
@@ -922,7 +1749,7 @@ parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
   int len;
   int i;
 
-  g_return_val_if_fail (adaptive != NULL, FALSE);
+  g_return_val_if_fail (media != NULL, FALSE);
   g_return_val_if_fail (parser != NULL, FALSE);
   g_return_val_if_fail (dir != NULL, FALSE);
 
@@ -993,7 +1820,7 @@ parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
         return FALSE;
 
       full_fn = g_strdup_printf ("%s/%s", dir, filename);
-      load_file (adaptive, full_fn);
+      load_file (media, full_fn);
       g_free (full_fn);
     }
 
@@ -1003,60 +1830,258 @@ parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
   return FALSE;
 }
 
-GssAdaptive *
-gss_adaptive_load (GssServer * server, const char *key, const char *dir,
-    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type)
+/**
+ * gss_adaptive_media_load:
+ * @dir: directory holding the gss-manifest and media files of a title
+ * @version: version of the title to load
+ * @is_isoff: whether to fragment for ISO BMFF stream types, see
+ *   gss_adaptive_stream_is_isoff()
+ *
+ * Parses and fragments the media files of @version of a title.
+ *
+ * Returns: a new #GssAdaptiveMedia with a reference count of 1, or
+ *   %NULL if the manifest could not be loaded
+ */
+GssAdaptiveMedia *
+gss_adaptive_media_load (const char *dir, const char *version,
+    gboolean is_isoff)
 {
-  GssAdaptive *adaptive;
-  char *filename;
+  GssAdaptiveMedia *media;
   gboolean ret;
   GError *error = NULL;
   JsonParser *parser;
 
-  g_return_val_if_fail (GSS_IS_SERVER (server), NULL);
-  g_return_val_if_fail (key != NULL, NULL);
   g_return_val_if_fail (dir != NULL, NULL);
+  g_return_val_if_fail (version != NULL, NULL);
 
-  GST_DEBUG ("looking for %s", key);
+  media = g_malloc0 (sizeof (GssAdaptiveMedia));
+  media->refcount = 1;
+  media->is_isoff = is_isoff;
+  media->manifest_filename = g_strdup_printf ("%s/gss-manifest", dir);
 
+  /* stat before parsing, so a manifest replaced meanwhile is noticed
+   * by gss_adaptive_media_is_current() */
   parser = json_parser_new ();
-  filename = g_strdup_printf ("%s/gss-manifest", dir);
-  ret = json_parser_load_from_file (parser, filename, &error);
-  if (!ret) {
-    GST_DEBUG ("failed to open %s", filename);
-    g_free (filename);
+  if (g_stat (media->manifest_filename, &media->manifest_stat) < 0 ||
+      !json_parser_load_from_file (parser, media->manifest_filename,
+          &error)) {
+    GST_DEBUG ("failed to open %s", media->manifest_filename);
     g_object_unref (parser);
-    g_error_free (error);
+    g_clear_error (&error);
+    gss_adaptive_media_unref (media);
+    return NULL;
+  }
+
+  GST_DEBUG ("loading %s", dir);
+
+  ret = parse_json (media, parser, dir, version);
+  g_object_unref (parser);
+  if (!ret) {
+    gss_adaptive_media_unref (media);
+    GST_WARNING ("json format error in %s/gss-manifest", dir);
     return NULL;
   }
-  g_free (filename);
 
-  GST_DEBUG ("loading %s", key);
+  GST_DEBUG ("loading done");
+
+  return media;
+}
+
+GssAdaptiveMedia *
+gss_adaptive_media_ref (GssAdaptiveMedia * media)
+{
+  g_return_val_if_fail (media != NULL, NULL);
+
+  g_atomic_int_inc (&media->refcount);
+
+  return media;
+}
+
+void
+gss_adaptive_media_unref (GssAdaptiveMedia * media)
+{
+  int i;
+
+  g_return_if_fail (media != NULL);
+
+  if (!g_atomic_int_dec_and_test (&media->refcount))
+    return;
+
+  for (i = 0; i < media->n_parsers; i++) {
+    gss_isom_parser_free (media->parsers[i]);
+    if (media->fds[i] >= 0) {
+      close (media->fds[i]);
+    }
+  }
+  g_free (media->manifest_filename);
+  g_free (media);
+}
+
+static gboolean
+stat_equal (const GStatBuf * a, const GStatBuf * b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+      a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+/**
+ * gss_adaptive_media_is_current:
+ * @media: a #GssAdaptiveMedia
+ *
+ * Checks whether the gss-manifest or any media file of @media has been
+ * modified, replaced or removed since it was loaded.
+ *
+ * Returns: %TRUE if all files are unchanged
+ */
+gboolean
+gss_adaptive_media_is_current (GssAdaptiveMedia * media)
+{
+  GStatBuf sb;
+  int i;
+
+  g_return_val_if_fail (media != NULL, FALSE);
+
+  if (g_stat (media->manifest_filename, &sb) < 0 ||
+      !stat_equal (&sb, &media->manifest_stat))
+    return FALSE;
+
+  for (i = 0; i < media->n_parsers; i++) {
+    if (g_stat (media->parsers[i]->filename, &sb) < 0 ||
+        !stat_equal (&sb, &media->stats[i]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * gss_adaptive_media_get_memory_size:
+ * @media: a #GssAdaptiveMedia
+ *
+ * Returns: the approximate number of bytes of memory used by the
+ *   parsed tracks of @media
+ */
+gsize
+gss_adaptive_media_get_memory_size (GssAdaptiveMedia * media)
+{
+  gsize size;
+  int i, j;
+
+  g_return_val_if_fail (media != NULL, 0);
+
+  size = sizeof (GssAdaptiveMedia);
+  for (i = 0; i < media->n_parsers; i++) {
+    GssIsomMovie *movie = media->parsers[i]->movie;
+
+    size += sizeof (GssIsomParser) + sizeof (GssIsomMovie);
+    for (j = 0; j < movie->n_tracks; j++) {
+      size += gss_isom_track_get_memory_size (movie->tracks[j]);
+    }
+  }
+
+  return size;
+}
+
+/**
+ * gss_adaptive_new_from_media:
+ * @server: a #GssServer
+ * @key: content ID of the title
+ * @version: version of the title
+ * @media: media loaded with gss_adaptive_media_load(), fragmented as
+ *   needed by @stream_type
+ * @drm_type: DRM to apply
+ * @stream_type: adaptive streaming format to serve
+ * @key_seed: PlayReady key seed, from gss_playready_get_key_seed()
+ * @license_url: PlayReady license URL for the protection header
+ *
+ * Creates an adaptive stream that serves @media with @drm_type and
+ * @stream_type.  Only the per-variant encryption and serialization
+ * state is created; the parsed media is shared, and @media gains a
+ * reference for as long as the adaptive stream exists.  The DRM
+ * configuration is passed in rather than read from @server, so that it
+ * can be copied when the load is queued.
+ *
+ * Returns: a new #GssAdaptive
+ */
+GssAdaptive *
+gss_adaptive_new_from_media (GssServer * server, const char *key,
+    const char *version, GssAdaptiveMedia * media, GssDrmType drm_type,
+    GssAdaptiveStream stream_type, const guint8 * key_seed,
+    const char *license_url)
+{
+  GssAdaptive *adaptive;
+  int i;
+
+  g_return_val_if_fail (GSS_IS_SERVER (server), NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+  g_return_val_if_fail (version != NULL, NULL);
+  g_return_val_if_fail (media != NULL, NULL);
+  g_return_val_if_fail (media->is_isoff ==
+      gss_adaptive_stream_is_isoff (stream_type), NULL);
 
   adaptive = gss_adaptive_new ();
 
   adaptive->server = server;
 
   adaptive->content_id = g_strdup (key);
+  adaptive->version = g_strdup (version);
   adaptive->kid = create_key_id (key);
   adaptive->kid_len = 16;
   adaptive->drm_type = drm_type;
   adaptive->stream_type = stream_type;
+  adaptive->media = gss_adaptive_media_ref (media);
+  adaptive->duration = media->duration;
 
-  gss_playready_generate_key (server->playready, adaptive->content_key,
+  gss_playready_generate_key_from_seed (key_seed, adaptive->content_key,
       adaptive->kid, adaptive->kid_len);
 
-  ret = parse_json (adaptive, parser, dir, version);
-  if (!ret) {
-    gss_adaptive_free (adaptive);
-    g_object_unref (parser);
-    GST_WARNING ("json format error in %s/gss-manifest", dir);
-    return NULL;
+  for (i = 0; i < media->n_parsers; i++) {
+    GssIsomParser *file = media->parsers[i];
+    GssIsomTrack *video_track;
+    GssIsomTrack *audio_track;
+
+    video_track = gss_isom_movie_get_video_track (file->movie);
+    if (video_track) {
+      gss_level_from_track (adaptive, video_track, file->movie,
+          file->filename, media->fds[i], TRUE, license_url);
+    }
+
+    audio_track = gss_isom_movie_get_audio_track (file->movie);
+    if (audio_track) {
+      gss_level_from_track (adaptive, audio_track, file->movie,
+          file->filename, media->fds[i], FALSE, license_url);
+    }
   }
 
-  g_object_unref (parser);
+  return adaptive;
+}
 
-  GST_DEBUG ("loading done");
+GssAdaptive *
+gss_adaptive_load (GssServer * server, const char *key, const char *dir,
+    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type)
+{
+  GssAdaptiveMedia *media;
+  GssAdaptive *adaptive;
+  guint8 key_seed[30];
+  char *license_url;
+
+  g_return_val_if_fail (GSS_IS_SERVER (server), NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+  g_return_val_if_fail (dir != NULL, NULL);
+
+  GST_DEBUG ("looking for %s", key);
+
+  media = gss_adaptive_media_load (dir, version,
+      gss_adaptive_stream_is_isoff (stream_type));
+  if (media == NULL)
+    return NULL;
+
+  gss_playready_get_key_seed (server->playready, key_seed);
+  license_url = gss_playready_get_license_url (server->playready);
+  adaptive = gss_adaptive_new_from_media (server, key, version, media,
+      drm_type, stream_type, key_seed, license_url);
+  g_free (license_url);
+  gss_adaptive_media_unref (media);
 
   return adaptive;
 }
@@ -1122,7 +2147,7 @@ gss_adaptive_convert_ism (GssAdaptive * adaptive, GssIsomMovie * movie,
 
   GST_DEBUG ("stsd entries %d", track->stsd.entry_count);
 
-  if (drm_type == GSS_DRM_PLAYREADY) {
+  if (drm_type == GSS_DRM_PLAYREADY || drm_type == GSS_DRM_CBCS) {
     track->is_encrypted = TRUE;
   }
   for (i = 0; i < track->n_fragments; i++) {
@@ -1147,6 +2172,7 @@ void
 gss_adaptive_convert_isoff_ondemand (GssAdaptive * adaptive,
     GssIsomMovie * movie, GssIsomTrack * track, GssDrmType drm_type)
 {
+  GssIsomMovie variant_movie;
   int i;
   guint64 offset = 0;
   gboolean is_video;
@@ -1155,15 +2181,18 @@ gss_adaptive_convert_isoff_ondemand (GssAdaptive * adaptive,
 
   GST_DEBUG ("stsd entries %d", track->stsd.entry_count);
 
-  if (drm_type != GSS_DRM_CLEAR) {
-    movie->pssh.data = adaptive->drm_info.data;
-    movie->pssh.len = adaptive->drm_info.data_len;
-    memcpy (movie->pssh.uuid,
+  /* The movie is shared with other variants, so the pssh box is
+   * added to a copy. */
+  memcpy (&variant_movie, movie, sizeof (GssIsomMovie));
+  if (adaptive->drm_info.data != NULL) {
+    variant_movie.pssh.data = adaptive->drm_info.data;
+    variant_movie.pssh.len = adaptive->drm_info.data_len;
+    memcpy (variant_movie.pssh.uuid,
         gss_drm_get_drm_uuid (adaptive->drm_info.drm_type), 16);
-    movie->pssh.present = TRUE;
+    variant_movie.pssh.present = TRUE;
   }
 
-  if (drm_type == GSS_DRM_PLAYREADY) {
+  if (drm_type == GSS_DRM_PLAYREADY || drm_type == GSS_DRM_CBCS) {
     track->is_encrypted = TRUE;
   }
   for (i = 0; i < track->n_fragments; i++) {
@@ -1178,7 +2207,7 @@ gss_adaptive_convert_isoff_ondemand (GssAdaptive * adaptive,
   }
   track->dash_size = offset;
 
-  gss_isom_movie_serialize_track_dash (movie, track,
+  gss_isom_movie_serialize_track_dash (&variant_movie, track,
       &track->dash_header_data, &track->dash_header_size,
       &track->dash_header_and_sidx_size);
 
@@ -1186,11 +2215,37 @@ gss_adaptive_convert_isoff_ondemand (GssAdaptive * adaptive,
 }
 
 
+/* cbcs uses a 1:9 pattern for video and encrypts all whole blocks of
+ * audio samples, with a constant IV derived from the level's IV. */
+static void
+setup_cbcs_tenc (GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomTrack * track, gboolean is_video)
+{
+  GssBoxTenc *tenc = &track->tenc;
+
+  memset (tenc, 0, sizeof (GssBoxTenc));
+  tenc->present = TRUE;
+  tenc->version = 1;
+  tenc->scheme_type = GST_MAKE_FOURCC ('c', 'b', 'c', 's');
+  if (is_video) {
+    tenc->crypt_byte_block = 1;
+    tenc->skip_byte_block = 9;
+  }
+  tenc->is_protected = 1;
+  tenc->per_sample_iv_size = 0;
+  memcpy (tenc->kid, adaptive->kid, 16);
+  tenc->constant_iv_size = 16;
+  GST_WRITE_UINT64_BE (tenc->constant_iv, level->iv);
+  GST_WRITE_UINT64_BE (tenc->constant_iv + 8, ~level->iv);
+}
+
 static void
 gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
-    GssIsomMovie * movie, const char *filename, gboolean is_video)
+    GssIsomMovie * movie, const char *filename, int fd, gboolean is_video,
+    const char *license_url)
 {
   GssAdaptiveLevel *level;
+  struct stat sb;
   int i;
 
   g_return_if_fail (adaptive != NULL);
@@ -1210,6 +2265,9 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
     adaptive->n_audio_levels++;
   }
   memset (level, 0, sizeof (GssAdaptiveLevel));
+  /* The parsed track is shared with other variants of the media, so
+   * encryption and serialization state goes into a copy. */
+  track = gss_isom_track_new_variant (track);
   level->track = track;
 
   if (is_video) {
@@ -1220,13 +2278,20 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
   if (adaptive->drm_type != GSS_DRM_CLEAR) {
     generate_iv (level, filename, track->tkhd.track_id);
 
+    if (adaptive->drm_type == GSS_DRM_CBCS) {
+      setup_cbcs_tenc (adaptive, level, track, is_video);
+    }
+
     for (i = 0; i < track->n_fragments; i++) {
       GssIsomFragment *fragment = track->fragments[i];
       gss_playready_setup_iv (adaptive->server->playready, adaptive, level,
           fragment);
-      /* Hack to prevent serialization of sample encryption UUID and
-       * enable saiz/saio serialization */
-      if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND) {
+      if (adaptive->drm_type == GSS_DRM_CBCS) {
+        gss_isom_fragment_set_pattern_encryption (fragment, &track->tenc);
+      } else if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
+          adaptive->stream_type == GSS_ADAPTIVE_STREAM_HLS_FMP4) {
+        /* Hack to prevent serialization of sample encryption UUID and
+         * enable saiz/saio serialization */
         fragment->sample_encryption.present = FALSE;
         fragment->saiz.present = TRUE;
         fragment->saio.present = TRUE;
@@ -1240,22 +2305,31 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
     if (adaptive->drm_info.data == NULL) {
       adaptive->drm_info.drm_type = GSS_DRM_PLAYREADY;
       adaptive->drm_info.data_len =
-          gss_playready_get_protection_header (adaptive,
-          adaptive->server->playready->license_url, NULL,
+          gss_playready_get_protection_header (adaptive, license_url, NULL,
           &adaptive->drm_info.data);
     }
   }
 
-  if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND) {
+  if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
+      adaptive->stream_type == GSS_ADAPTIVE_STREAM_HLS_FMP4) {
+    /* fMP4 HLS clients expect plain CENC rather than PIFF, so they get
+     * the DASH header, with its pssh, as init segment */
     gss_adaptive_convert_isoff_ondemand (adaptive, movie, track,
         adaptive->drm_type);
-  } else if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISM) {
+  } else if (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISM ||
+      adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_LIVE) {
+    /* isoff-live uses the CCFF header as init segment */
     gss_adaptive_convert_ism (adaptive, movie, track, adaptive->drm_type);
   }
 
   level->track_id = track->tkhd.track_id;
   level->n_fragments = track->n_fragments;
   level->filename = g_strdup (filename);
+  level->fd = fd;
+  if (fd >= 0 && fstat (fd, &sb) == 0) {
+    level->inode = sb.st_ino;
+    level->mtime = sb.st_mtime;
+  }
   level->bitrate = estimate_bitrate (track);
   level->video_width = track->mp4v.width;
   level->video_height = track->mp4v.height;
@@ -1278,79 +2352,36 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
 }
 
 static void
-load_file (GssAdaptive * adaptive, const char *filename)
+load_file (GssAdaptiveMedia * media, const char *filename)
 {
   GssIsomParser *file;
-  GssIsomTrack *video_track;
-  GssIsomTrack *audio_track;
+  int fd;
 
-  g_return_if_fail (adaptive != 0);
+  g_return_if_fail (media != 0);
   g_return_if_fail (filename != 0);
 
   file = gss_isom_parser_new ();
-  adaptive->parsers[adaptive->n_parsers] = file;
-  adaptive->n_parsers++;
-  gss_isom_parser_parse_file (file, filename);
-
-  if (file->movie->tracks[0]->n_fragments == 0) {
-    gss_isom_parser_fragmentize (file,
-        adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
-        adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
-  }
-#if 0
-  if (adaptive->drm_type == GSS_DRM_PLAYREADY &&
-      adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND) {
-    gss_playready_add_protection_header (file->movie, adaptive,
-        adaptive->server->playready->license_url, NULL);
+  fd = open (filename, O_RDONLY);
+  if (fd >= 0 && fstat (fd, &media->stats[media->n_parsers]) < 0) {
+    close (fd);
+    fd = -1;
   }
-#endif
-
-  if (adaptive->duration == 0) {
-    adaptive->duration = gss_isom_movie_get_duration (file->movie);
+  if (fd < 0) {
+    GST_WARNING ("failed to open \"%s\", error=\"%s\", broken manifest?",
+        filename, g_strerror (errno));
   }
+  media->fds[media->n_parsers] = fd;
+  media->parsers[media->n_parsers] = file;
+  media->n_parsers++;
+  gss_isom_parser_parse_file (file, filename);
 
-  video_track = gss_isom_movie_get_video_track (file->movie);
-  if (video_track) {
-    gss_level_from_track (adaptive, video_track, file->movie, filename, TRUE);
+  if (file->movie->tracks[0]->n_fragments == 0) {
+    gss_isom_parser_fragmentize (file, media->is_isoff);
   }
 
-  audio_track = gss_isom_movie_get_audio_track (file->movie);
-  if (audio_track) {
-    gss_level_from_track (adaptive, audio_track, file->movie, filename, FALSE);
-#if 0
-    GssAdaptiveLevel *level;
-    int i;
-
-    adaptive->audio_levels = g_realloc (adaptive->audio_levels,
-        (adaptive->n_audio_levels + 1) * sizeof (GssAdaptiveLevel));
-    level = adaptive->audio_levels + adaptive->n_audio_levels;
-    adaptive->n_audio_levels++;
-    memset (level, 0, sizeof (GssAdaptiveLevel));
-
-    generate_iv (level, filename, video_track->tkhd.track_id);
-
-    for (i = 0; i < audio_track->n_fragments; i++) {
-      GssIsomFragment *fragment = audio_track->fragments[i];
-      gss_playready_setup_iv (adaptive->server->playready, adaptive, level,
-          fragment);
-    }
-    gss_isom_track_prepare_streaming (file->movie, audio_track);
-
-    level->track_id = audio_track->tkhd.track_id;
-    level->track = audio_track;
-    level->n_fragments =
-        gss_isom_parser_get_n_fragments (file, level->track_id);
-    level->file = file;
-    level->filename = g_strdup (filename);
-    level->bitrate = audio_bitrate;
-    level->codec_data = gss_hex_encode (audio_track->esds.codec_data,
-        audio_track->esds.codec_data_len);
-    level->audio_rate = audio_track->mp4a.sample_rate >> 16;
-    /* FIXME hard-coded AAC LC */
-    level->codec = g_strdup ("mp4a.40.2");
-#endif
+  if (media->duration == 0) {
+    media->duration = gss_isom_movie_get_duration (file->movie);
   }
-
 }
 
 void
@@ -1375,7 +2406,10 @@ gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
   failed = FALSE;
   switch (adaptive->stream_type) {
     case GSS_ADAPTIVE_STREAM_ISM:
-      if (strcmp (path, "Manifest") == 0) {
+      if (adaptive->drm_type == GSS_DRM_CBCS) {
+        /* Smooth Streaming only supports PIFF encryption */
+        failed = TRUE;
+      } else if (strcmp (path, "Manifest") == 0) {
         gss_adaptive_resource_get_manifest (t, adaptive);
       } else if (strcmp (path, "content") == 0) {
         gss_adaptive_resource_get_content (t, adaptive);
@@ -1401,6 +2435,30 @@ gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
         failed = TRUE;
       }
       break;
+    case GSS_ADAPTIVE_STREAM_HLS_FMP4:
+      if (strcmp (path, "manifest.m3u8") == 0) {
+        gss_adaptive_resource_get_hls_master_playlist (t, adaptive);
+      } else if (strcmp (path, "content") == 0) {
+        gss_adaptive_resource_get_content (t, adaptive);
+      } else if (g_str_has_suffix (path, ".m3u8")) {
+        gss_adaptive_resource_get_hls_media_playlist (t, adaptive, path);
+      } else {
+        failed = TRUE;
+      }
+      break;
+    case GSS_ADAPTIVE_STREAM_HLS_TS:
+      if (adaptive->drm_type != GSS_DRM_CLEAR) {
+        failed = TRUE;
+      } else if (strcmp (path, "manifest.m3u8") == 0) {
+        gss_adaptive_resource_get_hls_master_playlist (t, adaptive);
+      } else if (strcmp (path, "segment") == 0) {
+        gss_adaptive_resource_get_ts_segment (t, adaptive);
+      } else if (g_str_has_suffix (path, ".m3u8")) {
+        gss_adaptive_resource_get_hls_media_playlist (t, adaptive, path);
+      } else {
+        failed = TRUE;
+      }
+      break;
     default:
       failed = TRUE;
   }
@@ -1421,6 +2479,10 @@ gss_adaptive_get_stream_type (const char *s)
     return GSS_ADAPTIVE_STREAM_ISOFF_LIVE;
   if (strcmp (s, "isoff-ondemand") == 0)
     return GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND;
+  if (strcmp (s, "hls-fmp4") == 0)
+    return GSS_ADAPTIVE_STREAM_HLS_FMP4;
+  if (strcmp (s, "hls-ts") == 0)
+    return GSS_ADAPTIVE_STREAM_HLS_TS;
   return GSS_ADAPTIVE_STREAM_UNKNOWN;
 }
 
@@ -1434,7 +2496,21 @@ gss_adaptive_stream_get_name (GssAdaptiveStream stream_type)
       return "isoff-live";
     case GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND:
       return "isoff-ondemand";
+    case GSS_ADAPTIVE_STREAM_HLS_FMP4:
+      return "hls-fmp4";
+    case GSS_ADAPTIVE_STREAM_HLS_TS:
+      return "hls-ts";
     default:
       return "unknown";
   }
 }
+
+/* Whether the stream type needs files fragmented for ISO BMFF (DASH
+ * and fMP4 HLS) rather than for Smooth Streaming and TS. */
+gboolean
+gss_adaptive_stream_is_isoff (GssAdaptiveStream stream_type)
+{
+  return (stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
+      stream_type == GSS_ADAPTIVE_STREAM_ISOFF_LIVE ||
+      stream_type == GSS_ADAPTIVE_STREAM_HLS_FMP4);
+}
@@ -21,8 +21,11 @@
 #ifndef _GSS_SMOOTH_STREAMING_H
 #define _GSS_SMOOTH_STREAMING_H
 
+#include <glib/gstdio.h>
+
 #include "gss-server.h"
 #include "gss-isom.h"
+#include "gss-fragment-store.h"
 
 G_BEGIN_DECLS
 
@@ -31,20 +34,24 @@ G_BEGIN_DECLS
 
 typedef struct _GssAdaptive GssAdaptive;
 typedef struct _GssAdaptiveLevel GssAdaptiveLevel;
+typedef struct _GssAdaptiveMedia GssAdaptiveMedia;
 typedef struct _GssAdaptiveQuery GssAdaptiveQuery;
 
 typedef enum {
   GSS_ADAPTIVE_STREAM_UNKNOWN,
   GSS_ADAPTIVE_STREAM_ISM,
   GSS_ADAPTIVE_STREAM_ISOFF_LIVE,
-  GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND
+  GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND,
+  GSS_ADAPTIVE_STREAM_HLS_FMP4,
+  GSS_ADAPTIVE_STREAM_HLS_TS
 } GssAdaptiveStream;
 
 typedef enum {
   GSS_DRM_UNKNOWN,
   GSS_DRM_CLEAR,
   GSS_DRM_PLAYREADY,
-  GSS_DRM_CENC
+  GSS_DRM_CENC,
+  GSS_DRM_CBCS
 } GssDrmType;
 
 typedef struct _GssDrmInfo GssDrmInfo;
@@ -56,10 +63,34 @@ struct _GssDrmInfo
   guint8 *data;
 };
 
+/* The parsed and fragmented files of one version of a title.  None of
+ * this depends on the DRM type, so it is shared by reference between
+ * all the GssAdaptive variants of the title that fragment the same
+ * way.  Read-only once loaded. */
+struct _GssAdaptiveMedia
+{
+  int refcount;
+  gboolean is_isoff;
+  guint64 duration;
+
+  int n_parsers;
+  GssIsomParser *parsers[20];
+
+  /* The media files are kept open so that fragments are read from the
+   * files that were parsed, even after they are replaced on disk.  The
+   * stats are used by gss_adaptive_media_is_current(). */
+  int fds[20];
+  GStatBuf stats[20];
+  char *manifest_filename;
+  GStatBuf manifest_stat;
+};
+
 struct _GssAdaptive
 {
+  int refcount;
   GssServer *server;
   char *content_id;
+  char *version;
   GssDrmType drm_type;
   GssAdaptiveStream stream_type;
   guint64 duration;
@@ -77,15 +108,27 @@ struct _GssAdaptive
   gsize kid_len;
   guint8 content_key[GSS_ADAPTIVE_KEY_LENGTH];
 
-  int n_parsers;
-  GssIsomParser *parsers[20];
+  GssAdaptiveMedia *media;
 
   GssDrmInfo drm_info;
+
+  /* If non-zero, isoff-live fragments are sent as CMAF chunks of
+   * roughly this duration (in 100 ns units) using chunked transfer
+   * encoding */
+  guint64 chunk_duration;
+
+  /* If non-NULL, encrypted fragments are kept here, so that they only
+   * need to be encrypted once.  Owned by the GssVod. */
+  GssFragmentStore *store;
 };
 
 struct _GssAdaptiveLevel
 {
   char *filename;
+  /* open media file, owned by adaptive->media, and its identity */
+  int fd;
+  guint64 inode;
+  gint64 mtime;
 
   int n_fragments;
   int bitrate;
@@ -94,6 +137,7 @@ struct _GssAdaptiveLevel
   int profile;
   int level;
 
+  /* variant of a track of adaptive->media, owned by the level */
   GssIsomTrack *track;
   int track_id;
   char *codec_data;
@@ -109,22 +153,46 @@ struct _GssAdaptiveQuery
   GssAdaptiveLevel *level;
   GssIsomFragment *fragment;
 
+  /* audio that is muxed together with level/fragment (hls-ts only) */
+  GssAdaptiveLevel *audio_level;
+  GssIsomFragment *audio_fragment;
+
   guint8 *data;
   gsize size;
+
+  SoupBuffer *buffer;
+
+  /* chunked delivery was cut short */
+  gboolean failed;
 };
 
 GssAdaptive *gss_adaptive_new (void);
 void gss_adaptive_free (GssAdaptive * adaptive);
+GssAdaptive *gss_adaptive_ref (GssAdaptive * adaptive);
+void gss_adaptive_unref (GssAdaptive * adaptive);
+gsize gss_adaptive_get_memory_size (GssAdaptive * adaptive);
 GssAdaptiveLevel *gss_adaptive_get_level (GssAdaptive * adaptive, gboolean video, guint64 bitrate);
 
 GssAdaptiveStream gss_adaptive_get_stream_type (const char *s);
 GssAdaptive * gss_adaptive_load (GssServer * server, const char *key,
     const char *dir, const char *version, GssDrmType drm_type,
     GssAdaptiveStream stream_type);
+GssAdaptive * gss_adaptive_new_from_media (GssServer * server,
+    const char *key, const char *version, GssAdaptiveMedia * media,
+    GssDrmType drm_type, GssAdaptiveStream stream_type,
+    const guint8 *key_seed, const char *license_url);
+GssAdaptiveMedia * gss_adaptive_media_load (const char *dir,
+    const char *version, gboolean is_isoff);
+GssAdaptiveMedia * gss_adaptive_media_ref (GssAdaptiveMedia * media);
+void gss_adaptive_media_unref (GssAdaptiveMedia * media);
+gsize gss_adaptive_media_get_memory_size (GssAdaptiveMedia * media);
+gboolean gss_adaptive_media_is_current (GssAdaptiveMedia * media);
 void gss_adaptive_get_resource (GssTransaction * t, GssAdaptive *adaptive,
     const char *subpath);
+void gss_adaptive_fill_store (GssAdaptive * adaptive);
 
 const char *gss_adaptive_stream_get_name (GssAdaptiveStream stream_type);
+gboolean gss_adaptive_stream_is_isoff (GssAdaptiveStream stream_type);
 
 G_END_DECLS
 
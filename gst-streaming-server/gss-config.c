@@ -140,6 +140,7 @@ gss_config_get_property (GObject * object, guint prop_id,
 
 void _priv_gss_transaction_initialize (void);
 void _priv_gss_transaction_cleanup (void);
+void _priv_gss_log_cleanup (void);
 
 void
 gss_init (void)
@@ -154,6 +155,7 @@ gss_deinit (void)
 {
   _gss_utils_deinit ();
   _priv_gss_transaction_cleanup ();
+  _priv_gss_log_cleanup ();
 }
 
 void
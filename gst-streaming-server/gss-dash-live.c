@@ -0,0 +1,1100 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Live DASH packaging for MPEG-TS program streams.  A tee branch of
+ * the stream pipeline demuxes and parses the TS into H.264 and AAC
+ * access units, which are cut into fragmented MP4 segments at video
+ * keyframes.  Each segment is serialized once into immutable
+ * SoupBuffers that are shared by every client, and a ring of the most
+ * recent segments is published through a dynamic MPD.  With a chunk
+ * duration set, segments are published as soon as their first
+ * moof/mdat chunk is packaged, and clients get the rest of the segment
+ * with chunked transfer encoding as it follows. */
+
+#include "config.h"
+
+#include "gss-dash-live.h"
+#include "gss-html.h"
+#include "gss-utils.h"
+
+#include <gst/base/gstbytewriter.h>
+
+#include <string.h>
+
+#define GSS_ISM_SECOND 10000000
+
+/* Shortest fragment; video is cut at the first keyframe after this */
+#define GSS_DASH_LIVE_MIN_FRAGMENT_DURATION (2 * GSS_ISM_SECOND)
+
+#define VIDEO_TRACK_ID 1
+#define AUDIO_TRACK_ID 2
+
+
+static void gss_dash_live_handle_mpd (GssTransaction * t);
+static void gss_dash_live_handle_init (GssTransaction * t);
+static void gss_dash_live_handle_segment (GssTransaction * t);
+
+
+static void
+gss_dash_live_track_init (GssDashLiveTrack * track, GssDashLive * dash,
+    gboolean is_video)
+{
+  track->dash = dash;
+  track->is_video = is_video;
+  track->samples = g_array_new (FALSE, FALSE, sizeof (GssBoxTrunSample));
+  track->sample_flags = g_array_new (FALSE, FALSE, sizeof (guint8));
+  track->data = g_byte_array_new ();
+}
+
+static void
+gss_dash_live_track_reset (GssDashLiveTrack * track)
+{
+  if (track->caps) {
+    gst_caps_unref (track->caps);
+    track->caps = NULL;
+  }
+  if (track->track) {
+    gss_isom_track_free (track->track);
+    track->track = NULL;
+  }
+  g_array_set_size (track->samples, 0);
+  g_array_set_size (track->sample_flags, 0);
+  g_byte_array_set_size (track->data, 0);
+}
+
+typedef struct _DashWaiter DashWaiter;
+struct _DashWaiter
+{
+  GssDashLiveSegment *segment;
+  GssTransaction *t;
+  gulong finished_id;
+};
+
+static void
+dash_waiter_free (DashWaiter * waiter)
+{
+  g_signal_handler_disconnect (waiter->t->msg, waiter->finished_id);
+  g_free (waiter);
+}
+
+static void
+gss_dash_live_waiter_finished (SoupMessage * msg, DashWaiter * waiter)
+{
+  /* the client went away; the transaction is freed after this */
+  waiter->segment->waiters = g_list_remove (waiter->segment->waiters, waiter);
+  g_signal_handler_disconnect (msg, waiter->finished_id);
+  g_free (waiter);
+}
+
+/* The headers have already been sent to clients waiting for the rest of
+ * an incomplete segment, so they are cut off by closing the
+ * connection. */
+static void
+gss_dash_live_segment_clear (GssDashLiveSegment * segment,
+    GssServer * server)
+{
+  GList *g;
+
+  for (g = segment->waiters; g; g = g_list_next (g)) {
+    DashWaiter *waiter = g->data;
+    GssTransaction *t = waiter->t;
+
+    dash_waiter_free (waiter);
+    t->debug_message = "segment dropped";
+    soup_socket_disconnect (soup_client_context_get_socket (t->client));
+  }
+  g_list_free (segment->waiters);
+  segment->waiters = NULL;
+
+  if (segment->location) {
+    if (server) {
+      gss_server_remove_resource (server, segment->location);
+    }
+    g_free (segment->location);
+    segment->location = NULL;
+  }
+  if (segment->chunks) {
+    g_ptr_array_free (segment->chunks, TRUE);
+    segment->chunks = NULL;
+  }
+  segment->size = 0;
+  segment->complete = FALSE;
+}
+
+/* Also forgets the published segments, so that the next pipeline
+ * starts a new timeline. */
+static void
+gss_dash_live_track_remove_resources (GssDashLiveTrack * track,
+    GssServer * server)
+{
+  int i;
+
+  for (i = 0; i < GSS_DASH_LIVE_SEGMENTS; i++) {
+    gss_dash_live_segment_clear (&track->segments[i], server);
+  }
+  track->n_segments = 0;
+  if (track->init_resource) {
+    gss_server_remove_resource (server, track->init_location);
+    track->init_resource = NULL;
+  }
+  if (track->init_buffer) {
+    soup_buffer_free (track->init_buffer);
+    track->init_buffer = NULL;
+  }
+}
+
+static void
+gss_dash_live_track_free (GssDashLiveTrack * track)
+{
+  int i;
+
+  gss_dash_live_track_reset (track);
+  g_array_free (track->samples, TRUE);
+  g_array_free (track->sample_flags, TRUE);
+  g_byte_array_free (track->data, TRUE);
+
+  for (i = 0; i < GSS_DASH_LIVE_SEGMENTS; i++) {
+    gss_dash_live_segment_clear (&track->segments[i], NULL);
+  }
+  if (track->init_buffer) {
+    soup_buffer_free (track->init_buffer);
+  }
+  g_free (track->init_location);
+  g_free (track->codecs);
+}
+
+GssDashLive *
+gss_dash_live_new (GssStream * stream)
+{
+  GssDashLive *dash;
+
+  dash = g_malloc0 (sizeof (GssDashLive));
+  dash->stream = stream;
+
+  dash->movie = gss_isom_movie_new ();
+  dash->movie->mvhd.timescale = GSS_ISM_SECOND;
+  dash->movie->mvhd.next_track_id = AUDIO_TRACK_ID + 1;
+  dash->movie->mehd.version = 1;
+
+  gss_dash_live_track_init (&dash->video, dash, TRUE);
+  gss_dash_live_track_init (&dash->audio, dash, FALSE);
+
+  return dash;
+}
+
+void
+gss_dash_live_free (GssDashLive * dash)
+{
+  g_return_if_fail (dash != NULL);
+
+  gss_dash_live_track_free (&dash->video);
+  gss_dash_live_track_free (&dash->audio);
+  gss_isom_movie_free (dash->movie);
+  g_free (dash);
+}
+
+void
+gss_dash_live_remove_resources (GssDashLive * dash)
+{
+  GssServer *server;
+
+  g_return_if_fail (dash != NULL);
+
+  server = GSS_OBJECT_SERVER (dash->stream->program);
+  gss_dash_live_track_remove_resources (&dash->video, server);
+  gss_dash_live_track_remove_resources (&dash->audio, server);
+}
+
+gboolean
+gss_dash_live_stream_is_supported (GssStream * stream)
+{
+#if GST_CHECK_VERSION(1,0,0)
+  if (!stream->program->enable_dash)
+    return FALSE;
+
+  return (stream->type == GSS_STREAM_TYPE_M2TS_H264BASE_AAC ||
+      stream->type == GSS_STREAM_TYPE_M2TS_H264MAIN_AAC);
+#else
+  return FALSE;
+#endif
+}
+
+/* Appended to a pipeline whose container parser feeds "tee name=livetee".
+ * There are deliberately no queues after the demuxer, so that both
+ * tracks are packaged in the same streaming thread. */
+const char *
+gss_dash_live_get_pipeline_string (void)
+{
+  return "livetee. ! queue ! tsdemux name=dashdemux "
+      "dashdemux. ! h264parse ! "
+      "video/x-h264,stream-format=avc,alignment=au ! "
+      "fakesink name=dashvideo signal-handoffs=true sync=false async=false "
+      "dashdemux. ! aacparse ! audio/mpeg,stream-format=raw ! "
+      "fakesink name=dashaudio signal-handoffs=true sync=false async=false ";
+}
+
+
+/* streaming thread */
+
+static GssIsomTrack *
+gss_dash_live_create_track (guint32 track_id, guint32 handler_type,
+    const char *handler_name)
+{
+  GssIsomTrack *track;
+
+  track = gss_isom_track_new ();
+
+  track->tkhd.present = TRUE;
+  track->tkhd.flags = 0x000007;
+  track->tkhd.track_id = track_id;
+  track->tkhd.matrix[0] = 0x00010000;
+  track->tkhd.matrix[4] = 0x00010000;
+  track->tkhd.matrix[8] = 0x40000000;
+
+  track->mdhd.version = 1;
+  track->mdhd.timescale = GSS_ISM_SECOND;
+  strcpy (track->mdhd.language_code, "und");
+
+  track->hdlr.present = TRUE;
+  track->hdlr.handler_type = handler_type;
+  track->hdlr.name = g_strdup (handler_name);
+
+  track->stsd.entry_count = 1;
+  track->stsd.entries = g_malloc0 (sizeof (GssBoxStsdEntry));
+
+  track->trex.track_id = track_id;
+  track->trex.default_sample_description_index = 1;
+
+  return track;
+}
+
+static void
+gss_dash_live_create_esds (GssIsomTrack * track, const guint8 * config,
+    int len)
+{
+  GstByteWriter *bw;
+
+  bw = gst_byte_writer_new ();
+  gst_byte_writer_put_uint32_be (bw, 0);
+  /* ES_DescrTag */
+  gst_byte_writer_put_uint8 (bw, 0x03);
+  gst_byte_writer_put_uint8 (bw, 23 + len);
+  gst_byte_writer_put_uint16_be (bw, track->tkhd.track_id);
+  gst_byte_writer_put_uint8 (bw, 0);
+  /* DecoderConfigDescrTag: MPEG-4 audio, audio stream */
+  gst_byte_writer_put_uint8 (bw, 0x04);
+  gst_byte_writer_put_uint8 (bw, 15 + len);
+  gst_byte_writer_put_uint8 (bw, 0x40);
+  gst_byte_writer_put_uint8 (bw, 0x15);
+  gst_byte_writer_put_uint24_be (bw, 0);
+  gst_byte_writer_put_uint32_be (bw, 0);
+  gst_byte_writer_put_uint32_be (bw, 0);
+  /* DecSpecificInfoTag */
+  gst_byte_writer_put_uint8 (bw, 0x05);
+  gst_byte_writer_put_uint8 (bw, len);
+  gst_byte_writer_put_data (bw, config, len);
+  /* SLConfigDescrTag */
+  gst_byte_writer_put_uint8 (bw, 0x06);
+  gst_byte_writer_put_uint8 (bw, 1);
+  gst_byte_writer_put_uint8 (bw, 0x02);
+
+  track->esds_store.size = gst_byte_writer_get_pos (bw);
+  track->esds_store.data = gst_byte_writer_free_and_get_data (bw);
+}
+
+typedef struct _DashCallback DashCallback;
+struct _DashCallback
+{
+  GssDashLiveTrack *track;
+  int generation;
+  gboolean is_init;
+  GssIsomFragment *fragment;
+  guint64 segment_timestamp;
+  gboolean is_last;
+  guint8 *data;
+  gsize size;
+  char *codecs;
+  int width;
+  int height;
+};
+
+static gboolean gss_dash_live_callback (gpointer data);
+
+static DashCallback *
+dash_callback_new (GssDashLiveTrack * track)
+{
+  DashCallback *callback;
+
+  callback = g_malloc0 (sizeof (DashCallback));
+  callback->track = track;
+  callback->generation = track->dash->generation;
+  g_object_ref (track->dash->stream);
+
+  return callback;
+}
+
+#if GST_CHECK_VERSION(1,0,0)
+static void
+gss_dash_live_track_set_caps (GssDashLiveTrack * track, GstCaps * caps)
+{
+  GstStructure *structure;
+  const GValue *value;
+  GstBuffer *codec_data;
+  GstMapInfo mapinfo;
+  DashCallback *callback;
+  GssIsomTrack *t;
+  gsize header_size;
+  char *codecs;
+  int width = 0;
+  int height = 0;
+  int rate = 0;
+  int channels = 0;
+
+  structure = gst_caps_get_structure (caps, 0);
+  value = gst_structure_get_value (structure, "codec_data");
+  if (value == NULL) {
+    GST_WARNING ("no codec_data in caps");
+    return;
+  }
+  codec_data = gst_value_get_buffer (value);
+  if (!gst_buffer_map (codec_data, &mapinfo, GST_MAP_READ)) {
+    GST_ERROR ("failed map");
+    return;
+  }
+
+  if (mapinfo.size < (track->is_video ? 4 : 2)) {
+    GST_WARNING ("short codec_data");
+    gst_buffer_unmap (codec_data, &mapinfo);
+    return;
+  }
+
+  if (track->is_video) {
+    gst_structure_get_int (structure, "width", &width);
+    gst_structure_get_int (structure, "height", &height);
+
+    t = gss_dash_live_create_track (VIDEO_TRACK_ID,
+        GST_MAKE_FOURCC ('v', 'i', 'd', 'e'), "VideoHandler");
+    t->tkhd.width = (guint32) width << 16;
+    t->tkhd.height = (guint32) height << 16;
+    t->vmhd.present = TRUE;
+    t->vmhd.flags = 1;
+    t->stsd.entries[0].atom = GST_MAKE_FOURCC ('a', 'v', 'c', '1');
+    t->mp4v.data_reference_index = 1;
+    t->mp4v.width = width;
+    t->mp4v.height = height;
+    t->esds.codec_data = g_memdup (mapinfo.data, mapinfo.size);
+    t->esds.codec_data_len = mapinfo.size;
+
+    codecs = g_strdup_printf ("avc1.%02x%02x%02x",
+        mapinfo.data[1], mapinfo.data[2], mapinfo.data[3]);
+  } else {
+    gst_structure_get_int (structure, "rate", &rate);
+    gst_structure_get_int (structure, "channels", &channels);
+
+    t = gss_dash_live_create_track (AUDIO_TRACK_ID,
+        GST_MAKE_FOURCC ('s', 'o', 'u', 'n'), "SoundHandler");
+    t->tkhd.volume = 0x0100;
+    t->smhd.present = TRUE;
+    t->stsd.entries[0].atom = GST_MAKE_FOURCC ('m', 'p', '4', 'a');
+    t->mp4a.data_reference_index = 1;
+    t->mp4a.channel_count = channels;
+    t->mp4a.sample_size = 16;
+    t->mp4a.sample_rate = (guint32) rate << 16;
+    gss_dash_live_create_esds (t, mapinfo.data, mapinfo.size);
+
+    codecs = g_strdup_printf ("mp4a.40.%d", mapinfo.data[0] >> 3);
+  }
+  gst_buffer_unmap (codec_data, &mapinfo);
+
+  /* renegotiated; samples already collected go out with the new
+   * track id, which is the same */
+  if (track->track) {
+    gss_isom_track_free (track->track);
+  }
+  track->track = t;
+
+  callback = dash_callback_new (track);
+  callback->is_init = TRUE;
+  callback->codecs = codecs;
+  callback->width = width;
+  callback->height = height;
+
+  /* The sidx that follows the header is empty and not used */
+  gss_isom_movie_serialize_track_dash (track->dash->movie, t,
+      &callback->data, &header_size, &callback->size);
+  callback->size = header_size;
+
+  g_idle_add (gss_dash_live_callback, callback);
+}
+#endif
+
+/* Hands the samples collected since the previous chunk to the main
+ * loop as one moof/mdat chunk of the current segment.  Without a chunk
+ * duration, that is the whole segment.  Each chunk gets its own
+ * sequence number. */
+static void
+gss_dash_live_track_finish_chunk (GssDashLiveTrack * track,
+    guint64 next_timestamp, gboolean is_last)
+{
+  GssIsomFragment *fragment;
+  DashCallback *callback;
+  int n_samples = track->samples->len;
+
+  fragment = gss_isom_fragment_new ();
+  fragment->mfhd.sequence_number = track->sequence_number++;
+  fragment->tfhd.track_id = track->track->tkhd.track_id;
+  fragment->tfdt.present = TRUE;
+  fragment->tfdt.version = 1;
+  fragment->tfdt.start_time = track->chunk_timestamp;
+  fragment->timestamp = track->chunk_timestamp;
+  fragment->duration = next_timestamp - track->chunk_timestamp;
+
+  fragment->trun.version = 1;
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples =
+      (GssBoxTrunSample *) g_array_free (track->samples, FALSE);
+  fragment->sdtp.present = TRUE;
+  fragment->sdtp.sample_flags =
+      (guint8 *) g_array_free (track->sample_flags, FALSE);
+  if (track->is_video) {
+    fragment->tfhd.default_sample_flags = 0x000100c0;
+    fragment->trun.flags = 0x0b01;
+  } else {
+    fragment->tfhd.default_sample_flags = 0xc0;
+    fragment->trun.flags = TR_SAMPLE_DURATION | TR_SAMPLE_SIZE |
+        TR_DATA_OFFSET;
+  }
+
+  fragment->mdat_size = 8 + track->data->len;
+  fragment->sglist = gss_sglist_new (1);
+  fragment->sglist->chunks[0].size = track->data->len;
+
+  /* The moof is serialized on the main loop, once the offset onto the
+   * MPD timeline is known, so that tfdt matches the SegmentTimeline. */
+  callback = dash_callback_new (track);
+  callback->fragment = fragment;
+  callback->segment_timestamp = track->fragment_timestamp;
+  callback->is_last = is_last;
+  callback->size = track->data->len;
+  callback->data = g_byte_array_free (track->data, FALSE);
+  g_idle_add (gss_dash_live_callback, callback);
+
+  track->samples = g_array_new (FALSE, FALSE, sizeof (GssBoxTrunSample));
+  track->sample_flags = g_array_new (FALSE, FALSE, sizeof (guint8));
+  track->data = g_byte_array_new ();
+}
+
+static void
+gss_dash_live_track_push_sample (GssDashLiveTrack * track,
+    const guint8 * data, gsize size, GstClockTime dts, GstClockTime pts,
+    gboolean is_sync)
+{
+  GssDashLive *dash = track->dash;
+  GssBoxTrunSample sample = { 0 };
+  guint8 sample_flags;
+  guint64 timestamp;
+
+  if (!dash->have_base_time) {
+    dash->base_time = dts;
+    dash->have_base_time = TRUE;
+  }
+  /* 100 ns units, relative to the first buffer of either track */
+  timestamp = (dts > dash->base_time) ? (dts - dash->base_time) / 100 : 0;
+
+  if (track->samples->len == 0) {
+    if (track->is_video) {
+      /* fragments must start with a keyframe */
+      if (!is_sync)
+        return;
+      dash->video_cut = timestamp;
+      dash->have_video_cut = TRUE;
+    } else {
+      /* audio starts with the first video fragment */
+      if (!dash->have_video_cut || timestamp < dash->video_cut)
+        return;
+    }
+    track->fragment_timestamp = timestamp;
+    track->chunk_timestamp = timestamp;
+  } else {
+    GssBoxTrunSample *last;
+    gboolean cut;
+
+    last = &g_array_index (track->samples, GssBoxTrunSample,
+        track->samples->len - 1);
+    last->duration = (timestamp > track->last_dts) ?
+        timestamp - track->last_dts : 0;
+
+    if (track->is_video) {
+      cut = is_sync && timestamp >= track->fragment_timestamp +
+          GSS_DASH_LIVE_MIN_FRAGMENT_DURATION;
+    } else {
+      /* follow the video fragment boundaries */
+      cut = dash->video_cut > track->fragment_timestamp &&
+          timestamp >= dash->video_cut;
+    }
+    if (cut) {
+      gss_dash_live_track_finish_chunk (track, timestamp, TRUE);
+      track->fragment_timestamp = timestamp;
+      track->chunk_timestamp = timestamp;
+      if (track->is_video) {
+        dash->video_cut = timestamp;
+      }
+    } else if (dash->chunk_duration > 0 &&
+        timestamp >= track->chunk_timestamp + dash->chunk_duration) {
+      gss_dash_live_track_finish_chunk (track, timestamp, FALSE);
+      track->chunk_timestamp = timestamp;
+    }
+  }
+
+  sample.size = size;
+  if (GST_CLOCK_TIME_IS_VALID (pts)) {
+    sample.composition_time_offset = ((gint64) pts - (gint64) dts) / 100;
+  }
+  g_array_append_val (track->samples, sample);
+  if (track->is_video) {
+    sample_flags = is_sync ? 0x14 : 0x1c;
+  } else {
+    sample_flags = 0;
+  }
+  g_array_append_val (track->sample_flags, sample_flags);
+  g_byte_array_append (track->data, data, size);
+
+  track->last_dts = timestamp;
+}
+
+#if GST_CHECK_VERSION(1,0,0)
+static void
+gss_dash_live_handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    gpointer user_data)
+{
+  GssDashLiveTrack *track = user_data;
+  GstMapInfo mapinfo;
+  GstCaps *caps;
+  GstClockTime dts;
+  GstClockTime pts;
+
+  caps = gst_pad_get_current_caps (pad);
+  if (caps && (track->caps == NULL ||
+          !gst_caps_is_equal (caps, track->caps))) {
+    if (track->caps) {
+      gst_caps_unref (track->caps);
+    }
+    track->caps = gst_caps_ref (caps);
+    gss_dash_live_track_set_caps (track, caps);
+  }
+  if (caps) {
+    gst_caps_unref (caps);
+  }
+  if (track->track == NULL)
+    return;
+
+  pts = GST_BUFFER_PTS (buffer);
+  dts = GST_BUFFER_DTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (dts)) {
+    dts = pts;
+  }
+  if (!GST_CLOCK_TIME_IS_VALID (dts)) {
+    GST_DEBUG ("dropping buffer without timestamp");
+    return;
+  }
+
+  if (!gst_buffer_map (buffer, &mapinfo, GST_MAP_READ)) {
+    GST_ERROR ("failed map");
+    return;
+  }
+  gss_dash_live_track_push_sample (track, mapinfo.data, mapinfo.size,
+      dts, pts, !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+  gst_buffer_unmap (buffer, &mapinfo);
+}
+#endif
+
+
+/* main loop */
+
+/* The first chunk of a segment publishes it, and later chunks go out to
+ * the clients that requested it meanwhile. */
+static void
+gss_dash_live_track_add_chunk (GssDashLiveTrack * track,
+    GssIsomFragment * fragment, guint64 segment_timestamp, gboolean is_last,
+    const guint8 * data, gsize size)
+{
+  GssDashLive *dash = track->dash;
+  GssStream *stream = dash->stream;
+  GssProgram *program = stream->program;
+  GssDashLiveSegment *segment = NULL;
+  SoupBuffer *buffer;
+  guint8 *chunk_data;
+  GList *g;
+
+  if (!program->dash.have_offset) {
+    gint64 now = g_get_real_time ();
+    guint64 end = fragment->timestamp + fragment->duration;
+
+    /* The first chunk of the program sets up its timeline, mapping
+     * timestamps onto availabilityStartTime so that segments are
+     * announced as available as soon as they have been packaged.
+     * Every stream and track of the program uses the same mapping, so
+     * segments cut at the same timestamp get the same time. */
+    program->dash.availability_start_time = now - end / 10;
+    /* round down, MPD times are in whole seconds */
+    program->dash.availability_start_time -=
+        program->dash.availability_start_time % G_USEC_PER_SEC;
+    program->dash.offset =
+        MAX ((now - program->dash.availability_start_time) * 10 -
+        (gint64) end, 0);
+    program->dash.have_offset = TRUE;
+  }
+  segment_timestamp += program->dash.offset;
+
+  /* moof_data ends with the mdat header */
+  fragment->tfdt.start_time = fragment->timestamp + program->dash.offset;
+  gss_isom_fragment_serialize (fragment, &fragment->moof_data,
+      &fragment->moof_size, track->is_video);
+  chunk_data = g_malloc (fragment->moof_size + size);
+  memcpy (chunk_data, fragment->moof_data, fragment->moof_size);
+  memcpy (chunk_data + fragment->moof_size, data, size);
+  buffer = soup_buffer_new (SOUP_MEMORY_TAKE, chunk_data,
+      fragment->moof_size + size);
+
+  if (track->n_segments > 0) {
+    segment = &track->segments[(track->n_segments - 1) %
+        GSS_DASH_LIVE_SEGMENTS];
+    if (segment->complete || segment->timestamp != segment_timestamp) {
+      segment = NULL;
+    }
+  }
+  if (segment == NULL) {
+    segment = &track->segments[track->n_segments % GSS_DASH_LIVE_SEGMENTS];
+    gss_dash_live_segment_clear (segment, GSS_OBJECT_SERVER (program));
+    segment->track = track;
+    segment->timestamp = segment_timestamp;
+    segment->duration = 0;
+    segment->chunks =
+        g_ptr_array_new_with_free_func ((GDestroyNotify) soup_buffer_free);
+    segment->location = g_strdup_printf ("/%s-%dx%d-%dkbps-%s-%"
+        G_GUINT64_FORMAT ".m4s", GSS_OBJECT_NAME (program), stream->width,
+        stream->height, stream->bitrate / 1000,
+        track->is_video ? "video" : "audio", segment_timestamp);
+
+    gss_server_add_resource (GSS_OBJECT_SERVER (program), segment->location,
+        0, track->is_video ? "video/mp4" : "audio/mp4",
+        gss_dash_live_handle_segment, NULL, NULL, segment);
+
+    track->n_segments++;
+  }
+
+  g_ptr_array_add (segment->chunks, buffer);
+  segment->size += buffer->length;
+  segment->duration += fragment->duration;
+  segment->complete = is_last;
+
+  for (g = segment->waiters; g; g = g_list_next (g)) {
+    DashWaiter *waiter = g->data;
+
+    soup_message_body_append_buffer (waiter->t->msg->response_body, buffer);
+    if (is_last) {
+      soup_message_body_complete (waiter->t->msg->response_body);
+    }
+    soup_server_unpause_message (waiter->t->soupserver, waiter->t->msg);
+  }
+  if (is_last) {
+    g_list_free_full (segment->waiters, (GDestroyNotify) dash_waiter_free);
+    segment->waiters = NULL;
+  }
+}
+
+static void
+gss_dash_live_track_set_init (GssDashLiveTrack * track, SoupBuffer * buffer,
+    char *codecs)
+{
+  GssDashLive *dash = track->dash;
+  GssStream *stream = dash->stream;
+  GssProgram *program = stream->program;
+
+  if (track->init_buffer) {
+    soup_buffer_free (track->init_buffer);
+  }
+  track->init_buffer = buffer;
+  g_free (track->codecs);
+  track->codecs = codecs;
+
+  if (track->init_resource == NULL) {
+    g_free (track->init_location);
+    track->init_location = g_strdup_printf ("/%s-%dx%d-%dkbps-%s-init.mp4",
+        GSS_OBJECT_NAME (program), stream->width, stream->height,
+        stream->bitrate / 1000, track->is_video ? "video" : "audio");
+    track->init_resource =
+        gss_server_add_resource (GSS_OBJECT_SERVER (program),
+        track->init_location, 0, track->is_video ? "video/mp4" : "audio/mp4",
+        gss_dash_live_handle_init, NULL, NULL, track);
+  }
+}
+
+static gboolean
+gss_dash_live_callback (gpointer data)
+{
+  DashCallback *callback = data;
+  GssDashLiveTrack *track = callback->track;
+  GssStream *stream = track->dash->stream;
+
+  if (callback->generation != track->dash->generation ||
+      stream->program == NULL) {
+    /* from a pipeline that has since been replaced or stopped */
+    g_free (callback->data);
+    g_free (callback->codecs);
+  } else if (callback->is_init) {
+    if (track->is_video) {
+      track->dash->width = callback->width;
+      track->dash->height = callback->height;
+    }
+    gss_dash_live_track_set_init (track,
+        soup_buffer_new (SOUP_MEMORY_TAKE, callback->data, callback->size),
+        callback->codecs);
+  } else {
+    gss_dash_live_track_add_chunk (track, callback->fragment,
+        callback->segment_timestamp, callback->is_last, callback->data,
+        callback->size);
+    g_free (callback->data);
+  }
+
+  if (callback->fragment) {
+    gss_isom_fragment_free (callback->fragment);
+  }
+  g_object_unref (stream);
+  g_free (callback);
+
+  return FALSE;
+}
+
+void
+gss_stream_add_dash (GssStream * stream, GstElement * pipeline)
+{
+  GssProgram *program = stream->program;
+  GssDashLive *dash;
+#if GST_CHECK_VERSION(1,0,0)
+  GstElement *e;
+#endif
+
+  if (program->dash.mpd_location == NULL) {
+    program->dash.mpd_location =
+        g_strdup_printf ("/%s.mpd", GSS_OBJECT_NAME (program));
+    gss_server_add_resource (GSS_OBJECT_SERVER (program),
+        program->dash.mpd_location, 0, "application/dash+xml",
+        gss_dash_live_handle_mpd, NULL, NULL, program);
+  }
+
+  if (stream->dash_live == NULL) {
+    stream->dash_live = gss_dash_live_new (stream);
+  }
+  dash = stream->dash_live;
+
+  /* The previous pipeline (if any) has been stopped, so the streaming
+   * thread state can be reset here. */
+  dash->generation++;
+  dash->chunk_duration = (guint64) program->dash.chunk_duration * 10000;
+  dash->have_base_time = FALSE;
+  dash->have_video_cut = FALSE;
+  gss_dash_live_track_reset (&dash->video);
+  gss_dash_live_track_reset (&dash->audio);
+
+#if GST_CHECK_VERSION(1,0,0)
+  e = gst_bin_get_by_name (GST_BIN (pipeline), "dashvideo");
+  g_assert (e != NULL);
+  g_signal_connect (e, "handoff", G_CALLBACK (gss_dash_live_handoff),
+      &dash->video);
+  g_object_unref (e);
+
+  e = gst_bin_get_by_name (GST_BIN (pipeline), "dashaudio");
+  g_assert (e != NULL);
+  g_signal_connect (e, "handoff", G_CALLBACK (gss_dash_live_handoff),
+      &dash->audio);
+  g_object_unref (e);
+#endif
+}
+
+/* Called when the program stops.  The MPD and segments of the stopped
+ * pipelines are unpublished, and the next pipeline gets a new
+ * availabilityStartTime. */
+void
+gss_program_remove_dash (GssProgram * program)
+{
+  GssServer *server = GSS_OBJECT_SERVER (program);
+  GList *g;
+
+  for (g = program->streams; g; g = g_list_next (g)) {
+    GssStream *stream = g->data;
+
+    if (stream->dash_live == NULL)
+      continue;
+    /* drop segments still queued by the stopped pipeline */
+    stream->dash_live->generation++;
+    if (server) {
+      gss_dash_live_remove_resources (stream->dash_live);
+    }
+  }
+
+  if (program->dash.mpd_location) {
+    if (server) {
+      gss_server_remove_resource (server, program->dash.mpd_location);
+    }
+    g_free (program->dash.mpd_location);
+    program->dash.mpd_location = NULL;
+  }
+  program->dash.availability_start_time = 0;
+  program->dash.have_offset = FALSE;
+  program->dash.offset = 0;
+}
+
+
+static void
+gss_dash_live_handle_init (GssTransaction * t)
+{
+  GssDashLiveTrack *track = (GssDashLiveTrack *) t->resource->priv;
+
+  if (track->init_buffer == NULL) {
+    gss_transaction_error_not_found (t, "no init segment");
+    return;
+  }
+
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+  soup_message_body_append_buffer (t->msg->response_body, track->init_buffer);
+}
+
+static void
+gss_dash_live_handle_segment (GssTransaction * t)
+{
+  GssDashLiveSegment *segment = (GssDashLiveSegment *) t->resource->priv;
+  guint i;
+
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+
+  /* segments never change once published, they only grow until
+   * complete */
+  soup_message_headers_replace (t->msg->response_headers,
+      "Cache-Control", "max-age=60");
+
+  if (!segment->complete) {
+    DashWaiter *waiter;
+
+    /* libsoup pauses the message once it has written the chunks
+     * appended so far, until gss_dash_live_track_add_chunk() appends
+     * the next one */
+    soup_message_headers_set_encoding (t->msg->response_headers,
+        SOUP_ENCODING_CHUNKED);
+    waiter = g_malloc0 (sizeof (DashWaiter));
+    waiter->segment = segment;
+    waiter->t = t;
+    waiter->finished_id = g_signal_connect (t->msg, "finished",
+        G_CALLBACK (gss_dash_live_waiter_finished), waiter);
+    segment->waiters = g_list_append (segment->waiters, waiter);
+  }
+
+  for (i = 0; i < segment->chunks->len; i++) {
+    soup_message_body_append_buffer (t->msg->response_body,
+        g_ptr_array_index (segment->chunks, i));
+  }
+}
+
+static int
+gss_dash_live_track_get_first_segment (GssDashLiveTrack * track)
+{
+  return MAX (0, track->n_segments - GSS_DASH_LIVE_SEGMENTS);
+}
+
+static void
+append_segment_template (GssTransaction * t, GssDashLiveTrack * track)
+{
+  GssStream *stream = track->dash->stream;
+  GssProgram *program = stream->program;
+  GString *s = t->s;
+  int i;
+
+  GSS_P ("        <SegmentTemplate timescale=\"10000000\" "
+      "initialization=\"%s%s\" "
+      "media=\"%s/%s-%dx%d-%dkbps-%s-$Time$.m4s\"",
+      GSS_OBJECT_SERVER (program)->base_url, track->init_location,
+      GSS_OBJECT_SERVER (program)->base_url, GSS_OBJECT_NAME (program),
+      stream->width, stream->height, stream->bitrate / 1000,
+      track->is_video ? "video" : "audio");
+  if (track->dash->chunk_duration > 0 &&
+      track->dash->chunk_duration < GSS_DASH_LIVE_MIN_FRAGMENT_DURATION) {
+    /* a segment can be requested once its first chunk is out */
+    GSS_P (" availabilityTimeOffset=\"%.3f\" "
+        "availabilityTimeComplete=\"false\"",
+        (double) (GSS_DASH_LIVE_MIN_FRAGMENT_DURATION -
+            track->dash->chunk_duration) / GSS_ISM_SECOND);
+  }
+  GSS_A (">\n");
+  GSS_A ("          <SegmentTimeline>\n");
+  for (i = gss_dash_live_track_get_first_segment (track);
+      i < track->n_segments; i++) {
+    GssDashLiveSegment *segment = &track->segments[i % GSS_DASH_LIVE_SEGMENTS];
+    guint64 duration = segment->duration;
+
+    /* the segment being packaged is announced with the shortest
+     * duration it can have */
+    if (!segment->complete) {
+      duration = MAX (duration, GSS_DASH_LIVE_MIN_FRAGMENT_DURATION);
+    }
+    GSS_P ("            <S t=\"%" G_GUINT64_FORMAT "\" d=\"%"
+        G_GUINT64_FORMAT "\" />\n", segment->timestamp, duration);
+  }
+  GSS_A ("          </SegmentTimeline>\n");
+  GSS_A ("        </SegmentTemplate>\n");
+}
+
+static guint64
+gss_dash_live_track_get_bitrate (GssDashLiveTrack * track)
+{
+  guint64 size = 0;
+  guint64 duration = 0;
+  int i;
+
+  for (i = gss_dash_live_track_get_first_segment (track);
+      i < track->n_segments; i++) {
+    GssDashLiveSegment *segment = &track->segments[i % GSS_DASH_LIVE_SEGMENTS];
+
+    if (!segment->complete)
+      continue;
+    size += segment->size;
+    duration += segment->duration;
+  }
+  if (duration == 0)
+    return 0;
+  return gst_util_uint64_scale (size * 8, GSS_ISM_SECOND, duration);
+}
+
+static char *
+format_time (gint64 time)
+{
+  GDateTime *datetime;
+  char *s;
+
+  datetime = g_date_time_new_from_unix_utc (time / G_USEC_PER_SEC);
+  s = g_date_time_format (datetime, "%Y-%m-%dT%H:%M:%SZ");
+  g_date_time_unref (datetime);
+
+  return s;
+}
+
+static void
+gss_dash_live_handle_mpd (GssTransaction * t)
+{
+  GssProgram *program = (GssProgram *) t->resource->priv;
+  GString *s;
+  GList *g;
+  guint64 time_shift_buffer_depth = 0;
+  char *availability_start_time;
+  char *publish_time;
+  int id;
+
+  if (program->dash.availability_start_time == 0) {
+    gss_transaction_error_not_found (t, "no segments yet");
+    return;
+  }
+
+  for (g = program->streams; g; g = g_list_next (g)) {
+    GssStream *stream = g->data;
+    GssDashLiveTrack *track;
+    guint64 depth = 0;
+    int i;
+
+    if (stream->dash_live == NULL)
+      continue;
+    track = &stream->dash_live->video;
+    for (i = gss_dash_live_track_get_first_segment (track);
+        i < track->n_segments; i++) {
+      depth += track->segments[i % GSS_DASH_LIVE_SEGMENTS].duration;
+    }
+    time_shift_buffer_depth = MAX (time_shift_buffer_depth, depth);
+  }
+
+  s = t->s = g_string_new ("");
+
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+  soup_message_headers_replace (t->msg->response_headers,
+      "Cache-Control", "no-store");
+
+  availability_start_time =
+      format_time (program->dash.availability_start_time);
+  publish_time = format_time (g_get_real_time ());
+
+  GSS_P ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+  GSS_P ("<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\"\n"
+      "  type=\"dynamic\"\n"
+      "  availabilityStartTime=\"%s\"\n"
+      "  publishTime=\"%s\"\n"
+      "  minimumUpdatePeriod=\"PT%dS\"\n"
+      "  minBufferTime=\"PT%dS\"\n"
+      "  timeShiftBufferDepth=\"PT%dS\"\n"
+      "  profiles=\"urn:mpeg:dash:profile:isoff-live:2011\">\n",
+      availability_start_time, publish_time,
+      GSS_DASH_LIVE_MIN_FRAGMENT_DURATION / GSS_ISM_SECOND,
+      GSS_DASH_LIVE_MIN_FRAGMENT_DURATION / GSS_ISM_SECOND,
+      (int) (time_shift_buffer_depth / GSS_ISM_SECOND));
+  GSS_A ("  <Period id=\"1\" start=\"PT0S\">\n");
+
+  GSS_A ("    <AdaptationSet id=\"1\" contentType=\"video\" "
+      "mimeType=\"video/mp4\" segmentAlignment=\"true\" "
+      "startWithSAP=\"1\">\n");
+  id = 0;
+  for (g = program->streams; g; g = g_list_next (g)) {
+    GssStream *stream = g->data;
+    GssDashLive *dash = stream->dash_live;
+
+    id++;
+    if (dash == NULL || dash->video.init_buffer == NULL ||
+        dash->video.n_segments == 0)
+      continue;
+
+    GSS_P ("      <Representation id=\"v%d\" bandwidth=\"%d\" "
+        "width=\"%d\" height=\"%d\" codecs=\"%s\">\n",
+        id, stream->bitrate, dash->width, dash->height, dash->video.codecs);
+    append_segment_template (t, &dash->video);
+    GSS_A ("      </Representation>\n");
+  }
+  GSS_A ("    </AdaptationSet>\n");
+
+  GSS_A ("    <AdaptationSet id=\"2\" contentType=\"audio\" "
+      "mimeType=\"audio/mp4\" segmentAlignment=\"true\" "
+      "startWithSAP=\"1\">\n");
+  id = 0;
+  for (g = program->streams; g; g = g_list_next (g)) {
+    GssStream *stream = g->data;
+    GssDashLive *dash = stream->dash_live;
+
+    id++;
+    if (dash == NULL || dash->audio.init_buffer == NULL ||
+        dash->audio.n_segments == 0)
+      continue;
+
+    GSS_P ("      <Representation id=\"a%d\" bandwidth=\"%" G_GUINT64_FORMAT
+        "\" codecs=\"%s\">\n", id,
+        gss_dash_live_track_get_bitrate (&dash->audio), dash->audio.codecs);
+    append_segment_template (t, &dash->audio);
+    GSS_A ("      </Representation>\n");
+  }
+  GSS_A ("    </AdaptationSet>\n");
+
+  GSS_A ("  </Period>\n");
+  GSS_A ("</MPD>\n");
+
+  g_free (availability_start_time);
+  g_free (publish_time);
+}
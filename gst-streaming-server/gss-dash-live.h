@@ -0,0 +1,111 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_DASH_LIVE_H
+#define _GSS_DASH_LIVE_H
+
+#include "gss-server.h"
+#include "gss-isom.h"
+
+G_BEGIN_DECLS
+
+#define GSS_DASH_LIVE_SEGMENTS 10
+
+typedef struct _GssDashLiveTrack GssDashLiveTrack;
+typedef struct _GssDashLiveSegment GssDashLiveSegment;
+
+struct _GssDashLiveSegment {
+  GssDashLiveTrack *track;
+  guint64 timestamp;
+  /* so far, until the segment is complete */
+  guint64 duration;
+  /* SoupBuffers of moof/mdat chunks, each one immutable */
+  GPtrArray *chunks;
+  gsize size;
+  gboolean complete;
+  /* responses sent the chunks as they arrive */
+  GList *waiters;
+  char *location;
+};
+
+struct _GssDashLiveTrack {
+  GssDashLive *dash;
+  gboolean is_video;
+
+  /* streaming thread */
+  GstCaps *caps;
+  GssIsomTrack *track;
+  GArray *samples;
+  GArray *sample_flags;
+  GByteArray *data;
+  guint64 fragment_timestamp;
+  guint64 chunk_timestamp;
+  guint64 last_dts;
+  int sequence_number;
+
+  /* main loop */
+  char *codecs;
+  char *init_location;
+  SoupBuffer *init_buffer;
+  GssResource *init_resource;
+  int n_segments;
+  GssDashLiveSegment segments[GSS_DASH_LIVE_SEGMENTS];
+};
+
+struct _GssDashLive {
+  GssStream *stream;
+  GssIsomMovie *movie;
+
+  GssDashLiveTrack video;
+  GssDashLiveTrack audio;
+
+  /* Incremented each time a new pipeline is attached, so that
+   * segments still queued from an old pipeline are dropped. */
+  int generation;
+
+  /* set before the pipeline starts, 0 to cut whole segments */
+  guint64 chunk_duration;
+
+  /* streaming thread.  Both tracks are packaged in the demuxer's
+   * streaming thread, so these need no locking. */
+  gboolean have_base_time;
+  guint64 base_time;
+  gboolean have_video_cut;
+  guint64 video_cut;
+
+  /* main loop */
+  int width;
+  int height;
+};
+
+
+GssDashLive * gss_dash_live_new (GssStream *stream);
+void gss_dash_live_free (GssDashLive *dash);
+void gss_dash_live_remove_resources (GssDashLive *dash);
+gboolean gss_dash_live_stream_is_supported (GssStream *stream);
+const char * gss_dash_live_get_pipeline_string (void);
+void gss_stream_add_dash (GssStream *stream, GstElement *pipeline);
+void gss_program_remove_dash (GssProgram *program);
+
+
+G_END_DECLS
+
+#endif
+
@@ -0,0 +1,409 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* On-disk store of encrypted fragments.
+ *
+ * Each fragment is kept in its own file, named after the SHA-1 of its
+ * key and spread over 256 subdirectories.  A file holds exactly the
+ * bytes that are sent to the client (the mdat box, header included),
+ * starting at offset 0, so it can be mapped or sent with sendfile()
+ * without any framing.  The index and LRU order live in memory and are
+ * rebuilt from the directory on startup, ordered by access time. */
+
+#include "config.h"
+
+#include <gst/gst.h>
+
+#include "gss-fragment-store.h"
+#include "gss-log.h"
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef struct _GssFragmentStoreEntry GssFragmentStoreEntry;
+
+struct _GssFragmentStoreEntry
+{
+  char *name;
+  gsize size;
+  time_t atime;
+  GList link;
+};
+
+struct _GssFragmentStore
+{
+  char *dir;
+  guint64 max_size;
+
+  GMutex lock;
+  GHashTable *entries;
+  /* most recently used at the head */
+  GQueue lru;
+  guint64 size;
+
+  guint64 hits;
+  guint64 misses;
+};
+
+
+static void
+gss_fragment_store_entry_free (GssFragmentStoreEntry * entry)
+{
+  g_free (entry->name);
+  g_free (entry);
+}
+
+static char *
+gss_fragment_store_get_name (const char *key)
+{
+  return g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+}
+
+static char *
+gss_fragment_store_get_path (GssFragmentStore * store, const char *name)
+{
+  return g_strdup_printf ("%s/%c%c/%s", store->dir, name[0], name[1], name);
+}
+
+static gint
+compare_atime (gconstpointer a, gconstpointer b)
+{
+  const GssFragmentStoreEntry *ea = a;
+  const GssFragmentStoreEntry *eb = b;
+
+  if (ea->atime < eb->atime)
+    return 1;
+  if (ea->atime > eb->atime)
+    return -1;
+  return 0;
+}
+
+static void
+gss_fragment_store_scan (GssFragmentStore * store)
+{
+  GDir *dir;
+  GList *list = NULL;
+  GList *g;
+  const char *subdir_name;
+
+  dir = g_dir_open (store->dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((subdir_name = g_dir_read_name (dir))) {
+    GDir *subdir;
+    char *subdir_path;
+    const char *name;
+
+    if (strlen (subdir_name) != 2)
+      continue;
+
+    subdir_path = g_strdup_printf ("%s/%s", store->dir, subdir_name);
+    subdir = g_dir_open (subdir_path, 0, NULL);
+    if (subdir == NULL) {
+      g_free (subdir_path);
+      continue;
+    }
+    while ((name = g_dir_read_name (subdir))) {
+      GssFragmentStoreEntry *entry;
+      GStatBuf statbuf;
+      char *path;
+
+      path = g_strdup_printf ("%s/%s", subdir_path, name);
+      /* anything else is a temporary file left by a crash */
+      if (strlen (name) != 40 || g_stat (path, &statbuf) < 0) {
+        g_unlink (path);
+        g_free (path);
+        continue;
+      }
+      g_free (path);
+
+      entry = g_malloc0 (sizeof (GssFragmentStoreEntry));
+      entry->name = g_strdup (name);
+      entry->size = statbuf.st_size;
+      entry->atime = statbuf.st_atime;
+      entry->link.data = entry;
+      list = g_list_prepend (list, entry);
+    }
+    g_dir_close (subdir);
+    g_free (subdir_path);
+  }
+  g_dir_close (dir);
+
+  list = g_list_sort (list, compare_atime);
+  for (g = list; g; g = g_list_next (g)) {
+    GssFragmentStoreEntry *entry = g->data;
+
+    g_hash_table_insert (store->entries, entry->name, entry);
+    g_queue_push_tail_link (&store->lru, &entry->link);
+    store->size += entry->size;
+  }
+  g_list_free (list);
+
+  GST_DEBUG ("fragment store %s: %d files, %" G_GUINT64_FORMAT " bytes",
+      store->dir, g_hash_table_size (store->entries), store->size);
+}
+
+/* Removes least recently used entries until the store fits in
+ * max_size, and returns the paths of their files, which the caller
+ * unlinks outside the lock. */
+static GList *
+gss_fragment_store_evict_unlocked (GssFragmentStore * store)
+{
+  GList *paths = NULL;
+
+  while (store->size > store->max_size && store->lru.tail) {
+    GssFragmentStoreEntry *entry = store->lru.tail->data;
+
+    g_queue_unlink (&store->lru, &entry->link);
+    store->size -= entry->size;
+    paths = g_list_prepend (paths,
+        gss_fragment_store_get_path (store, entry->name));
+    g_hash_table_remove (store->entries, entry->name);
+  }
+
+  return paths;
+}
+
+static void
+unlink_paths (GList * paths)
+{
+  GList *g;
+
+  for (g = paths; g; g = g_list_next (g)) {
+    g_unlink (g->data);
+  }
+  g_list_free_full (paths, g_free);
+}
+
+/**
+ * gss_fragment_store_new:
+ * @dir: directory to keep fragments in.  Created if it does not exist.
+ * @max_size: maximum number of bytes to keep on disk
+ *
+ * Opens a fragment store, indexing any fragments already in @dir.
+ * If they use more than @max_size bytes, the least recently used ones
+ * are removed.
+ *
+ * Returns: a new #GssFragmentStore
+ */
+GssFragmentStore *
+gss_fragment_store_new (const char *dir, guint64 max_size)
+{
+  GssFragmentStore *store;
+
+  g_return_val_if_fail (dir != NULL, NULL);
+
+  store = g_malloc0 (sizeof (GssFragmentStore));
+  store->dir = g_strdup (dir);
+  store->max_size = max_size;
+  g_mutex_init (&store->lock);
+  store->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) gss_fragment_store_entry_free);
+  g_queue_init (&store->lru);
+
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    GST_WARNING ("failed to create fragment store directory %s: %s",
+        dir, g_strerror (errno));
+  }
+  gss_fragment_store_scan (store);
+  unlink_paths (gss_fragment_store_evict_unlocked (store));
+
+  return store;
+}
+
+void
+gss_fragment_store_free (GssFragmentStore * store)
+{
+  g_return_if_fail (store != NULL);
+
+  g_hash_table_unref (store->entries);
+  g_mutex_clear (&store->lock);
+  g_free (store->dir);
+  g_free (store);
+}
+
+/**
+ * gss_fragment_store_lookup:
+ * @store: a #GssFragmentStore
+ * @key: key of the fragment
+ *
+ * Looks up the fragment stored under @key and marks it as recently
+ * used.
+ *
+ * Returns: a read-only mapping of the stored fragment, or %NULL if it
+ *   is not in the store.  Free with g_mapped_file_unref().
+ */
+GMappedFile *
+gss_fragment_store_lookup (GssFragmentStore * store, const char *key)
+{
+  GssFragmentStoreEntry *entry;
+  GMappedFile *mapped;
+  char *name;
+  char *path;
+
+  g_return_val_if_fail (store != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  name = gss_fragment_store_get_name (key);
+
+  g_mutex_lock (&store->lock);
+  entry = g_hash_table_lookup (store->entries, name);
+  if (entry == NULL) {
+    store->misses++;
+    g_mutex_unlock (&store->lock);
+    g_free (name);
+    return NULL;
+  }
+  g_queue_unlink (&store->lru, &entry->link);
+  g_queue_push_head_link (&store->lru, &entry->link);
+  store->hits++;
+  g_mutex_unlock (&store->lock);
+
+  /* An eviction racing with this only unlinks the file, which leaves
+   * an existing mapping intact. */
+  path = gss_fragment_store_get_path (store, name);
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped == NULL) {
+    GST_WARNING ("fragment store file %s disappeared", path);
+    g_mutex_lock (&store->lock);
+    entry = g_hash_table_lookup (store->entries, name);
+    if (entry) {
+      g_queue_unlink (&store->lru, &entry->link);
+      store->size -= entry->size;
+      g_hash_table_remove (store->entries, name);
+    }
+    g_mutex_unlock (&store->lock);
+  }
+  g_free (path);
+  g_free (name);
+
+  return mapped;
+}
+
+gboolean
+gss_fragment_store_contains (GssFragmentStore * store, const char *key)
+{
+  gboolean ret;
+  char *name;
+
+  g_return_val_if_fail (store != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  name = gss_fragment_store_get_name (key);
+  g_mutex_lock (&store->lock);
+  ret = g_hash_table_contains (store->entries, name);
+  g_mutex_unlock (&store->lock);
+  g_free (name);
+
+  return ret;
+}
+
+/**
+ * gss_fragment_store_add:
+ * @store: a #GssFragmentStore
+ * @key: key of the fragment
+ * @data: fragment data, as it will be sent
+ * @size: size of @data
+ *
+ * Writes @data to the store under @key, evicting least recently used
+ * fragments if the store goes over its size budget.  The file is
+ * written under a temporary name and renamed into place, so readers
+ * never see a partial fragment.  Failures are logged and otherwise
+ * ignored, since the fragment can always be assembled again.
+ */
+void
+gss_fragment_store_add (GssFragmentStore * store, const char *key,
+    const guint8 * data, gsize size)
+{
+  GssFragmentStoreEntry *entry;
+  GError *error = NULL;
+  GList *evicted;
+  char *name;
+  char *path;
+  char *subdir;
+
+  g_return_if_fail (store != NULL);
+  g_return_if_fail (key != NULL);
+
+  if (size > store->max_size)
+    return;
+
+  name = gss_fragment_store_get_name (key);
+  if (gss_fragment_store_contains (store, key)) {
+    g_free (name);
+    return;
+  }
+
+  subdir = g_strdup_printf ("%s/%c%c", store->dir, name[0], name[1]);
+  g_mkdir_with_parents (subdir, 0755);
+  g_free (subdir);
+
+  path = gss_fragment_store_get_path (store, name);
+  if (!g_file_set_contents (path, (const gchar *) data, size, &error)) {
+    GST_WARNING ("failed to write %s: %s", path, error->message);
+    g_error_free (error);
+    g_free (path);
+    g_free (name);
+    return;
+  }
+  g_free (path);
+
+  g_mutex_lock (&store->lock);
+  if (g_hash_table_contains (store->entries, name)) {
+    /* another thread stored the same fragment meanwhile */
+    g_mutex_unlock (&store->lock);
+    g_free (name);
+    return;
+  }
+  entry = g_malloc0 (sizeof (GssFragmentStoreEntry));
+  entry->name = name;
+  entry->size = size;
+  entry->link.data = entry;
+  g_hash_table_insert (store->entries, entry->name, entry);
+  g_queue_push_head_link (&store->lru, &entry->link);
+  store->size += size;
+  evicted = gss_fragment_store_evict_unlocked (store);
+  g_mutex_unlock (&store->lock);
+
+  unlink_paths (evicted);
+}
+
+void
+gss_fragment_store_get_stats (GssFragmentStore * store, int *n_files,
+    guint64 * size, guint64 * hits, guint64 * misses)
+{
+  g_return_if_fail (store != NULL);
+
+  g_mutex_lock (&store->lock);
+  if (n_files)
+    *n_files = g_hash_table_size (store->entries);
+  if (size)
+    *size = store->size;
+  if (hits)
+    *hits = store->hits;
+  if (misses)
+    *misses = store->misses;
+  g_mutex_unlock (&store->lock);
+}
@@ -0,0 +1,46 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_FRAGMENT_STORE_H
+#define _GSS_FRAGMENT_STORE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GssFragmentStore GssFragmentStore;
+
+
+GssFragmentStore *gss_fragment_store_new (const char *dir, guint64 max_size);
+void gss_fragment_store_free (GssFragmentStore *store);
+GMappedFile *gss_fragment_store_lookup (GssFragmentStore *store,
+    const char *key);
+gboolean gss_fragment_store_contains (GssFragmentStore *store,
+    const char *key);
+void gss_fragment_store_add (GssFragmentStore *store, const char *key,
+    const guint8 *data, gsize size);
+void gss_fragment_store_get_stats (GssFragmentStore *store, int *n_files,
+    guint64 *size, guint64 *hits, guint64 *misses);
+
+
+G_END_DECLS
+
+#endif
+
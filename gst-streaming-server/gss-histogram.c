@@ -0,0 +1,285 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Log-linear latency histograms.
+ *
+ * Values below 16 each get their own bucket; above that, every power
+ * of two is split into 16 linear buckets, so a bucket is never wider
+ * than 1/16th of the values it holds.  This is the bucketing of HDR
+ * histograms with 4 significant bits, which keeps percentiles within
+ * about 6% of the recorded values for any range.
+ *
+ * Counts are kept in a number of shards, each thread adding to the
+ * shard gss_metrics_get_shard() assigns it.  Adding a value is a single
+ * atomic increment, which rarely contends since threads are spread
+ * across shards.  Readers sum the shards, so a percentile may miss
+ * values added meanwhile, but never locks writers out. */
+
+#include "config.h"
+
+#include "gss-histogram.h"
+
+#include <math.h>
+#include <string.h>
+
+#define SUB_BITS 4
+#define N_SUB (1 << SUB_BITS)
+/* values up to 2^36 us, about 19 hours; larger ones are clamped */
+#define MAX_BITS 36
+#define N_BUCKETS ((MAX_BITS - SUB_BITS + 1) * N_SUB)
+#define N_SHARDS GSS_METRICS_N_SHARDS
+
+typedef struct _GssHistogramShard GssHistogramShard;
+
+struct _GssHistogramShard
+{
+  volatile gsize counts[N_BUCKETS];
+  /* of the values added, unclamped */
+  volatile gsize sum;
+};
+
+struct _GssHistogram
+{
+  GssHistogramShard shards[N_SHARDS];
+};
+
+static int
+gss_histogram_get_bucket (guint64 value)
+{
+  int shift;
+
+  if (value < 2 * N_SUB)
+    return value;
+  if (value >= (G_GUINT64_CONSTANT (1) << MAX_BITS))
+    return N_BUCKETS - 1;
+
+#ifdef __GNUC__
+  shift = 63 - __builtin_clzll (value) - SUB_BITS;
+#else
+  for (shift = 1; (value >> shift) >= 2 * N_SUB; shift++);
+#endif
+
+  return (shift + 1) * N_SUB + (int) ((value >> shift) - N_SUB);
+}
+
+/* largest value that falls into bucket @index */
+static gint64
+gss_histogram_get_bucket_value (int index)
+{
+  int shift;
+
+  if (index < N_SUB)
+    return index;
+
+  shift = index / N_SUB - 1;
+  return ((gint64) (N_SUB + index % N_SUB) << shift) +
+      (G_GINT64_CONSTANT (1) << shift) - 1;
+}
+
+/**
+ * gss_histogram_new:
+ *
+ * Creates an empty histogram.  Values can be added from any thread.
+ *
+ * Returns: a new #GssHistogram
+ */
+GssHistogram *
+gss_histogram_new (void)
+{
+  return g_malloc0 (sizeof (GssHistogram));
+}
+
+void
+gss_histogram_free (GssHistogram * histogram)
+{
+  g_free (histogram);
+}
+
+void
+gss_histogram_add (GssHistogram * histogram, gint64 value)
+{
+  GssHistogramShard *shard;
+  int bucket;
+
+  value = MAX (value, 0);
+  shard = &histogram->shards[gss_metrics_get_shard ()];
+  bucket = gss_histogram_get_bucket (value);
+  g_atomic_pointer_add (&shard->counts[bucket], 1);
+  g_atomic_pointer_add (&shard->sum, value);
+}
+
+/**
+ * gss_histogram_get_sum:
+ * @histogram: a #GssHistogram
+ *
+ * Like gss_histogram_get_percentiles(), may miss values added
+ * meanwhile.
+ *
+ * Returns: the sum of the values added to @histogram, with negative
+ * values counted as 0
+ */
+gint64
+gss_histogram_get_sum (GssHistogram * histogram)
+{
+  gint64 sum = 0;
+  int i;
+
+  for (i = 0; i < N_SHARDS; i++) {
+    sum += (gsize) g_atomic_pointer_get (&histogram->shards[i].sum);
+  }
+
+  return sum;
+}
+
+/**
+ * gss_histogram_get_percentiles:
+ * @histogram: a #GssHistogram
+ * @n_percentiles: number of percentiles to compute
+ * @percentiles: percentiles, between 0 and 100
+ * @values: returns the value at each of @percentiles, rounded up to the
+ *   end of its bucket, or 0 if the histogram is empty
+ *
+ * Computes several percentiles from a single pass over the shards.
+ *
+ * Returns: the number of values in the histogram
+ */
+guint64
+gss_histogram_get_percentiles (GssHistogram * histogram, int n_percentiles,
+    const double *percentiles, gint64 * values)
+{
+  guint64 counts[N_BUCKETS];
+  guint64 total = 0;
+  int i, j;
+
+  for (j = 0; j < N_BUCKETS; j++) {
+    counts[j] = 0;
+    for (i = 0; i < N_SHARDS; i++) {
+      counts[j] +=
+          (gsize) g_atomic_pointer_get (&histogram->shards[i].counts[j]);
+    }
+    total += counts[j];
+  }
+
+  for (i = 0; i < n_percentiles; i++) {
+    guint64 rank;
+    guint64 sum = 0;
+
+    values[i] = 0;
+    if (total == 0)
+      continue;
+
+    rank = MAX (ceil (percentiles[i] / 100.0 * total), 1);
+    for (j = 0; j < N_BUCKETS; j++) {
+      sum += counts[j];
+      if (sum >= rank) {
+        values[i] = gss_histogram_get_bucket_value (j);
+        break;
+      }
+    }
+  }
+
+  return total;
+}
+
+/**
+ * gss_latency_new:
+ * @name: name of what is measured, usually a resource location
+ *
+ * Creates a set of request latency histograms for one resource.
+ *
+ * Returns: a new #GssLatency
+ */
+GssLatency *
+gss_latency_new (const char *name)
+{
+  GssLatency *latency;
+
+  latency = g_malloc0 (sizeof (GssLatency));
+  latency->name = g_strdup (name);
+
+  return latency;
+}
+
+void
+gss_latency_free (GssLatency * latency)
+{
+  int i;
+
+  for (i = 0; i < GSS_LATENCY_N_STATUS_CLASSES; i++) {
+    if (latency->total[i])
+      gss_histogram_free (latency->total[i]);
+  }
+  if (latency->sync)
+    gss_histogram_free (latency->sync);
+  if (latency->async)
+    gss_histogram_free (latency->async);
+  g_free (latency->name);
+  g_free (latency);
+}
+
+/* Histograms are large, and most resources only ever answer with a
+ * couple of status classes, so they are created on first use.  Racing
+ * threads may both create one; the loser frees its copy. */
+static GssHistogram *
+gss_latency_get_histogram (GssHistogram ** histogram)
+{
+  GssHistogram *h;
+
+  h = g_atomic_pointer_get (histogram);
+  if (h == NULL) {
+    h = gss_histogram_new ();
+    if (!g_atomic_pointer_compare_and_exchange (histogram, NULL, h)) {
+      gss_histogram_free (h);
+      h = g_atomic_pointer_get (histogram);
+    }
+  }
+
+  return h;
+}
+
+/**
+ * gss_latency_add:
+ * @latency: a #GssLatency
+ * @status_code: HTTP status of the response
+ * @total_time: time from reading the request to the end of the
+ *   response, in microseconds
+ * @sync_time: time spent in the resource handler
+ * @async_time: time spent in asynchronous processing, 0 for requests
+ *   that were not processed asynchronously
+ *
+ * Records a finished request.  May be called from any thread.
+ */
+void
+gss_latency_add (GssLatency * latency, int status_code, gint64 total_time,
+    gint64 sync_time, gint64 async_time)
+{
+  int status_class = status_code / 100 - 1;
+  GssHistogram *histogram;
+
+  /* libsoup uses codes below 100 for transport errors */
+  if (status_class >= 0 && status_class < GSS_LATENCY_N_STATUS_CLASSES) {
+    histogram = gss_latency_get_histogram (&latency->total[status_class]);
+    gss_histogram_add (histogram, total_time);
+  }
+  gss_histogram_add (gss_latency_get_histogram (&latency->sync), sync_time);
+  if (async_time > 0) {
+    gss_histogram_add (gss_latency_get_histogram (&latency->async),
+        async_time);
+  }
+}
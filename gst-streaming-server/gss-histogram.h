@@ -0,0 +1,63 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_HISTOGRAM_H
+#define _GSS_HISTOGRAM_H
+
+#include <glib.h>
+#include "gss-metrics.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GssLatency GssLatency;
+
+/* 1xx to 5xx */
+#define GSS_LATENCY_N_STATUS_CLASSES 5
+
+/* Request latencies of one resource, in microseconds.  Histograms are
+ * created on first use and never freed before the GssLatency. */
+struct _GssLatency {
+  char *name;
+  /* total time, by status class */
+  GssHistogram *total[GSS_LATENCY_N_STATUS_CLASSES];
+  GssHistogram *sync;
+  GssHistogram *async;
+  /* response body bytes */
+  GssCounter bytes;
+};
+
+
+GssHistogram *gss_histogram_new (void);
+void gss_histogram_free (GssHistogram *histogram);
+void gss_histogram_add (GssHistogram *histogram, gint64 value);
+guint64 gss_histogram_get_percentiles (GssHistogram *histogram,
+    int n_percentiles, const double *percentiles, gint64 *values);
+gint64 gss_histogram_get_sum (GssHistogram *histogram);
+
+GssLatency *gss_latency_new (const char *name);
+void gss_latency_free (GssLatency *latency);
+void gss_latency_add (GssLatency *latency, int status_code,
+    gint64 total_time, gint64 sync_time, gint64 async_time);
+
+
+G_END_DECLS
+
+#endif
+
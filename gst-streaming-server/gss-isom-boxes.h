@@ -97,6 +97,8 @@ typedef struct _GssBoxSinf GssBoxSinf;
 typedef struct _GssBoxSaiz GssBoxSaiz;
 typedef struct _GssBoxSaio GssBoxSaio;
 typedef struct _GssBoxStore GssBoxStore;
+typedef struct _GssBoxTenc GssBoxTenc;
+typedef struct _GssBoxSenc GssBoxSenc;
 
 
 struct _GssBoxMfhd
@@ -163,7 +165,13 @@ struct _GssBoxUUIDSampleEncryption
   guint8 iv_size;
   guint8 kid[16];
   guint32 sample_count;
+  /* NULL if the entries are derived rather than stored; see
+   * gss_isom_fragment_get_sample_encryption() */
   GssBoxUUIDSampleEncryptionSample *samples;
+  guint64 base_iv;
+  guint16 first_clear_bytes;
+  guint16 clear_bytes;
+  gboolean block_aligned;
 };
 
 struct _GssBoxUUIDSampleEncryptionSample
@@ -691,6 +699,37 @@ struct _GssBoxSaio
   guint32 entry_count;
 };
 
+struct _GssBoxTenc
+{
+  gboolean present;
+  guint8 version;
+  guint32 flags;
+
+  /* scheme_type of the enclosing schm box */
+  guint32 scheme_type;
+
+  guint8 crypt_byte_block;
+  guint8 skip_byte_block;
+  guint8 is_protected;
+  guint8 per_sample_iv_size;
+  guint8 kid[16];
+  guint8 constant_iv_size;
+  guint8 constant_iv[16];
+};
+
+struct _GssBoxSenc
+{
+  gboolean present;
+  guint8 version;
+  guint32 flags;
+
+  /* These are special fields used while writing: the location of the
+   * saio offset and of the first sample entry in senc, so the offset
+   * can be fixed up relative to the start of the moof */
+  int saio_offset_fixup;
+  int data_offset;
+};
+
 struct _GssBoxSkip
 {
 };
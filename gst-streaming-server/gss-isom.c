@@ -504,22 +504,283 @@ gss_isom_fragment_new (void)
   return fragment;
 }
 
+static void
+gss_isom_sample_encryption_free_samples (GssBoxUUIDSampleEncryption * se)
+{
+  int i;
+
+  if (se->samples == NULL)
+    return;
+  for (i = 0; i < se->sample_count; i++) {
+    g_free (se->samples[i].entries);
+  }
+  g_free (se->samples);
+  se->samples = NULL;
+}
+
 void
 gss_isom_fragment_free (GssIsomFragment * fragment)
 {
-  int i;
   g_free (fragment->trun.samples);
   g_free (fragment->sdtp.sample_flags);
-  for (i = 0; i < fragment->sample_encryption.sample_count; i++) {
-    g_free (fragment->sample_encryption.samples[i].entries);
-  }
-  g_free (fragment->sample_encryption.samples);
+  gss_isom_sample_encryption_free_samples (&fragment->sample_encryption);
   g_free (fragment->moof_data);
   g_free (fragment->mdat_header);
   gss_sglist_free (fragment->sglist);
   g_free (fragment);
 }
 
+/* Returns the number of samples, starting at @first_sample, in the
+ * chunk of @fragment that lasts at least @chunk_duration, or up to the
+ * end of the fragment. */
+int
+gss_isom_fragment_get_chunk_length (GssIsomFragment * fragment,
+    int first_sample, guint64 chunk_duration)
+{
+  guint64 duration = 0;
+  int n_samples = 0;
+
+  g_return_val_if_fail (fragment != NULL, 0);
+  g_return_val_if_fail (first_sample >= 0, 0);
+
+  while (first_sample + n_samples < fragment->trun.sample_count) {
+    duration += fragment->trun.samples[first_sample + n_samples].duration;
+    n_samples++;
+    if (duration >= chunk_duration)
+      break;
+  }
+
+  return n_samples;
+}
+
+/* Creates a fragment that covers a run of samples of @fragment, for
+ * delivering a fragment as several CMAF chunks.  The sample tables are
+ * shared with @fragment, so the chunk must be freed with
+ * gss_isom_fragment_free_chunk() before @fragment is freed. */
+GssIsomFragment *
+gss_isom_fragment_new_chunk (GssIsomFragment * fragment, int first_sample,
+    int n_samples)
+{
+  GssIsomFragment *chunk;
+  guint64 offset = 0;
+  int i;
+
+  g_return_val_if_fail (fragment != NULL, NULL);
+  g_return_val_if_fail (first_sample >= 0, NULL);
+  g_return_val_if_fail (n_samples > 0, NULL);
+  g_return_val_if_fail (first_sample + n_samples <= fragment->trun.sample_count,
+      NULL);
+
+  chunk = g_malloc (sizeof (GssIsomFragment));
+  memcpy (chunk, fragment, sizeof (GssIsomFragment));
+
+  for (i = 0; i < first_sample; i++) {
+    offset += fragment->trun.samples[i].duration;
+  }
+  chunk->timestamp = fragment->timestamp + offset;
+  chunk->tfdt.start_time = fragment->tfdt.start_time + offset;
+
+  chunk->trun.sample_count = n_samples;
+  chunk->trun.samples = fragment->trun.samples + first_sample;
+  if (fragment->sdtp.sample_flags) {
+    chunk->sdtp.sample_flags = fragment->sdtp.sample_flags + first_sample;
+  }
+  if (fragment->sample_encryption.samples) {
+    chunk->sample_encryption.samples =
+        fragment->sample_encryption.samples + first_sample;
+  } else if (first_sample > 0) {
+    chunk->sample_encryption.first_clear_bytes =
+        fragment->sample_encryption.clear_bytes;
+  }
+  if (fragment->sample_encryption.sample_count > 0) {
+    chunk->sample_encryption.sample_count = n_samples;
+    chunk->sample_encryption.base_iv += first_sample;
+    chunk->saiz.sample_count = n_samples;
+  }
+
+  chunk->sglist = gss_sglist_new (n_samples);
+  memcpy (chunk->sglist->chunks, fragment->sglist->chunks + first_sample,
+      sizeof (GssSGChunk) * n_samples);
+
+  chunk->duration = 0;
+  chunk->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    chunk->duration += chunk->trun.samples[i].duration;
+    chunk->mdat_size += chunk->trun.samples[i].size;
+  }
+
+  chunk->offset = 0;
+  chunk->moof_data = NULL;
+  chunk->moof_size = 0;
+  chunk->mdat_header = NULL;
+  chunk->mdat_header_size = 0;
+
+  return chunk;
+}
+
+void
+gss_isom_fragment_free_chunk (GssIsomFragment * chunk)
+{
+  g_return_if_fail (chunk != NULL);
+
+  g_free (chunk->moof_data);
+  g_free (chunk->mdat_header);
+  gss_sglist_free (chunk->sglist);
+  g_free (chunk);
+}
+
+/* Creates a copy of @track with its own fragments, which can be set up
+ * for encryption and serialized without affecting @track, so that the
+ * same parsed media can be served with different DRM and stream types.
+ * Sample tables and scatter/gather lists are shared with @track, so the
+ * variant must be freed with gss_isom_track_free_variant() before
+ * @track is freed. */
+GssIsomTrack *
+gss_isom_track_new_variant (GssIsomTrack * track)
+{
+  GssIsomTrack *variant;
+  int i;
+
+  g_return_val_if_fail (track != NULL, NULL);
+
+  variant = g_malloc (sizeof (GssIsomTrack));
+  memcpy (variant, track, sizeof (GssIsomTrack));
+
+  variant->fragments = g_malloc (sizeof (GssIsomFragment *) *
+      MAX (track->n_fragments, 1));
+  variant->n_fragments_alloc = MAX (track->n_fragments, 1);
+  for (i = 0; i < track->n_fragments; i++) {
+    GssIsomFragment *fragment;
+
+    fragment = g_malloc (sizeof (GssIsomFragment));
+    memcpy (fragment, track->fragments[i], sizeof (GssIsomFragment));
+    fragment->moof_data = NULL;
+    fragment->moof_size = 0;
+    fragment->mdat_header = NULL;
+    fragment->mdat_header_size = 0;
+    fragment->tenc = NULL;
+    variant->fragments[i] = fragment;
+  }
+
+  variant->ccff_header_data = NULL;
+  variant->ccff_header_size = 0;
+  variant->dash_header_data = NULL;
+  variant->dash_header_size = 0;
+  variant->dash_header_and_sidx_size = 0;
+  variant->dash_size = 0;
+
+  return variant;
+}
+
+void
+gss_isom_track_free_variant (GssIsomTrack * variant)
+{
+  int i;
+
+  g_return_if_fail (variant != NULL);
+
+  for (i = 0; i < variant->n_fragments; i++) {
+    g_free (variant->fragments[i]->moof_data);
+    g_free (variant->fragments[i]->mdat_header);
+    g_free (variant->fragments[i]);
+  }
+  g_free (variant->fragments);
+  g_free (variant->ccff_header_data);
+  g_free (variant->dash_header_data);
+  g_free (variant);
+}
+
+/* Approximate number of bytes of memory used by @fragment, not
+ * counting anything it shares with the fragment it was copied from
+ * if @is_variant. */
+static gsize
+gss_isom_fragment_get_memory_size (GssIsomFragment * fragment,
+    gboolean is_variant)
+{
+  gsize size;
+
+  size = sizeof (GssIsomFragment);
+  size += fragment->moof_size;
+  size += fragment->mdat_header_size;
+  if (!is_variant) {
+    size += fragment->trun.sample_count * sizeof (GssBoxTrunSample);
+    if (fragment->sdtp.sample_flags) {
+      size += fragment->trun.sample_count;
+    }
+    if (fragment->sample_encryption.samples) {
+      size += fragment->sample_encryption.sample_count *
+          sizeof (GssBoxUUIDSampleEncryptionSample);
+    }
+    if (fragment->sglist) {
+      size += sizeof (GssSGList);
+      size += fragment->sglist->n_chunks * sizeof (GssSGChunk);
+    }
+  }
+
+  return size;
+}
+
+/**
+ * gss_isom_track_get_memory_size:
+ * @track: a #GssIsomTrack
+ *
+ * Returns: the approximate number of bytes of memory used by the
+ *   sample and fragment tables of @track, for cache accounting
+ */
+gsize
+gss_isom_track_get_memory_size (GssIsomTrack * track)
+{
+  gsize size;
+  int i;
+
+  g_return_val_if_fail (track != NULL, 0);
+
+  size = sizeof (GssIsomTrack);
+  size += track->stts.entry_count * sizeof (GssBoxSttsEntry);
+  size += track->ctts.entry_count * sizeof (GssBoxCttsEntry);
+  size += track->stsc.entry_count * sizeof (GssBoxStscEntry);
+  size += track->stco.entry_count * sizeof (guint64);
+  size += track->stss.entry_count * sizeof (guint32);
+  if (track->stsz.sample_sizes) {
+    size += track->stsz.sample_count * sizeof (guint32);
+  }
+  size += track->esds.codec_data_len;
+  size += track->ccff_header_size;
+  size += track->dash_header_and_sidx_size;
+  size += track->n_fragments_alloc * sizeof (GssIsomFragment *);
+  for (i = 0; i < track->n_fragments; i++) {
+    size += gss_isom_fragment_get_memory_size (track->fragments[i], FALSE);
+  }
+
+  return size;
+}
+
+/**
+ * gss_isom_track_get_variant_memory_size:
+ * @variant: a track created with gss_isom_track_new_variant()
+ *
+ * Returns: the approximate number of bytes of memory used by @variant
+ *   itself, not counting the tables it shares with its track
+ */
+gsize
+gss_isom_track_get_variant_memory_size (GssIsomTrack * variant)
+{
+  gsize size;
+  int i;
+
+  g_return_val_if_fail (variant != NULL, 0);
+
+  size = sizeof (GssIsomTrack);
+  size += variant->ccff_header_size;
+  size += variant->dash_header_and_sidx_size;
+  size += variant->n_fragments_alloc * sizeof (GssIsomFragment *);
+  for (i = 0; i < variant->n_fragments; i++) {
+    size += gss_isom_fragment_get_memory_size (variant->fragments[i], TRUE);
+  }
+
+  return size;
+}
+
 
 static gboolean
 file_read (GssIsomParser * file, guint8 * buffer, guint64 offset,
@@ -940,41 +1201,46 @@ gss_isom_parse_mfra (GssIsomParser * file, guint64 offset, guint64 size)
   GST_DEBUG ("FIXME parse mfra atom");
 }
 
+/**
+ * gss_isom_fragment_set_sample_encryption:
+ * @fragment: a #GssIsomFragment
+ * @base_iv: initialization vector of the first sample
+ * @is_video: whether to leave the start of each sample in the clear
+ *
+ * Sets up PIFF sample encryption for @fragment.  Nothing is stored per
+ * sample: sample i uses the IV @base_iv + i, and for video a single
+ * subsample leaves the NAL headers in the clear.  The entries are
+ * derived when they are needed, with
+ * gss_isom_fragment_get_sample_encryption().
+ *
+ * Sample encryption tables parsed from a file are replaced, but not
+ * freed, since they may be shared with the fragment of another track
+ * variant.  They are freed along with the parsed fragment.
+ */
 void
 gss_isom_fragment_set_sample_encryption (GssIsomFragment * fragment,
-    int n_samples, guint64 * init_vectors, gboolean is_video)
+    guint64 base_iv, gboolean is_video)
 {
   GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
-  GssBoxTrun *trun = &fragment->trun;
-  int i;
+  int n_samples = fragment->trun.sample_count;
 
+  se->samples = NULL;
   se->present = TRUE;
   se->flags = 0;
   se->sample_count = n_samples;
-  se->samples =
-      g_malloc0 (sizeof (GssBoxUUIDSampleEncryptionSample) * n_samples);
-  for (i = 0; i < n_samples; i++) {
-    se->samples[i].iv = init_vectors[i];
-  }
+  se->base_iv = base_iv;
+  se->block_aligned = FALSE;
 
   if (is_video) {
     /* This actually is for just H.264, not all video */
     se->flags |= 0x0002;
-    for (i = 0; i < n_samples; i++) {
-      int clear_bytes;
-      se->samples[i].num_entries = 1;
-      se->samples[i].entries = g_malloc0 (se->samples[i].num_entries *
-          sizeof (GssBoxUUIDSampleEncryptionSampleEntry));
-      clear_bytes = 48;
-      /* x264 header is around 750 bytes */
-      if (fragment->timestamp == 0 && i == 0)
-        clear_bytes = 1000;
-      clear_bytes = MIN (clear_bytes, trun->samples[i].size);
-      se->samples[i].entries[0].bytes_of_clear_data = clear_bytes;
-      se->samples[i].entries[0].bytes_of_encrypted_data =
-          trun->samples[i].size - clear_bytes;
+    se->clear_bytes = 48;
+    /* x264 header is around 750 bytes */
+    if (fragment->timestamp == 0) {
+      se->first_clear_bytes = 1000;
+    } else {
+      se->first_clear_bytes = se->clear_bytes;
     }
-
   }
 
   if (is_video) {
@@ -986,6 +1252,92 @@ gss_isom_fragment_set_sample_encryption (GssIsomFragment * fragment,
   fragment->saio.entry_count = 1;
 }
 
+/**
+ * gss_isom_fragment_get_sample_encryption:
+ * @fragment: a #GssIsomFragment
+ * @index: sample index
+ * @sample: location for the sample encryption entry
+ * @entry: storage for a derived subsample entry
+ *
+ * Fills @sample with the encryption parameters of sample @index.  For
+ * tables parsed from a file, @sample refers to the stored subsample
+ * entries; otherwise they are derived into @entry, which must stay
+ * around for as long as @sample is used.
+ */
+void
+gss_isom_fragment_get_sample_encryption (GssIsomFragment * fragment,
+    int index, GssBoxUUIDSampleEncryptionSample * sample,
+    GssBoxUUIDSampleEncryptionSampleEntry * entry)
+{
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  guint32 size;
+  guint32 clear_bytes;
+
+  if (se->samples) {
+    *sample = se->samples[index];
+    return;
+  }
+
+  sample->iv = se->base_iv + index;
+  if (!(se->flags & 0x0002)) {
+    sample->num_entries = 0;
+    sample->entries = NULL;
+    return;
+  }
+
+  size = fragment->trun.samples[index].size;
+  clear_bytes = (index == 0) ? se->first_clear_bytes : se->clear_bytes;
+  clear_bytes = MIN (clear_bytes, size);
+  if (se->block_aligned) {
+    clear_bytes += (size - clear_bytes) & 0xf;
+  }
+  entry->bytes_of_clear_data = clear_bytes;
+  entry->bytes_of_encrypted_data = size - clear_bytes;
+  sample->num_entries = 1;
+  sample->entries = entry;
+}
+
+/**
+ * gss_isom_fragment_set_pattern_encryption:
+ * @fragment: fragment set up with gss_isom_fragment_set_sample_encryption()
+ * @tenc: track encryption box of the fragment's track
+ *
+ * Switches @fragment from PIFF sample encryption to the CENC scheme
+ * described by @tenc, which must use a constant IV.  Subsamples are
+ * adjusted so that each protected range is a whole number of cipher
+ * blocks, and the subsample table is written as a senc box.
+ */
+void
+gss_isom_fragment_set_pattern_encryption (GssIsomFragment * fragment,
+    const GssBoxTenc * tenc)
+{
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  int i;
+
+  fragment->tenc = tenc;
+  se->present = FALSE;
+  fragment->saiz.present = FALSE;
+  fragment->saio.present = FALSE;
+  fragment->tfdt.present = TRUE;
+
+  if (se->flags & 0x0002) {
+    se->block_aligned = TRUE;
+    for (i = 0; se->samples && i < se->sample_count; i++) {
+      GssBoxUUIDSampleEncryptionSampleEntry *entry;
+      int partial;
+
+      if (se->samples[i].num_entries == 0)
+        continue;
+      entry = &se->samples[i].entries[0];
+      partial = entry->bytes_of_encrypted_data & 0xf;
+      entry->bytes_of_clear_data += partial;
+      entry->bytes_of_encrypted_data -= partial;
+    }
+    fragment->senc.present = TRUE;
+    fragment->senc.flags = 0x0002;
+  }
+}
+
 static void
 gss_isom_parse_mvhd (GssIsomParser * file, GssBoxMvhd * mvhd,
     GstByteReader * br)
@@ -2215,9 +2567,10 @@ gss_isom_sdtp_serialize (GssBoxSdtp * sdtp, GstByteWriter * bw,
 }
 
 static void
-gss_isom_sample_encryption_serialize (GssBoxUUIDSampleEncryption * se,
+gss_isom_sample_encryption_serialize (GssIsomFragment * fragment,
     GstByteWriter * bw)
 {
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
   int offset;
   int i, j;
 
@@ -2235,14 +2588,18 @@ gss_isom_sample_encryption_serialize (GssBoxUUIDSampleEncryption * se,
   }
   gst_byte_writer_put_uint32_be (bw, se->sample_count);
   for (i = 0; i < se->sample_count; i++) {
-    gst_byte_writer_put_uint64_be (bw, se->samples[i].iv);
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    gst_byte_writer_put_uint64_be (bw, sample.iv);
     if (se->flags & 0x0002) {
-      gst_byte_writer_put_uint16_be (bw, se->samples[i].num_entries);
-      for (j = 0; j < se->samples[i].num_entries; j++) {
+      gst_byte_writer_put_uint16_be (bw, sample.num_entries);
+      for (j = 0; j < sample.num_entries; j++) {
         gst_byte_writer_put_uint16_be (bw,
-            se->samples[i].entries[j].bytes_of_clear_data);
+            sample.entries[j].bytes_of_clear_data);
         gst_byte_writer_put_uint32_be (bw,
-            se->samples[i].entries[j].bytes_of_encrypted_data);
+            sample.entries[j].bytes_of_encrypted_data);
       }
     }
   }
@@ -2251,24 +2608,29 @@ gss_isom_sample_encryption_serialize (GssBoxUUIDSampleEncryption * se,
 }
 
 static void
-gss_isom_serialize_custom_encryption_tables (GssBoxUUIDSampleEncryption * se,
+gss_isom_serialize_custom_encryption_tables (GssIsomFragment * fragment,
     GstByteWriter * bw, int *sizes)
 {
   /* CENC-style sample encryption tables */
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
   int i, j;
 
   for (i = 0; i < se->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
     int sample_offset = bw->parent.byte;
-    gst_byte_writer_put_uint64_be (bw, se->samples[i].iv);
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    gst_byte_writer_put_uint64_be (bw, sample.iv);
     if (se->flags & 0x0002) {
       /* FIXME wtf is this.  This is not my beautiful CENC */
-      gst_byte_writer_put_uint16_be (bw, se->samples[i].num_entries);
+      gst_byte_writer_put_uint16_be (bw, sample.num_entries);
 
-      for (j = 0; j < se->samples[i].num_entries; j++) {
+      for (j = 0; j < sample.num_entries; j++) {
         gst_byte_writer_put_uint16_be (bw,
-            se->samples[i].entries[j].bytes_of_clear_data);
+            sample.entries[j].bytes_of_clear_data);
         gst_byte_writer_put_uint32_be (bw,
-            se->samples[i].entries[j].bytes_of_encrypted_data);
+            sample.entries[j].bytes_of_encrypted_data);
       }
     }
     sizes[i] = bw->parent.byte - sample_offset;
@@ -2340,6 +2702,91 @@ gss_isom_saio_serialize (GssBoxSaio * saio, GstByteWriter * bw,
   BOX_FINISH (bw, offset_saio);
 }
 
+/* ISO/IEC 23001-7 senc, with saiz and saio pointing at its sample
+ * entries.  Only used with constant IVs, so the auxiliary information
+ * is just the subsample table. */
+static void
+gss_isom_senc_serialize (GssIsomFragment * fragment, GstByteWriter * bw)
+{
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  GssBoxSenc *senc = &fragment->senc;
+  guint8 *sizes;
+  int offset;
+  int size;
+  int i, j;
+
+  if (!senc->present)
+    return;
+
+  /* Each entry is a subsample count and 6 bytes per subsample */
+  sizes = g_malloc (se->sample_count);
+  for (i = 0; i < se->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    sizes[i] = 2 + 6 * sample.num_entries;
+  }
+
+  offset = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'a', 'i', 'z'));
+  gst_byte_writer_put_uint8 (bw, 0);
+  gst_byte_writer_put_uint24_be (bw, 0);
+  size = sizes[0];
+  for (i = 1; i < se->sample_count; i++) {
+    if (sizes[i] != size) {
+      size = 0;
+      break;
+    }
+  }
+  gst_byte_writer_put_uint8 (bw, size);
+  gst_byte_writer_put_uint32_be (bw, se->sample_count);
+  if (size == 0) {
+    gst_byte_writer_put_data (bw, sizes, se->sample_count);
+  }
+  BOX_FINISH (bw, offset);
+  g_free (sizes);
+
+  offset = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'a', 'i', 'o'));
+  gst_byte_writer_put_uint8 (bw, 0);
+  gst_byte_writer_put_uint24_be (bw, 0);
+  gst_byte_writer_put_uint32_be (bw, 1);
+  senc->saio_offset_fixup = bw->parent.byte;
+  gst_byte_writer_put_uint32_be (bw, 0);
+  BOX_FINISH (bw, offset);
+
+  offset = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'e', 'n', 'c'));
+  gst_byte_writer_put_uint8 (bw, senc->version);
+  gst_byte_writer_put_uint24_be (bw, senc->flags);
+  gst_byte_writer_put_uint32_be (bw, se->sample_count);
+  senc->data_offset = bw->parent.byte;
+  for (i = 0; i < se->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    gst_byte_writer_put_uint16_be (bw, sample.num_entries);
+    for (j = 0; j < sample.num_entries; j++) {
+      gst_byte_writer_put_uint16_be (bw,
+          sample.entries[j].bytes_of_clear_data);
+      gst_byte_writer_put_uint32_be (bw,
+          sample.entries[j].bytes_of_encrypted_data);
+    }
+  }
+  BOX_FINISH (bw, offset);
+}
+
+static void
+gss_isom_fragment_fixup_saio (GssIsomFragment * fragment, GstByteWriter * bw,
+    int offset_moof)
+{
+  if (!fragment->senc.present)
+    return;
+
+  GST_WRITE_UINT32_BE ((void *) (bw->parent.data +
+          fragment->senc.saio_offset_fixup),
+      fragment->senc.data_offset - offset_moof);
+}
+
 static void
 gss_isom_traf_serialize (GssIsomFragment * fragment, GstByteWriter * bw,
     gboolean is_video)
@@ -2357,7 +2804,8 @@ gss_isom_traf_serialize (GssIsomFragment * fragment, GstByteWriter * bw,
   }
   gss_isom_sdtp_serialize (&fragment->sdtp, bw, fragment->trun.sample_count);
 
-  gss_isom_sample_encryption_serialize (&fragment->sample_encryption, bw);
+  gss_isom_sample_encryption_serialize (fragment, bw);
+  gss_isom_senc_serialize (fragment, bw);
 
   if (fragment->saiz.present) {
     int *sizes;
@@ -2366,8 +2814,7 @@ gss_isom_traf_serialize (GssIsomFragment * fragment, GstByteWriter * bw,
 
     sizes = g_malloc (sizeof (int) * fragment->sample_encryption.sample_count);
     table_bw = gst_byte_writer_new ();
-    gss_isom_serialize_custom_encryption_tables (&fragment->sample_encryption,
-        table_bw, sizes);
+    gss_isom_serialize_custom_encryption_tables (fragment, table_bw, sizes);
     gss_isom_saiz_serialize (&fragment->saiz, bw, sizes);
     /* We can calculate how many bytes are left before the mdat */
     table_offset = gst_byte_writer_get_pos (bw) + 28;
@@ -2447,6 +2894,7 @@ gss_isom_fragment_serialize (GssIsomFragment * fragment, guint8 ** data,
   GST_WRITE_UINT32_BE ((void *) (bw->parent.data +
           fragment->trun.data_offset_fixup),
       bw->parent.byte + 8 - offset_moof + fragment->mdat_header_size);
+  gss_isom_fragment_fixup_saio (fragment, bw, offset_moof);
 
   gst_byte_writer_put_uint32_be (bw,
       fragment->mdat_header_size + fragment->mdat_size);
@@ -2781,6 +3229,40 @@ gss_isom_esds_serialize (GssBoxEsds * esds, GstByteWriter * bw)
   }
 }
 
+static void
+gss_isom_schm_tenc_serialize (GssBoxTenc * tenc, GstByteWriter * bw)
+{
+  int offset;
+  int offset_tenc;
+
+  offset = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'c', 'h', 'm'));
+  gst_byte_writer_put_uint32_be (bw, 0);
+  gst_byte_writer_put_uint32_le (bw, tenc->scheme_type);
+  gst_byte_writer_put_uint32_be (bw, 0x00010000);
+  BOX_FINISH (bw, offset);
+
+  offset = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'c', 'h', 'i'));
+  offset_tenc = BOX_INIT (bw, GST_MAKE_FOURCC ('t', 'e', 'n', 'c'));
+  gst_byte_writer_put_uint8 (bw, tenc->version);
+  gst_byte_writer_put_uint24_be (bw, tenc->flags);
+  gst_byte_writer_put_uint8 (bw, 0);
+  if (tenc->version == 0) {
+    gst_byte_writer_put_uint8 (bw, 0);
+  } else {
+    gst_byte_writer_put_uint8 (bw, (tenc->crypt_byte_block << 4) |
+        (tenc->skip_byte_block & 0x0f));
+  }
+  gst_byte_writer_put_uint8 (bw, tenc->is_protected);
+  gst_byte_writer_put_uint8 (bw, tenc->per_sample_iv_size);
+  gst_byte_writer_put_data (bw, tenc->kid, 16);
+  if (tenc->is_protected && tenc->per_sample_iv_size == 0) {
+    gst_byte_writer_put_uint8 (bw, tenc->constant_iv_size);
+    gst_byte_writer_put_data (bw, tenc->constant_iv, tenc->constant_iv_size);
+  }
+  BOX_FINISH (bw, offset_tenc);
+  BOX_FINISH (bw, offset);
+}
+
 static void
 gss_isom_sinf_serialize (GssIsomTrack * track, GstByteWriter * bw)
 {
@@ -2795,6 +3277,12 @@ gss_isom_sinf_serialize (GssIsomTrack * track, GstByteWriter * bw)
   gst_byte_writer_put_uint32_le (bw, stsd->entries[0].atom);
   BOX_FINISH (bw, offset2);
 
+  if (track->tenc.present) {
+    gss_isom_schm_tenc_serialize (&track->tenc, bw);
+    BOX_FINISH (bw, offset_sinf);
+    return;
+  }
+
   offset2 = BOX_INIT (bw, GST_MAKE_FOURCC ('s', 'c', 'h', 'm'));
   gst_byte_writer_put_uint32_be (bw, 0);
   gst_byte_writer_put_uint32_le (bw, GST_MAKE_FOURCC ('c', 'e', 'n', 'c'));
@@ -3428,6 +3916,7 @@ gss_isom_track_serialize_dash (GssIsomTrack * track, guint8 ** data, int *size)
     GST_WRITE_UINT32_BE ((void *) (bw->parent.data +
             fragment->trun.data_offset_fixup),
         bw->parent.byte + 8 - offset_moof);
+    gss_isom_fragment_fixup_saio (fragment, bw, offset_moof);
   }
 
   *size = bw->parent.byte;
@@ -69,7 +69,11 @@ struct _GssIsomFragment {
   GssBoxTrik trik;
   GssBoxSaiz saiz;
   GssBoxSaio saio;
+  GssBoxSenc senc;
 
+  /* Set for CENC schemes other than PIFF/cenc; points to the tenc of
+   * the track the fragment belongs to. */
+  const GssBoxTenc *tenc;
 };
 
 struct _GssIsomMovie
@@ -136,6 +140,9 @@ struct _GssIsomTrack
   GssBoxEsds esds;
   GssBoxStore esds_store;
 
+  /* inside mdia/minf/stbl/stsd/sinf/schi */
+  GssBoxTenc tenc;
+
   /* in mvex at top level */
   GssBoxTrex trex;
 
@@ -223,9 +230,18 @@ GssIsomFragment * gss_isom_track_get_fragment (GssIsomTrack * track, int index);
 GssIsomFragment * gss_isom_track_get_fragment_by_timestamp (GssIsomTrack *track,
     guint64 timestamp);
 gboolean gss_isom_track_is_video (GssIsomTrack *track);
+GssIsomTrack * gss_isom_track_new_variant (GssIsomTrack *track);
+void gss_isom_track_free_variant (GssIsomTrack *variant);
+gsize gss_isom_track_get_memory_size (GssIsomTrack *track);
+gsize gss_isom_track_get_variant_memory_size (GssIsomTrack *variant);
 
 void gss_isom_fragment_set_sample_encryption (GssIsomFragment *fragment,
-    int n_samples, guint64 *init_vectors, gboolean is_video);
+    guint64 base_iv, gboolean is_video);
+void gss_isom_fragment_get_sample_encryption (GssIsomFragment *fragment,
+    int index, GssBoxUUIDSampleEncryptionSample *sample,
+    GssBoxUUIDSampleEncryptionSampleEntry *entry);
+void gss_isom_fragment_set_pattern_encryption (GssIsomFragment *fragment,
+    const GssBoxTenc *tenc);
 void gss_isom_fragment_serialize (GssIsomFragment *fragment, guint8 **data,
     gsize *size, gboolean is_video);
 void gss_isom_movie_serialize_track_ccff (GssIsomMovie * movie, GssIsomTrack *track,
@@ -246,8 +262,16 @@ GssIsomTrack * gss_isom_movie_get_video_track (GssIsomMovie * movie);
 GssIsomTrack * gss_isom_movie_get_audio_track (GssIsomMovie * movie);
 GssIsomTrack * gss_isom_movie_get_track_by_id (GssIsomMovie * movie, int track_id);
 
+GssIsomTrack *gss_isom_track_new (void);
+void gss_isom_track_free (GssIsomTrack * track);
+
 GssIsomFragment *gss_isom_fragment_new (void);
 void gss_isom_fragment_free (GssIsomFragment * fragment);
+int gss_isom_fragment_get_chunk_length (GssIsomFragment *fragment,
+    int first_sample, guint64 chunk_duration);
+GssIsomFragment *gss_isom_fragment_new_chunk (GssIsomFragment * fragment,
+    int first_sample, int n_samples);
+void gss_isom_fragment_free_chunk (GssIsomFragment * chunk);
 
 void gss_isom_parser_fragmentize (GssIsomParser *file, gboolean is_dash);
 #if 0
@@ -4,9 +4,13 @@
 #endif
 
 #include "gss-log.h"
+#include "gss-metrics.h"
 #include "gss-utils.h"
 #include "gss-object.h"
 #include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -26,6 +30,7 @@ static void log_handler (GstDebugCategory * category, GstDebugLevel level,
     GstDebugMessage * message, gpointer data);
 static void glog_handler (const gchar * log_domain, GLogLevelFlags log_level,
     const gchar * message, gpointer user_data);
+static void gss_log_access_start (void);
 
 GST_DEBUG_CATEGORY (gss_debug);
 
@@ -51,6 +56,8 @@ gss_log_init (void)
 
   openlog ("gst-streaming-server", LOG_NDELAY, LOG_DAEMON);
 
+  gss_log_access_start ();
+
   _gss_error_quark = g_quark_from_static_string ("GStreamer Streaming Server");
 }
 
@@ -174,56 +181,333 @@ gss_log_send_syslog (int level, const char *msg)
   syslog (LOG_DAEMON | severity, "%s", msg);
 }
 
+/* Access log
+ *
+ * gss_log_transaction() runs for every finished request, so it only
+ * copies a fixed-size record into a bounded multi-producer ring.  A
+ * writer thread formats the records and writes them out in batches,
+ * either to syslog or to a file that is rotated when it reaches the
+ * configured size.  When the ring is full, records are dropped and
+ * counted rather than blocking the caller. */
+
+#define GSS_LOG_RING_SIZE 4096
+#define GSS_LOG_FLUSH_INTERVAL (50 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct _GssLogRecord GssLogRecord;
+typedef struct _GssLogSlot GssLogSlot;
+
+struct _GssLogRecord
+{
+  gint64 time;
+  const char *method;
+  int status_code;
+  gsize length;
+  guint64 sync_process_time;
+  guint64 async_process_time;
+  guint64 total_time;
+  gsize start;
+  gsize end;
+  char addr[48];
+  char debug_message[64];
+  char uri[256];
+};
+
+struct _GssLogSlot
+{
+  volatile guint sequence;
+  GssLogRecord record;
+};
+
+static GssLogSlot *access_log_ring;
+static volatile guint access_log_tail;
+static guint access_log_head;
+static GssCounter access_log_n_dropped;
+static GssCounter access_log_n_logged;
+
+static GThread *access_log_thread;
+static GMutex access_log_lock;
+static GCond access_log_cond;
+static gboolean access_log_exit;
+static gboolean access_log_reopen;
+static char *access_log_filename;
+static gsize access_log_max_size;
+
+static gpointer gss_log_access_thread (gpointer data);
+
+static void
+gss_log_access_start (void)
+{
+  int i;
+
+  if (access_log_ring != NULL)
+    return;
+
+  access_log_ring = g_malloc0 (GSS_LOG_RING_SIZE * sizeof (GssLogSlot));
+  for (i = 0; i < GSS_LOG_RING_SIZE; i++) {
+    access_log_ring[i].sequence = i;
+  }
+  access_log_thread = g_thread_new ("gss-access-log", gss_log_access_thread,
+      NULL);
+}
+
+void
+_priv_gss_log_cleanup (void)
+{
+  if (access_log_thread == NULL)
+    return;
+
+  g_mutex_lock (&access_log_lock);
+  access_log_exit = TRUE;
+  g_cond_signal (&access_log_cond);
+  g_mutex_unlock (&access_log_lock);
+
+  g_thread_join (access_log_thread);
+  access_log_thread = NULL;
+}
+
+/**
+ * gss_log_set_access_log:
+ * @filename: (allow-none): file to append the access log to, or %NULL
+ *   to send it to syslog
+ * @max_size: size in bytes at which the file is rotated, or 0 to never
+ *   rotate
+ *
+ * Sets where the access log is written.  When the file grows beyond
+ * @max_size, it is renamed to @filename with ".1" appended and a new
+ * file is started.
+ */
+void
+gss_log_set_access_log (const char *filename, gsize max_size)
+{
+  g_mutex_lock (&access_log_lock);
+  g_free (access_log_filename);
+  access_log_filename = (filename && filename[0]) ? g_strdup (filename) : NULL;
+  access_log_max_size = max_size;
+  access_log_reopen = TRUE;
+  g_mutex_unlock (&access_log_lock);
+}
+
+/**
+ * gss_log_get_access_log_stats:
+ * @n_logged: (out) (allow-none): number of records written
+ * @n_dropped: (out) (allow-none): number of records dropped because
+ *   the writer thread could not keep up
+ *
+ * Returns counters for the access log.
+ */
+void
+gss_log_get_access_log_stats (guint64 * n_logged, guint64 * n_dropped)
+{
+  if (n_logged)
+    *n_logged = gss_counter_get (&access_log_n_logged);
+  if (n_dropped)
+    *n_dropped = gss_counter_get (&access_log_n_dropped);
+}
+
 void
 gss_log_transaction (GssTransaction * t)
 {
-  char *s;
-  const char *user_agent;
+  GssLogSlot *slot;
+  GssLogRecord *record;
+  SoupURI *uri;
+  guint tail;
+  gsize n;
+  gint diff;
+
+  if (G_UNLIKELY (access_log_ring == NULL))
+    return;
+
+  tail = g_atomic_int_get (&access_log_tail);
+  while (TRUE) {
+    slot = &access_log_ring[tail & (GSS_LOG_RING_SIZE - 1)];
+    diff = (gint) (g_atomic_int_get (&slot->sequence) - tail);
+    if (diff == 0) {
+      if (g_atomic_int_compare_and_exchange (&access_log_tail, tail, tail + 1))
+        break;
+    } else if (diff < 0) {
+      gss_counter_add (&access_log_n_dropped, 1);
+      return;
+    }
+    tail = g_atomic_int_get (&access_log_tail);
+  }
+
+  record = &slot->record;
+  record->time = g_get_real_time ();
+  /* soup methods are interned, so the pointer stays valid */
+  record->method = t->msg->method;
+  record->status_code = t->msg->status_code;
+  record->length = t->msg->response_body->length;
+  record->sync_process_time = t->sync_process_time;
+  record->async_process_time = t->async_process_time;
+  record->total_time = t->total_time;
+  record->start = t->start;
+  record->end = t->end;
+  g_strlcpy (record->addr,
+      soup_address_get_physical (soup_client_context_get_address (t->client)),
+      sizeof (record->addr));
+  g_strlcpy (record->debug_message,
+      t->debug_message ? t->debug_message : "",
+      sizeof (record->debug_message));
+
+  uri = soup_message_get_uri (t->msg);
+  n = g_strlcpy (record->uri, uri->path, sizeof (record->uri));
+  if (uri->query && n + 1 < sizeof (record->uri)) {
+    record->uri[n] = '?';
+    g_strlcpy (record->uri + n + 1, uri->query, sizeof (record->uri) - n - 1);
+  }
+
+  g_atomic_int_set (&slot->sequence, tail + 1);
+}
+
+static void
+gss_log_access_format (GString * s, const GssLogRecord * record)
+{
   GDateTime *datetime;
   char *dt;
-  const char *addr;
 
-  user_agent = soup_message_headers_get_one (t->msg->request_headers,
-      "User-Agent");
-  if (user_agent == NULL) {
-    user_agent = "-";
-  }
-  datetime = g_date_time_new_now_utc ();
+  datetime = g_date_time_new_from_unix_utc (record->time / G_USEC_PER_SEC);
   dt = g_date_time_format (datetime, "%Y-%m-%d %H:%M:%S");
-  addr =
-      soup_address_get_physical (soup_client_context_get_address (t->client));
-  if (0) {
-    s = g_strdup_printf ("%s - - [%s] \"%s %s %s\" %d %d \"%s\" \"%s\"",
-        addr,
-        dt,
-        t->msg->method,
-        t->path,
-        "HTTP/1.1",
-        t->msg->status_code,
-        (int) t->msg->response_body->length, "-", user_agent);
-  } else {
-    char *uri;
-    uri = soup_uri_to_string (soup_message_get_uri (t->msg), TRUE);
-    s = g_strdup_printf ("%s %s %s \"%s\" %d %" G_GSIZE_FORMAT
-        " %" G_GUINT64_FORMAT
-        " %" G_GUINT64_FORMAT
-        " %" G_GUINT64_FORMAT
-        " %" G_GSIZE_FORMAT
-        " %" G_GSIZE_FORMAT
-        " %s",
-        addr,
-        dt, t->msg->method,
-        uri,
-        t->msg->status_code,
-        t->msg->response_body->length,
-        t->sync_process_time, t->async_process_time, t->total_time,
-        t->start, t->end, t->debug_message ? t->debug_message : "");
-    g_free (uri);
-  }
-  syslog (LOG_USER | LOG_INFO, "%s", s);
-  if (gss_log_verbosity >= 2)
-    g_print ("%s\n", s);
-  g_free (s);
+  g_string_append_printf (s, "%s %s %s \"%s\" %d %" G_GSIZE_FORMAT
+      " %" G_GUINT64_FORMAT
+      " %" G_GUINT64_FORMAT
+      " %" G_GUINT64_FORMAT
+      " %" G_GSIZE_FORMAT
+      " %" G_GSIZE_FORMAT
+      " %s",
+      record->addr, dt, record->method, record->uri, record->status_code,
+      record->length,
+      record->sync_process_time, record->async_process_time,
+      record->total_time, record->start, record->end, record->debug_message);
   g_free (dt);
   g_date_time_unref (datetime);
 }
+
+static FILE *
+gss_log_access_open (const char *filename, gsize * size)
+{
+  GStatBuf statbuf;
+  FILE *file;
+
+  file = g_fopen (filename, "a");
+  if (file == NULL) {
+    GST_WARNING ("could not open access log %s: %s", filename,
+        g_strerror (errno));
+    return NULL;
+  }
+  *size = 0;
+  if (g_stat (filename, &statbuf) == 0) {
+    *size = statbuf.st_size;
+  }
+  return file;
+}
+
+static gpointer
+gss_log_access_thread (gpointer data)
+{
+  GString *batch;
+  FILE *file = NULL;
+  char *filename = NULL;
+  gsize file_size = 0;
+  gsize max_size = 0;
+  gboolean done;
+
+  batch = g_string_new (NULL);
+  while (TRUE) {
+    GssLogSlot *slot;
+    int n_records;
+    gboolean written = TRUE;
+
+    g_mutex_lock (&access_log_lock);
+    done = access_log_exit;
+    if (access_log_reopen) {
+      if (file) {
+        fclose (file);
+        file = NULL;
+      }
+      g_free (filename);
+      filename = g_strdup (access_log_filename);
+      max_size = access_log_max_size;
+      access_log_reopen = FALSE;
+    }
+    g_mutex_unlock (&access_log_lock);
+
+    if (filename && file == NULL) {
+      file = gss_log_access_open (filename, &file_size);
+    }
+
+    n_records = 0;
+    while (n_records < GSS_LOG_RING_SIZE) {
+      slot = &access_log_ring[access_log_head & (GSS_LOG_RING_SIZE - 1)];
+      if ((gint) (g_atomic_int_get (&slot->sequence) -
+              (access_log_head + 1)) < 0)
+        break;
+
+      if (filename) {
+        gss_log_access_format (batch, &slot->record);
+        g_string_append_c (batch, '\n');
+      } else {
+        GString *s = g_string_new (NULL);
+        gss_log_access_format (s, &slot->record);
+        syslog (LOG_USER | LOG_INFO, "%s", s->str);
+        if (gss_log_verbosity >= 2)
+          g_print ("%s\n", s->str);
+        g_string_free (s, TRUE);
+      }
+
+      g_atomic_int_set (&slot->sequence, access_log_head + GSS_LOG_RING_SIZE);
+      access_log_head++;
+      n_records++;
+    }
+
+    if (batch->len > 0) {
+      if (file && max_size > 0 && file_size > 0 &&
+          file_size + batch->len > max_size) {
+        char *rotated;
+
+        fclose (file);
+        rotated = g_strdup_printf ("%s.1", filename);
+        if (g_rename (filename, rotated) < 0) {
+          GST_WARNING ("could not rotate access log %s: %s", filename,
+              g_strerror (errno));
+        }
+        g_free (rotated);
+        file = gss_log_access_open (filename, &file_size);
+      }
+      if (file && fwrite (batch->str, 1, batch->len, file) == batch->len &&
+          fflush (file) == 0) {
+        file_size += batch->len;
+      } else {
+        written = FALSE;
+      }
+      if (gss_log_verbosity >= 2)
+        g_print ("%s", batch->str);
+      g_string_truncate (batch, 0);
+    }
+    if (n_records > 0) {
+      /* records that could not be written to the file count as dropped */
+      gss_counter_add (written ? &access_log_n_logged : &access_log_n_dropped,
+          n_records);
+    }
+
+    if (done)
+      break;
+
+    /* Under load, go straight back for the next batch; otherwise wait
+     * so that a trickle of requests is written in batches too. */
+    if (n_records < GSS_LOG_RING_SIZE / 2) {
+      g_mutex_lock (&access_log_lock);
+      if (!access_log_exit && !access_log_reopen) {
+        g_cond_wait_until (&access_log_cond, &access_log_lock,
+            g_get_monotonic_time () + GSS_LOG_FLUSH_INTERVAL);
+      }
+      g_mutex_unlock (&access_log_lock);
+    }
+  }
+
+  if (file)
+    fclose (file);
+  g_free (filename);
+  g_string_free (batch, TRUE);
+
+  return NULL;
+}
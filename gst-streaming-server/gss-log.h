@@ -36,6 +36,8 @@ void gss_log_init (void);
 void gss_log_set_verbosity (int level);
 void gss_log_send_syslog (int level, const char *msg);
 void gss_log_transaction (GssTransaction *t);
+void gss_log_set_access_log (const char *filename, gsize max_size);
+void gss_log_get_access_log_stats (guint64 *n_logged, guint64 *n_dropped);
 
 
 G_END_DECLS
@@ -37,6 +37,7 @@ gss_metrics_new (void)
   GssMetrics *metrics;
 
   metrics = g_new0 (GssMetrics, 1);
+  g_mutex_init (&metrics->lock);
 
   return metrics;
 }
@@ -44,23 +45,234 @@ gss_metrics_new (void)
 void
 gss_metrics_free (GssMetrics * metrics)
 {
+  g_mutex_clear (&metrics->lock);
   g_free (metrics);
 }
 
+/**
+ * gss_metrics_add_client:
+ * @metrics: a #GssMetrics
+ * @bitrate: bitrate of the stream the client receives, in bits/s
+ *
+ * Counts a new client.  May be called from any thread.
+ */
 void
 gss_metrics_add_client (GssMetrics * metrics, int bitrate)
 {
+  g_mutex_lock (&metrics->lock);
   metrics->n_clients++;
   metrics->max_clients = MAX (metrics->max_clients, metrics->n_clients);
-
   metrics->bitrate += bitrate;
   metrics->max_bitrate = MAX (metrics->max_bitrate, metrics->bitrate);
-
+  g_mutex_unlock (&metrics->lock);
 }
 
+/**
+ * gss_metrics_remove_client:
+ * @metrics: a #GssMetrics
+ * @bitrate: the bitrate given to gss_metrics_add_client()
+ *
+ * Counts a client going away.  May be called from any thread,
+ * including streaming threads.
+ */
 void
 gss_metrics_remove_client (GssMetrics * metrics, int bitrate)
 {
+  g_mutex_lock (&metrics->lock);
   metrics->n_clients--;
   metrics->bitrate -= bitrate;
+  g_mutex_unlock (&metrics->lock);
+}
+
+int
+gss_metrics_get_n_clients (GssMetrics * metrics)
+{
+  int n_clients;
+
+  g_mutex_lock (&metrics->lock);
+  n_clients = metrics->n_clients;
+  g_mutex_unlock (&metrics->lock);
+
+  return n_clients;
+}
+
+int
+gss_metrics_get_max_clients (GssMetrics * metrics)
+{
+  int max_clients;
+
+  g_mutex_lock (&metrics->lock);
+  max_clients = metrics->max_clients;
+  g_mutex_unlock (&metrics->lock);
+
+  return max_clients;
+}
+
+gint64
+gss_metrics_get_bitrate (GssMetrics * metrics)
+{
+  gint64 bitrate;
+
+  g_mutex_lock (&metrics->lock);
+  bitrate = metrics->bitrate;
+  g_mutex_unlock (&metrics->lock);
+
+  return bitrate;
+}
+
+gint64
+gss_metrics_get_max_bitrate (GssMetrics * metrics)
+{
+  gint64 max_bitrate;
+
+  g_mutex_lock (&metrics->lock);
+  max_bitrate = metrics->max_bitrate;
+  g_mutex_unlock (&metrics->lock);
+
+  return max_bitrate;
+}
+
+static gint next_shard;
+static GPrivate shard_index;
+
+/**
+ * gss_metrics_get_shard:
+ *
+ * Returns the shard of #GssCounter and #GssHistogram values that the
+ * calling thread adds to.  Threads are assigned shards in turn when
+ * they first ask.
+ *
+ * Returns: a shard index, less than %GSS_METRICS_N_SHARDS
+ */
+int
+gss_metrics_get_shard (void)
+{
+  gpointer index;
+
+  index = g_private_get (&shard_index);
+  if (index == NULL) {
+    index = GINT_TO_POINTER (g_atomic_int_add (&next_shard, 1) %
+        GSS_METRICS_N_SHARDS + 1);
+    g_private_set (&shard_index, index);
+  }
+
+  return GPOINTER_TO_INT (index) - 1;
+}
+
+void
+gss_counter_add (GssCounter * counter, gssize value)
+{
+  g_atomic_pointer_add (&counter->shards[gss_metrics_get_shard ()].value,
+      value);
+}
+
+/**
+ * gss_counter_get:
+ * @counter: a #GssCounter
+ *
+ * Sums the shards of @counter without stopping writers, so values
+ * added meanwhile may or may not be included.
+ *
+ * Returns: the value of @counter
+ */
+gint64
+gss_counter_get (GssCounter * counter)
+{
+  gint64 value = 0;
+  int i;
+
+  for (i = 0; i < GSS_METRICS_N_SHARDS; i++) {
+    value += (gssize) g_atomic_pointer_get (&counter->shards[i].value);
+  }
+
+  return value;
+}
+
+/**
+ * gss_metrics_append_header:
+ * @s: a #GString
+ * @name: metric name
+ * @type: "counter", "gauge" or "summary"
+ * @help: description of the metric
+ *
+ * Appends the comments that start a metric family in the Prometheus
+ * text exposition format.
+ */
+void
+gss_metrics_append_header (GString * s, const char *name, const char *type,
+    const char *help)
+{
+  g_string_append_printf (s, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+      name, type);
+}
+
+/**
+ * gss_metrics_append_label:
+ * @s: a #GString
+ * @name: label name
+ * @value: label value
+ *
+ * Appends name="value", escaping @value as the Prometheus text format
+ * requires.
+ */
+void
+gss_metrics_append_label (GString * s, const char *name, const char *value)
+{
+  const char *p;
+
+  g_string_append_printf (s, "%s=\"", name);
+  for (p = value; *p; p++) {
+    if (*p == '\\' || *p == '"') {
+      g_string_append_c (s, '\\');
+      g_string_append_c (s, *p);
+    } else if (*p == '\n') {
+      g_string_append (s, "\\n");
+    } else {
+      g_string_append_c (s, *p);
+    }
+  }
+  g_string_append_c (s, '"');
+}
+
+/**
+ * gss_metrics_append_quantiles:
+ * @s: a #GString
+ * @name: metric name
+ * @labels: labels of the metric, already formatted, or ""
+ * @histogram: a #GssHistogram of microseconds
+ *
+ * Appends the p50, p90, p99 and p99.9 of @histogram, in seconds, as
+ * one line each with a quantile label, followed by the _sum and _count
+ * lines of a summary.  The family should be declared as "summary".
+ *
+ * Returns: the number of values in @histogram
+ */
+guint64
+gss_metrics_append_quantiles (GString * s, const char *name,
+    const char *labels, GssHistogram * histogram)
+{
+  static const double percentiles[] = { 50, 90, 99, 99.9 };
+  static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+  gint64 values[G_N_ELEMENTS (percentiles)];
+  guint64 n;
+  int i;
+
+  n = gss_histogram_get_percentiles (histogram, G_N_ELEMENTS (percentiles),
+      percentiles, values);
+  for (i = 0; i < G_N_ELEMENTS (percentiles); i++) {
+    g_string_append_printf (s, "%s{%s%squantile=\"%s\"} %g\n", name,
+        labels, labels[0] ? "," : "", quantiles[i], values[i] * 1e-6);
+  }
+  if (labels[0]) {
+    g_string_append_printf (s, "%s_sum{%s} %g\n", name, labels,
+        gss_histogram_get_sum (histogram) * 1e-6);
+    g_string_append_printf (s, "%s_count{%s} %" G_GUINT64_FORMAT "\n",
+        name, labels, n);
+  } else {
+    g_string_append_printf (s, "%s_sum %g\n", name,
+        gss_histogram_get_sum (histogram) * 1e-6);
+    g_string_append_printf (s, "%s_count %" G_GUINT64_FORMAT "\n", name, n);
+  }
+
+  return n;
 }
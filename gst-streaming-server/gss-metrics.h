@@ -22,12 +22,30 @@
 #ifndef _GSS_METRICS_H
 #define _GSS_METRICS_H
 
-#include "gss-config.h"
 #include "gss-types.h"
 
 G_BEGIN_DECLS
 
+#define GSS_METRICS_N_SHARDS 8
+
+typedef struct _GssCounter GssCounter;
+
+/* A counter that threads add to without contending: each thread adds to
+ * its own shard, on a separate cache line, and readers sum the shards.
+ * All zeroes is a valid counter at 0. */
+struct _GssCounter {
+  struct {
+    volatile gssize value;
+    char padding[64 - sizeof (gssize)];
+  } shards[GSS_METRICS_N_SHARDS];
+};
+
+/* Clients are added from the main loop and removed from streaming
+ * threads, so the fields are only used with lock held.  Read them with
+ * the getters.  glib has no 64-bit atomics on 32-bit hosts, and the
+ * bitrates can exceed 2^31 bits/s. */
 struct _GssMetrics {
+  GMutex lock;
   int n_clients;
   int max_clients;
   gint64 bitrate;
@@ -38,6 +56,21 @@ GssMetrics * gss_metrics_new (void);
 void gss_metrics_free (GssMetrics * metrics);
 void gss_metrics_add_client (GssMetrics * metrics, int bitrate);
 void gss_metrics_remove_client (GssMetrics * metrics, int bitrate);
+int gss_metrics_get_n_clients (GssMetrics *metrics);
+int gss_metrics_get_max_clients (GssMetrics *metrics);
+gint64 gss_metrics_get_bitrate (GssMetrics *metrics);
+gint64 gss_metrics_get_max_bitrate (GssMetrics *metrics);
+
+int gss_metrics_get_shard (void);
+void gss_counter_add (GssCounter *counter, gssize value);
+gint64 gss_counter_get (GssCounter *counter);
+
+void gss_metrics_append_header (GString *s, const char *name,
+    const char *type, const char *help);
+void gss_metrics_append_label (GString *s, const char *name,
+    const char *value);
+guint64 gss_metrics_append_quantiles (GString *s, const char *name,
+    const char *labels, GssHistogram *histogram);
 
 G_END_DECLS
 
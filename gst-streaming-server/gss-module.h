@@ -49,6 +49,8 @@ struct _GssModule {
 struct _GssModuleClass {
   GssObjectClass module_class;
 
+  /* appends metrics in the Prometheus text format, from the main loop */
+  void (*append_metrics) (GssModule *module, GString *s);
 };
 
 
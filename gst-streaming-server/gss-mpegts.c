@@ -0,0 +1,676 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <gst/gst.h>
+#include <gst/base/gstbytereader.h>
+#include <gst/base/gstbytewriter.h>
+
+#include "gss-mpegts.h"
+
+#include <string.h>
+
+/**
+ * SECTION:gss-mpegts
+ * @short_description: MPEG transport stream packaging of ISOM fragments
+ * @see_also: #GssAdaptive
+ *
+ * Converts the samples of an audio and a video #GssIsomFragment into
+ * an MPEG-TS segment suitable for HLS clients that don't handle
+ * fragmented MP4.  H.264 samples are rewritten from the length-prefixed
+ * (avcC) form to Annex B, with SPS/PPS inserted in front of each
+ * keyframe, and AAC samples are given ADTS headers built from the
+ * AudioSpecificConfig.
+ */
+
+#define GSS_ISM_SECOND 10000000
+
+#define MPEGTS_CLOCK 90000
+#define MPEGTS_TIMESTAMP_MASK G_GUINT64_CONSTANT(0x1ffffffff)
+/* added to all PTS/DTS values so that PCR can run ahead of the first DTS */
+#define MPEGTS_TIMESTAMP_OFFSET MPEGTS_CLOCK
+#define MPEGTS_PCR_DELAY (MPEGTS_CLOCK / 10)
+
+#define MPEGTS_STREAM_TYPE_AAC_ADTS 0x0f
+#define MPEGTS_STREAM_TYPE_H264 0x1b
+
+#define ADTS_HEADER_SIZE 7
+
+typedef struct _GssMpegtsMux GssMpegtsMux;
+struct _GssMpegtsMux
+{
+  GstByteWriter *bw;
+  int pcr_pid;
+
+  guint8 cc_pat;
+  guint8 cc_pmt;
+  guint8 cc_video;
+  guint8 cc_audio;
+
+  /* the video PID has had a keyframe, so later samples only carry
+   * SPS/PPS and the random access indicator if they are sync samples */
+  gboolean video_started;
+
+  /* scratch space for assembling one PES packet */
+  guint8 *pes;
+  gsize pes_alloc;
+};
+
+typedef struct _MpegtsAvcConfig MpegtsAvcConfig;
+struct _MpegtsAvcConfig
+{
+  int nal_length_size;
+  guint8 *param_sets;
+  gsize param_sets_len;
+};
+
+typedef struct _MpegtsAacConfig MpegtsAacConfig;
+struct _MpegtsAacConfig
+{
+  int object_type;
+  int rate_index;
+  int channels;
+};
+
+
+static guint32
+mpegts_crc32 (const guint8 * data, int len)
+{
+  guint32 crc = 0xffffffff;
+  int i;
+  int j;
+
+  for (i = 0; i < len; i++) {
+    crc ^= ((guint32) data[i]) << 24;
+    for (j = 0; j < 8; j++) {
+      if (crc & 0x80000000) {
+        crc = (crc << 1) ^ 0x04c11db7;
+      } else {
+        crc <<= 1;
+      }
+    }
+  }
+
+  return crc;
+}
+
+static guint8 *
+mpegts_mux_get_cc (GssMpegtsMux * mux, int pid)
+{
+  switch (pid) {
+    case 0:
+      return &mux->cc_pat;
+    case GSS_MPEGTS_PID_PMT:
+      return &mux->cc_pmt;
+    case GSS_MPEGTS_PID_VIDEO:
+      return &mux->cc_video;
+    case GSS_MPEGTS_PID_AUDIO:
+      return &mux->cc_audio;
+    default:
+      g_assert_not_reached ();
+  }
+  return NULL;
+}
+
+static guint8 *
+mpegts_mux_get_pes_buffer (GssMpegtsMux * mux, gsize size)
+{
+  if (size > mux->pes_alloc) {
+    mux->pes_alloc = MAX (size, mux->pes_alloc * 2);
+    mux->pes = g_realloc (mux->pes, mux->pes_alloc);
+  }
+  return mux->pes;
+}
+
+static void
+mpegts_write_section (GssMpegtsMux * mux, int pid, const guint8 * section,
+    int len)
+{
+  guint8 packet[GSS_MPEGTS_PACKET_SIZE];
+  guint8 *cc = mpegts_mux_get_cc (mux, pid);
+
+  g_assert (len <= GSS_MPEGTS_PACKET_SIZE - 5);
+
+  memset (packet, 0xff, sizeof (packet));
+  packet[0] = 0x47;
+  packet[1] = 0x40 | ((pid >> 8) & 0x1f);
+  packet[2] = pid & 0xff;
+  packet[3] = 0x10 | (*cc & 0x0f);
+  (*cc)++;
+  /* pointer_field */
+  packet[4] = 0;
+  memcpy (packet + 5, section, len);
+
+  gst_byte_writer_put_data (mux->bw, packet, sizeof (packet));
+}
+
+static void
+mpegts_write_pat (GssMpegtsMux * mux)
+{
+  guint8 s[16];
+
+  s[0] = 0x00;                  /* table_id */
+  s[1] = 0xb0;
+  s[2] = 13;                    /* section_length */
+  s[3] = 0x00;
+  s[4] = 0x01;                  /* transport_stream_id */
+  s[5] = 0xc1;                  /* version 0, current */
+  s[6] = 0x00;
+  s[7] = 0x00;
+  s[8] = 0x00;
+  s[9] = 0x01;                  /* program_number */
+  s[10] = 0xe0 | ((GSS_MPEGTS_PID_PMT >> 8) & 0x1f);
+  s[11] = GSS_MPEGTS_PID_PMT & 0xff;
+  GST_WRITE_UINT32_BE (s + 12, mpegts_crc32 (s, 12));
+
+  mpegts_write_section (mux, 0, s, sizeof (s));
+}
+
+static int
+mpegts_put_es_info (guint8 * s, int stream_type, int pid)
+{
+  s[0] = stream_type;
+  s[1] = 0xe0 | ((pid >> 8) & 0x1f);
+  s[2] = pid & 0xff;
+  s[3] = 0xf0;
+  s[4] = 0x00;                  /* ES_info_length */
+  return 5;
+}
+
+static void
+mpegts_write_pmt (GssMpegtsMux * mux, gboolean have_video,
+    gboolean have_audio)
+{
+  guint8 s[32];
+  int section_length;
+  int n;
+
+  s[0] = 0x02;                  /* table_id */
+  s[3] = 0x00;
+  s[4] = 0x01;                  /* program_number */
+  s[5] = 0xc1;                  /* version 0, current */
+  s[6] = 0x00;
+  s[7] = 0x00;
+  s[8] = 0xe0 | ((mux->pcr_pid >> 8) & 0x1f);
+  s[9] = mux->pcr_pid & 0xff;
+  s[10] = 0xf0;
+  s[11] = 0x00;                 /* program_info_length */
+  n = 12;
+  if (have_video) {
+    n += mpegts_put_es_info (s + n, MPEGTS_STREAM_TYPE_H264,
+        GSS_MPEGTS_PID_VIDEO);
+  }
+  if (have_audio) {
+    n += mpegts_put_es_info (s + n, MPEGTS_STREAM_TYPE_AAC_ADTS,
+        GSS_MPEGTS_PID_AUDIO);
+  }
+
+  section_length = n - 3 + 4;
+  s[1] = 0xb0 | ((section_length >> 8) & 0x0f);
+  s[2] = section_length & 0xff;
+  GST_WRITE_UINT32_BE (s + n, mpegts_crc32 (s, n));
+  n += 4;
+
+  mpegts_write_section (mux, GSS_MPEGTS_PID_PMT, s, n);
+}
+
+/* Splits a PES packet into transport packets, using the adaptation
+ * field for the random access indicator, PCR, and stuffing of the
+ * last packet. */
+static void
+mpegts_write_pes (GssMpegtsMux * mux, int pid, const guint8 * data,
+    gsize len, gboolean random_access, gint64 pcr)
+{
+  guint8 packet[GSS_MPEGTS_PACKET_SIZE];
+  guint8 *cc = mpegts_mux_get_cc (mux, pid);
+  gboolean first = TRUE;
+
+  while (len > 0) {
+    guint8 *p;
+    int af_min;
+    int af_size;
+    int payload;
+
+    af_min = 0;
+    if (first && (random_access || pcr >= 0)) {
+      af_min = 2 + ((pcr >= 0) ? 6 : 0);
+    }
+    payload = MIN (len, GSS_MPEGTS_PACKET_SIZE - 4 - af_min);
+    af_size = GSS_MPEGTS_PACKET_SIZE - 4 - payload;
+
+    packet[0] = 0x47;
+    packet[1] = (first ? 0x40 : 0) | ((pid >> 8) & 0x1f);
+    packet[2] = pid & 0xff;
+    packet[3] = ((af_size > 0) ? 0x30 : 0x10) | (*cc & 0x0f);
+    (*cc)++;
+
+    p = packet + 4;
+    if (af_size > 0) {
+      p[0] = af_size - 1;
+      if (af_size > 1) {
+        guint8 *q = p + 2;
+
+        p[1] = 0;
+        if (first && random_access) {
+          p[1] |= 0x40;
+        }
+        if (first && pcr >= 0) {
+          guint64 base = pcr & MPEGTS_TIMESTAMP_MASK;
+
+          p[1] |= 0x10;
+          q[0] = base >> 25;
+          q[1] = base >> 17;
+          q[2] = base >> 9;
+          q[3] = base >> 1;
+          q[4] = ((base & 1) << 7) | 0x7e;
+          q[5] = 0;
+          q += 6;
+        }
+        memset (q, 0xff, p + af_size - q);
+      }
+      p += af_size;
+    }
+    memcpy (p, data, payload);
+
+    gst_byte_writer_put_data (mux->bw, packet, sizeof (packet));
+
+    data += payload;
+    len -= payload;
+    first = FALSE;
+  }
+}
+
+static guint8 *
+mpegts_put_timestamp (guint8 * p, int prefix, guint64 ts)
+{
+  p[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+  p[1] = (ts >> 22) & 0xff;
+  p[2] = ((ts >> 14) & 0xfe) | 1;
+  p[3] = (ts >> 7) & 0xff;
+  p[4] = ((ts << 1) & 0xfe) | 1;
+  return p + 5;
+}
+
+static guint64
+mpegts_convert_time (gint64 ts)
+{
+  if (ts < 0)
+    ts = 0;
+  return (gst_util_uint64_scale (ts, MPEGTS_CLOCK, GSS_ISM_SECOND) +
+      MPEGTS_TIMESTAMP_OFFSET) & MPEGTS_TIMESTAMP_MASK;
+}
+
+static gboolean
+mpegts_parse_avcc (MpegtsAvcConfig * config, const guint8 * data, int len)
+{
+  GstByteReader br;
+  GstByteWriter *bw;
+  guint8 byte;
+  int n_sets;
+  int i;
+  int j;
+
+  if (data == NULL)
+    return FALSE;
+
+  gst_byte_reader_init (&br, data, len);
+
+  if (!gst_byte_reader_skip (&br, 4) ||
+      !gst_byte_reader_get_uint8 (&br, &byte))
+    return FALSE;
+  config->nal_length_size = (byte & 0x03) + 1;
+
+  bw = gst_byte_writer_new ();
+  /* first SPS, then PPS */
+  for (i = 0; i < 2; i++) {
+    if (!gst_byte_reader_get_uint8 (&br, &byte)) {
+      gst_byte_writer_free (bw);
+      return FALSE;
+    }
+    n_sets = (i == 0) ? (byte & 0x1f) : byte;
+    for (j = 0; j < n_sets; j++) {
+      guint16 size;
+      const guint8 *set;
+
+      if (!gst_byte_reader_get_uint16_be (&br, &size) ||
+          !gst_byte_reader_get_data (&br, size, &set)) {
+        gst_byte_writer_free (bw);
+        return FALSE;
+      }
+      gst_byte_writer_put_uint32_be (bw, 0x00000001);
+      gst_byte_writer_put_data (bw, set, size);
+    }
+  }
+
+  config->param_sets_len = bw->parent.byte;
+  config->param_sets = gst_byte_writer_free_and_get_data (bw);
+
+  return TRUE;
+}
+
+static void
+mpegts_parse_aac_config (MpegtsAacConfig * config, const guint8 * data,
+    int len)
+{
+  if (data == NULL || len < 2) {
+    /* AAC LC, 44.1 kHz, stereo */
+    config->object_type = 2;
+    config->rate_index = 4;
+    config->channels = 2;
+    return;
+  }
+
+  config->object_type = data[0] >> 3;
+  config->rate_index = ((data[0] & 0x07) << 1) | (data[1] >> 7);
+  config->channels = (data[1] >> 3) & 0x0f;
+}
+
+/* Converts length-prefixed NAL units to Annex B start codes.  With
+ * 4-byte lengths, which is the common case, this is done in place
+ * since the start code is the same size as the length field. */
+static gsize
+mpegts_write_annexb (guint8 * dest, const guint8 * src, gsize size,
+    int nal_length_size)
+{
+  gsize offset;
+  gsize n;
+
+  if (nal_length_size == 4) {
+    memcpy (dest, src, size);
+    offset = 0;
+    while (offset + 4 <= size) {
+      guint32 nal_size = GST_READ_UINT32_BE (dest + offset);
+
+      GST_WRITE_UINT32_BE (dest + offset, 0x00000001);
+      offset += 4 + nal_size;
+    }
+    if (offset != size) {
+      GST_WARNING ("NAL lengths don't match sample size");
+    }
+    return size;
+  }
+
+  offset = 0;
+  n = 0;
+  while (offset + nal_length_size <= size) {
+    gsize nal_size = 0;
+    int i;
+
+    for (i = 0; i < nal_length_size; i++) {
+      nal_size = (nal_size << 8) | src[offset + i];
+    }
+    offset += nal_length_size;
+    if (offset + nal_size > size) {
+      GST_WARNING ("NAL length overruns sample");
+      break;
+    }
+    GST_WRITE_UINT32_BE (dest + n, 0x00000001);
+    memcpy (dest + n + 4, src + offset, nal_size);
+    n += 4 + nal_size;
+    offset += nal_size;
+  }
+  return n;
+}
+
+/* Whether sample @i of @fragment is a sync sample, going by the sample
+ * flags of the trun and tfhd.  Fragments without any flags, such as
+ * those cut by gss_isom_parser_fragmentize(), are only known to start
+ * with one. */
+static gboolean
+mpegts_sample_is_sync (GssIsomFragment * fragment, int i)
+{
+  guint32 flags;
+
+  if (fragment->trun.flags & TR_SAMPLE_FLAGS) {
+    flags = fragment->trun.samples[i].flags;
+  } else if (i == 0 && (fragment->trun.flags & TR_FIRST_SAMPLE_FLAGS)) {
+    flags = fragment->trun.first_sample_flags;
+  } else if (fragment->tfhd.flags & TF_DEFAULT_SAMPLE_FLAGS) {
+    flags = fragment->tfhd.default_sample_flags;
+  } else {
+    return (i == 0);
+  }
+
+  /* sample_is_non_sync_sample */
+  return !(flags & 0x00010000);
+}
+
+static void
+mpegts_write_video_sample (GssMpegtsMux * mux, MpegtsAvcConfig * avc,
+    const guint8 * data, gsize size, guint64 pts, guint64 dts,
+    gboolean keyframe)
+{
+  static const guint8 aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+  guint8 *pes;
+  guint8 *p;
+  gsize max_size;
+
+  max_size = 19 + sizeof (aud) + avc->param_sets_len;
+  if (avc->nal_length_size == 4) {
+    max_size += size;
+  } else {
+    /* every NAL unit is at least nal_length_size + 1 bytes, and grows
+     * by at most 3 bytes */
+    max_size += size * 3;
+  }
+  pes = mpegts_mux_get_pes_buffer (mux, max_size);
+
+  p = pes;
+  p[0] = 0x00;
+  p[1] = 0x00;
+  p[2] = 0x01;
+  p[3] = 0xe0;
+  /* unbounded PES_packet_length is allowed for video */
+  p[4] = 0x00;
+  p[5] = 0x00;
+  p[6] = 0x80;
+  if (pts != dts) {
+    p[7] = 0xc0;
+    p[8] = 10;
+    p = mpegts_put_timestamp (p + 9, 0x3, pts);
+    p = mpegts_put_timestamp (p, 0x1, dts);
+  } else {
+    p[7] = 0x80;
+    p[8] = 5;
+    p = mpegts_put_timestamp (p + 9, 0x2, pts);
+  }
+
+  memcpy (p, aud, sizeof (aud));
+  p += sizeof (aud);
+  if (!mux->video_started) {
+    keyframe = TRUE;
+    mux->video_started = TRUE;
+  }
+  if (keyframe) {
+    memcpy (p, avc->param_sets, avc->param_sets_len);
+    p += avc->param_sets_len;
+  }
+  p += mpegts_write_annexb (p, data, size, avc->nal_length_size);
+
+  mpegts_write_pes (mux, GSS_MPEGTS_PID_VIDEO, pes, p - pes, keyframe,
+      (mux->pcr_pid == GSS_MPEGTS_PID_VIDEO) ? (gint64) dts -
+      MPEGTS_PCR_DELAY : -1);
+}
+
+static void
+mpegts_write_audio_sample (GssMpegtsMux * mux, MpegtsAacConfig * aac,
+    const guint8 * data, gsize size, guint64 pts)
+{
+  guint8 *pes;
+  guint8 *p;
+  gsize frame_length;
+  gsize pes_length;
+
+  frame_length = ADTS_HEADER_SIZE + size;
+  pes = mpegts_mux_get_pes_buffer (mux, 14 + frame_length);
+
+  pes_length = 8 + frame_length;
+  if (pes_length > 0xffff) {
+    pes_length = 0;
+  }
+
+  p = pes;
+  p[0] = 0x00;
+  p[1] = 0x00;
+  p[2] = 0x01;
+  p[3] = 0xc0;
+  p[4] = pes_length >> 8;
+  p[5] = pes_length & 0xff;
+  p[6] = 0x80;
+  p[7] = 0x80;
+  p[8] = 5;
+  p = mpegts_put_timestamp (p + 9, 0x2, pts);
+
+  p[0] = 0xff;
+  p[1] = 0xf1;
+  p[2] = (((aac->object_type - 1) & 0x03) << 6) |
+      ((aac->rate_index & 0x0f) << 2) | ((aac->channels >> 2) & 0x01);
+  p[3] = ((aac->channels & 0x03) << 6) | ((frame_length >> 11) & 0x03);
+  p[4] = (frame_length >> 3) & 0xff;
+  p[5] = ((frame_length & 0x07) << 5) | 0x1f;
+  p[6] = 0xfc;
+  p += ADTS_HEADER_SIZE;
+
+  memcpy (p, data, size);
+  p += size;
+
+  mpegts_write_pes (mux, GSS_MPEGTS_PID_AUDIO, pes, p - pes, TRUE,
+      (mux->pcr_pid == GSS_MPEGTS_PID_AUDIO) ? (gint64) pts -
+      MPEGTS_PCR_DELAY : -1);
+}
+
+/**
+ * gss_mpegts_mux_fragments:
+ * @video_track: track that @video_fragment belongs to, or %NULL
+ * @video_fragment: video fragment, or %NULL
+ * @video_data: sample data of @video_fragment, without the mdat header
+ * @audio_track: track that @audio_fragment belongs to, or %NULL
+ * @audio_fragment: audio fragment, or %NULL
+ * @audio_data: sample data of @audio_fragment, without the mdat header
+ * @size: location for the size of the returned segment
+ *
+ * Packages the samples of the given fragments into a single MPEG-TS
+ * segment, interleaved by decode time.  The fragments are expected to
+ * cover the same time range and the video fragment to start with a
+ * keyframe, which is how gss_isom_parser_fragmentize() cuts them.
+ * SPS/PPS are inserted, and the random access indicator set, on the
+ * first video sample and on every later sync sample.
+ *
+ * Returns: newly allocated segment, or %NULL on error
+ */
+guint8 *
+gss_mpegts_mux_fragments (GssIsomTrack * video_track,
+    GssIsomFragment * video_fragment, const guint8 * video_data,
+    GssIsomTrack * audio_track, GssIsomFragment * audio_fragment,
+    const guint8 * audio_data, gsize * size)
+{
+  GssMpegtsMux mux;
+  MpegtsAvcConfig avc;
+  MpegtsAacConfig aac;
+  gsize video_offset = 0;
+  gsize audio_offset = 0;
+  gsize video_data_size = 0;
+  gsize audio_data_size = 0;
+  guint64 video_ts = 0;
+  guint64 audio_ts = 0;
+  int n_video = 0;
+  int n_audio = 0;
+  int vi = 0;
+  int ai = 0;
+
+  g_return_val_if_fail (size != NULL, NULL);
+  g_return_val_if_fail (video_fragment != NULL || audio_fragment != NULL,
+      NULL);
+
+  memset (&mux, 0, sizeof (mux));
+  memset (&avc, 0, sizeof (avc));
+
+  if (video_fragment) {
+    g_return_val_if_fail (video_track != NULL, NULL);
+    g_return_val_if_fail (video_data != NULL, NULL);
+
+    if (!mpegts_parse_avcc (&avc, video_track->esds.codec_data,
+            video_track->esds.codec_data_len)) {
+      GST_WARNING ("failed to parse avcC codec data");
+      return NULL;
+    }
+    n_video = video_fragment->trun.sample_count;
+    video_data_size = video_fragment->mdat_size - 8;
+    video_ts = video_fragment->timestamp;
+  }
+  if (audio_fragment) {
+    g_return_val_if_fail (audio_track != NULL, NULL);
+    g_return_val_if_fail (audio_data != NULL, NULL);
+
+    mpegts_parse_aac_config (&aac, audio_track->esds.codec_data,
+        audio_track->esds.codec_data_len);
+    n_audio = audio_fragment->trun.sample_count;
+    audio_data_size = audio_fragment->mdat_size - 8;
+    audio_ts = audio_fragment->timestamp;
+  }
+
+  mux.bw = gst_byte_writer_new ();
+  mux.pcr_pid = video_fragment ? GSS_MPEGTS_PID_VIDEO : GSS_MPEGTS_PID_AUDIO;
+
+  mpegts_write_pat (&mux);
+  mpegts_write_pmt (&mux, (video_fragment != NULL), (audio_fragment != NULL));
+
+  while (vi < n_video || ai < n_audio) {
+    if (vi < n_video && (ai >= n_audio || video_ts <= audio_ts)) {
+      GssBoxTrunSample *sample = &video_fragment->trun.samples[vi];
+
+      if (video_offset + sample->size > video_data_size) {
+        GST_WARNING ("video samples overrun mdat");
+        n_video = vi;
+        continue;
+      }
+      mpegts_write_video_sample (&mux, &avc, video_data + video_offset,
+          sample->size,
+          mpegts_convert_time ((gint64) video_ts +
+              (gint32) sample->composition_time_offset),
+          mpegts_convert_time (video_ts),
+          mpegts_sample_is_sync (video_fragment, vi));
+
+      video_offset += sample->size;
+      video_ts += sample->duration;
+      vi++;
+    } else {
+      GssBoxTrunSample *sample = &audio_fragment->trun.samples[ai];
+
+      if (audio_offset + sample->size > audio_data_size) {
+        GST_WARNING ("audio samples overrun mdat");
+        n_audio = ai;
+        continue;
+      }
+      mpegts_write_audio_sample (&mux, &aac, audio_data + audio_offset,
+          sample->size, mpegts_convert_time (audio_ts));
+
+      audio_offset += sample->size;
+      audio_ts += sample->duration;
+      ai++;
+    }
+  }
+
+  g_free (mux.pes);
+  g_free (avc.param_sets);
+
+  *size = mux.bw->parent.byte;
+  return gst_byte_writer_free_and_get_data (mux.bw);
+}
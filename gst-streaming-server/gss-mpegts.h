@@ -0,0 +1,44 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_MPEGTS_H
+#define _GSS_MPEGTS_H
+
+#include "gss-isom.h"
+
+G_BEGIN_DECLS
+
+#define GSS_MPEGTS_PACKET_SIZE 188
+
+#define GSS_MPEGTS_PID_PMT 0x1000
+#define GSS_MPEGTS_PID_VIDEO 0x0100
+#define GSS_MPEGTS_PID_AUDIO 0x0101
+
+
+guint8 * gss_mpegts_mux_fragments (GssIsomTrack *video_track,
+    GssIsomFragment *video_fragment, const guint8 *video_data,
+    GssIsomTrack *audio_track, GssIsomFragment *audio_fragment,
+    const guint8 *audio_data, gsize *size);
+
+
+G_END_DECLS
+
+#endif
+
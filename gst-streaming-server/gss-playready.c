@@ -42,6 +42,7 @@
 #include "gss-playready.h"
 #include "gss-utils.h"
 #include "gss-html.h"
+#include "gss-sglist.h"
 
 #include <openssl/aes.h>
 #include <openssl/evp.h>
@@ -50,7 +51,8 @@ enum
 {
   PROP_LICENSE_URL = 1,
   PROP_KEY_SEED,
-  PROP_ALLOW_CLEAR
+  PROP_ALLOW_CLEAR,
+  PROP_ENCRYPT_THREADS
 };
 
 #define DEFAULT_LICENSE_URL "http://playready.directtaps.net/pr/svc/rightsmanager.asmx"
@@ -60,6 +62,7 @@ enum
  * key seed.  */
 #define DEFAULT_KEY_SEED "5D5068BEC9B384FF6044867159F16D6B755544FCD5116989B1ACC4278E88"
 #define DEFAULT_ALLOW_CLEAR FALSE
+#define DEFAULT_ENCRYPT_THREADS 0
 
 
 static void gss_playready_finalize (GObject * object);
@@ -72,6 +75,10 @@ static void gss_playready_post_resource (GssTransaction * t);
 static char *gss_playready_generate_checksum (guint8 * key_id,
     guint8 * content_key);
 static void gss_playready_attach (GssObject * object, GssServer * server);
+static void gss_playready_append_metrics (GssModule * module, GString * s);
+static void gss_playready_encrypt_task (gpointer data, gpointer user_data);
+static void gss_playready_set_encrypt_threads (GssPlayready * playready,
+    int encrypt_threads);
 
 static GssObject *parent_class;
 
@@ -80,9 +87,11 @@ G_DEFINE_TYPE (GssPlayready, gss_playready, GSS_TYPE_MODULE);
 static void
 gss_playready_init (GssPlayready * playready)
 {
+  g_mutex_init (&playready->lock);
   playready->license_url = g_strdup (DEFAULT_LICENSE_URL);
   gss_playready_set_key_seed_hex (playready, DEFAULT_KEY_SEED);
   playready->allow_clear = DEFAULT_ALLOW_CLEAR;
+  gss_playready_set_encrypt_threads (playready, DEFAULT_ENCRYPT_THREADS);
 }
 
 static void
@@ -93,6 +102,8 @@ gss_playready_class_init (GssPlayreadyClass * playready_class)
   G_OBJECT_CLASS (playready_class)->finalize = gss_playready_finalize;
 
   GSS_OBJECT_CLASS (playready_class)->attach = gss_playready_attach;
+  GSS_MODULE_CLASS (playready_class)->append_metrics =
+      gss_playready_append_metrics;
 
   g_object_class_install_property (G_OBJECT_CLASS (playready_class),
       PROP_LICENSE_URL, g_param_spec_string ("license-url", "License URL",
@@ -109,6 +120,13 @@ gss_playready_class_init (GssPlayreadyClass * playready_class)
           "Allow clear streaming in addition to encrypted streaming.",
           DEFAULT_ALLOW_CLEAR,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (playready_class),
+      PROP_ENCRYPT_THREADS, g_param_spec_int ("encrypt-threads",
+          "Encrypt Threads",
+          "Number of threads used to encrypt large fragments "
+          "(0 = one per CPU, 1 = no parallel encryption).",
+          0, 64, DEFAULT_ENCRYPT_THREADS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   parent_class = g_type_class_peek_parent (playready_class);
 }
@@ -119,6 +137,10 @@ gss_playready_finalize (GObject * object)
   GssPlayready *playready = GSS_PLAYREADY (object);
 
   g_free (playready->license_url);
+  if (playready->encrypt_pool) {
+    g_thread_pool_free (playready->encrypt_pool, FALSE, TRUE);
+  }
+  g_mutex_clear (&playready->lock);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -133,14 +155,21 @@ gss_playready_set_property (GObject * object, guint prop_id,
 
   switch (prop_id) {
     case PROP_LICENSE_URL:
+      g_mutex_lock (&playready->lock);
       g_free (playready->license_url);
       playready->license_url = g_value_dup_string (value);
+      g_mutex_unlock (&playready->lock);
       break;
     case PROP_KEY_SEED:
       gss_playready_set_key_seed_hex (playready, g_value_get_string (value));
       break;
     case PROP_ALLOW_CLEAR:
+      g_mutex_lock (&playready->lock);
       playready->allow_clear = g_value_get_boolean (value);
+      g_mutex_unlock (&playready->lock);
+      break;
+    case PROP_ENCRYPT_THREADS:
+      gss_playready_set_encrypt_threads (playready, g_value_get_int (value));
       break;
     default:
       g_assert_not_reached ();
@@ -158,13 +187,16 @@ gss_playready_get_property (GObject * object, guint prop_id,
 
   switch (prop_id) {
     case PROP_LICENSE_URL:
-      g_value_set_string (value, playready->license_url);
+      g_value_take_string (value, gss_playready_get_license_url (playready));
       break;
     case PROP_KEY_SEED:
       g_value_take_string (value, gss_playready_get_key_seed_hex (playready));
       break;
     case PROP_ALLOW_CLEAR:
-      g_value_set_boolean (value, playready->allow_clear);
+      g_value_set_boolean (value, gss_playready_get_allow_clear (playready));
+      break;
+    case PROP_ENCRYPT_THREADS:
+      g_value_set_int (value, playready->encrypt_threads);
       break;
     default:
       g_assert_not_reached ();
@@ -178,6 +210,36 @@ gss_playready_new (void)
   return g_object_new (GSS_TYPE_PLAYREADY, NULL);
 }
 
+static void
+gss_playready_set_encrypt_threads (GssPlayready * playready,
+    int encrypt_threads)
+{
+  int n_threads;
+
+  playready->encrypt_threads = encrypt_threads;
+
+  n_threads = encrypt_threads;
+  if (n_threads == 0) {
+#if GLIB_CHECK_VERSION (2, 36, 0)
+    n_threads = g_get_num_processors ();
+#else
+    n_threads = 1;
+#endif
+  }
+  playready->n_encrypt_threads = n_threads;
+
+  /* The thread calling gss_playready_encrypt_fragment() encrypts one
+   * of the ranges, so the pool needs one thread fewer.  The pool is
+   * never freed here, since workers may be using it. */
+  if (playready->encrypt_pool == NULL) {
+    playready->encrypt_pool = g_thread_pool_new (gss_playready_encrypt_task,
+        playready, MAX (n_threads - 1, 1), FALSE, NULL);
+  } else {
+    g_thread_pool_set_max_threads (playready->encrypt_pool,
+        MAX (n_threads - 1, 1), NULL);
+  }
+}
+
 static void
 gss_playready_attach (GssObject * object, GssServer * server)
 {
@@ -194,6 +256,21 @@ gss_playready_attach (GssObject * object, GssServer * server)
   server->playready = playready;
 }
 
+static void
+gss_playready_append_metrics (GssModule * module, GString * s)
+{
+  GssPlayready *playready = GSS_PLAYREADY (module);
+
+  gss_metrics_append_header (s, "gss_encrypt_bytes_total", "counter",
+      "Bytes of fragments loaded and encrypted.");
+  GSS_P ("gss_encrypt_bytes_total %" G_GINT64_FORMAT "\n",
+      gss_counter_get (&playready->encrypt_bytes));
+  gss_metrics_append_header (s, "gss_encrypt_seconds_total", "counter",
+      "Time spent loading and encrypting fragments.");
+  GSS_P ("gss_encrypt_seconds_total %g\n",
+      gss_counter_get (&playready->encrypt_time) * 1e-6);
+}
+
 static void
 gss_playready_get_resource (GssTransaction * t)
 {
@@ -241,6 +318,7 @@ gss_playready_post_resource (GssTransaction * t)
 void
 gss_playready_set_key_seed_hex (GssPlayready * playready, const char *key_seed)
 {
+  guint8 seed[30];
   int i;
 
   if (strlen (key_seed) != 60) {
@@ -257,16 +335,75 @@ gss_playready_set_key_seed_hex (GssPlayready * playready, const char *key_seed)
     }
   }
   for (i = 0; i < 30; i++) {
-    playready->key_seed[i] =
-        (g_ascii_xdigit_value (key_seed[i * 2]) << 4) |
+    seed[i] = (g_ascii_xdigit_value (key_seed[i * 2]) << 4) |
         g_ascii_xdigit_value (key_seed[i * 2 + 1]);
   }
+
+  g_mutex_lock (&playready->lock);
+  memcpy (playready->key_seed, seed, 30);
+  g_mutex_unlock (&playready->lock);
 }
 
 char *
 gss_playready_get_key_seed_hex (GssPlayready * playready)
 {
-  return gss_hex_encode (playready->key_seed, 30);
+  guint8 seed[30];
+
+  gss_playready_get_key_seed (playready, seed);
+
+  return gss_hex_encode (seed, 30);
+}
+
+/**
+ * gss_playready_get_key_seed:
+ * @playready: a #GssPlayready
+ * @seed: returns the 30 byte key seed
+ *
+ * Copies the key-seed property, safe to call from any thread.
+ */
+void
+gss_playready_get_key_seed (GssPlayready * playready, guint8 * seed)
+{
+  g_mutex_lock (&playready->lock);
+  memcpy (seed, playready->key_seed, 30);
+  g_mutex_unlock (&playready->lock);
+}
+
+/**
+ * gss_playready_get_license_url:
+ * @playready: a #GssPlayready
+ *
+ * Returns: a copy of the license-url property, safe to call from any
+ * thread.  Free with g_free().
+ */
+char *
+gss_playready_get_license_url (GssPlayready * playready)
+{
+  char *license_url;
+
+  g_mutex_lock (&playready->lock);
+  license_url = g_strdup (playready->license_url);
+  g_mutex_unlock (&playready->lock);
+
+  return license_url;
+}
+
+/**
+ * gss_playready_get_allow_clear:
+ * @playready: a #GssPlayready
+ *
+ * Returns: the allow-clear property, safe to call from any thread.
+ */
+gboolean
+gss_playready_get_allow_clear (GssPlayready * playready)
+{
+  gboolean allow_clear;
+
+  g_mutex_lock (&playready->lock);
+  allow_clear = playready->allow_clear;
+  g_mutex_unlock (&playready->lock);
+
+  return allow_clear;
 }
 
 
@@ -359,6 +496,27 @@ gss_playready_setup (GssServer * server)
 void
 gss_playready_generate_key (GssPlayready * playready, guint8 * key,
     const guint8 * kid, int kid_len)
+{
+  guint8 seed[30];
+
+  gss_playready_get_key_seed (playready, seed);
+  gss_playready_generate_key_from_seed (seed, key, kid, kid_len);
+}
+
+/**
+ * gss_playready_generate_key_from_seed:
+ * @seed: a 30 byte key seed, from gss_playready_get_key_seed()
+ * @key: returns the 16 byte content key
+ * @kid: key ID
+ * @kid_len: length of @kid
+ *
+ * Like gss_playready_generate_key(), with a key seed copied earlier, so
+ * that a key can be generated on another thread from the configuration
+ * at the time the work was queued.
+ */
+void
+gss_playready_generate_key_from_seed (const guint8 * seed, guint8 * key,
+    const guint8 * kid, int kid_len)
 {
   GChecksum *checksum;
   guint8 *hash_a;
@@ -373,20 +531,20 @@ gss_playready_generate_key (GssPlayready * playready, guint8 * key,
   hash_b = g_malloc (size);
   hash_c = g_malloc (size);
 
-  g_checksum_update (checksum, playready->key_seed, 30);
+  g_checksum_update (checksum, seed, 30);
   g_checksum_update (checksum, kid, kid_len);
   g_checksum_get_digest (checksum, hash_a, &size);
 
   g_checksum_reset (checksum);
-  g_checksum_update (checksum, playready->key_seed, 30);
+  g_checksum_update (checksum, seed, 30);
   g_checksum_update (checksum, kid, kid_len);
-  g_checksum_update (checksum, playready->key_seed, 30);
+  g_checksum_update (checksum, seed, 30);
   g_checksum_get_digest (checksum, hash_b, &size);
 
   g_checksum_reset (checksum);
-  g_checksum_update (checksum, playready->key_seed, 30);
+  g_checksum_update (checksum, seed, 30);
   g_checksum_update (checksum, kid, kid_len);
-  g_checksum_update (checksum, playready->key_seed, 30);
+  g_checksum_update (checksum, seed, 30);
   g_checksum_update (checksum, kid, kid_len);
   g_checksum_get_digest (checksum, hash_c, &size);
 
@@ -485,22 +643,11 @@ void
 gss_playready_setup_iv (GssPlayready * playready, GssAdaptive * adaptive,
     GssAdaptiveLevel * level, GssIsomFragment * fragment)
 {
-  guint64 *init_vectors;
-  int i;
-  int n_samples;
   guint64 iv;
-  gboolean is_video;
 
-  n_samples = gss_isom_fragment_get_n_samples (fragment);
-  init_vectors = g_malloc (n_samples * sizeof (guint64));
   iv = level->iv + ((guint64) fragment->index << 32);
-  for (i = 0; i < n_samples; i++) {
-    init_vectors[i] = iv + i;
-  }
-  is_video = gss_isom_track_is_video (level->track);
-  gss_isom_fragment_set_sample_encryption (fragment, n_samples,
-      init_vectors, is_video);
-  g_free (init_vectors);
+  gss_isom_fragment_set_sample_encryption (fragment, iv,
+      gss_isom_track_is_video (level->track));
 }
 
 static char *
@@ -515,97 +662,733 @@ gss_playready_generate_checksum (guint8 * key_id, guint8 * content_key)
   return g_base64_encode (dest, 8);
 }
 
+/* AES-CTR keystream is generated for many samples at once: the counter
+ * blocks of every encrypted run are collected into a batch and
+ * encrypted with a single ECB call, so the cipher can pipeline blocks
+ * across samples, which matters when samples are only a few hundred
+ * bytes.  Samples large enough to keep the cipher busy on their own are
+ * run through a CTR context instead, resetting only the IV.  A batch is
+ * set up once for each range of samples a thread loads, so the key is
+ * expanded once per range, however many pieces it is read in. */
+#define GSS_PLAYREADY_BATCH_BLOCKS 256
+#define GSS_PLAYREADY_BATCH_RUNS 512
+#define GSS_PLAYREADY_DIRECT_SIZE 2048
+
+/* Fragments are only split for parallel encryption if each thread gets
+ * at least this many bytes; below that, handing off costs more than
+ * it saves. */
+#define GSS_PLAYREADY_PARALLEL_RANGE_SIZE (256 * 1024)
+
+typedef struct _GssPlayreadyRun GssPlayreadyRun;
+typedef struct _GssPlayreadyBatch GssPlayreadyBatch;
+
+struct _GssPlayreadyRun
+{
+  const guint8 *src;
+  guint8 *dest;
+  int len;
+  int keystream_offset;
+};
+
+struct _GssPlayreadyBatch
+{
 #if OPENSSL_VERSION_NUMBER >= 0x100010fL
-void
-gss_playready_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
-    guint8 * content_key)
+  EVP_CIPHER_CTX *ctx;
+  EVP_CIPHER_CTX *ctr_ctx;
+  /* cbcs only, instead of the above */
+  EVP_CIPHER_CTX *cbc_ctx;
+#else
+  AES_KEY key;
+  guint8 raw_iv[16];
+  guint8 ecount_buf[16];
+  unsigned int num;
+#endif
+
+  /* current sample */
+  gboolean direct;
+  guint64 iv;
+  guint64 counter;
+  int partial;
+  int partial_offset;
+
+  int n_blocks;
+  int n_runs;
+  guint8 counters[GSS_PLAYREADY_BATCH_BLOCKS * 16];
+  guint8 keystream[GSS_PLAYREADY_BATCH_BLOCKS * 16];
+  GssPlayreadyRun runs[GSS_PLAYREADY_BATCH_RUNS];
+};
+
+static gboolean
+gss_playready_fragment_is_cbcs (GssIsomFragment * fragment)
+{
+  return fragment->tenc &&
+      fragment->tenc->scheme_type == GST_MAKE_FOURCC ('c', 'b', 'c', 's');
+}
+
+/* Sets up the cipher for the encryption scheme of @fragment */
+static GssPlayreadyBatch *
+gss_playready_batch_new (GssIsomFragment * fragment, guint8 * content_key)
+{
+  GssPlayreadyBatch *batch;
+
+  batch = g_malloc (sizeof (GssPlayreadyBatch));
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  batch->ctx = NULL;
+  batch->ctr_ctx = NULL;
+  batch->cbc_ctx = NULL;
+  if (gss_playready_fragment_is_cbcs (fragment)) {
+    batch->cbc_ctx = EVP_CIPHER_CTX_new ();
+    EVP_EncryptInit_ex (batch->cbc_ctx, EVP_aes_128_cbc (), NULL,
+        content_key, NULL);
+    EVP_CIPHER_CTX_set_padding (batch->cbc_ctx, 0);
+  } else {
+    batch->ctx = EVP_CIPHER_CTX_new ();
+    EVP_EncryptInit_ex (batch->ctx, EVP_aes_128_ecb (), NULL, content_key,
+        NULL);
+    EVP_CIPHER_CTX_set_padding (batch->ctx, 0);
+    batch->ctr_ctx = EVP_CIPHER_CTX_new ();
+    EVP_EncryptInit_ex (batch->ctr_ctx, EVP_aes_128_ctr (), NULL,
+        content_key, NULL);
+  }
+#else
+  AES_set_encrypt_key (content_key, 16 * 8, &batch->key);
+#endif
+  batch->direct = FALSE;
+  batch->partial = 0;
+  batch->n_blocks = 0;
+  batch->n_runs = 0;
+
+  return batch;
+}
+
+static void
+gss_playready_batch_flush (GssPlayreadyBatch * batch)
 {
-  GssBoxTrun *trun = &fragment->trun;
-  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
-  guint64 sample_offset;
   int i;
-  int bytes = 0;
-  EVP_CIPHER_CTX *ctx;
 
-  sample_offset = 8;
+  if (batch->n_blocks == 0)
+    return;
 
-  ctx = EVP_CIPHER_CTX_new ();
-  for (i = 0; i < trun->sample_count; i++) {
-    unsigned char raw_iv[16];
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  {
     int len;
+    EVP_EncryptUpdate (batch->ctx, batch->keystream, &len, batch->counters,
+        batch->n_blocks * 16);
+  }
+#else
+  for (i = 0; i < batch->n_blocks; i++) {
+    AES_encrypt (batch->counters + i * 16, batch->keystream + i * 16,
+        &batch->key);
+  }
+#endif
 
-    memset (raw_iv, 0, 16);
-    GST_WRITE_UINT64_BE (raw_iv, se->samples[i].iv);
+  for (i = 0; i < batch->n_runs; i++) {
+    const guint8 *ks = batch->keystream + batch->runs[i].keystream_offset;
+    const guint8 *src = batch->runs[i].src;
+    guint8 *dest = batch->runs[i].dest;
+    int len = batch->runs[i].len;
+    int j;
+
+    for (j = 0; j + 8 <= len; j += 8) {
+      guint64 a, b;
+      memcpy (&a, src + j, 8);
+      memcpy (&b, ks + j, 8);
+      a ^= b;
+      memcpy (dest + j, &a, 8);
+    }
+    for (; j < len; j++) {
+      dest[j] = src[j] ^ ks[j];
+    }
+  }
+  batch->n_runs = 0;
+
+  /* Keep the last block if the current sample has keystream left in
+   * it.  Encrypting its counter again yields the same keystream. */
+  if (batch->partial > 0) {
+    int last = (batch->n_blocks - 1) * 16;
+    memcpy (batch->counters, batch->counters + last, 16);
+    batch->partial_offset -= last;
+    batch->n_blocks = 1;
+  } else {
+    batch->n_blocks = 0;
+  }
+}
 
-    EVP_EncryptInit_ex (ctx, EVP_aes_128_ctr (), NULL, content_key, raw_iv);
+static void
+gss_playready_batch_add_run (GssPlayreadyBatch * batch, const guint8 * src,
+    guint8 * dest, int len, int keystream_offset)
+{
+  GssPlayreadyRun *run;
 
-    if (se->samples[i].num_entries == 0) {
-      EVP_EncryptUpdate (ctx,
-          mdat_data + sample_offset, &len,
-          mdat_data + sample_offset, trun->samples[i].size);
-      bytes += trun->samples[i].size;
+  run = &batch->runs[batch->n_runs++];
+  run->src = src;
+  run->dest = dest;
+  run->len = len;
+  run->keystream_offset = keystream_offset;
+}
+
+static void
+gss_playready_batch_start_sample (GssPlayreadyBatch * batch, guint64 iv,
+    guint64 encrypted_size)
+{
+  batch->iv = iv;
+  batch->counter = 0;
+  batch->partial = 0;
+  batch->direct = (encrypted_size >= GSS_PLAYREADY_DIRECT_SIZE);
+  if (batch->direct) {
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+    guint8 raw_iv[16];
+
+    GST_WRITE_UINT64_BE (raw_iv, iv);
+    memset (raw_iv + 8, 0, 8);
+    EVP_EncryptInit_ex (batch->ctr_ctx, NULL, NULL, NULL, raw_iv);
+#else
+    GST_WRITE_UINT64_BE (batch->raw_iv, iv);
+    memset (batch->raw_iv + 8, 0, 8);
+    batch->num = 0;
+#endif
+  }
+}
+
+static void
+gss_playready_batch_encrypt (GssPlayreadyBatch * batch, const guint8 * src,
+    guint8 * dest, int len)
+{
+  if (batch->direct) {
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+    int out_len;
+    EVP_EncryptUpdate (batch->ctr_ctx, dest, &out_len, src, len);
+#else
+    AES_ctr128_encrypt (src, dest, len, &batch->key, batch->raw_iv,
+        batch->ecount_buf, &batch->num);
+#endif
+    return;
+  }
+
+  while (len > 0) {
+    guint8 *block;
+    guint64 iv;
+    guint64 counter;
+    int n_blocks;
+    int n;
+    int i;
+
+    if (batch->n_runs == GSS_PLAYREADY_BATCH_RUNS) {
+      gss_playready_batch_flush (batch);
+    }
+
+    if (batch->partial > 0) {
+      n = MIN (batch->partial, len);
+      gss_playready_batch_add_run (batch, src, dest, n, batch->partial_offset);
+      batch->partial -= n;
+      batch->partial_offset += n;
+      src += n;
+      dest += n;
+      len -= n;
+      continue;
+    }
+
+    if (batch->n_blocks == GSS_PLAYREADY_BATCH_BLOCKS) {
+      gss_playready_batch_flush (batch);
+    }
+
+    n_blocks = MIN ((len + 15) / 16,
+        GSS_PLAYREADY_BATCH_BLOCKS - batch->n_blocks);
+    block = batch->counters + batch->n_blocks * 16;
+    iv = batch->iv;
+    counter = batch->counter;
+    for (i = 0; i < n_blocks; i++) {
+      GST_WRITE_UINT64_BE (block, iv);
+      GST_WRITE_UINT64_BE (block + 8, counter);
+      block += 16;
+      counter++;
+    }
+    batch->counter = counter;
+    n = MIN (len, n_blocks * 16);
+    batch->partial = n_blocks * 16 - n;
+    batch->partial_offset = batch->n_blocks * 16 + n;
+    batch->n_blocks += n_blocks;
+    gss_playready_batch_add_run (batch, src, dest, n,
+        batch->partial_offset - n);
+    src += n;
+    dest += n;
+    len -= n;
+  }
+}
+
+/* Writes out the runs still waiting for keystream, at the end of a
+ * range of samples */
+static void
+gss_playready_batch_complete (GssPlayreadyBatch * batch)
+{
+  batch->partial = 0;
+  gss_playready_batch_flush (batch);
+}
+
+static void
+gss_playready_batch_free (GssPlayreadyBatch * batch)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  if (batch->ctx) {
+    EVP_CIPHER_CTX_free (batch->ctx);
+    EVP_CIPHER_CTX_free (batch->ctr_ctx);
+  }
+  if (batch->cbc_ctx) {
+    EVP_CIPHER_CTX_free (batch->cbc_ctx);
+  }
+#endif
+  memset (batch, 0, sizeof (GssPlayreadyBatch));
+  g_free (batch);
+}
+
+/* cbcs: AES-CBC over the first crypt_byte_block blocks of every
+ * (crypt + skip) blocks of each protected range, chained across the
+ * encrypted blocks only, restarting from the constant IV for each
+ * subsample.  A pattern of 0:0 encrypts every whole block.  Trailing
+ * partial blocks are left clear. */
+static void
+gss_playready_encrypt_pattern (const GssBoxTenc * tenc, gpointer ctx,
+    const guint8 * src, guint8 * dest, int len)
+{
+  int n_blocks = len / 16;
+  int crypt = tenc->crypt_byte_block;
+  int skip = tenc->skip_byte_block;
+  int i;
+#if OPENSSL_VERSION_NUMBER < 0x100010fL
+  guint8 iv[16];
+#endif
+
+  if (crypt == 0 && skip == 0) {
+    crypt = n_blocks;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  EVP_EncryptInit_ex ((EVP_CIPHER_CTX *) ctx, NULL, NULL, NULL,
+      tenc->constant_iv);
+#else
+  /* AES_cbc_encrypt() leaves the last cipher block in iv */
+  memcpy (iv, tenc->constant_iv, 16);
+#endif
+  for (i = 0; i < n_blocks; i += crypt + skip) {
+    int n = MIN (crypt, n_blocks - i);
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+    int out_len;
+
+    EVP_EncryptUpdate ((EVP_CIPHER_CTX *) ctx, dest + i * 16, &out_len,
+        src + i * 16, n * 16);
+#else
+    AES_cbc_encrypt (src + i * 16, dest + i * 16, n * 16, (AES_KEY *) ctx,
+        iv, AES_ENCRYPT);
+#endif
+    if (src != dest && i + n < n_blocks) {
+      memcpy (dest + (i + n) * 16, src + (i + n) * 16,
+          MIN (skip, n_blocks - i - n) * 16);
+    }
+  }
+  if (src != dest) {
+    memcpy (dest + n_blocks * 16, src + n_blocks * 16, len - n_blocks * 16);
+  }
+}
+
+static void
+gss_playready_encrypt_range_cbcs (GssIsomFragment * fragment,
+    GssPlayreadyBatch * batch, const guint8 * src, guint8 * dest,
+    int first_sample, int last_sample, guint64 sample_offset)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  const GssBoxTenc *tenc = fragment->tenc;
+  gpointer ctx;
+  int i;
+
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  ctx = batch->cbc_ctx;
+#else
+  ctx = &batch->key;
+#endif
+
+  for (i = first_sample; i < last_sample; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    if (sample.num_entries == 0) {
+      gss_playready_encrypt_pattern (tenc, ctx, src + sample_offset,
+          dest + sample_offset, trun->samples[i].size);
     } else {
       guint64 offset;
       int j;
       offset = sample_offset;
-      for (j = 0; j < se->samples[i].num_entries; j++) {
-        offset += se->samples[i].entries[j].bytes_of_clear_data;
-        EVP_EncryptUpdate (ctx,
-            mdat_data + offset, &len,
-            mdat_data + offset,
-            se->samples[i].entries[j].bytes_of_encrypted_data);
-        offset += se->samples[i].entries[j].bytes_of_encrypted_data;
-        bytes += se->samples[i].entries[j].bytes_of_encrypted_data;
+      for (j = 0; j < sample.num_entries; j++) {
+        if (src != dest) {
+          memcpy (dest + offset, src + offset,
+              sample.entries[j].bytes_of_clear_data);
+        }
+        offset += sample.entries[j].bytes_of_clear_data;
+        gss_playready_encrypt_pattern (tenc, ctx, src + offset, dest + offset,
+            sample.entries[j].bytes_of_encrypted_data);
+        offset += sample.entries[j].bytes_of_encrypted_data;
+      }
+      if (src != dest && offset < sample_offset + trun->samples[i].size) {
+        memcpy (dest + offset, src + offset,
+            sample_offset + trun->samples[i].size - offset);
       }
     }
     sample_offset += trun->samples[i].size;
   }
-  EVP_CIPHER_CTX_free (ctx);
 }
-#else
+
+/* Encrypts samples first_sample to last_sample - 1, starting at
+ * sample_offset in the mdat, from src to dest, with a batch set up by
+ * gss_playready_batch_new() for the fragment.  src and dest may be the
+ * same buffer; otherwise clear bytes are copied across. */
+static void
+gss_playready_encrypt_range (GssIsomFragment * fragment,
+    GssPlayreadyBatch * batch, const guint8 * src, guint8 * dest,
+    int first_sample, int last_sample, guint64 sample_offset)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  int i;
+
+  if (gss_playready_fragment_is_cbcs (fragment)) {
+    gss_playready_encrypt_range_cbcs (fragment, batch, src, dest,
+        first_sample, last_sample, sample_offset);
+    return;
+  }
+
+  for (i = first_sample; i < last_sample; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+    guint64 encrypted_size;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    if (sample.num_entries == 0) {
+      encrypted_size = trun->samples[i].size;
+    } else {
+      int j;
+      encrypted_size = 0;
+      for (j = 0; j < sample.num_entries; j++) {
+        encrypted_size += sample.entries[j].bytes_of_encrypted_data;
+      }
+    }
+    gss_playready_batch_start_sample (batch, sample.iv, encrypted_size);
+
+    if (sample.num_entries == 0) {
+      gss_playready_batch_encrypt (batch, src + sample_offset,
+          dest + sample_offset, trun->samples[i].size);
+    } else {
+      guint64 offset;
+      int j;
+      offset = sample_offset;
+      for (j = 0; j < sample.num_entries; j++) {
+        if (src != dest) {
+          memcpy (dest + offset, src + offset,
+              sample.entries[j].bytes_of_clear_data);
+        }
+        offset += sample.entries[j].bytes_of_clear_data;
+        gss_playready_batch_encrypt (batch, src + offset, dest + offset,
+            sample.entries[j].bytes_of_encrypted_data);
+        offset += sample.entries[j].bytes_of_encrypted_data;
+      }
+      if (src != dest && offset < sample_offset + trun->samples[i].size) {
+        memcpy (dest + offset, src + offset,
+            sample_offset + trun->samples[i].size - offset);
+      }
+    }
+    sample_offset += trun->samples[i].size;
+  }
+  gss_playready_batch_complete (batch);
+}
+
 void
 gss_playready_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
     guint8 * content_key)
+{
+  GssPlayreadyBatch *batch;
+
+  batch = gss_playready_batch_new (fragment, content_key);
+  gss_playready_encrypt_range (fragment, batch, mdat_data, mdat_data, 0,
+      fragment->trun.sample_count, 8);
+  gss_playready_batch_free (batch);
+}
+
+typedef struct _GssPlayreadyJob GssPlayreadyJob;
+typedef struct _GssPlayreadyTask GssPlayreadyTask;
+
+struct _GssPlayreadyJob
+{
+  GssIsomFragment *fragment;
+  int fd;
+  guint8 *clear_data;
+  guint8 *mdat_data;
+  guint8 *content_key;
+
+  GMutex lock;
+  GCond cond;
+  int n_pending;
+  GError *error;
+};
+
+struct _GssPlayreadyTask
+{
+  GssPlayreadyJob *job;
+  int first_sample;
+  int last_sample;
+  guint64 sample_offset;
+};
+
+/* Reads a range of samples in pieces of about this many bytes, and
+ * encrypts each piece before reading the next, while it is still in
+ * cache. */
+#define GSS_PLAYREADY_LOAD_SIZE (64 * 1024)
+
+static gboolean
+gss_playready_load_range (GssPlayreadyJob * job, int first_sample,
+    int last_sample, guint64 sample_offset, GError ** error)
+{
+  GssIsomFragment *fragment = job->fragment;
+  guint8 *src = job->clear_data ? job->clear_data : job->mdat_data;
+  GssPlayreadyBatch *batch;
+  int i;
+
+  if (job->fd < 0) {
+    if (job->content_key) {
+      batch = gss_playready_batch_new (fragment, job->content_key);
+      gss_playready_encrypt_range (fragment, batch, src, job->mdat_data,
+          first_sample, last_sample, sample_offset);
+      gss_playready_batch_free (batch);
+    } else if (src != job->mdat_data) {
+      gsize size = 0;
+      for (i = first_sample; i < last_sample; i++) {
+        size += fragment->trun.samples[i].size;
+      }
+      memcpy (job->mdat_data + sample_offset, src + sample_offset, size);
+    }
+    return TRUE;
+  }
+
+  /* one key schedule for all the pieces */
+  batch = job->content_key ?
+      gss_playready_batch_new (fragment, job->content_key) : NULL;
+
+  i = first_sample;
+  while (i < last_sample) {
+    gsize size = 0;
+    int n = 0;
+
+    do {
+      size += fragment->trun.samples[i + n].size;
+      n++;
+    } while (i + n < last_sample && size < GSS_PLAYREADY_LOAD_SIZE);
+
+    if (!gss_sglist_load_range (fragment->sglist, job->fd,
+            src + sample_offset, sample_offset - 8, size, error)) {
+      if (batch) {
+        gss_playready_batch_free (batch);
+      }
+      return FALSE;
+    }
+    if (batch) {
+      gss_playready_encrypt_range (fragment, batch, src, job->mdat_data,
+          i, i + n, sample_offset);
+    } else if (src != job->mdat_data) {
+      memcpy (job->mdat_data + sample_offset, src + sample_offset, size);
+    }
+
+    i += n;
+    sample_offset += size;
+  }
+
+  if (batch) {
+    gss_playready_batch_free (batch);
+  }
+
+  return TRUE;
+}
+
+static void
+gss_playready_encrypt_task (gpointer data, gpointer user_data)
+{
+  GssPlayreadyTask *task = data;
+  GssPlayreadyJob *job = task->job;
+  GError *error = NULL;
+
+  gss_playready_load_range (job, task->first_sample, task->last_sample,
+      task->sample_offset, &error);
+
+  g_mutex_lock (&job->lock);
+  if (error) {
+    if (job->error == NULL) {
+      job->error = error;
+    } else {
+      g_error_free (error);
+    }
+  }
+  job->n_pending--;
+  if (job->n_pending == 0) {
+    g_cond_signal (&job->cond);
+  }
+  g_mutex_unlock (&job->lock);
+}
+
+/* Loads @fragment, in parallel ranges when it is large enough */
+static gboolean
+gss_playready_load_fragment_ranges (GssPlayready * playready,
+    GssIsomFragment * fragment, int fd, guint8 * clear_data,
+    guint8 * mdat_data, guint8 * content_key, GError ** error)
 {
   GssBoxTrun *trun = &fragment->trun;
-  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  GssPlayreadyJob job;
+  GssPlayreadyTask *tasks;
+  guint64 total;
+  guint64 first_offset;
   guint64 sample_offset;
+  guint64 next_cut;
+  int n_ranges;
+  int n_tasks;
+  int first_sample;
+  gboolean ret;
   int i;
 
+  job.fragment = fragment;
+  job.fd = fd;
+  job.clear_data = clear_data;
+  job.mdat_data = mdat_data;
+  job.content_key = content_key;
+  job.error = NULL;
+
+  total = fragment->mdat_size - 8;
+  n_ranges = MIN (playready->n_encrypt_threads,
+      (int) (total / GSS_PLAYREADY_PARALLEL_RANGE_SIZE));
+  if (n_ranges < 2 || trun->sample_count < n_ranges ||
+      (fd < 0 && content_key == NULL)) {
+    return gss_playready_load_range (&job, 0, trun->sample_count, 8, error);
+  }
+
+  g_mutex_init (&job.lock);
+  g_cond_init (&job.cond);
+
+  tasks = g_malloc (sizeof (GssPlayreadyTask) * n_ranges);
+  n_tasks = 0;
+  first_sample = 0;
+  first_offset = 8;
   sample_offset = 8;
+  next_cut = total / n_ranges;
+  for (i = 0; i < trun->sample_count && n_tasks < n_ranges - 1; i++) {
+    sample_offset += trun->samples[i].size;
+    if (sample_offset - 8 >= next_cut) {
+      tasks[n_tasks].job = &job;
+      tasks[n_tasks].first_sample = first_sample;
+      tasks[n_tasks].last_sample = i + 1;
+      tasks[n_tasks].sample_offset = first_offset;
+      n_tasks++;
+      first_sample = i + 1;
+      first_offset = sample_offset;
+      next_cut = total * (n_tasks + 1) / n_ranges;
+    }
+  }
 
-  for (i = 0; i < trun->sample_count; i++) {
-    unsigned char raw_iv[16];
-    unsigned char ecount_buf[16] = { 0 };
-    unsigned int num = 0;
-    AES_KEY key;
+  job.n_pending = n_tasks;
+  for (i = 0; i < n_tasks; i++) {
+    g_thread_pool_push (playready->encrypt_pool, &tasks[i], NULL);
+  }
 
-    memset (raw_iv, 0, 16);
-    GST_WRITE_UINT64_BE (raw_iv, se->samples[i].iv);
+  /* remainder */
+  ret = TRUE;
+  if (first_sample < trun->sample_count) {
+    ret = gss_playready_load_range (&job, first_sample, trun->sample_count,
+        first_offset, error);
+  }
 
-    AES_set_encrypt_key (content_key, 16 * 8, &key);
+  g_mutex_lock (&job.lock);
+  while (job.n_pending > 0) {
+    g_cond_wait (&job.cond, &job.lock);
+  }
+  g_mutex_unlock (&job.lock);
 
-    if (se->samples[i].num_entries == 0) {
-      AES_ctr128_encrypt (mdat_data + sample_offset,
-          mdat_data + sample_offset, trun->samples[i].size,
-          &key, raw_iv, ecount_buf, &num);
+  if (job.error) {
+    if (ret) {
+      g_propagate_error (error, job.error);
+      ret = FALSE;
     } else {
-      guint64 offset;
-      int j;
-      offset = sample_offset;
-      for (j = 0; j < se->samples[i].num_entries; j++) {
-        offset += se->samples[i].entries[j].bytes_of_clear_data;
-        AES_ctr128_encrypt (mdat_data + offset,
-            mdat_data + offset,
-            se->samples[i].entries[j].bytes_of_encrypted_data,
-            &key, raw_iv, ecount_buf, &num);
-        offset += se->samples[i].entries[j].bytes_of_encrypted_data;
-      }
+      g_error_free (job.error);
     }
-    sample_offset += trun->samples[i].size;
   }
+
+  g_mutex_clear (&job.lock);
+  g_cond_clear (&job.cond);
+  g_free (tasks);
+
+  return ret;
+}
+
+/**
+ * gss_playready_load_fragment:
+ * @playready: the #GssPlayready module
+ * @fragment: fragment to load
+ * @fd: file descriptor of the fragment's media file, or -1 if the
+ *   samples are already in @clear_data (or @mdat_data)
+ * @clear_data: (allow-none): buffer laid out like @mdat_data that
+ *   receives the clear samples, or %NULL
+ * @mdat_data: the mdat box, including its 8 byte header
+ * @content_key: (allow-none): 16 byte content key, or %NULL to leave
+ *   the samples clear
+ * @error: location for a #GError, or %NULL
+ *
+ * Reads the samples of @fragment from @fd and encrypts them into
+ * @mdat_data.  Samples are read a few at a time and each group is
+ * encrypted as soon as it is read, so the data is only brought into
+ * cache once.  If @clear_data is given, the clear samples are kept
+ * there and only @mdat_data is encrypted, so a clear copy can be
+ * shared between variants.  Otherwise samples are encrypted in place
+ * in @mdat_data.
+ *
+ * Large fragments are split into ranges of samples with roughly equal
+ * numbers of bytes, which are loaded and encrypted in parallel on the
+ * module's thread pool.  The calling thread handles the last range
+ * itself and returns once all ranges are done.
+ *
+ * Bytes encrypted and the time taken are counted for the metrics.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gss_playready_load_fragment (GssPlayready * playready,
+    GssIsomFragment * fragment, int fd, guint8 * clear_data,
+    guint8 * mdat_data, guint8 * content_key, GError ** error)
+{
+  gint64 start;
+  gboolean ret;
+
+  start = g_get_monotonic_time ();
+  ret = gss_playready_load_fragment_ranges (playready, fragment, fd,
+      clear_data, mdat_data, content_key, error);
+  if (content_key) {
+    gss_counter_add (&playready->encrypt_bytes, fragment->mdat_size - 8);
+    gss_counter_add (&playready->encrypt_time,
+        g_get_monotonic_time () - start);
+  }
+
+  return ret;
+}
+
+/**
+ * gss_playready_encrypt_fragment:
+ * @playready: the #GssPlayready module
+ * @fragment: fragment with sample encryption set up
+ * @mdat_data: the mdat box, including its 8 byte header
+ * @content_key: 16 byte content key
+ *
+ * Encrypts the samples of @fragment in place, like
+ * gss_playready_encrypt_samples(), splitting large fragments across
+ * the module's thread pool as gss_playready_load_fragment() does.
+ */
+void
+gss_playready_encrypt_fragment (GssPlayready * playready,
+    GssIsomFragment * fragment, guint8 * mdat_data, guint8 * content_key)
+{
+  gss_playready_load_fragment (playready, fragment, -1, NULL, mdat_data,
+      content_key, NULL);
 }
-#endif
 
 const char *
 gss_playready_get_uri (GssDrmType drm_type)
@@ -616,6 +1399,7 @@ gss_playready_get_uri (GssDrmType drm_type)
     case GSS_DRM_PLAYREADY:
       return "urn:uuid:9a04f079-9840-4286-ab92-e65be0885f95";
     case GSS_DRM_CENC:
+    case GSS_DRM_CBCS:
       return "urn:mpeg:dash:mp4protection:2011";
     default:
       return NULL;
@@ -629,6 +1413,8 @@ gss_drm_get_drm_type (const char *s)
     return GSS_DRM_PLAYREADY;
   if (strcmp (s, "clear") == 0)
     return GSS_DRM_CLEAR;
+  if (strcmp (s, "cbcs") == 0)
+    return GSS_DRM_CBCS;
   return GSS_DRM_UNKNOWN;
 }
 
@@ -642,6 +1428,8 @@ gss_drm_get_drm_name (GssDrmType drm_type)
       return "pr";
     case GSS_DRM_CENC:
       return "cenc";
+    case GSS_DRM_CBCS:
+      return "cbcs";
     default:
       return "";
   }
@@ -42,11 +42,22 @@ G_BEGIN_DECLS
 struct _GssPlayready {
   GssModule module;
 
-  /* properties */
+  /* properties.  license_url, key_seed and allow_clear are read from
+   * frontend and loader threads while the admin page may change them,
+   * so they are accessed under lock. */
+  GMutex lock;
   char *license_url;
   guint8 key_seed[30];
   gboolean allow_clear;
+  int encrypt_threads;
 
+  int n_encrypt_threads;
+  GThreadPool *encrypt_pool;
+
+  /* fragments loaded with encryption, and the time it took in
+   * microseconds */
+  GssCounter encrypt_bytes;
+  GssCounter encrypt_time;
 };
 
 struct _GssPlayreadyClass
@@ -60,8 +71,13 @@ GType gss_playready_get_type (void);
 GssPlayready *gss_playready_new (void);
 void gss_playready_set_key_seed_hex (GssPlayready *playready, const char *key_seed);
 char * gss_playready_get_key_seed_hex (GssPlayready *playready);
+void gss_playready_get_key_seed (GssPlayready *playready, guint8 *seed);
+char * gss_playready_get_license_url (GssPlayready *playready);
+gboolean gss_playready_get_allow_clear (GssPlayready *playready);
 void gss_playready_generate_key (GssPlayready *playready, guint8 *key,
         const guint8 * kid, int kid_len);
+void gss_playready_generate_key_from_seed (const guint8 *seed, guint8 *key,
+        const guint8 * kid, int kid_len);
 
 void gss_playready_setup (GssServer * server);
 gsize gss_playready_get_protection_header (GssAdaptive * adaptive,
@@ -70,6 +86,11 @@ char * gss_playready_get_protection_header_base64 (GssAdaptive *adaptive,
     const char *la_url, const char *auth_token);
 void gss_playready_encrypt_samples (GssIsomFragment * fragment,
     guint8 * mdat_data, guint8 * content_key);
+void gss_playready_encrypt_fragment (GssPlayready *playready,
+    GssIsomFragment * fragment, guint8 * mdat_data, guint8 * content_key);
+gboolean gss_playready_load_fragment (GssPlayready *playready,
+    GssIsomFragment * fragment, int fd, guint8 * clear_data,
+    guint8 * mdat_data, guint8 * content_key, GError ** error);
 void gss_playready_setup_iv (GssPlayready *playready, GssAdaptive * adaptive,
     GssAdaptiveLevel * level, GssIsomFragment * fragment);
 
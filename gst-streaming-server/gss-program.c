@@ -26,6 +26,7 @@
 #include "gss-soup.h"
 #include "gss-content.h"
 #include "gss-utils.h"
+#include "gss-dash-live.h"
 
 /**
  * SECTION:gss-program
@@ -39,13 +40,17 @@ enum
   PROP_ENABLED,
   PROP_STATE,
   PROP_UUID,
-  PROP_DESCRIPTION
+  PROP_DESCRIPTION,
+  PROP_ENABLE_DASH,
+  PROP_DASH_CHUNK_DURATION
 };
 
 #define DEFAULT_ENABLED FALSE
 #define DEFAULT_STATE GSS_PROGRAM_STATE_STOPPED
 #define DEFAULT_UUID "00000000-0000-0000-0000-000000000000"
 #define DEFAULT_DESCRIPTION ""
+#define DEFAULT_ENABLE_DASH FALSE
+#define DEFAULT_DASH_CHUNK_DURATION 0
 
 
 static void gss_program_frag_resource (GssTransaction * transaction);
@@ -112,6 +117,8 @@ gss_program_init (GssProgram * program)
   gss_uuid_create (uuid);
   program->uuid = gss_uuid_to_string (uuid);
   program->description = g_strdup (DEFAULT_DESCRIPTION);
+  program->enable_dash = DEFAULT_ENABLE_DASH;
+  program->dash.chunk_duration = DEFAULT_DASH_CHUNK_DURATION;
   program->safe_description = gss_html_sanitize_entity (program->description);
 
   gss_object_set_title (GSS_OBJECT (program), program->uuid);
@@ -141,6 +148,17 @@ gss_program_class_init (GssProgramClass * program_class)
       PROP_DESCRIPTION, g_param_spec_string ("description", "Description",
           "Description", DEFAULT_DESCRIPTION,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (program_class),
+      PROP_ENABLE_DASH, g_param_spec_boolean ("enable-dash", "Enable DASH",
+          "Package MPEG-TS streams as live DASH", DEFAULT_ENABLE_DASH,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (program_class),
+      PROP_DASH_CHUNK_DURATION, g_param_spec_int ("dash-chunk-duration",
+          "DASH Chunk Duration",
+          "Duration (in ms) of low-latency chunks of live DASH segments, "
+          "or 0 to publish whole segments.", 0, 10000,
+          DEFAULT_DASH_CHUNK_DURATION,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   program_class->add_resources = gss_program_add_resources;
 
@@ -159,6 +177,7 @@ gss_program_finalize (GObject * object)
   if (program->hls.variant_buffer) {
     soup_buffer_free (program->hls.variant_buffer);
   }
+  g_free (program->dash.mpd_location);
 
   gss_metrics_free (program->metrics);
   g_free (program->follow_uri);
@@ -189,6 +208,12 @@ gss_program_set_property (GObject * object, guint prop_id,
       program->safe_description =
           gss_html_sanitize_entity (program->description);
       break;
+    case PROP_ENABLE_DASH:
+      program->enable_dash = g_value_get_boolean (value);
+      break;
+    case PROP_DASH_CHUNK_DURATION:
+      program->dash.chunk_duration = g_value_get_int (value);
+      break;
     default:
       g_assert_not_reached ();
       break;
@@ -216,6 +241,12 @@ gss_program_get_property (GObject * object, guint prop_id,
     case PROP_UUID:
       g_value_set_string (value, program->uuid);
       break;
+    case PROP_ENABLE_DASH:
+      g_value_set_boolean (value, program->enable_dash);
+      break;
+    case PROP_DASH_CHUNK_DURATION:
+      g_value_set_int (value, program->dash.chunk_duration);
+      break;
     default:
       g_assert_not_reached ();
       break;
@@ -289,6 +320,9 @@ gss_program_remove_stream (GssProgram * program, GssStream * stream)
   program->streams = g_list_remove (program->streams, stream);
 
   gss_stream_remove_resources (stream);
+  if (stream->dash_live) {
+    gss_dash_live_remove_resources (stream->dash_live);
+  }
   stream->program = NULL;
 
   g_object_unref (stream);
@@ -438,6 +472,8 @@ gss_program_stop (GssProgram * program)
     }
 #endif
   }
+
+  gss_program_remove_dash (program);
 }
 
 void
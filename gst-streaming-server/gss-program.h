@@ -96,6 +96,17 @@ struct _GssProgram {
     gboolean have_iv;
     guint32 init_vector[4];
   } hls;
+
+  gboolean enable_dash;
+  struct {
+    char *mpd_location;
+    gint64 availability_start_time; /* wall clock, in microseconds */
+    /* from stream timestamps onto the MPD timeline, shared by all
+     * streams and tracks so that their segments line up */
+    gboolean have_offset;
+    guint64 offset;
+    int chunk_duration; /* ms, or 0 for whole segments */
+  } dash;
 };
 
 typedef struct _GssProgramClass GssProgramClass;
@@ -27,6 +27,7 @@
 #include "gss-soup.h"
 #include "gss-content.h"
 #include "gss-utils.h"
+#include "gss-dash-live.h"
 
 #include <stdio.h>
 
@@ -205,6 +206,9 @@ gss_stream_create_follow_pipeline (GssStream * stream, const char *follow_url)
   GString *pipe_desc;
   GError *error = NULL;
   GstBus *bus;
+  gboolean enable_dash;
+
+  enable_dash = gss_dash_live_stream_is_supported (stream);
 
   pipe_desc = g_string_new ("");
 
@@ -233,9 +237,15 @@ gss_stream_create_follow_pipeline (GssStream * stream, const char *follow_url)
       g_assert_not_reached ();
       break;
   }
+  if (enable_dash) {
+    g_string_append (pipe_desc, "tee name=livetee ! ");
+  }
   g_string_append (pipe_desc, "queue ! ");
   g_string_append_printf (pipe_desc, "%s name=sink ",
       gss_server_get_multifdsink_string ());
+  if (enable_dash) {
+    g_string_append (pipe_desc, gss_dash_live_get_pipeline_string ());
+  }
 
   GST_DEBUG ("pipeline: %s", pipe_desc->str);
   error = NULL;
@@ -258,6 +268,10 @@ gss_stream_create_follow_pipeline (GssStream * stream, const char *follow_url)
   g_object_unref (e);
   stream->pipeline = pipe;
 
+  if (enable_dash) {
+    gss_stream_add_dash (stream, pipe);
+  }
+
   bus = gst_pipeline_get_bus (GST_PIPELINE (pipe));
   gst_bus_add_signal_watch (bus);
   g_signal_connect (bus, "message", G_CALLBACK (handle_pipeline_message),
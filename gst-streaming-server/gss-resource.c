@@ -237,8 +237,7 @@ gss_resource_onetime_redirect (GssTransaction * t)
   or->timeout_id = g_timeout_add_full (G_PRIORITY_DEFAULT, 5000,
       onetime_expire, or, NULL);
 
-  g_hash_table_replace (t->server->resources, or->resource.location,
-      (GssResource *) or);
+  gss_server_add_resource_simple (t->server, (GssResource *) or);
 
   base_url = gss_soup_get_base_url_http (t->server, t->msg);
   url = g_strdup_printf ("%s%s", base_url, or->resource.location);
@@ -38,6 +38,8 @@ typedef enum {
   GSS_RESOURCE_USER = (1<<5),
   GSS_RESOURCE_KIOSK = (1<<6),
   GSS_RESOURCE_PREFIX = (1<<7),
+  /* may be served by the frontend threads */
+  GSS_RESOURCE_THREADSAFE = (1<<8),
 } GssResourceFlags;
 
 struct _GssResource {
@@ -55,6 +57,9 @@ struct _GssResource {
   GDestroyNotify destroy;
 
   gpointer priv;
+
+  /* owned by the server, set on first request */
+  GssLatency *latency;
 };
 
 
@@ -35,6 +35,10 @@
 #include "gss-playready.h"
 #include "gss-log.h"
 
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
 #define GST_CAT_DEFAULT gss_debug
 
 /**
@@ -55,8 +59,22 @@ enum
   PROP_SERVER_HOSTNAME,
   PROP_MAX_CONNECTIONS,
   PROP_MAX_RATE,
+  PROP_WORKER_THREADS,
+  PROP_PIN_WORKER_THREADS,
+  PROP_FRONTEND_THREADS,
+  PROP_FRONTEND_PORT,
+  /* in priority order */
+  PROP_MAX_QUEUED_HIGH,
+  PROP_MAX_QUEUED_NORMAL,
+  PROP_MAX_QUEUED_LOW,
+  PROP_MAX_QUEUE_WAIT_HIGH,
+  PROP_MAX_QUEUE_WAIT_NORMAL,
+  PROP_MAX_QUEUE_WAIT_LOW,
+  PROP_ACCESS_LOG_FILE,
+  PROP_ACCESS_LOG_MAX_SIZE,
   PROP_ADMIN_HOSTS_ALLOW,
   PROP_KIOSK_HOSTS_ALLOW,
+  PROP_METRICS_HOSTS_ALLOW,
   PROP_REALM,
   PROP_ADMIN_TOKEN,
   PROP_ENABLE_HTML5_VIDEO,
@@ -75,8 +93,22 @@ enum
 #define DEFAULT_SERVER_HOSTNAME ""
 #define DEFAULT_MAX_CONNECTIONS 10000
 #define DEFAULT_MAX_RATE 100000
+#define DEFAULT_WORKER_THREADS 0
+#define DEFAULT_PIN_WORKER_THREADS FALSE
+#define DEFAULT_FRONTEND_THREADS 0
+#define DEFAULT_FRONTEND_PORT 8081
+#define DEFAULT_MAX_QUEUED_HIGH 1000
+#define DEFAULT_MAX_QUEUED_NORMAL 1000
+#define DEFAULT_MAX_QUEUED_LOW 200
+#define DEFAULT_MAX_QUEUE_WAIT_HIGH 1000
+#define DEFAULT_MAX_QUEUE_WAIT_NORMAL 4000
+#define DEFAULT_MAX_QUEUE_WAIT_LOW 60000
+#define DEFAULT_ACCESS_LOG_FILE ""
+#define DEFAULT_ACCESS_LOG_MAX_SIZE 100
 #define DEFAULT_ADMIN_HOSTS_ALLOW "0.0.0.0/0"
 #define DEFAULT_KIOSK_HOSTS_ALLOW ""
+/* localhost is always allowed */
+#define DEFAULT_METRICS_HOSTS_ALLOW ""
 /* This is the result of soup_auth_domain_digest_encode_password ("admin",
  * "GStreamer Streaming Server", "admin"); */
 #define DEFAULT_ADMIN_TOKEN "f09e5ebc80c348d2ccf8a59a8cd37827"
@@ -104,12 +136,20 @@ static void gss_asset_get_resource (GssTransaction * t);
 static void gss_server_resource_callback (SoupServer * soupserver,
     SoupMessage * msg, const char *path, GHashTable * query,
     SoupClientContext * client, gpointer user_data);
+static void gss_server_handle_request (GssTransaction * t);
+static void gss_server_resource_dispatch (GssTransaction * t);
+static void gss_server_resource_call (GssTransaction * t);
+static void gss_server_sync_done (GssTransaction * t);
+static void gss_server_set_frontends (GssServer * server);
+static void gss_server_stop_frontends (GssServer * server);
 static void gss_server_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
 static void gss_server_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 static void gss_server_setup_resources (GssServer * server);
 static void gss_server_attach (GssObject * object, GssServer * x_server);
+static void gss_server_append_metrics (GssModule * module, GString * s);
+static void gss_server_count_fds (gpointer data, gpointer user_data);
 
 
 static gboolean periodic_timer (gpointer data);
@@ -177,6 +217,7 @@ gss_server_set_http_port (GssServer * server, int port)
   if (server->server) {
     soup_server_add_handler (server->server, "/", gss_server_resource_callback,
         server, NULL);
+    gss_transaction_connect_server (server->server);
     soup_server_run_async (server->server);
   }
 }
@@ -235,6 +276,7 @@ gss_server_set_https_port (GssServer * server, int port)
   if (server->ssl_server) {
     soup_server_add_handler (server->ssl_server, "/",
         gss_server_resource_callback, server, NULL);
+    gss_transaction_connect_server (server->ssl_server);
     soup_server_run_async (server->ssl_server);
   }
 }
@@ -243,11 +285,17 @@ static void
 gss_server_init (GssServer * server)
 {
   char *s;
+  int i;
 
   server->metrics = gss_metrics_new ();
 
   server->resources = g_hash_table_new_full (g_str_hash, g_str_equal,
       NULL, (GDestroyNotify) gss_resource_free);
+  g_rw_lock_init (&server->resources_lock);
+  server->frontends = g_ptr_array_new ();
+  server->latencies = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) gss_latency_free);
+  g_mutex_init (&server->latencies_lock);
 
   server->client_session = soup_session_async_new ();
 
@@ -258,6 +306,28 @@ gss_server_init (GssServer * server)
   gss_object_set_title (GSS_OBJECT (server), "GStreamer Streaming Server");
   server->max_connections = DEFAULT_MAX_CONNECTIONS;
   server->max_rate = DEFAULT_MAX_RATE;
+  server->worker_threads = DEFAULT_WORKER_THREADS;
+  server->pin_worker_threads = DEFAULT_PIN_WORKER_THREADS;
+  gss_transaction_set_worker_threads (server->worker_threads,
+      server->pin_worker_threads);
+  server->frontend_threads = DEFAULT_FRONTEND_THREADS;
+  server->frontend_port = DEFAULT_FRONTEND_PORT;
+  server->max_queued[GSS_TRANSACTION_PRIORITY_HIGH] = DEFAULT_MAX_QUEUED_HIGH;
+  server->max_queued[GSS_TRANSACTION_PRIORITY_NORMAL] =
+      DEFAULT_MAX_QUEUED_NORMAL;
+  server->max_queued[GSS_TRANSACTION_PRIORITY_LOW] = DEFAULT_MAX_QUEUED_LOW;
+  server->max_queue_wait[GSS_TRANSACTION_PRIORITY_HIGH] =
+      DEFAULT_MAX_QUEUE_WAIT_HIGH;
+  server->max_queue_wait[GSS_TRANSACTION_PRIORITY_NORMAL] =
+      DEFAULT_MAX_QUEUE_WAIT_NORMAL;
+  server->max_queue_wait[GSS_TRANSACTION_PRIORITY_LOW] =
+      DEFAULT_MAX_QUEUE_WAIT_LOW;
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    gss_transaction_set_admission_limits (i, server->max_queued[i],
+        server->max_queue_wait[i]);
+  }
+  server->access_log_file = g_strdup (DEFAULT_ACCESS_LOG_FILE);
+  server->access_log_max_size = DEFAULT_ACCESS_LOG_MAX_SIZE;
   server->admin_hosts_allow = g_strdup (DEFAULT_ADMIN_HOSTS_ALLOW);
   server->admin_arl =
       gss_addr_range_list_new_from_string (server->admin_hosts_allow, TRUE,
@@ -266,6 +336,13 @@ gss_server_init (GssServer * server)
   server->kiosk_arl =
       gss_addr_range_list_new_from_string (server->kiosk_hosts_allow, FALSE,
       FALSE);
+  server->metrics_hosts_allow = g_strdup (DEFAULT_METRICS_HOSTS_ALLOW);
+  server->metrics_arl =
+      gss_addr_range_list_new_from_string (server->metrics_hosts_allow, FALSE,
+      TRUE);
+  server->fd_count_pool = g_thread_pool_new (gss_server_count_fds, server, 1,
+      FALSE, NULL);
+  server->n_open_fds = -1;
   server->admin_token = g_strdup (DEFAULT_ADMIN_TOKEN);
   server->realm = g_strdup (DEFAULT_REALM);
   server->enable_html5_video = DEFAULT_ENABLE_HTML5_VIDEO;
@@ -301,6 +378,10 @@ gss_server_finalize (GObject * object)
 
   g_list_free_full (server->programs, g_object_unref);
 
+  gss_server_stop_frontends (server);
+  g_ptr_array_free (server->frontends, TRUE);
+  g_thread_pool_free (server->fd_count_pool, TRUE, TRUE);
+
   if (server->server)
     g_object_unref (server->server);
   if (server->ssl_server)
@@ -315,6 +396,9 @@ gss_server_finalize (GObject * object)
     gss_resource_free (server->prefix_resources[i]);
   }
   g_free (server->prefix_resources);
+  g_rw_lock_clear (&server->resources_lock);
+  g_hash_table_unref (server->latencies);
+  g_mutex_clear (&server->latencies_lock);
   gss_metrics_free (server->metrics);
   g_free (server->base_url);
   g_free (server->base_url_https);
@@ -324,9 +408,12 @@ gss_server_finalize (GObject * object)
   gss_addr_range_list_free (server->admin_arl);
   g_free (server->kiosk_hosts_allow);
   gss_addr_range_list_free (server->kiosk_arl);
+  g_free (server->metrics_hosts_allow);
+  gss_addr_range_list_free (server->metrics_arl);
   g_free (server->admin_token);
   g_free (server->archive_dir);
   g_free (server->cas_server);
+  g_free (server->access_log_file);
   g_object_unref (server->client_session);
 
   parent_class->finalize (object);
@@ -342,6 +429,7 @@ gss_server_class_init (GssServerClass * server_class)
   G_OBJECT_CLASS (server_class)->finalize = gss_server_finalize;
 
   GSS_OBJECT_CLASS (server_class)->attach = gss_server_attach;
+  GSS_MODULE_CLASS (server_class)->append_metrics = gss_server_append_metrics;
 
   g_object_class_install_property (G_OBJECT_CLASS (server_class),
       PROP_ENABLE_PUBLIC_INTERFACE,
@@ -378,6 +466,81 @@ gss_server_class_init (GssServerClass * server_class)
           "Maximum bitrate (in kbytes/sec, 0 is unlimited)",
           "Maximum bitrate (in kbytes/sec)", 0, G_MAXINT, DEFAULT_MAX_RATE,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_WORKER_THREADS, g_param_spec_int ("worker-threads",
+          "Worker Threads",
+          "Number of threads for reading and encrypting fragments, "
+          "or 0 for one per CPU.", 0, GSS_TRANSACTION_MAX_WORKERS,
+          DEFAULT_WORKER_THREADS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_PIN_WORKER_THREADS, g_param_spec_boolean ("pin-worker-threads",
+          "Pin Worker Threads", "Pin each worker thread to one CPU",
+          DEFAULT_PIN_WORKER_THREADS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_FRONTEND_THREADS, g_param_spec_int ("frontend-threads",
+          "Frontend Threads",
+          "Number of threads serving video on demand on the frontend port, "
+          "or 0 to disable.", 0, 64, DEFAULT_FRONTEND_THREADS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_FRONTEND_PORT, g_param_spec_int ("frontend-port",
+          "Frontend Port", "Port shared by the frontend threads", 1, 65535,
+          DEFAULT_FRONTEND_PORT,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUED_HIGH, g_param_spec_int ("max-queued-high",
+          "Maximum Queued (high priority)",
+          "Queued high priority transactions above which requests are "
+          "refused, or 0 for no limit", 0, G_MAXINT, DEFAULT_MAX_QUEUED_HIGH,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUED_NORMAL, g_param_spec_int ("max-queued-normal",
+          "Maximum Queued (normal priority)",
+          "Queued normal priority transactions above which requests are "
+          "refused, or 0 for no limit", 0, G_MAXINT,
+          DEFAULT_MAX_QUEUED_NORMAL,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUED_LOW, g_param_spec_int ("max-queued-low",
+          "Maximum Queued (low priority)",
+          "Queued low priority transactions above which requests are "
+          "refused, or 0 for no limit", 0, G_MAXINT, DEFAULT_MAX_QUEUED_LOW,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUE_WAIT_HIGH, g_param_spec_int ("max-queue-wait-high",
+          "Maximum Queue Wait (high priority)",
+          "Average queue wait in ms above which high priority requests "
+          "are refused, or 0 for no limit", 0, G_MAXINT,
+          DEFAULT_MAX_QUEUE_WAIT_HIGH,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUE_WAIT_NORMAL, g_param_spec_int ("max-queue-wait-normal",
+          "Maximum Queue Wait (normal priority)",
+          "Average queue wait in ms above which normal priority requests "
+          "are refused, or 0 for no limit", 0, G_MAXINT,
+          DEFAULT_MAX_QUEUE_WAIT_NORMAL,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_MAX_QUEUE_WAIT_LOW, g_param_spec_int ("max-queue-wait-low",
+          "Maximum Queue Wait (low priority)",
+          "Average queue wait in ms above which low priority requests "
+          "are refused, or 0 for no limit", 0, G_MAXINT,
+          DEFAULT_MAX_QUEUE_WAIT_LOW,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_ACCESS_LOG_FILE, g_param_spec_string ("access-log-file",
+          "Access Log File",
+          "File to write the access log to, or empty to send it to syslog",
+          DEFAULT_ACCESS_LOG_FILE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_ACCESS_LOG_MAX_SIZE, g_param_spec_int ("access-log-max-size",
+          "Access Log Maximum Size",
+          "Size in MB at which the access log file is rotated, or 0 to "
+          "never rotate", 0, G_MAXINT, DEFAULT_ACCESS_LOG_MAX_SIZE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
   g_object_class_install_property (G_OBJECT_CLASS (server_class),
       PROP_ADMIN_HOSTS_ALLOW, g_param_spec_string ("admin-hosts-allow",
           "Allowed Hosts (admin)", "Allowed Hosts (admin)",
@@ -389,6 +552,12 @@ gss_server_class_init (GssServerClass * server_class)
           "here will automatically be given access to the kiosk group.",
           DEFAULT_KIOSK_HOSTS_ALLOW,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (server_class),
+      PROP_METRICS_HOSTS_ALLOW, g_param_spec_string ("metrics-hosts-allow",
+          "Allowed Hosts (metrics)", "IP addresses or address ranges "
+          "allowed to read /metrics, in addition to localhost.",
+          DEFAULT_METRICS_HOSTS_ALLOW,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 #if 0
   /* Don't want to expose this yet */
   g_object_class_install_property (G_OBJECT_CLASS (server_class),
@@ -464,6 +633,7 @@ gss_server_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
 {
   GssServer *server;
+  int i;
 
   server = GSS_SERVER (object);
 
@@ -486,6 +656,51 @@ gss_server_set_property (GObject * object, guint prop_id,
     case PROP_MAX_RATE:
       server->max_rate = g_value_get_int (value);
       break;
+    case PROP_WORKER_THREADS:
+      server->worker_threads = g_value_get_int (value);
+      gss_transaction_set_worker_threads (server->worker_threads,
+          server->pin_worker_threads);
+      break;
+    case PROP_PIN_WORKER_THREADS:
+      server->pin_worker_threads = g_value_get_boolean (value);
+      gss_transaction_set_worker_threads (server->worker_threads,
+          server->pin_worker_threads);
+      break;
+    case PROP_FRONTEND_THREADS:
+      server->frontend_threads = g_value_get_int (value);
+      gss_server_set_frontends (server);
+      break;
+    case PROP_FRONTEND_PORT:
+      server->frontend_port = g_value_get_int (value);
+      gss_server_set_frontends (server);
+      break;
+    case PROP_MAX_QUEUED_HIGH:
+    case PROP_MAX_QUEUED_NORMAL:
+    case PROP_MAX_QUEUED_LOW:
+      i = prop_id - PROP_MAX_QUEUED_HIGH;
+      server->max_queued[i] = g_value_get_int (value);
+      gss_transaction_set_admission_limits (i, server->max_queued[i],
+          server->max_queue_wait[i]);
+      break;
+    case PROP_MAX_QUEUE_WAIT_HIGH:
+    case PROP_MAX_QUEUE_WAIT_NORMAL:
+    case PROP_MAX_QUEUE_WAIT_LOW:
+      i = prop_id - PROP_MAX_QUEUE_WAIT_HIGH;
+      server->max_queue_wait[i] = g_value_get_int (value);
+      gss_transaction_set_admission_limits (i, server->max_queued[i],
+          server->max_queue_wait[i]);
+      break;
+    case PROP_ACCESS_LOG_FILE:
+      g_free (server->access_log_file);
+      server->access_log_file = g_value_dup_string (value);
+      gss_log_set_access_log (server->access_log_file,
+          (gsize) server->access_log_max_size * 1024 * 1024);
+      break;
+    case PROP_ACCESS_LOG_MAX_SIZE:
+      server->access_log_max_size = g_value_get_int (value);
+      gss_log_set_access_log (server->access_log_file,
+          (gsize) server->access_log_max_size * 1024 * 1024);
+      break;
     case PROP_ADMIN_HOSTS_ALLOW:
       if (strcmp (server->admin_hosts_allow, g_value_get_string (value))) {
         g_free (server->admin_hosts_allow);
@@ -506,6 +721,16 @@ gss_server_set_property (GObject * object, guint prop_id,
             FALSE, FALSE);
       }
       break;
+    case PROP_METRICS_HOSTS_ALLOW:
+      if (strcmp (server->metrics_hosts_allow, g_value_get_string (value))) {
+        g_free (server->metrics_hosts_allow);
+        server->metrics_hosts_allow = g_value_dup_string (value);
+        gss_addr_range_list_free (server->metrics_arl);
+        server->metrics_arl =
+            gss_addr_range_list_new_from_string (server->metrics_hosts_allow,
+            FALSE, TRUE);
+      }
+      break;
     case PROP_ADMIN_TOKEN:
       g_free (server->admin_token);
       server->admin_token = g_value_dup_string (value);
@@ -573,12 +798,45 @@ gss_server_get_property (GObject * object, guint prop_id,
     case PROP_MAX_RATE:
       g_value_set_int (value, server->max_rate);
       break;
+    case PROP_WORKER_THREADS:
+      g_value_set_int (value, server->worker_threads);
+      break;
+    case PROP_PIN_WORKER_THREADS:
+      g_value_set_boolean (value, server->pin_worker_threads);
+      break;
+    case PROP_FRONTEND_THREADS:
+      g_value_set_int (value, server->frontend_threads);
+      break;
+    case PROP_FRONTEND_PORT:
+      g_value_set_int (value, server->frontend_port);
+      break;
+    case PROP_MAX_QUEUED_HIGH:
+    case PROP_MAX_QUEUED_NORMAL:
+    case PROP_MAX_QUEUED_LOW:
+      g_value_set_int (value,
+          server->max_queued[prop_id - PROP_MAX_QUEUED_HIGH]);
+      break;
+    case PROP_MAX_QUEUE_WAIT_HIGH:
+    case PROP_MAX_QUEUE_WAIT_NORMAL:
+    case PROP_MAX_QUEUE_WAIT_LOW:
+      g_value_set_int (value,
+          server->max_queue_wait[prop_id - PROP_MAX_QUEUE_WAIT_HIGH]);
+      break;
+    case PROP_ACCESS_LOG_FILE:
+      g_value_set_string (value, server->access_log_file);
+      break;
+    case PROP_ACCESS_LOG_MAX_SIZE:
+      g_value_set_int (value, server->access_log_max_size);
+      break;
     case PROP_ADMIN_HOSTS_ALLOW:
       g_value_set_string (value, server->admin_hosts_allow);
       break;
     case PROP_KIOSK_HOSTS_ALLOW:
       g_value_set_string (value, server->kiosk_hosts_allow);
       break;
+    case PROP_METRICS_HOSTS_ALLOW:
+      g_value_set_string (value, server->metrics_hosts_allow);
+      break;
     case PROP_ADMIN_TOKEN:
       g_value_set_string (value, server->admin_token);
       break;
@@ -629,6 +887,132 @@ gss_server_get_resource (GssTransaction * t)
 
   gss_config_append_config_block (G_OBJECT (server), t, FALSE);
 
+  {
+    static const char *names[GSS_TRANSACTION_N_PRIORITIES] = {
+      "High", "Normal", "Low"
+    };
+    int i;
+
+    GSS_A ("<h2>Worker Queues</h2>\n");
+    GSS_A ("<table class='table table-striped table-bordered "
+        "table-condensed'>\n");
+    GSS_A ("<tr><th>Priority</th><th>Transactions</th>"
+        "<th>Mean Wait (ms)</th><th>Max Wait (ms)</th><th>Late</th>"
+        "<th>Shed</th><th>Degraded</th></tr>\n");
+    for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+      GssTransactionQueueStats stats;
+
+      gss_transaction_get_queue_stats (i, &stats);
+      GSS_P ("<tr><td>%s</td><td>%" G_GUINT64_FORMAT "</td><td>%.1f</td>"
+          "<td>%.1f</td><td>%" G_GUINT64_FORMAT "</td><td>%" G_GUINT64_FORMAT
+          "</td><td>%" G_GUINT64_FORMAT "</td></tr>\n", names[i],
+          stats.n_transactions, stats.n_transactions ?
+          stats.total_wait * 1e-3 / stats.n_transactions : 0.0,
+          stats.max_wait * 1e-3, stats.n_late, stats.n_shed,
+          stats.n_degraded);
+    }
+    GSS_A ("</table>\n");
+  }
+
+  GSS_P ("<p><a href='/admin/latency?session_id=%s'>Request Latency</a></p>\n",
+      t->session->session_id);
+
+  gss_html_footer (t);
+}
+
+static const char *status_classes[GSS_LATENCY_N_STATUS_CLASSES] = {
+  "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+static int
+gss_server_latency_compare (gconstpointer a, gconstpointer b)
+{
+  const GssLatency *la = *(const GssLatency **) a;
+  const GssLatency *lb = *(const GssLatency **) b;
+
+  return strcmp (la->name, lb->name);
+}
+
+static void
+gss_server_append_latency_row (GssTransaction * t, const char *location,
+    const char *what, GssHistogram * histogram)
+{
+  static const double percentiles[] = { 50, 90, 99, 99.9 };
+  gint64 values[G_N_ELEMENTS (percentiles)];
+  GString *s = t->s;
+  guint64 n;
+
+  if (histogram == NULL)
+    return;
+
+  n = gss_histogram_get_percentiles (histogram, G_N_ELEMENTS (percentiles),
+      percentiles, values);
+  GSS_P ("<tr><td>%s</td><td>%s</td><td>%" G_GUINT64_FORMAT "</td>"
+      "<td>%.1f</td><td>%.1f</td><td>%.1f</td><td>%.1f</td></tr>\n",
+      location, what, n, values[0] * 1e-3, values[1] * 1e-3,
+      values[2] * 1e-3, values[3] * 1e-3);
+}
+
+/* Returns the latencies of all resources, sorted by location.  They
+ * are only freed with the server, so they can be read after unlocking. */
+static GPtrArray *
+gss_server_get_latencies (GssServer * server)
+{
+  GPtrArray *latencies;
+  GHashTableIter iter;
+  gpointer value;
+
+  latencies = g_ptr_array_new ();
+  g_mutex_lock (&server->latencies_lock);
+  g_hash_table_iter_init (&iter, server->latencies);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    g_ptr_array_add (latencies, value);
+  }
+  g_mutex_unlock (&server->latencies_lock);
+  g_ptr_array_sort (latencies, gss_server_latency_compare);
+
+  return latencies;
+}
+
+static void
+gss_server_get_latency_resource (GssTransaction * t)
+{
+  GssServer *server = GSS_SERVER (t->resource->priv);
+  GString *s = g_string_new ("");
+  GPtrArray *latencies;
+  int i, j;
+
+  t->s = s;
+
+  gss_html_header (t);
+
+  GSS_A ("<h1>Request Latency</h1><br>\n");
+  GSS_A ("<p>Total time from reading the request to the end of the "
+      "response, by status, then time spent in the resource handler and "
+      "in asynchronous processing.</p>\n");
+
+  latencies = gss_server_get_latencies (server);
+
+  GSS_A ("<table class='table table-striped table-bordered "
+      "table-condensed'>\n");
+  GSS_A ("<tr><th>Resource</th><th>Time</th><th>Requests</th>"
+      "<th>p50 (ms)</th><th>p90 (ms)</th><th>p99 (ms)</th>"
+      "<th>p99.9 (ms)</th></tr>\n");
+  for (i = 0; i < latencies->len; i++) {
+    GssLatency *latency = g_ptr_array_index (latencies, i);
+
+    for (j = 0; j < GSS_LATENCY_N_STATUS_CLASSES; j++) {
+      gss_server_append_latency_row (t, latency->name, status_classes[j],
+          g_atomic_pointer_get (&latency->total[j]));
+    }
+    gss_server_append_latency_row (t, latency->name, "handler",
+        g_atomic_pointer_get (&latency->sync));
+    gss_server_append_latency_row (t, latency->name, "async",
+        g_atomic_pointer_get (&latency->async));
+  }
+  GSS_A ("</table>\n");
+  g_ptr_array_free (latencies, TRUE);
+
   gss_html_footer (t);
 }
 
@@ -647,6 +1031,311 @@ gss_server_post_resource (GssTransaction * t)
   }
 }
 
+static void
+gss_server_append_request_metrics (GssServer * server, GString * s)
+{
+  GPtrArray *latencies;
+  GString *labels;
+  GString *requests;
+  GString *durations;
+  GString *handler;
+  GString *async;
+  GString *bytes;
+  GssHistogram *histogram;
+  guint64 n;
+  int i, j;
+
+  /* each metric family must be contiguous, so all are collected in one
+   * pass over the histograms and appended after */
+  labels = g_string_new ("");
+  requests = g_string_new ("");
+  durations = g_string_new ("");
+  handler = g_string_new ("");
+  async = g_string_new ("");
+  bytes = g_string_new ("");
+
+  latencies = gss_server_get_latencies (server);
+  for (i = 0; i < latencies->len; i++) {
+    GssLatency *latency = g_ptr_array_index (latencies, i);
+
+    for (j = 0; j < GSS_LATENCY_N_STATUS_CLASSES; j++) {
+      histogram = g_atomic_pointer_get (&latency->total[j]);
+      if (histogram == NULL)
+        continue;
+
+      g_string_truncate (labels, 0);
+      gss_metrics_append_label (labels, "resource", latency->name);
+      g_string_append_c (labels, ',');
+      gss_metrics_append_label (labels, "code", status_classes[j]);
+      n = gss_metrics_append_quantiles (durations,
+          "gss_request_duration_seconds", labels->str, histogram);
+      g_string_append_printf (requests, "gss_requests_total{%s} %"
+          G_GUINT64_FORMAT "\n", labels->str, n);
+    }
+
+    g_string_truncate (labels, 0);
+    gss_metrics_append_label (labels, "resource", latency->name);
+    histogram = g_atomic_pointer_get (&latency->sync);
+    if (histogram) {
+      gss_metrics_append_quantiles (handler, "gss_request_handler_seconds",
+          labels->str, histogram);
+    }
+    histogram = g_atomic_pointer_get (&latency->async);
+    if (histogram) {
+      gss_metrics_append_quantiles (async, "gss_request_async_seconds",
+          labels->str, histogram);
+    }
+    g_string_append_printf (bytes, "gss_response_bytes_total{%s} %"
+        G_GINT64_FORMAT "\n", labels->str,
+        gss_counter_get (&latency->bytes));
+  }
+  g_ptr_array_free (latencies, TRUE);
+
+  gss_metrics_append_header (s, "gss_requests_total", "counter",
+      "Requests answered, by resource and status class.");
+  g_string_append_len (s, requests->str, requests->len);
+  gss_metrics_append_header (s, "gss_request_duration_seconds", "summary",
+      "Time from reading the request to the end of the response.");
+  g_string_append_len (s, durations->str, durations->len);
+  gss_metrics_append_header (s, "gss_request_handler_seconds", "summary",
+      "Time spent in the resource handler.");
+  g_string_append_len (s, handler->str, handler->len);
+  gss_metrics_append_header (s, "gss_request_async_seconds", "summary",
+      "Time spent in asynchronous processing, by worker threads.");
+  g_string_append_len (s, async->str, async->len);
+  gss_metrics_append_header (s, "gss_response_bytes_total", "counter",
+      "Response body bytes, by resource.");
+  g_string_append_len (s, bytes->str, bytes->len);
+
+  g_string_free (labels, TRUE);
+  g_string_free (requests, TRUE);
+  g_string_free (durations, TRUE);
+  g_string_free (handler, TRUE);
+  g_string_free (async, TRUE);
+  g_string_free (bytes, TRUE);
+}
+
+static void
+gss_server_append_queue_metrics (GString * s)
+{
+  static const char *priorities[GSS_TRANSACTION_N_PRIORITIES] = {
+    "high", "normal", "low"
+  };
+  GssTransactionQueueStats stats[GSS_TRANSACTION_N_PRIORITIES];
+  gint64 busy_time;
+  int n_threads;
+  int i;
+
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    gss_transaction_get_queue_stats (i, &stats[i]);
+  }
+
+  gss_metrics_append_header (s, "gss_async_queued", "gauge",
+      "Async transactions waiting for a worker thread.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_queued{priority=\"%s\"} %d\n", priorities[i],
+        stats[i].n_queued);
+  }
+  gss_metrics_append_header (s, "gss_async_transactions_total", "counter",
+      "Async transactions taken by a worker thread.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_transactions_total{priority=\"%s\"} %"
+        G_GUINT64_FORMAT "\n", priorities[i], stats[i].n_transactions);
+  }
+  gss_metrics_append_header (s, "gss_async_wait_seconds_total", "counter",
+      "Time async transactions waited in the queue.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_wait_seconds_total{priority=\"%s\"} %g\n",
+        priorities[i], stats[i].total_wait * 1e-6);
+  }
+  gss_metrics_append_header (s, "gss_async_late_total", "counter",
+      "Async transactions that missed their deadline.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_late_total{priority=\"%s\"} %" G_GUINT64_FORMAT "\n",
+        priorities[i], stats[i].n_late);
+  }
+  gss_metrics_append_header (s, "gss_async_shed_total", "counter",
+      "Requests refused by admission control.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_shed_total{priority=\"%s\"} %" G_GUINT64_FORMAT "\n",
+        priorities[i], stats[i].n_shed);
+  }
+  gss_metrics_append_header (s, "gss_async_degraded_total", "counter",
+      "Requests served from cache while over the admission limits.");
+  for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+    GSS_P ("gss_async_degraded_total{priority=\"%s\"} %" G_GUINT64_FORMAT
+        "\n", priorities[i], stats[i].n_degraded);
+  }
+
+  gss_transaction_get_worker_stats (&n_threads, &busy_time);
+  gss_metrics_append_header (s, "gss_worker_threads", "gauge",
+      "Worker threads for async transactions.");
+  GSS_P ("gss_worker_threads %d\n", n_threads);
+  gss_metrics_append_header (s, "gss_worker_busy_seconds_total", "counter",
+      "Time worker threads spent processing transactions.");
+  GSS_P ("gss_worker_busy_seconds_total %g\n", busy_time * 1e-6);
+}
+
+static void
+gss_server_count_fds (gpointer data, gpointer user_data)
+{
+  GssServer *server = user_data;
+  GDir *dir;
+  int n_fds = 0;
+
+  dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while (g_dir_read_name (dir)) {
+    n_fds++;
+  }
+  g_dir_close (dir);
+
+  /* not counting the one used to read the directory */
+  g_atomic_int_set (&server->n_open_fds, n_fds - 1);
+}
+
+/* Reading /proc/self/fd takes time proportional to the number of open
+ * connections, so it is done on fd_count_pool and each scrape reports
+ * the count started by the one before. */
+static void
+gss_server_append_fd_metrics (GssServer * server, GString * s)
+{
+  struct rlimit limit;
+  int n_fds;
+
+  if (g_thread_pool_unprocessed (server->fd_count_pool) == 0) {
+    g_thread_pool_push (server->fd_count_pool, server, NULL);
+  }
+
+  n_fds = g_atomic_int_get (&server->n_open_fds);
+  if (n_fds >= 0) {
+    gss_metrics_append_header (s, "process_open_fds", "gauge",
+        "Open file descriptors.");
+    GSS_P ("process_open_fds %d\n", n_fds);
+  }
+
+  if (getrlimit (RLIMIT_NOFILE, &limit) == 0) {
+    gss_metrics_append_header (s, "process_max_fds", "gauge",
+        "Maximum number of open file descriptors.");
+    GSS_P ("process_max_fds %" G_GUINT64_FORMAT "\n",
+        (guint64) limit.rlim_cur);
+  }
+}
+
+static void
+gss_server_append_stream_metrics (GssServer * server, GString * s)
+{
+  GString *labels;
+  GString *clients;
+  GString *served;
+  GList *g, *h;
+
+  labels = g_string_new ("");
+  clients = g_string_new ("");
+  served = g_string_new ("");
+
+  for (g = server->programs; g; g = g_list_next (g)) {
+    GssProgram *program = g->data;
+
+    for (h = program->streams; h; h = g_list_next (h)) {
+      GssStream *stream = h->data;
+      guint64 in, out;
+
+      gss_stream_get_stats (stream, &in, &out);
+
+      g_string_truncate (labels, 0);
+      gss_metrics_append_label (labels, "program", GSS_OBJECT_NAME (program));
+      g_string_append_c (labels, ',');
+      gss_metrics_append_label (labels, "stream", GSS_OBJECT_NAME (stream));
+      g_string_append_printf (clients, "gss_stream_clients{%s} %d\n",
+          labels->str, gss_metrics_get_n_clients (stream->metrics));
+      g_string_append_printf (served, "gss_stream_bytes_served_total{%s} %"
+          G_GUINT64_FORMAT "\n", labels->str, out);
+    }
+  }
+
+  gss_metrics_append_header (s, "gss_stream_clients", "gauge",
+      "Clients of a live stream.");
+  g_string_append_len (s, clients->str, clients->len);
+  gss_metrics_append_header (s, "gss_stream_bytes_served_total", "counter",
+      "Bytes sent to the clients of a live stream.");
+  g_string_append_len (s, served->str, served->len);
+
+  g_string_free (labels, TRUE);
+  g_string_free (clients, TRUE);
+  g_string_free (served, TRUE);
+}
+
+static void
+gss_server_append_access_log_metrics (GString * s)
+{
+  guint64 n_logged, n_dropped;
+
+  gss_log_get_access_log_stats (&n_logged, &n_dropped);
+
+  gss_metrics_append_header (s, "gss_access_log_records_total", "counter",
+      "Requests written to the access log.");
+  GSS_P ("gss_access_log_records_total %" G_GUINT64_FORMAT "\n", n_logged);
+  gss_metrics_append_header (s, "gss_access_log_dropped_total", "counter",
+      "Requests left out of the access log because it fell behind.");
+  GSS_P ("gss_access_log_dropped_total %" G_GUINT64_FORMAT "\n", n_dropped);
+}
+
+static void
+gss_server_append_metrics (GssModule * module, GString * s)
+{
+  GssServer *server = GSS_SERVER (module);
+
+  gss_metrics_append_header (s, "gss_clients", "gauge",
+      "Clients of live streams.");
+  GSS_P ("gss_clients %d\n", gss_metrics_get_n_clients (server->metrics));
+  gss_metrics_append_header (s, "gss_clients_max", "gauge",
+      "Most clients of live streams at once.");
+  GSS_P ("gss_clients_max %d\n",
+      gss_metrics_get_max_clients (server->metrics));
+  gss_metrics_append_header (s, "gss_bitrate_bits_per_second", "gauge",
+      "Bitrate of the live streams being served.");
+  GSS_P ("gss_bitrate_bits_per_second %" G_GINT64_FORMAT "\n",
+      gss_metrics_get_bitrate (server->metrics));
+
+  gss_server_append_request_metrics (server, s);
+  gss_server_append_queue_metrics (s);
+  gss_server_append_fd_metrics (server, s);
+  gss_server_append_stream_metrics (server, s);
+  gss_server_append_access_log_metrics (s);
+}
+
+/* Serves the metrics of all modules to Prometheus-style scrapers.
+ * Everything read is either lock-free or under a lock that is only
+ * held briefly, so scraping does not stall the main loop. */
+static void
+gss_server_get_metrics_resource (GssTransaction * t)
+{
+  GssServer *server = GSS_SERVER (t->resource->priv);
+  GString *s;
+  GList *g;
+
+  /* scrapers do not log in, so they are allowed by address */
+  if (!gss_addr_range_list_check_address (server->metrics_arl,
+          soup_client_context_get_address (t->client))) {
+    gss_transaction_error_not_found (t, "metrics not allowed from host");
+    return;
+  }
+
+  s = g_string_new ("");
+  t->s = s;
+
+  for (g = server->modules; g; g = g_list_next (g)) {
+    GssModuleClass *module_class = GSS_MODULE_GET_CLASS (g->data);
+
+    if (module_class->append_metrics) {
+      module_class->append_metrics (GSS_MODULE (g->data), s);
+    }
+  }
+}
+
 static void
 gss_server_attach (GssObject * object, GssServer * x_server)
 {
@@ -659,6 +1348,15 @@ gss_server_attach (GssObject * object, GssServer * x_server)
   r->name = g_strdup ("Server");
   gss_module_set_admin_resource (GSS_MODULE (server), r);
 
+  r = gss_server_add_resource (GSS_OBJECT_SERVER (object), "/admin/latency",
+      GSS_RESOURCE_ADMIN, GSS_TEXT_HTML, gss_server_get_latency_resource,
+      NULL, NULL, server);
+  r->name = g_strdup ("Request Latency");
+
+  gss_server_add_resource (GSS_OBJECT_SERVER (object), "/metrics", 0,
+      "text/plain; version=0.0.4; charset=utf-8",
+      gss_server_get_metrics_resource, NULL, NULL, server);
+
 }
 
 void
@@ -729,6 +1427,7 @@ gss_server_add_resource (GssServer * server, const char *location,
   resource->post_callback = post_callback;
   resource->priv = priv;
 
+  g_rw_lock_writer_lock (&server->resources_lock);
   if (flags & GSS_RESOURCE_PREFIX) {
     server->n_prefix_resources++;
     server->prefix_resources = g_realloc (server->prefix_resources,
@@ -737,6 +1436,7 @@ gss_server_add_resource (GssServer * server, const char *location,
   } else {
     g_hash_table_replace (server->resources, resource->location, resource);
   }
+  g_rw_lock_writer_unlock (&server->resources_lock);
 
   return resource;
 }
@@ -744,7 +1444,9 @@ gss_server_add_resource (GssServer * server, const char *location,
 void
 gss_server_remove_resource (GssServer * server, const char *location)
 {
+  g_rw_lock_writer_lock (&server->resources_lock);
   g_hash_table_remove (server->resources, location);
+  g_rw_lock_writer_unlock (&server->resources_lock);
 }
 
 void
@@ -754,6 +1456,7 @@ gss_server_remove_resources_by_priv (GssServer * server, void *priv)
   const char *key;
   GssResource *resource;
 
+  g_rw_lock_writer_lock (&server->resources_lock);
   g_hash_table_iter_init (&iter, server->resources);
   while (g_hash_table_iter_next (&iter, (gpointer *) & key,
           (gpointer *) & resource)) {
@@ -761,6 +1464,7 @@ gss_server_remove_resources_by_priv (GssServer * server, void *priv)
       g_hash_table_iter_remove (&iter);
     }
   }
+  g_rw_lock_writer_unlock (&server->resources_lock);
 }
 
 static void
@@ -859,7 +1563,9 @@ gss_server_setup_resources (GssServer * server)
 void
 gss_server_add_resource_simple (GssServer * server, GssResource * r)
 {
+  g_rw_lock_writer_lock (&server->resources_lock);
   g_hash_table_replace (server->resources, r->location, r);
+  g_rw_lock_writer_unlock (&server->resources_lock);
 }
 
 void
@@ -1040,6 +1746,16 @@ gss_server_lookup_resource (GssServer * server, const char *path)
   return g_hash_table_lookup (server->resources, path);
 }
 
+/* Synchronous processing ends when the handler returns, unless the
+ * transaction was queued for async processing before. */
+static void
+gss_server_sync_done (GssTransaction * t)
+{
+  if (t->sync_process_time < 0) {
+    t->sync_process_time += g_get_real_time ();
+  }
+}
+
 static void
 gss_server_resource_callback (SoupServer * soupserver, SoupMessage * msg,
     const char *path, GHashTable * query, SoupClientContext * client,
@@ -1047,9 +1763,23 @@ gss_server_resource_callback (SoupServer * soupserver, SoupMessage * msg,
 {
   GssServer *server = (GssServer *) user_data;
   GssTransaction *t;
-  GssSession *session;
 
   t = gss_transaction_new (server, soupserver, msg, path, query, client);
+  gss_server_handle_request (t);
+  gss_server_sync_done (t);
+}
+
+/* Checks access to the resource for the request, and dispatches it */
+static void
+gss_server_handle_request (GssTransaction * t)
+{
+  GssServer *server = t->server;
+  SoupServer *soupserver = t->soupserver;
+  SoupMessage *msg = t->msg;
+  SoupClientContext *client = t->client;
+  GHashTable *query = t->query;
+  const char *path = t->path;
+  GssSession *session;
 
   t->resource = gss_server_lookup_resource (server, path);
 
@@ -1095,6 +1825,48 @@ gss_server_resource_callback (SoupServer * soupserver, SoupMessage * msg,
     }
   }
 
+  gss_server_resource_dispatch (t);
+}
+
+static GssLatency *
+gss_server_get_resource_latency (GssServer * server, GssResource * resource)
+{
+  GssLatency *latency;
+
+  latency = g_atomic_pointer_get (&resource->latency);
+  if (latency)
+    return latency;
+
+  g_mutex_lock (&server->latencies_lock);
+  latency = g_hash_table_lookup (server->latencies, resource->location);
+  if (latency == NULL) {
+    latency = gss_latency_new (resource->location);
+    g_hash_table_insert (server->latencies, latency->name, latency);
+  }
+  g_mutex_unlock (&server->latencies_lock);
+  g_atomic_pointer_set (&resource->latency, latency);
+
+  return latency;
+}
+
+/* Calls the resource callback for the request method, once access to
+ * t->resource has been checked. */
+static void
+gss_server_resource_dispatch (GssTransaction * t)
+{
+  gss_server_resource_call (t);
+
+  /* afterwards, as one-time resources hand over to the resource they
+   * stand for */
+  t->latency = gss_server_get_resource_latency (t->server, t->resource);
+}
+
+static void
+gss_server_resource_call (GssTransaction * t)
+{
+  GssServer *server = t->server;
+  SoupMessage *msg = t->msg;
+
   if (t->resource->content_type) {
     soup_message_headers_replace (msg->response_headers, "Content-Type",
         t->resource->content_type);
@@ -1117,7 +1889,7 @@ gss_server_resource_callback (SoupServer * soupserver, SoupMessage * msg,
 
 
   if (t->resource->flags & GSS_RESOURCE_HTTP_ONLY) {
-    if (soupserver != server->server) {
+    if (t->soupserver == server->ssl_server) {
       gss_resource_onetime_redirect (t);
       return;
     }
@@ -1158,6 +1930,237 @@ gss_server_resource_callback (SoupServer * soupserver, SoupMessage * msg,
   }
 }
 
+/* Frontend threads each run a SoupServer in their own GMainContext,
+ * all listening on frontend-port with SO_REUSEPORT, so the kernel
+ * spreads connections across them.  They only serve resources flagged
+ * GSS_RESOURCE_THREADSAFE; sessions, live streams and the admin pages
+ * stay on the main loop and the http-port. */
+typedef struct _GssFrontend GssFrontend;
+struct _GssFrontend
+{
+  GssServer *server;
+  GSocket *socket;
+  GMainContext *context;
+  GMainLoop *loop;
+  GThread *thread;
+};
+
+#ifdef SOUP_CHECK_VERSION
+#if SOUP_CHECK_VERSION (2, 48, 0) && defined (SO_REUSEPORT)
+#define GSS_ENABLE_FRONTENDS
+#endif
+#endif
+
+#ifdef GSS_ENABLE_FRONTENDS
+static void
+gss_server_frontend_callback (SoupServer * soupserver, SoupMessage * msg,
+    const char *path, GHashTable * query, SoupClientContext * client,
+    gpointer user_data)
+{
+  GssServer *server = (GssServer *) user_data;
+  GssTransaction *t;
+
+  t = gss_transaction_new (server, soupserver, msg, path, query, client);
+
+  /* the main loop may be adding or removing resources meanwhile.
+   * Thread-safe resources live as long as the server. */
+  g_rw_lock_reader_lock (&server->resources_lock);
+  t->resource = gss_server_lookup_resource (server, path);
+  if (t->resource && !(t->resource->flags & GSS_RESOURCE_THREADSAFE)) {
+    t->resource = NULL;
+  }
+  g_rw_lock_reader_unlock (&server->resources_lock);
+
+  if (!t->resource) {
+    gss_transaction_error_not_found (t, "resource not found");
+  } else {
+    gss_server_resource_dispatch (t);
+  }
+
+  gss_server_sync_done (t);
+}
+
+static gpointer
+gss_server_frontend_thread (gpointer priv)
+{
+  GssFrontend *frontend = priv;
+  SoupServer *soupserver;
+  GError *error = NULL;
+
+  g_main_context_push_thread_default (frontend->context);
+  gss_transaction_attach_thread (frontend->context);
+
+  soupserver = soup_server_new (NULL, NULL);
+  soup_server_add_handler (soupserver, "/", gss_server_frontend_callback,
+      frontend->server, NULL);
+  gss_transaction_connect_server (soupserver);
+  if (soup_server_listen_socket (soupserver, frontend->socket, 0, &error)) {
+    g_main_loop_run (frontend->loop);
+  } else {
+    GST_ERROR ("frontend failed to listen: %s", error->message);
+    g_error_free (error);
+  }
+  soup_server_disconnect (soupserver);
+  g_object_unref (soupserver);
+
+  gss_transaction_detach_thread ();
+  g_main_context_pop_thread_default (frontend->context);
+
+  return NULL;
+}
+
+static gboolean
+gss_server_frontend_quit (gpointer priv)
+{
+  GssFrontend *frontend = priv;
+
+  g_main_loop_quit (frontend->loop);
+
+  return FALSE;
+}
+
+static GSocket *
+gss_server_frontend_socket_new (GSocketFamily family, int port,
+    GError ** error)
+{
+  GSocket *socket;
+  GInetAddress *any;
+  GSocketAddress *address;
+  gboolean ret;
+  int one = 1;
+
+  socket = g_socket_new (family, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, error);
+  if (socket == NULL)
+    return NULL;
+
+  if (setsockopt (g_socket_get_fd (socket), SOL_SOCKET, SO_REUSEPORT, &one,
+          sizeof (one)) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+        "failed to set SO_REUSEPORT: %s", g_strerror (errno));
+    g_object_unref (socket);
+    return NULL;
+  }
+
+  any = g_inet_address_new_any (family);
+  address = g_inet_socket_address_new (any, port);
+  ret = g_socket_bind (socket, address, TRUE, error) &&
+      g_socket_listen (socket, error);
+  g_object_unref (address);
+  g_object_unref (any);
+  if (!ret) {
+    g_object_unref (socket);
+    return NULL;
+  }
+
+  return socket;
+}
+#endif
+
+static void
+gss_server_stop_frontends (GssServer * server)
+{
+  guint i;
+
+  for (i = 0; i < server->frontends->len; i++) {
+    GssFrontend *frontend = g_ptr_array_index (server->frontends, i);
+#ifdef GSS_ENABLE_FRONTENDS
+    GSource *source;
+
+    /* an idle source, so a quit before the loop starts is not lost */
+    source = g_idle_source_new ();
+    g_source_set_callback (source, gss_server_frontend_quit, frontend, NULL);
+    g_source_attach (source, frontend->context);
+    g_source_unref (source);
+    g_thread_join (frontend->thread);
+
+    /* calls queued with g_main_context_invoke(), such as requests
+     * waiting for a VOD load, would never run now.  Run them here so
+     * they release what they hold; their messages were closed with
+     * the frontend's server. */
+    while (g_main_context_iteration (frontend->context, FALSE));
+#endif
+
+    g_main_loop_unref (frontend->loop);
+    g_main_context_unref (frontend->context);
+    g_object_unref (frontend->socket);
+    g_free (frontend);
+  }
+  g_ptr_array_set_size (server->frontends, 0);
+}
+
+/**
+ * gss_server_is_running_context:
+ * @server: a #GssServer
+ * @context: a #GMainContext
+ *
+ * Call from the main loop only.
+ *
+ * Returns: TRUE if @context is the main context or is run by one of
+ * the frontend threads of @server.  Calls for stopped frontends should
+ * be made in the main loop instead of being invoked in @context.
+ */
+gboolean
+gss_server_is_running_context (GssServer * server, GMainContext * context)
+{
+  guint i;
+
+  if (context == g_main_context_default ())
+    return TRUE;
+
+  for (i = 0; i < server->frontends->len; i++) {
+    GssFrontend *frontend = g_ptr_array_index (server->frontends, i);
+
+    if (frontend->context == context)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+gss_server_set_frontends (GssServer * server)
+{
+  gss_server_stop_frontends (server);
+
+  if (server->frontend_threads == 0)
+    return;
+
+#ifdef GSS_ENABLE_FRONTENDS
+  while (server->frontends->len < (guint) server->frontend_threads) {
+    GssFrontend *frontend;
+    GSocket *socket;
+    GError *error = NULL;
+
+    socket = gss_server_frontend_socket_new (G_SOCKET_FAMILY_IPV6,
+        server->frontend_port, NULL);
+    if (socket == NULL) {
+      /* try again with just IPv4 */
+      socket = gss_server_frontend_socket_new (G_SOCKET_FAMILY_IPV4,
+          server->frontend_port, &error);
+    }
+    if (socket == NULL) {
+      GST_WARNING_OBJECT (server, "failed to open frontend port %d: %s",
+          server->frontend_port, error->message);
+      g_error_free (error);
+      break;
+    }
+
+    frontend = g_malloc0 (sizeof (GssFrontend));
+    frontend->server = server;
+    frontend->socket = socket;
+    frontend->context = g_main_context_new ();
+    frontend->loop = g_main_loop_new (frontend->context, FALSE);
+    frontend->thread = g_thread_new ("gss_frontend",
+        gss_server_frontend_thread, frontend);
+    g_ptr_array_add (server->frontends, frontend);
+  }
+#else
+  GST_WARNING_OBJECT (server, "frontend threads need SO_REUSEPORT and "
+      "libsoup 2.48");
+#endif
+}
+
 static void
 gss_server_resource_main_page (GssTransaction * t)
 {
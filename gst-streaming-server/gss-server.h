@@ -62,8 +62,18 @@ struct _GssServer
   char *server_hostname;
   int max_connections;
   int max_rate;
+  int worker_threads;
+  gboolean pin_worker_threads;
+  int frontend_threads;
+  int frontend_port;
+  /* admission limits by GssTransactionPriority */
+  int max_queued[GSS_TRANSACTION_N_PRIORITIES];
+  int max_queue_wait[GSS_TRANSACTION_N_PRIORITIES];
+  char *access_log_file;
+  int access_log_max_size;
   char *admin_hosts_allow;
   char *kiosk_hosts_allow;
+  char *metrics_hosts_allow;
   char *realm;
   char *cas_server;
   gboolean enable_html5_video;
@@ -87,9 +97,17 @@ struct _GssServer
   SoupSession *client_session;
   char *base_url;
   char *base_url_https;
+  /* changed only from the main loop, which reads them unlocked;
+   * frontend threads read them with resources_lock held */
   GHashTable *resources;
   int n_prefix_resources;
   GssResource **prefix_resources;
+  GRWLock resources_lock;
+  GPtrArray *frontends;
+  /* GssLatency by resource location, kept across resources being
+   * removed and added again */
+  GHashTable *latencies;
+  GMutex latencies_lock;
 
   /* FIXME move this into a private structure */
   void *rtsp_server;
@@ -110,6 +128,11 @@ struct _GssServer
 
   GssAddrRangeList *admin_arl;
   GssAddrRangeList *kiosk_arl;
+  GssAddrRangeList *metrics_arl;
+
+  /* counts /proc/self/fd for the metrics, off the main loop */
+  GThreadPool *fd_count_pool;
+  volatile gint n_open_fds;
 
   GssPlayready *playready;
 };
@@ -171,6 +194,8 @@ void gss_server_add_resource_simple (GssServer * server, GssResource * r);
 void gss_server_add_program_simple (GssServer * server, GssProgram * program);
 
 void gss_server_disable_programs (GssServer *server);
+gboolean gss_server_is_running_context (GssServer *server,
+    GMainContext *context);
 
 void gss_server_add_warnings_callback (GssServer *server, void (*add_warnings_func)(GssTransaction *t, void *priv),
     void *priv);
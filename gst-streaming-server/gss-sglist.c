@@ -26,6 +26,7 @@
 #include "gss-sglist.h"
 #include "gss-log.h"
 
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -110,6 +111,88 @@ gss_sglist_load (GssSGList * sglist, int fd, guint8 * dest, GError ** error)
   return TRUE;
 }
 
+/**
+ * gss_sglist_load_range:
+ * @sglist: a #GssSGList
+ * @fd: file descriptor to read from
+ * @dest: destination for the data
+ * @offset: offset into the concatenated chunks
+ * @size: number of bytes to read
+ * @error: location for a #GError, or %NULL
+ *
+ * Like gss_sglist_load(), but only reads @size bytes starting at
+ * @offset, as if the chunks were laid out one after the other.  Uses
+ * pread(), so it may be called from several threads on the same @fd.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+gss_sglist_load_range (GssSGList * sglist, int fd, guint8 * dest,
+    gsize offset, gsize size, GError ** error)
+{
+  int i;
+  ssize_t n;
+  gsize chunk_start = 0;
+
+  for (i = 0; i < sglist->n_chunks && size > 0; i++) {
+    GssSGChunk *chunk = &sglist->chunks[i];
+    gsize skip;
+    gsize len;
+    gsize done;
+
+    if (offset >= chunk_start + chunk->size) {
+      chunk_start += chunk->size;
+      continue;
+    }
+
+    skip = offset - chunk_start;
+    len = MIN ((gsize) chunk->size - skip, size);
+    for (done = 0; done < len; done += (gsize) n) {
+      n = pread (fd, dest + done, len - done,
+          (off_t) (chunk->offset + skip + done));
+      if (n < 0 && errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      if (n < 0) {
+        GST_WARNING ("failed to read %" G_GSIZE_FORMAT " bytes at %"
+            G_GUINT64_FORMAT " error=\"%s\"", len - done,
+            (guint64) (chunk->offset + skip + done), g_strerror (errno));
+        if (error) {
+          *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
+              "failed to read from file");
+        }
+        return FALSE;
+      }
+      if (n == 0) {
+        /* the file is shorter than the sample table says */
+        GST_WARNING ("short read, got %" G_GSIZE_FORMAT " of %"
+            G_GSIZE_FORMAT " bytes at %" G_GUINT64_FORMAT, done, len,
+            (guint64) (chunk->offset + skip));
+        if (error) {
+          *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
+              "unexpected end of file");
+        }
+        return FALSE;
+      }
+    }
+    dest += len;
+    offset += len;
+    size -= len;
+    chunk_start += chunk->size;
+  }
+
+  if (size > 0) {
+    if (error) {
+      *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
+          "read past end of scatter/gather list");
+    }
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 void
 gss_sglist_merge (GssSGList * sglist)
 {
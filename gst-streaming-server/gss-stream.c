@@ -29,6 +29,7 @@
 #endif
 #include "gss-content.h"
 #include "gss-utils.h"
+#include "gss-dash-live.h"
 
 enum
 {
@@ -146,6 +147,9 @@ gss_stream_finalize (GObject * object)
   if (stream->hls.index_buffer) {
     soup_buffer_free (stream->hls.index_buffer);
   }
+  if (stream->dash_live) {
+    gss_dash_live_free (stream->dash_live);
+  }
 #define CLEANUP(x) do { \
   if (x) { \
     if (GST_OBJECT_REFCOUNT (x) != 1) \
@@ -400,6 +404,8 @@ stream_resource (GssTransaction * t)
 {
   GssStream *stream = (GssStream *) t->resource->priv;
   GssConnection *connection;
+  int n_clients;
+  gint64 bitrate;
 
   if (!stream->program->enable_streaming
       || stream->program->state != GSS_PROGRAM_STATE_RUNNING) {
@@ -407,14 +413,14 @@ stream_resource (GssTransaction * t)
     return;
   }
 
-  if (t->server->metrics->n_clients >= t->server->max_connections ||
-      t->server->metrics->bitrate + stream->bitrate >=
-      t->server->max_rate * 8000) {
+  n_clients = gss_metrics_get_n_clients (t->server->metrics);
+  bitrate = gss_metrics_get_bitrate (t->server->metrics);
+  if (n_clients >= t->server->max_connections ||
+      bitrate + stream->bitrate >= (gint64) t->server->max_rate * 8000) {
     GST_DEBUG ("n_clients %d max_connections %d\n",
-        t->server->metrics->n_clients, t->server->max_connections);
+        n_clients, t->server->max_connections);
     GST_DEBUG ("current bitrate %" G_GINT64_FORMAT " bitrate %d max_bitrate %d"
-        "\n", t->server->metrics->bitrate, stream->bitrate,
-        t->server->max_rate * 8000);
+        "\n", bitrate, stream->bitrate, t->server->max_rate * 8000);
     soup_message_set_status (t->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
     return;
   }
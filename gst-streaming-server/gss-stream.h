@@ -100,6 +100,9 @@ struct _GssStream {
     gboolean at_eos; /* true if sliding window is at the end of the stream */
   } hls;
 
+  /* live DASH */
+  GssDashLive *dash_live;
+
   /* FIXME move this into a private structure */
   void *rtsp_stream;
 };
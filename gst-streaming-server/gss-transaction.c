@@ -20,19 +20,174 @@
 
 #include "config.h"
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+
 #include "gss-html.h"
 #include "gss-transaction.h"
 #include "gss-log.h"
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include <json-glib/json-glib.h>
 
-static void gss_transaction_finalize (GssTransaction * t, SoupMessage * msg);
-static void gss_transaction_wrote_headers (SoupMessage * msg,
-    GssTransaction * t);
-static void gss_transaction_finished (SoupMessage * msg, GssTransaction * t);
+/* Freed transactions are kept on a small freelist per thread and
+ * reused for the next requests on that thread. */
+#define GSS_TRANSACTION_FREELIST_SIZE 64
+
+typedef struct _GssTransactionFreelist GssTransactionFreelist;
+struct _GssTransactionFreelist
+{
+  GssTransaction *head;
+  int length;
+};
+
+static void
+gss_transaction_freelist_free (gpointer data)
+{
+  GssTransactionFreelist *freelist = data;
+
+  while (freelist->head) {
+    GssTransaction *t = freelist->head;
+
+    freelist->head = t->free_next;
+    g_free (t);
+  }
+  g_free (freelist);
+}
+
+static GPrivate transaction_freelist =
+G_PRIVATE_INIT (gss_transaction_freelist_free);
+
+static GQuark
+gss_transaction_quark (void)
+{
+  static gsize quark = 0;
+
+  if (g_once_init_enter (&quark)) {
+    g_once_init_leave (&quark,
+        g_quark_from_static_string ("gss-transaction"));
+  }
+
+  return (GQuark) quark;
+}
+
+static GssTransaction *
+gss_transaction_alloc (void)
+{
+  GssTransactionFreelist *freelist;
+  GssTransaction *t;
+
+  freelist = g_private_get (&transaction_freelist);
+  if (freelist == NULL || freelist->head == NULL)
+    return g_new0 (GssTransaction, 1);
+
+  t = freelist->head;
+  freelist->head = t->free_next;
+  freelist->length--;
+  memset (t, 0, sizeof (GssTransaction));
+
+  return t;
+}
 
+static void
+gss_transaction_request_started (SoupServer * soupserver, SoupMessage * msg,
+    SoupClientContext * client, gpointer user_data)
+{
+  GssTransaction *t;
+
+  t = gss_transaction_alloc ();
+  t->soupserver = soupserver;
+  t->msg = msg;
+  t->client = client;
+  t->total_time = -g_get_real_time ();
+  t->priority = GSS_TRANSACTION_PRIORITY_NORMAL;
+
+  /* libsoup only emits request-finished for messages that got as far
+   * as a method, so a connection closed while idle, or stolen, leaves
+   * the transaction to be freed with the message */
+  g_object_set_qdata_full (G_OBJECT (msg), gss_transaction_quark (), t,
+      (GDestroyNotify) gss_transaction_free);
+}
 
+static void
+gss_transaction_request_finished (SoupServer * soupserver, SoupMessage * msg,
+    SoupClientContext * client, gpointer user_data)
+{
+  GssTransaction *t;
+
+  t = g_object_steal_qdata (G_OBJECT (msg), gss_transaction_quark ());
+  if (t == NULL)
+    return;
+
+  if (t->delay_source) {
+    g_source_destroy (t->delay_source);
+    g_source_unref (t->delay_source);
+  }
+
+  t->total_time += g_get_real_time ();
+
+  /* only requests that reached a resource handler are logged */
+  if (t->server) {
+    gss_log_transaction (t);
+    if (t->sync_process_time > 1000) {
+      char *uri;
+      uri = soup_uri_to_string (soup_message_get_uri (t->msg), TRUE);
+      GST_WARNING ("synchronous processing too slow: %" G_GUINT64_FORMAT
+          " us, \"%s\"", t->sync_process_time, uri);
+      g_free (uri);
+    }
+  }
+
+  if (t->latency) {
+    gss_latency_add (t->latency, msg->status_code, t->total_time,
+        t->sync_process_time, t->async_process_time);
+    if (msg->method != SOUP_METHOD_HEAD) {
+      gss_counter_add (&t->latency->bytes, msg->response_body->length);
+    }
+  }
+
+  /* a client that goes away while the transaction is queued or being
+   * processed leaves it to gss_transaction_finish_async() to free */
+  t->done = TRUE;
+  if (t->async_pending)
+    return;
+
+  gss_transaction_free (t);
+}
+
+/**
+ * gss_transaction_connect_server:
+ * @soupserver: a #SoupServer
+ *
+ * Connects the handlers that create a #GssTransaction when @soupserver
+ * starts reading a request, and log and free it when the response is
+ * done.  This is done once per server rather than once per message.
+ * Must be called from the thread running @soupserver, before it starts
+ * listening.
+ */
+void
+gss_transaction_connect_server (SoupServer * soupserver)
+{
+  g_signal_connect (soupserver, "request-started",
+      G_CALLBACK (gss_transaction_request_started), NULL);
+  g_signal_connect (soupserver, "request-finished",
+      G_CALLBACK (gss_transaction_request_finished), NULL);
+  g_signal_connect (soupserver, "request-aborted",
+      G_CALLBACK (gss_transaction_request_finished), NULL);
+}
+
+/* Returns the transaction started for @msg, which lives until the
+ * response is done */
 GssTransaction *
 gss_transaction_new (GssServer * server, SoupServer * soupserver,
     SoupMessage * msg, const char *path, GHashTable * query,
@@ -40,22 +195,20 @@ gss_transaction_new (GssServer * server, SoupServer * soupserver,
 {
   GssTransaction *transaction;
 
-  transaction = g_new0 (GssTransaction, 1);
+  transaction = g_object_get_qdata (G_OBJECT (msg), gss_transaction_quark ());
+  if (transaction == NULL) {
+    GST_WARNING ("server not connected with "
+        "gss_transaction_connect_server()");
+    gss_transaction_connect_server (soupserver);
+    gss_transaction_request_started (soupserver, msg, client, NULL);
+    transaction = g_object_get_qdata (G_OBJECT (msg),
+        gss_transaction_quark ());
+  }
+
   transaction->server = server;
-  transaction->soupserver = soupserver;
-  transaction->msg = msg;
   transaction->path = path;
   transaction->query = query;
-  transaction->client = client;
   transaction->sync_process_time = -g_get_real_time ();
-  transaction->total_time = -g_get_real_time ();
-
-  g_signal_connect (msg, "wrote-headers",
-      G_CALLBACK (gss_transaction_wrote_headers), transaction);
-  g_signal_connect (msg, "finished", G_CALLBACK (gss_transaction_finished),
-      transaction);
-  g_object_weak_ref (G_OBJECT (msg), (GWeakNotify) (gss_transaction_finalize),
-      transaction);
 
   return transaction;
 }
@@ -63,39 +216,22 @@ gss_transaction_new (GssServer * server, SoupServer * soupserver,
 void
 gss_transaction_free (GssTransaction * transaction)
 {
-  g_free (transaction);
-}
+  GssTransactionFreelist *freelist;
 
-static void
-gss_transaction_wrote_headers (SoupMessage * msg, GssTransaction * t)
-{
-  if (t->sync_process_time < 0) {
-    t->sync_process_time += g_get_real_time ();
+  freelist = g_private_get (&transaction_freelist);
+  if (freelist == NULL) {
+    freelist = g_new0 (GssTransactionFreelist, 1);
+    g_private_set (&transaction_freelist, freelist);
   }
-}
-
-static void
-gss_transaction_finished (SoupMessage * msg, GssTransaction * t)
-{
-  t->total_time += g_get_real_time ();
 
-  gss_log_transaction (t);
-  if (t->sync_process_time > 1000) {
-    char *uri;
-    uri = soup_uri_to_string (soup_message_get_uri (t->msg), TRUE);
-    GST_WARNING ("synchronous processing too slow: %" G_GUINT64_FORMAT
-        " us, \"%s\"", t->sync_process_time, uri);
-    g_free (uri);
+  if (freelist->length >= GSS_TRANSACTION_FREELIST_SIZE) {
+    g_free (transaction);
+    return;
   }
-  g_object_weak_unref (G_OBJECT (t->msg),
-      (GWeakNotify) (gss_transaction_finalize), t);
-  gss_transaction_free (t);
-}
 
-static void
-gss_transaction_finalize (GssTransaction * t, SoupMessage * msg)
-{
-  GST_ERROR ("message being finalized that was never completed");
+  transaction->free_next = freelist->head;
+  freelist->head = transaction;
+  freelist->length++;
 }
 
 void
@@ -162,72 +298,694 @@ unpause (gpointer priv)
 {
   GssTransaction *t = (GssTransaction *) priv;
 
+  g_source_unref (t->delay_source);
+  t->delay_source = NULL;
   soup_server_unpause_message (t->soupserver, t->msg);
-  g_free (t);
 
   return FALSE;
 }
 
+/**
+ * gss_transaction_unpause:
+ * @t: a #GssTransaction
+ *
+ * Unpauses the message of @t, unless the client has gone away, as it
+ * may have while @t was being processed asynchronously.
+ */
 void
-gss_transaction_delay (GssTransaction * t, int msec)
+gss_transaction_unpause (GssTransaction * t)
 {
-  GssTransaction *new_t;
+  if (t->done)
+    return;
 
-  /* FIXME this is pure evil */
+  soup_server_unpause_message (t->soupserver, t->msg);
+}
 
-  new_t = g_malloc0 (sizeof (GssTransaction));
-  memcpy (new_t, t, sizeof (GssTransaction));
+/* The transaction stays valid until the response is done, which
+ * removes the timeout if the client goes away first. */
+void
+gss_transaction_delay (GssTransaction * t, int msec)
+{
+  g_return_if_fail (t->delay_source == NULL);
 
   soup_server_pause_message (t->soupserver, t->msg);
-  g_timeout_add (msec, unpause, new_t);
+  t->delay_source = g_timeout_source_new (msec);
+  g_source_set_callback (t->delay_source, unpause, t, NULL);
+  g_source_attach (t->delay_source, g_main_context_get_thread_default ());
 }
 
-#define ASYNC_THREADS 1
-static GAsyncQueue *async_queue;
-static GThread *async_threads[ASYNC_THREADS];
+/* Async transactions run on a pool of worker threads.  Each worker has
+ * its own queue, filled round-robin from the main loop, and idle
+ * workers steal from the tail of the other queues, so one slow
+ * transaction does not hold up the ones queued behind it.
+ *
+ * Each queue is split by priority.  Workers take from the priorities
+ * in weighted round-robin order, so low priority work still makes
+ * progress.  A transaction waiting past its deadline, counted from
+ * when the request arrived, is moved to the low priority queue so it
+ * does not delay work that can still be on time. */
+typedef struct _GssWorker GssWorker;
+struct _GssWorker
+{
+  int index;
+  GThread *thread;
+  gboolean exit;
+  gboolean pinned;
+  /* round-robin credit left for each priority */
+  int credit[GSS_TRANSACTION_N_PRIORITIES];
+
+  GMutex lock;
+  GQueue queues[GSS_TRANSACTION_N_PRIORITIES];
+};
+
+static const int priority_weights[GSS_TRANSACTION_N_PRIORITIES] = { 8, 4, 1 };
+
+/* in microseconds after the request arrived */
+static const gint64 priority_deadlines[GSS_TRANSACTION_N_PRIORITIES] = {
+  1 * G_USEC_PER_SEC, 4 * G_USEC_PER_SEC, 60 * G_USEC_PER_SEC
+};
+
+static GssTransactionQueueStats queue_stats[GSS_TRANSACTION_N_PRIORITIES];
+static GMutex stats_lock;
+
+/* Admission control.  A transaction is refused when its priority
+ * already has max_queued transactions waiting, or when transactions of
+ * its priority have recently waited longer than max_wait on average.
+ * Refusing quickly is better than queueing work that will finish too
+ * late to be of use.  0 means no limit. */
+static int max_queued[GSS_TRANSACTION_N_PRIORITIES];
+static gint64 max_wait[GSS_TRANSACTION_N_PRIORITIES];
+/* transactions waiting in the queues at each priority */
+static int n_queued_priority[GSS_TRANSACTION_N_PRIORITIES];
+/* moving average of the queue wait, in microseconds, under stats_lock */
+static gint64 wait_estimate[GSS_TRANSACTION_N_PRIORITIES];
+/* monotonic time a transaction was last taken at each priority, or the
+ * queue stopped being empty, under stats_lock */
+static gint64 last_progress[GSS_TRANSACTION_N_PRIORITIES];
+
+/* Blocking reads that must not wait behind the worker queues, see
+ * gss_transaction_process_io() */
+#define GSS_TRANSACTION_IO_THREADS 2
+#define GSS_TRANSACTION_MAX_IO_QUEUED 64
+static GThreadPool *io_pool;
+
+static void gss_transaction_io_task (gpointer data, gpointer user_data);
+
+static GssWorker workers[GSS_TRANSACTION_MAX_WORKERS];
+/* workers receiving transactions */
+static int n_workers;
+/* workers that have ever been started, and may have queued work */
+static int n_workers_started;
+static gboolean pin_workers;
+static GssCounter worker_busy_time;
+static guint next_worker;
+/* transactions in queues, not yet taken by a worker */
+static int n_queued;
+static GMutex idle_lock;
+static GCond idle_cond;
+
+/* Finished transactions are pushed onto a lock-free stack by the
+ * workers and handed to the main loop in batches.  The worker that
+ * pushes onto an empty stack wakes the main loop through an eventfd (a
+ * pipe where eventfd is missing), so a busy server costs one wakeup
+ * per batch rather than one idle source per transaction.
+ *
+ * Each frontend thread has its own completion source, so transactions
+ * finish in the loop that received the request. */
+typedef struct _GssCompletion GssCompletion;
+struct _GssCompletion
+{
+  GssCompletion *next;
+  GSourceFunc func;
+  gpointer data;
+};
+
+typedef struct _GssCompletionSource GssCompletionSource;
+struct _GssCompletionSource
+{
+  GSource source;
+  GPollFD poll_fd;
+  int write_fd;
+  GssCompletion *completed;
+};
 
+static GSource *completion_source;
+/* the completion source of a frontend thread */
+static GPrivate thread_completion_source;
+
+static void
+gss_completion_source_push (GssCompletionSource * cs, GSourceFunc func,
+    gpointer data)
+{
+  GssCompletion *completion;
+  GssCompletion *head;
+
+  completion = g_slice_new (GssCompletion);
+  completion->func = func;
+  completion->data = data;
+  do {
+    head = g_atomic_pointer_get (&cs->completed);
+    completion->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&cs->completed, head,
+          completion));
+
+  if (head == NULL) {
+#ifdef HAVE_SYS_EVENTFD_H
+    guint64 one = 1;
+    if (write (cs->write_fd, &one, sizeof (one)) < 0) {
+#else
+    char one = 1;
+    if (write (cs->write_fd, &one, 1) < 0) {
+#endif
+      GST_WARNING ("failed to wake main loop: %s", g_strerror (errno));
+    }
+  }
+}
+
+/* Runs after any calls queued by gss_transaction_invoke(), so it is
+ * the last user of the transaction. */
 static gboolean
-gss_transaction_async_finish (gpointer priv)
+gss_transaction_finish_async (gpointer data)
 {
-  GssTransaction *t = priv;
+  GssTransaction *t = data;
+  GSource *source = t->completion_source;
+  SoupMessage *msg = t->msg;
 
+  t->completion_source = NULL;
+  t->async_pending = FALSE;
   if (t->finish)
     t->finish (t, t->priv);
+  g_source_unref (source);
+
+  /* the response finished while the transaction was in flight */
+  if (t->done)
+    gss_transaction_free (t);
+  g_object_unref (msg);
 
   return FALSE;
 }
 
+static gboolean
+gss_completion_source_prepare (GSource * source, gint * timeout)
+{
+  GssCompletionSource *cs = (GssCompletionSource *) source;
+
+  *timeout = -1;
+  return g_atomic_pointer_get (&cs->completed) != NULL;
+}
+
+static gboolean
+gss_completion_source_check (GSource * source)
+{
+  GssCompletionSource *cs = (GssCompletionSource *) source;
+
+  return (cs->poll_fd.revents & G_IO_IN) ||
+      g_atomic_pointer_get (&cs->completed) != NULL;
+}
+
+static gboolean
+gss_completion_source_dispatch (GSource * source, GSourceFunc callback,
+    gpointer user_data)
+{
+  GssCompletionSource *cs = (GssCompletionSource *) source;
+  GssCompletion *list;
+  GssCompletion *c;
+  GssCompletion *next;
+  char buffer[64];
+
+  /* clear the wakeup before taking the stack, so a push after this
+   * signals again */
+  if (cs->poll_fd.revents & G_IO_IN) {
+    if (read (cs->poll_fd.fd, buffer, sizeof (buffer)) < 0 &&
+        errno != EAGAIN) {
+      GST_WARNING ("failed to read wakeup: %s", g_strerror (errno));
+    }
+  }
+
+  do {
+    list = g_atomic_pointer_get (&cs->completed);
+  } while (!g_atomic_pointer_compare_and_exchange (&cs->completed, list,
+          NULL));
+
+  /* the stack is newest first */
+  c = NULL;
+  while (list) {
+    next = list->next;
+    list->next = c;
+    c = list;
+    list = next;
+  }
+
+  while (c) {
+    next = c->next;
+    c->func (c->data);
+    g_slice_free (GssCompletion, c);
+    c = next;
+  }
+
+  return TRUE;
+}
+
+static void
+gss_completion_source_finalize (GSource * source)
+{
+  GssCompletionSource *cs = (GssCompletionSource *) source;
+
+  close (cs->poll_fd.fd);
+  if (cs->write_fd != cs->poll_fd.fd) {
+    close (cs->write_fd);
+  }
+}
+
+static GSourceFuncs gss_completion_source_funcs = {
+  gss_completion_source_prepare,
+  gss_completion_source_check,
+  gss_completion_source_dispatch,
+  gss_completion_source_finalize
+};
+
+static GSource *
+gss_completion_source_new (GMainContext * context)
+{
+  GSource *source;
+  GssCompletionSource *cs;
+  int fds[2];
+
+#ifdef HAVE_SYS_EVENTFD_H
+  fds[0] = fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] < 0) {
+    g_error ("failed to create eventfd: %s", g_strerror (errno));
+  }
+#else
+  if (pipe (fds) < 0) {
+    g_error ("failed to create pipe: %s", g_strerror (errno));
+  }
+  fcntl (fds[0], F_SETFL, O_NONBLOCK);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+  source = g_source_new (&gss_completion_source_funcs,
+      sizeof (GssCompletionSource));
+  cs = (GssCompletionSource *) source;
+  cs->poll_fd.fd = fds[0];
+  cs->poll_fd.events = G_IO_IN;
+  cs->write_fd = fds[1];
+  g_source_add_poll (source, &cs->poll_fd);
+  g_source_attach (source, context);
+
+  return source;
+}
+
+/* The completion source of the loop running in this thread */
+static GSource *
+gss_completion_source_get (void)
+{
+  GSource *source;
+
+  source = g_private_get (&thread_completion_source);
+  if (source == NULL)
+    source = completion_source;
+
+  return source;
+}
+
+/**
+ * gss_transaction_attach_thread:
+ * @context: the #GMainContext run by the calling thread
+ *
+ * Makes async transactions queued from the calling thread finish in
+ * @context rather than the main loop.  For frontend threads that run
+ * their own #SoupServer.
+ */
+void
+gss_transaction_attach_thread (GMainContext * context)
+{
+  g_return_if_fail (context != NULL);
+  g_return_if_fail (g_private_get (&thread_completion_source) == NULL);
+
+  g_private_set (&thread_completion_source,
+      gss_completion_source_new (context));
+}
+
+/**
+ * gss_transaction_detach_thread:
+ *
+ * Undoes gss_transaction_attach_thread().  Transactions still being
+ * processed keep the completion source alive, but are not finished,
+ * so the loop should only be stopped when its server is shut down.
+ */
+void
+gss_transaction_detach_thread (void)
+{
+  GSource *source;
+
+  source = g_private_get (&thread_completion_source);
+  if (source == NULL)
+    return;
+
+  g_private_set (&thread_completion_source, NULL);
+  g_source_destroy (source);
+  g_source_unref (source);
+}
+
+/**
+ * gss_transaction_invoke:
+ * @t: a #GssTransaction being processed asynchronously
+ * @func: function to call
+ * @data: data to pass to @func
+ *
+ * Calls @func from the loop that queued @t, for handing partial
+ * results to the client from the process function.  Calls are made in
+ * order, and before the finish function of @t.  The return value of
+ * @func is ignored.
+ */
+void
+gss_transaction_invoke (GssTransaction * t, GSourceFunc func, gpointer data)
+{
+  g_return_if_fail (t->completion_source != NULL);
+
+  gss_completion_source_push ((GssCompletionSource *) t->completion_source,
+      func, data);
+}
+
+static void
+gss_worker_update_affinity (GssWorker * worker)
+{
+  gboolean pin = g_atomic_int_get (&pin_workers);
+
+  if (worker->pinned == pin)
+    return;
+  worker->pinned = pin;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+  {
+    cpu_set_t set;
+    int n_cpus;
+    int i;
+
+    n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    CPU_ZERO (&set);
+    if (pin) {
+      CPU_SET (worker->index % n_cpus, &set);
+    } else {
+      for (i = 0; i < n_cpus && i < CPU_SETSIZE; i++) {
+        CPU_SET (i, &set);
+      }
+    }
+    /* pid 0 is the calling thread */
+    if (sched_setaffinity (0, sizeof (set), &set) < 0) {
+      GST_WARNING ("failed to set affinity of worker %d: %s", worker->index,
+          g_strerror (errno));
+    }
+  }
+#endif
+}
+
+/* Takes the next transaction from the queues of @victim, using the
+ * round-robin credit of @worker.  Called with @victim locked. */
+static GssTransaction *
+gss_worker_take (GssWorker * worker, GssWorker * victim, gboolean steal)
+{
+  GssTransaction *t;
+  gint64 now;
+  int i;
+
+  now = g_get_monotonic_time ();
+  while (TRUE) {
+    int priority = -1;
+
+    for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+      if (!g_queue_is_empty (&victim->queues[i]) && worker->credit[i] > 0) {
+        priority = i;
+        break;
+      }
+    }
+    if (priority < 0) {
+      gboolean empty = TRUE;
+
+      for (i = 0; i < GSS_TRANSACTION_N_PRIORITIES; i++) {
+        worker->credit[i] = priority_weights[i];
+        if (!g_queue_is_empty (&victim->queues[i]))
+          empty = FALSE;
+      }
+      if (empty)
+        return NULL;
+      continue;
+    }
+
+    if (steal) {
+      t = g_queue_pop_tail (&victim->queues[priority]);
+    } else {
+      t = g_queue_pop_head (&victim->queues[priority]);
+    }
+
+    if (priority != GSS_TRANSACTION_PRIORITY_LOW && now > t->deadline) {
+      g_mutex_lock (&stats_lock);
+      queue_stats[priority].n_late++;
+      g_atomic_int_add (&n_queued_priority[priority], -1);
+      if (g_atomic_int_add (&n_queued_priority[GSS_TRANSACTION_PRIORITY_LOW],
+              1) == 0) {
+        last_progress[GSS_TRANSACTION_PRIORITY_LOW] = now;
+      }
+      g_mutex_unlock (&stats_lock);
+      t->priority = GSS_TRANSACTION_PRIORITY_LOW;
+      g_queue_push_tail (&victim->queues[GSS_TRANSACTION_PRIORITY_LOW], t);
+      continue;
+    }
+
+    worker->credit[priority]--;
+    g_atomic_int_add (&n_queued_priority[priority], -1);
+    return t;
+  }
+}
+
+static GssTransaction *
+gss_worker_pop (GssWorker * worker)
+{
+  GssTransaction *t;
+  int n;
+  int i;
+
+  g_mutex_lock (&worker->lock);
+  t = gss_worker_take (worker, worker, FALSE);
+  g_mutex_unlock (&worker->lock);
+  if (t)
+    return t;
+
+  n = g_atomic_int_get (&n_workers_started);
+  for (i = 1; i < n && t == NULL; i++) {
+    GssWorker *victim = &workers[(worker->index + i) % n];
+
+    g_mutex_lock (&victim->lock);
+    t = gss_worker_take (worker, victim, TRUE);
+    g_mutex_unlock (&victim->lock);
+  }
+
+  return t;
+}
+
+static void
+gss_worker_update_stats (GssTransaction * t)
+{
+  GssTransactionQueueStats *stats = &queue_stats[t->queue_priority];
+  gint64 now;
+  gint64 wait;
+
+  now = g_get_monotonic_time ();
+  wait = now - t->queue_time;
+
+  g_mutex_lock (&stats_lock);
+  stats->n_transactions++;
+  stats->total_wait += wait;
+  stats->max_wait = MAX (stats->max_wait, wait);
+  wait_estimate[t->queue_priority] +=
+      (wait - wait_estimate[t->queue_priority]) / 8;
+  /* taken from the queue of its current priority */
+  last_progress[t->priority] = now;
+  g_mutex_unlock (&stats_lock);
+}
+
+/* The moving average is only updated as transactions are taken, so it
+ * would stay low while all workers are busy and the queue backs up.
+ * While transactions are waiting, the oldest one has waited at least
+ * since the last one was taken or the queue stopped being empty.
+ * Called with stats_lock held. */
+static gint64
+gss_transaction_get_wait_estimate (GssTransactionPriority priority)
+{
+  gint64 wait = wait_estimate[priority];
+
+  if (g_atomic_int_get (&n_queued_priority[priority]) > 0) {
+    wait = MAX (wait, g_get_monotonic_time () - last_progress[priority]);
+  }
+
+  return wait;
+}
+
+/**
+ * gss_transaction_get_queue_stats:
+ * @priority: a #GssTransactionPriority
+ * @stats: (out): location for the statistics of @priority
+ *
+ * Gets the number of async transactions queued at @priority that have
+ * started processing, how long they waited in the queue, and how many
+ * missed their deadline and were moved to low priority.  Also how many
+ * are waiting now.
+ */
+void
+gss_transaction_get_queue_stats (GssTransactionPriority priority,
+    GssTransactionQueueStats * stats)
+{
+  g_return_if_fail (priority < GSS_TRANSACTION_N_PRIORITIES);
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (&stats_lock);
+  *stats = queue_stats[priority];
+  g_mutex_unlock (&stats_lock);
+  stats->n_queued = g_atomic_int_get (&n_queued_priority[priority]);
+}
+
+/**
+ * gss_transaction_get_worker_stats:
+ * @n_threads: (out): location for the number of worker threads
+ * @busy_time: (out): location for the time, in microseconds, that
+ *   worker threads have spent running process functions
+ *
+ * Gets what is needed to compute the utilization of the worker
+ * threads, without locking.
+ */
+void
+gss_transaction_get_worker_stats (int *n_threads, gint64 * busy_time)
+{
+  *n_threads = g_atomic_int_get (&n_workers);
+  *busy_time = gss_counter_get (&worker_busy_time);
+}
+
 static gpointer
-gss_transaction_async_thread (gpointer unused)
+gss_transaction_async_thread (gpointer priv)
 {
+  GssWorker *worker = priv;
   GssTransaction *t;
+  gint64 start;
+  gint64 elapsed;
 
   while (TRUE) {
-    t = g_async_queue_pop (async_queue);
-    if (t->server == NULL) {
-      g_free (t);
-      g_thread_exit (NULL);
+    gss_worker_update_affinity (worker);
+
+    t = gss_worker_pop (worker);
+    if (t == NULL) {
+      gboolean exit;
+
+      g_mutex_lock (&idle_lock);
+      while (g_atomic_int_get (&n_queued) <= 0 && !worker->exit) {
+        g_cond_wait (&idle_cond, &idle_lock);
+      }
+      exit = worker->exit;
+      g_mutex_unlock (&idle_lock);
+      if (exit)
+        break;
+      continue;
     }
+    g_atomic_int_add (&n_queued, -1);
+    gss_worker_update_stats (t);
 
-    t->async_process_time -= g_get_real_time ();
+    start = g_get_real_time ();
     if (t->process)
       t->process (t, t->priv);
-    t->async_process_time += g_get_real_time ();
-    g_idle_add (gss_transaction_async_finish, t);
+    elapsed = g_get_real_time () - start;
+    t->async_process_time += elapsed;
+    gss_counter_add (&worker_busy_time, elapsed);
+    gss_completion_source_push ((GssCompletionSource *) t->completion_source,
+        gss_transaction_finish_async, t);
   }
+
   return NULL;
 }
 
+/**
+ * gss_transaction_set_worker_threads:
+ * @n_threads: number of worker threads, or 0 for one per online CPU
+ * @pin_threads: whether to pin each worker thread to one CPU
+ *
+ * Sets the number of threads that run the process functions of
+ * gss_transaction_process_async().  Surplus workers finish their
+ * queued transactions before exiting.  Must be called from the main
+ * loop.
+ */
 void
-_priv_gss_transaction_initialize (void)
+gss_transaction_set_worker_threads (int n_threads, gboolean pin_threads)
 {
   int i;
 
-  async_queue = g_async_queue_new ();
+  g_return_if_fail (n_threads >= 0);
+
+  if (n_threads == 0) {
+#if GLIB_CHECK_VERSION (2, 36, 0)
+    n_threads = g_get_num_processors ();
+#else
+    n_threads = 1;
+#endif
+  }
+  n_threads = CLAMP (n_threads, 1, GSS_TRANSACTION_MAX_WORKERS);
+
+  if (completion_source == NULL) {
+    completion_source = gss_completion_source_new (NULL);
+  }
+  if (io_pool == NULL) {
+    io_pool = g_thread_pool_new (gss_transaction_io_task, NULL,
+        GSS_TRANSACTION_IO_THREADS, FALSE, NULL);
+  }
+
+  g_atomic_int_set (&pin_workers, pin_threads);
+
+  if (n_threads < n_workers) {
+    int old_n_workers = n_workers;
 
-  for (i = 0; i < ASYNC_THREADS; i++) {
-    async_threads[i] =
-        g_thread_new ("gss_worker", gss_transaction_async_thread, NULL);
+    /* stop queueing to the surplus workers first */
+    n_workers = n_threads;
+    g_mutex_lock (&idle_lock);
+    for (i = n_threads; i < old_n_workers; i++) {
+      workers[i].exit = TRUE;
+    }
+    g_cond_broadcast (&idle_cond);
+    g_mutex_unlock (&idle_lock);
+
+    for (i = n_threads; i < old_n_workers; i++) {
+      g_thread_join (workers[i].thread);
+      workers[i].thread = NULL;
+      workers[i].exit = FALSE;
+    }
+  }
+
+  for (i = n_workers; i < n_threads; i++) {
+    GssWorker *worker = &workers[i];
+
+    if (i >= n_workers_started) {
+      int j;
+
+      worker->index = i;
+      g_mutex_init (&worker->lock);
+      for (j = 0; j < GSS_TRANSACTION_N_PRIORITIES; j++) {
+        g_queue_init (&worker->queues[j]);
+      }
+      g_atomic_int_set (&n_workers_started, i + 1);
+    }
+    worker->thread = g_thread_new ("gss_worker",
+        gss_transaction_async_thread, worker);
+  }
+  n_workers = n_threads;
+
+  /* wake the workers to update their affinity */
+  g_mutex_lock (&idle_lock);
+  g_cond_broadcast (&idle_cond);
+  g_mutex_unlock (&idle_lock);
+}
+
+void
+_priv_gss_transaction_initialize (void)
+{
+  if (n_workers == 0) {
+    gss_transaction_set_worker_threads (1, FALSE);
   }
 }
 
@@ -236,34 +994,249 @@ _priv_gss_transaction_cleanup (void)
 {
   int i;
 
-  for (i = 0; i < ASYNC_THREADS; i++) {
-    GssTransaction *t = g_malloc0 (sizeof (GssTransaction));
-    /* Send a fake transaction to cause each thread to exit */
-    g_async_queue_push (async_queue, t);
+  g_mutex_lock (&idle_lock);
+  for (i = 0; i < n_workers; i++) {
+    workers[i].exit = TRUE;
   }
-  for (i = 0; i < ASYNC_THREADS; i++) {
-    g_thread_join (async_threads[i]);
+  g_cond_broadcast (&idle_cond);
+  g_mutex_unlock (&idle_lock);
+
+  for (i = 0; i < n_workers; i++) {
+    g_thread_join (workers[i].thread);
+    workers[i].thread = NULL;
+    workers[i].exit = FALSE;
+  }
+  n_workers = 0;
+
+  if (io_pool) {
+    g_thread_pool_free (io_pool, FALSE, TRUE);
+    io_pool = NULL;
+  }
+
+  if (completion_source) {
+    g_source_destroy (completion_source);
+    g_source_unref (completion_source);
+    completion_source = NULL;
   }
-  g_async_queue_unref (async_queue);
-  async_queue = NULL;
 }
 
+/**
+ * gss_transaction_set_priority:
+ * @t: a #GssTransaction
+ * @priority: a #GssTransactionPriority
+ *
+ * Sets the priority at which gss_transaction_process_async() queues
+ * @t.  The default is %GSS_TRANSACTION_PRIORITY_NORMAL.
+ */
 void
-gss_transaction_process_async (GssTransaction * t,
-    GssTransactionFunc process, GssTransactionFunc finish, gpointer priv)
+gss_transaction_set_priority (GssTransaction * t,
+    GssTransactionPriority priority)
 {
-  if (async_queue == NULL) {
-    _priv_gss_transaction_initialize ();
-  }
+  g_return_if_fail (t != NULL);
+  g_return_if_fail (priority < GSS_TRANSACTION_N_PRIORITIES);
+
+  t->priority = priority;
+}
+
+static void
+gss_transaction_io_task (gpointer data, gpointer user_data)
+{
+  GssTransaction *t = data;
+  gint64 start;
+
+  start = g_get_real_time ();
+  if (t->process)
+    t->process (t, t->priv);
+  t->async_process_time += g_get_real_time () - start;
+  gss_completion_source_push ((GssCompletionSource *) t->completion_source,
+      gss_transaction_finish_async, t);
+}
 
+static void
+gss_transaction_prepare_async (GssTransaction * t,
+    GssTransactionFunc process, GssTransactionFunc finish, gpointer priv)
+{
   t->sync_process_time += g_get_real_time ();
 
   t->process = process;
   t->finish = finish;
   t->priv = priv;
-  g_async_queue_push (async_queue, t);
+  /* the message and the transaction are kept until the finish function
+   * has run, even if the client goes away meanwhile */
+  t->async_pending = TRUE;
+  g_object_ref (t->msg);
+  t->completion_source = g_source_ref (gss_completion_source_get ());
+  t->queue_priority = t->priority;
+  t->queue_time = g_get_monotonic_time ();
+  /* total_time holds minus the arrival time until the request is done */
+  t->deadline = t->queue_time + (-t->total_time - g_get_real_time ()) +
+      priority_deadlines[t->priority];
+}
+
+void
+gss_transaction_process_async (GssTransaction * t,
+    GssTransactionFunc process, GssTransactionFunc finish, gpointer priv)
+{
+  GssWorker *worker;
+
+  if (n_workers == 0) {
+    _priv_gss_transaction_initialize ();
+  }
+
+  gss_transaction_prepare_async (t, process, finish, priv);
+
+  worker = &workers[next_worker++ % n_workers];
+  if (g_atomic_int_add (&n_queued_priority[t->priority], 1) == 0) {
+    g_mutex_lock (&stats_lock);
+    last_progress[t->priority] = t->queue_time;
+    g_mutex_unlock (&stats_lock);
+  }
+  g_mutex_lock (&worker->lock);
+  g_queue_push_tail (&worker->queues[t->priority], t);
+  g_mutex_unlock (&worker->lock);
+
+  g_atomic_int_inc (&n_queued);
+  g_mutex_lock (&idle_lock);
+  g_cond_signal (&idle_cond);
+  g_mutex_unlock (&idle_lock);
 }
 
+/**
+ * gss_transaction_process_io:
+ * @t: a #GssTransaction
+ * @process: function doing blocking I/O, called from another thread
+ * @finish: function called from the loop that queued @t when done
+ * @priv: data passed to @process and @finish
+ *
+ * Like gss_transaction_process_async(), but runs @process on a few
+ * threads set aside for blocking reads that need little CPU, such as
+ * serving stored fragments, so that it neither waits behind the worker
+ * queues nor blocks the loop.  It is not subject to admission limits.
+ *
+ * Returns: FALSE, without queueing @t, if too many transactions are
+ *   already waiting for these threads
+ */
+gboolean
+gss_transaction_process_io (GssTransaction * t,
+    GssTransactionFunc process, GssTransactionFunc finish, gpointer priv)
+{
+  if (n_workers == 0) {
+    _priv_gss_transaction_initialize ();
+  }
+
+  if (g_thread_pool_unprocessed (io_pool) >= GSS_TRANSACTION_MAX_IO_QUEUED)
+    return FALSE;
+
+  gss_transaction_prepare_async (t, process, finish, priv);
+  g_thread_pool_push (io_pool, t, NULL);
+
+  return TRUE;
+}
+
+/**
+ * gss_transaction_set_admission_limits:
+ * @priority: a #GssTransactionPriority
+ * @max_queued_transactions: maximum number of transactions waiting at
+ *   @priority, or 0
+ * @max_wait_ms: maximum average wait in the queue at @priority, in
+ *   milliseconds, or 0
+ *
+ * Sets the limits above which gss_transaction_admit() refuses
+ * transactions of @priority.
+ */
+void
+gss_transaction_set_admission_limits (GssTransactionPriority priority,
+    int max_queued_transactions, int max_wait_ms)
+{
+  g_return_if_fail (priority < GSS_TRANSACTION_N_PRIORITIES);
+  g_return_if_fail (max_queued_transactions >= 0);
+  g_return_if_fail (max_wait_ms >= 0);
+
+  g_atomic_int_set (&max_queued[priority], max_queued_transactions);
+  g_mutex_lock (&stats_lock);
+  max_wait[priority] = (gint64) max_wait_ms * 1000;
+  g_mutex_unlock (&stats_lock);
+}
+
+/**
+ * gss_transaction_admit:
+ * @t: a #GssTransaction
+ *
+ * Checks the admission limits for the priority of @t before it is
+ * passed to gss_transaction_process_async().  Callers that get FALSE
+ * should answer from what they have at hand, or call
+ * gss_transaction_shed().
+ *
+ * Returns: TRUE if @t may be queued
+ */
+gboolean
+gss_transaction_admit (GssTransaction * t)
+{
+  GssTransactionPriority priority = t->priority;
+  int queued;
+  int limit;
+  gboolean ret = TRUE;
+
+  queued = g_atomic_int_get (&n_queued_priority[priority]);
+  limit = g_atomic_int_get (&max_queued[priority]);
+  if (limit > 0 && queued >= limit)
+    return FALSE;
+
+  /* the estimate is only updated as transactions are taken, so it is
+   * stale once the queue has drained */
+  if (queued > 0) {
+    g_mutex_lock (&stats_lock);
+    if (max_wait[priority] > 0 &&
+        gss_transaction_get_wait_estimate (priority) > max_wait[priority])
+      ret = FALSE;
+    g_mutex_unlock (&stats_lock);
+  }
+
+  return ret;
+}
+
+/**
+ * gss_transaction_shed:
+ * @t: a #GssTransaction refused by gss_transaction_admit()
+ *
+ * Responds to @t with 503 Service Unavailable, and a Retry-After header
+ * estimated from the current queue wait.
+ */
+void
+gss_transaction_shed (GssTransaction * t)
+{
+  gint64 wait;
+  char *s;
+
+  g_mutex_lock (&stats_lock);
+  queue_stats[t->priority].n_shed++;
+  wait = gss_transaction_get_wait_estimate (t->priority);
+  g_mutex_unlock (&stats_lock);
+
+  t->debug_message = "overloaded";
+  s = g_strdup_printf ("%d", (int) MAX (1,
+          (wait + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC));
+  soup_message_headers_replace (t->msg->response_headers, "Retry-After", s);
+  g_free (s);
+  soup_message_set_response (t->msg, GSS_TEXT_PLAIN, SOUP_MEMORY_STATIC,
+      "503 Service Unavailable\n", strlen ("503 Service Unavailable\n"));
+  soup_message_set_status (t->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+}
+
+/**
+ * gss_transaction_count_degraded:
+ * @t: a #GssTransaction refused by gss_transaction_admit()
+ *
+ * Counts @t as answered without queueing, for example from a cache,
+ * while the limits for its priority were exceeded.
+ */
+void
+gss_transaction_count_degraded (GssTransaction * t)
+{
+  g_mutex_lock (&stats_lock);
+  queue_stats[t->priority].n_degraded++;
+  g_mutex_unlock (&stats_lock);
+}
 
 /* some stuff copied from json-glib because it needs a one-line
  * modification to include all properties, not just non-default ones */
@@ -25,10 +25,39 @@
 #include <libsoup/soup.h>
 #include "gss-config.h"
 #include "gss-types.h"
+#include "gss-histogram.h"
 
 G_BEGIN_DECLS
 
+#define GSS_TRANSACTION_MAX_WORKERS 64
+
 typedef void (*GssTransactionCallback)(GssTransaction *transaction);
+
+/* Async work classes, highest first.  HIGH is for work a client is
+ * waiting on at the live edge, LOW for bulk downloads and background
+ * work. */
+typedef enum {
+  GSS_TRANSACTION_PRIORITY_HIGH,
+  GSS_TRANSACTION_PRIORITY_NORMAL,
+  GSS_TRANSACTION_PRIORITY_LOW,
+  GSS_TRANSACTION_N_PRIORITIES
+} GssTransactionPriority;
+
+typedef struct _GssTransactionQueueStats GssTransactionQueueStats;
+struct _GssTransactionQueueStats {
+  guint64 n_transactions;
+  /* moved to low priority after missing their deadline */
+  guint64 n_late;
+  /* in microseconds */
+  gint64 total_wait;
+  gint64 max_wait;
+  /* refused with 503 by admission control */
+  guint64 n_shed;
+  /* served from cache instead while over the limits */
+  guint64 n_degraded;
+  /* waiting in the queue now */
+  int n_queued;
+};
 typedef void (*GssTransactionFunc)(GssTransaction *transaction,
     gpointer priv);
 
@@ -53,19 +82,56 @@ struct _GssTransaction {
   GssTransactionFunc process;
   GssTransactionFunc finish;
   gpointer priv;
+
+  GssTransactionPriority priority;
+  /* priority and monotonic time when queued, and deadline */
+  GssTransactionPriority queue_priority;
+  gint64 queue_time;
+  gint64 deadline;
+  /* completion source of the loop that queued it */
+  GSource *completion_source;
+  /* between gss_transaction_process_async() and the finish function */
+  gboolean async_pending;
+  /* the response is done or the client went away */
+  gboolean done;
+  /* pending gss_transaction_delay() */
+  GSource *delay_source;
+  /* where to record the latency of the request when finished */
+  GssLatency *latency;
+  /* in the freelist of its thread */
+  GssTransaction *free_next;
 };
 
 GssTransaction * gss_transaction_new (GssServer *server,
     SoupServer * soupserver, SoupMessage * msg, const char *path,
     GHashTable * query, SoupClientContext * client);
 void gss_transaction_free (GssTransaction *transaction);
+void gss_transaction_connect_server (SoupServer *soupserver);
 void gss_transaction_error_not_found (GssTransaction *t, const char *reason);
 void gss_transaction_redirect (GssTransaction * t, const char *target);
 void gss_transaction_error (GssTransaction * t, const char *message);
 void gss_transaction_delay (GssTransaction *t, int msec);
+void gss_transaction_unpause (GssTransaction *t);
 void gss_transaction_dump (GssTransaction *t);
 void gss_transaction_process_async (GssTransaction *t,
     GssTransactionFunc process, GssTransactionFunc finish, gpointer priv);
+gboolean gss_transaction_process_io (GssTransaction *t,
+    GssTransactionFunc process, GssTransactionFunc finish, gpointer priv);
+void gss_transaction_set_priority (GssTransaction *t,
+    GssTransactionPriority priority);
+void gss_transaction_set_worker_threads (int n_threads, gboolean pin_threads);
+void gss_transaction_get_queue_stats (GssTransactionPriority priority,
+    GssTransactionQueueStats *stats);
+void gss_transaction_get_worker_stats (int *n_threads, gint64 *busy_time);
+void gss_transaction_invoke (GssTransaction *t, GSourceFunc func,
+    gpointer data);
+void gss_transaction_set_admission_limits (GssTransactionPriority priority,
+    int max_queued_transactions, int max_wait_ms);
+gboolean gss_transaction_admit (GssTransaction *t);
+void gss_transaction_shed (GssTransaction *t);
+void gss_transaction_count_degraded (GssTransaction *t);
+void gss_transaction_attach_thread (GMainContext *context);
+void gss_transaction_detach_thread (void);
 
 gchar *gss_json_gobject_to_data (GObject * gobject, gsize * length);
 
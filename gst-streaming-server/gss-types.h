@@ -37,8 +37,10 @@ typedef struct _GssServer GssServer;
 typedef struct _GssServerClass GssServerClass;
 typedef struct _GssConnection GssConnection;
 typedef struct _GssHLSSegment GssHLSSegment;
+typedef struct _GssDashLive GssDashLive;
 typedef struct _GssRtspStream GssRtspStream;
 typedef struct _GssMetrics GssMetrics;
+typedef struct _GssHistogram GssHistogram;
 typedef struct _GssResource GssResource;
 typedef struct _GssSession GssSession;
 typedef struct _GssTransaction GssTransaction;
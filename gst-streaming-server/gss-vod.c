@@ -34,13 +34,32 @@ enum
   PROP_ENDPOINT,
   PROP_ARCHIVE_DIR,
   PROP_DIR_LEVELS,
-  PROP_CACHE_SIZE
+  PROP_CACHE_SIZE,
+  PROP_CACHE_MEMORY,
+  PROP_CHECK_INTERVAL,
+  PROP_CHUNK_DURATION,
+  PROP_STORE_DIR,
+  PROP_STORE_SIZE,
+  PROP_PRELOAD_FILE,
+  PROP_PRELOAD_CONCURRENCY,
+  PROP_PRELOAD_READY
 };
 
 #define DEFAULT_ENDPOINT "vod"
 #define DEFAULT_ARCHIVE_DIR "vod"
 #define DEFAULT_DIR_LEVELS 0
 #define DEFAULT_CACHE_SIZE 100
+#define DEFAULT_CACHE_MEMORY 1024
+#define DEFAULT_CHECK_INTERVAL 10
+#define DEFAULT_CHUNK_DURATION 0
+#define DEFAULT_STORE_DIR ""
+#define DEFAULT_STORE_SIZE 10240
+#define DEFAULT_PRELOAD_FILE ""
+#define DEFAULT_PRELOAD_CONCURRENCY 2
+
+/* threads loading titles for viewers */
+#define GSS_VOD_LOAD_THREADS 2
+#define DEFAULT_PRELOAD_READY 100
 
 static void gss_vod_finalize (GObject * object);
 static void gss_vod_set_property (GObject * object, guint prop_id,
@@ -49,21 +68,155 @@ static void gss_vod_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 static void gss_vod_get_resource (GssTransaction * t);
 static void gss_vod_post_resource (GssTransaction * t);
-static GssAdaptive *gss_vod_get_adaptive (GssVod * vod, const char *key,
-    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type);
 static void gss_vod_get_adaptive_resource (GssTransaction * t);
+static void gss_vod_get_ready_resource (GssTransaction * t);
 static void gss_vod_attach (GssObject * object, GssServer * server);
+static void gss_vod_append_metrics (GssModule * module, GString * s);
 static void gss_vod_player_get_resource (GssTransaction * t);
+static void gss_vod_fill_task (gpointer data, gpointer user_data);
+static void gss_vod_cache_evict (GssVod * vod);
+static void gss_vod_load_task (gpointer data, gpointer user_data);
+static gboolean gss_vod_load_finish (gpointer data);
+
+typedef struct _GssVodCacheEntry GssVodCacheEntry;
+typedef struct _GssVodLoad GssVodLoad;
+typedef struct _GssVodWaiter GssVodWaiter;
+typedef struct _GssVodRequest GssVodRequest;
+typedef struct _GssVodPreload GssVodPreload;
+
+typedef void (*GssVodLoadCallback) (GssVod * vod, GssAdaptive * adaptive,
+    gpointer user_data);
+
+static void gss_vod_load_adaptive (GssVod * vod, GThreadPool * pool,
+    const char *key, const char *version, GssDrmType drm_type,
+    GssAdaptiveStream stream_type, GssVodLoadCallback callback,
+    gpointer user_data);
+static gboolean gss_vod_preload_add (GssVod * vod, const char *stream);
+static void gss_vod_preload_file (GssVod * vod);
+static void gss_vod_preload_next (GssVod * vod);
+static gboolean gss_vod_preload_start (gpointer data);
+static GssVodLoad *gss_vod_load_new (GssVod * vod, GThreadPool * pool,
+    char *hash_key, const char *key, const char *version, gboolean is_isoff);
+
+struct _GssVodCacheEntry
+{
+  char *key;
+  GssAdaptive *adaptive;
+  gsize size;
+  /* monotonic time of the next check for changed files */
+  gint64 check_time;
+  GList link;
+};
+
+/* A load running on load_pool, or preload_pool for preloads.  A media
+ * load parses the files of a title; a stream load creates one DRM and
+ * stream type variant from loaded media.  Requests arriving while a
+ * load is running wait for it instead of starting another.  A check
+ * stats the files of cached media, so that requests never do. */
+struct _GssVodLoad
+{
+  GssVod *vod;
+  GThreadPool *pool;
+  char *hash_key;
+  gboolean is_media;
+  gboolean is_check;
+
+  char *key;
+  char *version;
+  gboolean is_isoff;
+
+  /* media loads */
+  char *dir;
+  GList *streams;
+
+  /* stream loads.  The DRM configuration is copied when the load is
+   * queued, since the admin page may change it meanwhile. */
+  GssDrmType drm_type;
+  GssAdaptiveStream stream_type;
+  guint8 key_seed[30];
+  char *license_url;
+  GList *waiters;
+
+  GssAdaptiveMedia *media;
+  GssAdaptive *adaptive;
+
+  /* checks */
+  gboolean is_current;
+};
+
+/* Waiters are called in the loop they were added from, which is a
+ * frontend thread for requests arriving there */
+struct _GssVodWaiter
+{
+  GssVodLoadCallback callback;
+  gpointer user_data;
+  GMainContext *context;
+  GssVod *vod;
+  GssAdaptive *adaptive;
+};
+
+/* A paused transaction waiting for its stream to load.  libsoup frees
+ * the path and query passed to the handler once it returns, so copies
+ * are kept for the transaction. */
+struct _GssVodRequest
+{
+  GssTransaction *t;
+  SoupMessage *msg;
+  GHashTable *query;
+  char *full_path;
+  /* the part after the stream, in full_path */
+  const char *path;
+  gulong finished_id;
+};
+
+/* A stream on the preload list that has not been started yet */
+struct _GssVodPreload
+{
+  char *key;
+  char *version;
+  GssDrmType drm_type;
+  GssAdaptiveStream stream_type;
+};
 
 G_DEFINE_TYPE (GssVod, gss_vod, GSS_TYPE_MODULE);
 
 static GObjectClass *parent_class;
 
+static void
+gss_vod_cache_entry_free (GssVodCacheEntry * entry)
+{
+  gss_adaptive_unref (entry->adaptive);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+gss_vod_preload_free (GssVodPreload * preload)
+{
+  g_free (preload->key);
+  g_free (preload->version);
+  g_free (preload);
+}
+
 static void
 gss_vod_init (GssVod * vod)
 {
-  vod->cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-      (GDestroyNotify) gss_adaptive_free);
+  g_mutex_init (&vod->lock);
+  vod->cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) gss_vod_cache_entry_free);
+  g_queue_init (&vod->cache_lru);
+  vod->media_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) gss_adaptive_media_unref);
+  vod->loads = g_hash_table_new (g_str_hash, g_str_equal);
+  vod->media_loads = g_hash_table_new (g_str_hash, g_str_equal);
+  vod->load_pool = g_thread_pool_new (gss_vod_load_task, vod,
+      GSS_VOD_LOAD_THREADS, FALSE, NULL);
+  vod->preload_pool = g_thread_pool_new (gss_vod_load_task, vod,
+      DEFAULT_PRELOAD_CONCURRENCY, FALSE, NULL);
+  vod->fill_pool = g_thread_pool_new (gss_vod_fill_task, vod, 1, FALSE, NULL);
+  vod->preload_queue = g_queue_new ();
+  vod->media_load_time = gss_histogram_new ();
+  vod->stream_load_time = gss_histogram_new ();
 }
 
 static void
@@ -74,6 +227,7 @@ gss_vod_class_init (GssVodClass * vod_class)
   G_OBJECT_CLASS (vod_class)->finalize = gss_vod_finalize;
 
   GSS_OBJECT_CLASS (vod_class)->attach = gss_vod_attach;
+  GSS_MODULE_CLASS (vod_class)->append_metrics = gss_vod_append_metrics;
 
   g_object_class_install_property (G_OBJECT_CLASS (vod_class),
       PROP_ENDPOINT, g_param_spec_string ("endpoint", "Endpoint",
@@ -95,6 +249,61 @@ gss_vod_class_init (GssVodClass * vod_class)
           "Number of streams to hold in memory.", 1, 10000, DEFAULT_CACHE_SIZE,
           (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
               G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_CACHE_MEMORY, g_param_spec_int ("cache-memory", "Cache Memory",
+          "Maximum memory (in MB) used by streams held in memory.  The "
+          "least recently used streams are dropped to stay under it.",
+          1, G_MAXINT, DEFAULT_CACHE_MEMORY,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_CHECK_INTERVAL, g_param_spec_int ("check-interval",
+          "Check Interval",
+          "Interval (in seconds) between checks for changed files of "
+          "cached titles, or 0 to never check.", 0, G_MAXINT,
+          DEFAULT_CHECK_INTERVAL,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_CHUNK_DURATION, g_param_spec_int ("chunk-duration",
+          "Chunk Duration",
+          "Duration (in ms) of low-latency chunks for isoff-live streams, "
+          "or 0 to send whole fragments.", 0, 10000, DEFAULT_CHUNK_DURATION,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_STORE_DIR, g_param_spec_string ("store-dir", "Store Directory",
+          "Directory for storing encrypted fragments, or empty to encrypt "
+          "on every request.  Takes effect on restart.", DEFAULT_STORE_DIR,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_STORE_SIZE, g_param_spec_int ("store-size", "Store Size",
+          "Maximum size (in MB) of the encrypted fragment store.  "
+          "Takes effect on restart.", 1, G_MAXINT, DEFAULT_STORE_SIZE,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PRELOAD_FILE, g_param_spec_string ("preload-file", "Preload File",
+          "File listing streams to load at startup, one "
+          "content-id/version/drm/stream-type per line, or empty.  "
+          "Takes effect on restart.", DEFAULT_PRELOAD_FILE,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PRELOAD_CONCURRENCY, g_param_spec_int ("preload-concurrency",
+          "Preload Concurrency",
+          "Maximum number of preload streams loading at once, on threads "
+          "separate from the ones loading streams for viewers.", 1, 64,
+          DEFAULT_PRELOAD_CONCURRENCY,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PRELOAD_READY, g_param_spec_int ("preload-ready", "Preload Ready",
+          "Percentage of preload streams that must be done before the "
+          "server reports ready.", 0, 100, DEFAULT_PRELOAD_READY,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
 
   parent_class = g_type_class_peek_parent (vod_class);
 }
@@ -106,9 +315,27 @@ gss_vod_finalize (GObject * object)
 
   vod = GSS_VOD (object);
 
+  /* wait for pending fills, which use the fragment store */
+  g_thread_pool_free (vod->fill_pool, TRUE, TRUE);
+  /* loads hold a reference to vod, so none are running */
+  g_thread_pool_free (vod->load_pool, FALSE, TRUE);
+  g_thread_pool_free (vod->preload_pool, FALSE, TRUE);
+  g_hash_table_unref (vod->loads);
+  g_hash_table_unref (vod->media_loads);
+  g_queue_free_full (vod->preload_queue, (GDestroyNotify) gss_vod_preload_free);
+
   g_free (vod->endpoint);
   g_free (vod->archive_dir);
+  g_free (vod->store_dir);
+  g_free (vod->preload_file);
   g_hash_table_unref (vod->cache);
+  g_hash_table_unref (vod->media_cache);
+  if (vod->store) {
+    gss_fragment_store_free (vod->store);
+  }
+  gss_histogram_free (vod->media_load_time);
+  gss_histogram_free (vod->stream_load_time);
+  g_mutex_clear (&vod->lock);
 
   parent_class->finalize (object);
 }
@@ -140,7 +367,40 @@ gss_vod_set_property (GObject * object, guint prop_id,
       vod->dir_levels = g_value_get_int (value);
       break;
     case PROP_CACHE_SIZE:
+      g_mutex_lock (&vod->lock);
       vod->cache_size = g_value_get_int (value);
+      gss_vod_cache_evict (vod);
+      g_mutex_unlock (&vod->lock);
+      break;
+    case PROP_CACHE_MEMORY:
+      g_mutex_lock (&vod->lock);
+      vod->cache_memory = g_value_get_int (value);
+      gss_vod_cache_evict (vod);
+      g_mutex_unlock (&vod->lock);
+      break;
+    case PROP_CHECK_INTERVAL:
+      vod->check_interval = g_value_get_int (value);
+      break;
+    case PROP_CHUNK_DURATION:
+      vod->chunk_duration = g_value_get_int (value);
+      break;
+    case PROP_STORE_DIR:
+      string_replace (&vod->store_dir, g_value_dup_string (value));
+      break;
+    case PROP_STORE_SIZE:
+      vod->store_size = g_value_get_int (value);
+      break;
+    case PROP_PRELOAD_FILE:
+      string_replace (&vod->preload_file, g_value_dup_string (value));
+      break;
+    case PROP_PRELOAD_CONCURRENCY:
+      vod->preload_concurrency = g_value_get_int (value);
+      g_thread_pool_set_max_threads (vod->preload_pool,
+          vod->preload_concurrency, NULL);
+      gss_vod_preload_next (vod);
+      break;
+    case PROP_PRELOAD_READY:
+      vod->preload_ready = g_value_get_int (value);
       break;
     default:
       g_assert_not_reached ();
@@ -169,6 +429,30 @@ gss_vod_get_property (GObject * object, guint prop_id,
     case PROP_CACHE_SIZE:
       g_value_set_int (value, vod->cache_size);
       break;
+    case PROP_CACHE_MEMORY:
+      g_value_set_int (value, vod->cache_memory);
+      break;
+    case PROP_CHECK_INTERVAL:
+      g_value_set_int (value, vod->check_interval);
+      break;
+    case PROP_CHUNK_DURATION:
+      g_value_set_int (value, vod->chunk_duration);
+      break;
+    case PROP_STORE_DIR:
+      g_value_set_string (value, vod->store_dir);
+      break;
+    case PROP_STORE_SIZE:
+      g_value_set_int (value, vod->store_size);
+      break;
+    case PROP_PRELOAD_FILE:
+      g_value_set_string (value, vod->preload_file);
+      break;
+    case PROP_PRELOAD_CONCURRENCY:
+      g_value_set_int (value, vod->preload_concurrency);
+      break;
+    case PROP_PRELOAD_READY:
+      g_value_set_int (value, vod->preload_ready);
+      break;
     default:
       g_assert_not_reached ();
       break;
@@ -199,12 +483,114 @@ gss_vod_attach (GssObject * object, GssServer * server)
   gss_module_set_admin_resource (GSS_MODULE (vod), r);
 
   gss_server_add_resource (GSS_OBJECT_SERVER (object), "/vod/",
-      GSS_RESOURCE_PREFIX, NULL, gss_vod_get_adaptive_resource, NULL, NULL,
+      GSS_RESOURCE_PREFIX | GSS_RESOURCE_THREADSAFE, NULL, gss_vod_get_adaptive_resource, NULL, NULL,
       vod);
 
   gss_server_add_resource (GSS_OBJECT_SERVER (object), "/vod-player",
       GSS_RESOURCE_UI, GSS_TEXT_HTML, gss_vod_player_get_resource,
       NULL, NULL, vod);
+
+  gss_server_add_resource (GSS_OBJECT_SERVER (object), "/vod-ready",
+      GSS_RESOURCE_THREADSAFE, GSS_TEXT_PLAIN, gss_vod_get_ready_resource, NULL, NULL, vod);
+
+  /* Loads read the DRM configuration from the PlayReady module, which
+   * may be attached after this one, so preloads are started from the
+   * main loop once the server is set up. */
+  gss_vod_preload_file (vod);
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, gss_vod_preload_start,
+      g_object_ref (vod), g_object_unref);
+}
+
+/* The store is opened on first use, after the configuration has been
+ * loaded, and kept until the module is finalized.  Called with the lock
+ * held. */
+static GssFragmentStore *
+gss_vod_get_store (GssVod * vod)
+{
+  if (vod->store == NULL && vod->store_dir && vod->store_dir[0]) {
+    vod->store = gss_fragment_store_new (vod->store_dir,
+        (guint64) vod->store_size * 1024 * 1024);
+  }
+  return vod->store;
+}
+
+static void
+gss_vod_append_metrics (GssModule * module, GString * s)
+{
+  GssVod *vod = GSS_VOD (module);
+  GssFragmentStore *store;
+  int n_streams;
+  int n_titles;
+  gsize cache_bytes;
+  guint64 cache_hits;
+  guint64 cache_misses;
+  guint64 cache_evictions;
+  guint64 cache_invalidations;
+
+  g_mutex_lock (&vod->lock);
+  n_streams = g_hash_table_size (vod->cache);
+  n_titles = g_hash_table_size (vod->media_cache);
+  cache_bytes = vod->cache_bytes;
+  cache_hits = vod->cache_hits;
+  cache_misses = vod->cache_misses;
+  cache_evictions = vod->cache_evictions;
+  cache_invalidations = vod->cache_invalidations;
+  store = vod->store;
+  g_mutex_unlock (&vod->lock);
+
+  gss_metrics_append_header (s, "gss_vod_cache_streams", "gauge",
+      "Adaptive streams in the VOD cache.");
+  GSS_P ("gss_vod_cache_streams %d\n", n_streams);
+  gss_metrics_append_header (s, "gss_vod_cache_titles", "gauge",
+      "Parsed titles in the VOD cache.");
+  GSS_P ("gss_vod_cache_titles %d\n", n_titles);
+  gss_metrics_append_header (s, "gss_vod_cache_bytes", "gauge",
+      "Memory used by the VOD cache.");
+  GSS_P ("gss_vod_cache_bytes %" G_GSIZE_FORMAT "\n", cache_bytes);
+  gss_metrics_append_header (s, "gss_vod_cache_hits_total", "counter",
+      "VOD cache lookups that found a stream.");
+  GSS_P ("gss_vod_cache_hits_total %" G_GUINT64_FORMAT "\n", cache_hits);
+  gss_metrics_append_header (s, "gss_vod_cache_misses_total", "counter",
+      "VOD cache lookups that had to load a stream.");
+  GSS_P ("gss_vod_cache_misses_total %" G_GUINT64_FORMAT "\n", cache_misses);
+  gss_metrics_append_header (s, "gss_vod_cache_evictions_total", "counter",
+      "Streams evicted from the VOD cache.");
+  GSS_P ("gss_vod_cache_evictions_total %" G_GUINT64_FORMAT "\n",
+      cache_evictions);
+  gss_metrics_append_header (s, "gss_vod_cache_invalidations_total",
+      "counter", "Streams dropped from the VOD cache as their files changed.");
+  GSS_P ("gss_vod_cache_invalidations_total %" G_GUINT64_FORMAT "\n",
+      cache_invalidations);
+
+  gss_metrics_append_header (s, "gss_vod_load_seconds", "summary",
+      "Time to parse a title, or to create a stream from a parsed title.");
+  gss_metrics_append_quantiles (s, "gss_vod_load_seconds", "kind=\"media\"",
+      vod->media_load_time);
+  gss_metrics_append_quantiles (s, "gss_vod_load_seconds",
+      "kind=\"stream\"", vod->stream_load_time);
+
+  if (store) {
+    int n_files;
+    guint64 size;
+    guint64 hits;
+    guint64 misses;
+
+    gss_fragment_store_get_stats (store, &n_files, &size, &hits, &misses);
+
+    gss_metrics_append_header (s, "gss_fragment_store_fragments", "gauge",
+        "Encrypted fragments on disk.");
+    GSS_P ("gss_fragment_store_fragments %d\n", n_files);
+    gss_metrics_append_header (s, "gss_fragment_store_bytes", "gauge",
+        "Size of the encrypted fragments on disk.");
+    GSS_P ("gss_fragment_store_bytes %" G_GUINT64_FORMAT "\n", size);
+    gss_metrics_append_header (s, "gss_fragment_store_hits_total", "counter",
+        "Fragments served from the store.");
+    GSS_P ("gss_fragment_store_hits_total %" G_GUINT64_FORMAT "\n", hits);
+    gss_metrics_append_header (s, "gss_fragment_store_misses_total",
+        "counter", "Fragments that had to be encrypted.");
+    GSS_P ("gss_fragment_store_misses_total %" G_GUINT64_FORMAT "\n",
+        misses);
+  }
 }
 
 static void
@@ -212,18 +598,178 @@ gss_vod_get_resource (GssTransaction * t)
 {
   GssVod *vod = GSS_VOD (t->resource->priv);
   GString *s = g_string_new ("");
+  GssFragmentStore *store;
+  int n_streams;
+  int n_titles;
+  gsize cache_bytes;
+  guint64 cache_hits;
+  guint64 cache_misses;
+  guint64 cache_evictions;
+  guint64 cache_invalidations;
+  int preload_done;
+  int preload_total;
+  int preload_failed;
+  int preload_running;
 
   t->s = s;
 
+  g_mutex_lock (&vod->lock);
+  n_streams = g_hash_table_size (vod->cache);
+  n_titles = g_hash_table_size (vod->media_cache);
+  cache_bytes = vod->cache_bytes;
+  cache_hits = vod->cache_hits;
+  cache_misses = vod->cache_misses;
+  cache_evictions = vod->cache_evictions;
+  cache_invalidations = vod->cache_invalidations;
+  preload_done = vod->preload_done;
+  preload_total = vod->preload_total;
+  preload_failed = vod->preload_failed;
+  preload_running = vod->preload_running;
+  store = gss_vod_get_store (vod);
+  g_mutex_unlock (&vod->lock);
+
   gss_html_header (t);
 
   GSS_A ("<h1>Video On Demand</h1>\n");
 
   gss_config_append_config_block (G_OBJECT (vod), t, TRUE);
 
+  GSS_A ("<h2>Stream Cache</h2>\n");
+  GSS_P ("<p>%d streams, %d titles, %" G_GSIZE_FORMAT " MB, %"
+      G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %"
+      G_GUINT64_FORMAT " evictions, %" G_GUINT64_FORMAT
+      " invalidations</p>\n",
+      n_streams, n_titles, cache_bytes / (1024 * 1024), cache_hits,
+      cache_misses, cache_evictions, cache_invalidations);
+
+  GSS_A ("<h2>Preload</h2>\n");
+  GSS_P ("<p>%d of %d streams done, %d failed, %d loading, %s</p>\n",
+      preload_done, preload_total, preload_failed, preload_running,
+      gss_vod_is_ready (vod) ? "ready" : "not ready");
+  GSS_A ("<form method='post' enctype='multipart/form-data'>\n");
+  GSS_A ("<input name='action' type='hidden' value='preload'>\n");
+  GSS_A ("<textarea name='streams' rows='4' "
+      "placeholder='content-id/version/drm/stream-type'></textarea>\n");
+  GSS_A ("<button type='submit' class='btn'>Preload</button>\n");
+  GSS_A ("</form>\n");
+
+  if (store) {
+    int n_files;
+    guint64 size;
+    guint64 hits;
+    guint64 misses;
+
+    gss_fragment_store_get_stats (store, &n_files, &size, &hits, &misses);
+
+    GSS_A ("<h2>Encrypted Fragment Store</h2>\n");
+    GSS_P ("<p>%d fragments, %" G_GUINT64_FORMAT " MB, %" G_GUINT64_FORMAT
+        " hits, %" G_GUINT64_FORMAT " misses</p>\n", n_files,
+        size / (1024 * 1024), hits, misses);
+    GSS_A ("<form method='post' enctype='multipart/form-data'>\n");
+    GSS_A ("<input name='action' type='hidden' value='fill-store'>\n");
+    GSS_A ("<input name='content-id' type='text' placeholder='Content ID'>\n");
+    GSS_A ("<input name='version' type='text' value='0'>\n");
+    GSS_A ("<select name='drm'>\n");
+    GSS_A ("<option value='pr'>PlayReady</option>\n");
+    GSS_A ("<option value='cenc'>CENC</option>\n");
+    GSS_A ("<option value='cbcs'>CENC cbcs</option>\n");
+    GSS_A ("</select>\n");
+    GSS_A ("<button type='submit' class='btn'>Pre-encrypt</button>\n");
+    GSS_A ("</form>\n");
+  }
+
   gss_html_footer (t);
 }
 
+static void
+gss_vod_fill_task (gpointer data, gpointer user_data)
+{
+  GssAdaptive *adaptive = data;
+
+  GST_DEBUG ("filling fragment store for %s", adaptive->content_id);
+  gss_adaptive_fill_store (adaptive);
+  GST_DEBUG ("done filling fragment store for %s", adaptive->content_id);
+  gss_adaptive_unref (adaptive);
+}
+
+static void
+gss_vod_fill_loaded (GssVod * vod, GssAdaptive * adaptive, gpointer user_data)
+{
+  if (adaptive == NULL) {
+    GST_WARNING ("failed to load stream for filling fragment store");
+    return;
+  }
+
+  g_thread_pool_push (vod->fill_pool, gss_adaptive_ref (adaptive), NULL);
+}
+
+static gboolean
+handle_action_fill_store (GssVod * vod, GssTransaction * t, GHashTable * hash)
+{
+  const char *content_id;
+  const char *version;
+  const char *drm;
+  GssDrmType drm_type;
+  GssAdaptive *adaptive;
+
+  content_id = g_hash_table_lookup (hash, "content-id");
+  version = g_hash_table_lookup (hash, "version");
+  drm = g_hash_table_lookup (hash, "drm");
+  if (content_id == NULL || content_id[0] == 0 || strchr (content_id, '/') ||
+      version == NULL || version[0] == 0 || strchr (version, '/') ||
+      drm == NULL)
+    return FALSE;
+
+  drm_type = gss_drm_get_drm_type (drm);
+  if (drm_type == GSS_DRM_UNKNOWN || drm_type == GSS_DRM_CLEAR)
+    return FALSE;
+
+  g_mutex_lock (&vod->lock);
+  if (gss_vod_get_store (vod) == NULL) {
+    g_mutex_unlock (&vod->lock);
+    return FALSE;
+  }
+  g_mutex_unlock (&vod->lock);
+
+  /* the encrypted fragments are the same for all stream types */
+  adaptive = gss_vod_lookup_adaptive (vod, content_id, version, drm_type,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  if (adaptive) {
+    gss_vod_fill_loaded (vod, adaptive, NULL);
+    gss_adaptive_unref (adaptive);
+  } else {
+    gss_vod_load_adaptive (vod, vod->load_pool, content_id, version,
+        drm_type, GSS_ADAPTIVE_STREAM_ISOFF_LIVE, gss_vod_fill_loaded, NULL);
+  }
+
+  return TRUE;
+}
+static gboolean
+handle_action_preload (GssVod * vod, GssTransaction * t, GHashTable * hash)
+{
+  const char *streams;
+  char **lines;
+  gboolean ret = TRUE;
+  int i;
+
+  streams = g_hash_table_lookup (hash, "streams");
+  if (streams == NULL)
+    return FALSE;
+
+  lines = g_strsplit (streams, "\n", 0);
+  for (i = 0; lines[i]; i++) {
+    g_strstrip (lines[i]);
+    if (lines[i][0] == 0)
+      continue;
+    if (!gss_vod_preload_add (vod, lines[i]))
+      ret = FALSE;
+  }
+  g_strfreev (lines);
+
+  gss_vod_preload_next (vod);
+
+  return ret;
+}
 
 static void
 gss_vod_post_resource (GssTransaction * t)
@@ -238,9 +784,15 @@ gss_vod_post_resource (GssTransaction * t)
 
     value = g_hash_table_lookup (hash, "action");
     if (value) {
+      if (strcmp (value, "fill-store") == 0) {
+        ret = handle_action_fill_store (vod, t, hash);
+      } else if (strcmp (value, "preload") == 0) {
+        ret = handle_action_preload (vod, t, hash);
+      }
     } else {
       ret = gss_config_handle_post_hash (G_OBJECT (vod), t, hash);
     }
+    g_hash_table_unref (hash);
   }
 
   if (ret) {
@@ -296,6 +848,85 @@ chomp (const char **s)
   return key;
 }
 
+static void
+gss_vod_serve_adaptive (GssTransaction * t, GssAdaptive * adaptive,
+    const char *path)
+{
+  GST_DEBUG ("subpath: %s", path);
+
+  /* keep the stream alive until the response is done, even if it is
+   * evicted from the cache meanwhile */
+  g_object_set_data_full (G_OBJECT (t->msg), "gss-adaptive",
+      gss_adaptive_ref (adaptive), (GDestroyNotify) gss_adaptive_unref);
+  gss_adaptive_get_resource (t, adaptive, path);
+}
+
+static void
+gss_vod_request_finished (SoupMessage * msg, GssVodRequest * request)
+{
+  /* the client went away; the transaction is freed after this */
+  request->t = NULL;
+}
+
+static void
+gss_vod_request_loaded (GssVod * vod, GssAdaptive * adaptive,
+    gpointer user_data)
+{
+  GssVodRequest *request = user_data;
+  GssTransaction *t = request->t;
+
+  g_signal_handler_disconnect (request->msg, request->finished_id);
+
+  if (t) {
+    /* the copies live as long as the message, since async processing
+     * and the access log use them after this returns */
+    if (request->query) {
+      g_object_set_data_full (G_OBJECT (t->msg), "gss-query",
+          g_hash_table_ref (request->query),
+          (GDestroyNotify) g_hash_table_unref);
+    }
+    g_object_set_data_full (G_OBJECT (t->msg), "gss-path",
+        request->full_path, g_free);
+    t->query = request->query;
+    t->path = request->full_path;
+    request->full_path = NULL;
+
+    /* The handler's synchronous time was already closed when it
+     * paused the message.  Serving it now is timed the same way, and
+     * added to it, instead of counting the wait for the load. */
+    t->sync_process_time -= g_get_real_time ();
+
+    soup_server_unpause_message (t->soupserver, t->msg);
+    if (adaptive == NULL) {
+      gss_transaction_error_not_found (t, "failed to load");
+    } else {
+      gss_vod_serve_adaptive (t, adaptive, request->path);
+      if (t->s) {
+        int len;
+        gchar *content;
+
+        len = t->s->len;
+        content = g_string_free (t->s, FALSE);
+        soup_message_body_append (t->msg->response_body, SOUP_MEMORY_TAKE,
+            content, len);
+        t->s = NULL;
+      }
+    }
+
+    /* unless serving it went async, which closes it */
+    if (t->sync_process_time < 0) {
+      t->sync_process_time += g_get_real_time ();
+    }
+  }
+
+  if (request->query) {
+    g_hash_table_unref (request->query);
+  }
+  g_object_unref (request->msg);
+  g_free (request->full_path);
+  g_free (request);
+}
+
 static void
 gss_vod_get_adaptive_resource (GssTransaction * t)
 {
@@ -325,7 +956,8 @@ gss_vod_get_adaptive_resource (GssTransaction * t)
     goto error;
   }
 
-  if (drm_type == GSS_DRM_CLEAR && !t->server->playready->allow_clear) {
+  if (drm_type == GSS_DRM_CLEAR &&
+      !gss_playready_get_allow_clear (t->server->playready)) {
     gss_transaction_error_not_found (t, "clear streaming disabled");
     goto error;
   }
@@ -336,17 +968,32 @@ gss_vod_get_adaptive_resource (GssTransaction * t)
   }
 
   adaptive =
-      gss_vod_get_adaptive (vod, key, content_version, drm_type, stream_type);
-  if (adaptive == NULL) {
-    GST_DEBUG ("failed to load %s", key);
-    gss_transaction_error_not_found (t, "failed to load");
-    goto error;
+      gss_vod_lookup_adaptive (vod, key, content_version, drm_type,
+      stream_type);
+  if (adaptive) {
+    gss_vod_serve_adaptive (t, adaptive, path);
+    gss_adaptive_unref (adaptive);
+  } else {
+    GssVodRequest *request;
+
+    /* parsing a title can take seconds, so the response waits for the
+     * load to finish on load_pool */
+    request = g_malloc0 (sizeof (GssVodRequest));
+    request->t = t;
+    request->msg = g_object_ref (t->msg);
+    if (t->query) {
+      request->query = g_hash_table_ref (t->query);
+    }
+    request->full_path = g_strdup (t->path);
+    request->path = request->full_path + (path - t->path);
+    request->finished_id = g_signal_connect (t->msg, "finished",
+        G_CALLBACK (gss_vod_request_finished), request);
+
+    soup_server_pause_message (t->soupserver, t->msg);
+    gss_vod_load_adaptive (vod, vod->load_pool, key, content_version,
+        drm_type, stream_type, gss_vod_request_loaded, request);
   }
 
-  GST_DEBUG ("subpath: %s", path);
-
-  gss_adaptive_get_resource (t, adaptive, path);
-
 error:
   g_free (key);
   g_free (content_version);
@@ -354,55 +1001,691 @@ error:
   g_free (drm);
 }
 
-static GssAdaptive *
-gss_vod_get_adaptive (GssVod * vod, const char *key, const char *version,
+static char *
+gss_vod_get_dir (GssVod * vod, const char *key)
+{
+  switch (vod->dir_levels) {
+    case 0:
+      return g_strdup_printf ("%s/%s", vod->archive_dir, key);
+    case 1:
+      return g_strdup_printf ("%s/%c/%s", vod->archive_dir, key[0], key);
+    case 2:
+      return g_strdup_printf ("%s/%c/%c/%s", vod->archive_dir, key[0],
+          key[1], key);
+    case 3:
+      return g_strdup_printf ("%s/%c/%c/%c/%s", vod->archive_dir, key[0],
+          key[1], key[2], key);
+    default:
+      g_assert_not_reached ();
+  }
+
+  return NULL;
+}
+
+static char *
+gss_vod_get_media_key (const char *key, const char *version, gboolean is_isoff)
+{
+  return g_strdup_printf ("%s/%s/%s", key, version,
+      is_isoff ? "isoff" : "ism");
+}
+
+static char *
+gss_vod_get_stream_key (const char *key, const char *version,
     GssDrmType drm_type, GssAdaptiveStream stream_type)
 {
+  return g_strdup_printf ("%s/%s/%s/%s", key, version,
+      gss_drm_get_drm_name (drm_type),
+      gss_adaptive_stream_get_name (stream_type));
+}
+
+static gboolean
+media_equal (gpointer key, gpointer value, gpointer user_data)
+{
+  return value == user_data;
+}
+
+/* Drops @media from the media cache if no cached stream uses it any
+ * more.  Streams still in use by transactions keep their own
+ * reference. */
+static void
+gss_vod_cache_release_media (GssVod * vod, GssAdaptiveMedia * media)
+{
+  GList *g;
+  gsize size;
+
+  for (g = vod->cache_lru.head; g; g = g_list_next (g)) {
+    GssVodCacheEntry *entry = g->data;
+    if (entry->adaptive->media == media)
+      return;
+  }
+
+  /* media may have been dropped already while a stream was loading */
+  size = gss_adaptive_media_get_memory_size (media);
+  if (g_hash_table_foreach_remove (vod->media_cache, media_equal, media) > 0) {
+    vod->cache_bytes -= size;
+  }
+}
+
+/* Evicts least recently used streams until the cache is within both
+ * the cache-size and cache-memory limits.  The most recently used
+ * stream is always kept. */
+static void
+gss_vod_cache_evict (GssVod * vod)
+{
+  gsize max_bytes;
+
+  max_bytes = (gsize) vod->cache_memory * 1024 * 1024;
+  while (vod->cache_lru.length > 1 &&
+      (vod->cache_lru.length > (guint) vod->cache_size ||
+          vod->cache_bytes > max_bytes)) {
+    GssVodCacheEntry *entry = vod->cache_lru.tail->data;
+    GssAdaptiveMedia *media = entry->adaptive->media;
+
+    GST_DEBUG ("evicting %s", entry->key);
+    g_queue_unlink (&vod->cache_lru, &entry->link);
+    vod->cache_bytes -= entry->size;
+    vod->cache_evictions++;
+    /* holds a reference to media until the entry is freed */
+    gss_vod_cache_release_media (vod, media);
+    g_hash_table_remove (vod->cache, entry->key);
+  }
+}
+
+/* Adds @media to the media cache under @media_key.  Called with the
+ * lock held. */
+static void
+gss_vod_cache_insert_media (GssVod * vod, const char *media_key,
+    GssAdaptiveMedia * media)
+{
+  g_hash_table_insert (vod->media_cache, g_strdup (media_key),
+      gss_adaptive_media_ref (media));
+  vod->cache_bytes += gss_adaptive_media_get_memory_size (media);
+}
+
+/* Adds @adaptive to the cache under @hash_key as the most recently used
+ * stream, then evicts down to the limits.  Called with the lock held. */
+static void
+gss_vod_cache_insert (GssVod * vod, const char *hash_key,
+    GssAdaptive * adaptive)
+{
+  GssVodCacheEntry *entry;
+
+  entry = g_malloc0 (sizeof (GssVodCacheEntry));
+  entry->key = g_strdup (hash_key);
+  entry->adaptive = gss_adaptive_ref (adaptive);
+  entry->size = gss_adaptive_get_memory_size (adaptive);
+  entry->check_time = g_get_monotonic_time () +
+      (gint64) vod->check_interval * G_USEC_PER_SEC;
+  entry->link.data = entry;
+  g_hash_table_insert (vod->cache, entry->key, entry);
+  g_queue_push_head_link (&vod->cache_lru, &entry->link);
+  vod->cache_bytes += entry->size;
+  gss_vod_cache_evict (vod);
+}
+
+/**
+ * gss_vod_add_adaptive:
+ * @vod: a #GssVod
+ * @adaptive: a stream with its @media set
+ *
+ * Adds @adaptive to the cache as if @vod had loaded it, along with its
+ * media if that is not cached yet, and evicts the least recently used
+ * streams beyond the cache-size and cache-memory limits.  Does nothing
+ * if the same stream is already cached.
+ */
+void
+gss_vod_add_adaptive (GssVod * vod, GssAdaptive * adaptive)
+{
+  char *hash_key;
+  char *media_key;
+
+  g_return_if_fail (GSS_IS_VOD (vod));
+  g_return_if_fail (adaptive != NULL);
+  g_return_if_fail (adaptive->media != NULL);
+
+  hash_key = gss_vod_get_stream_key (adaptive->content_id, adaptive->version,
+      adaptive->drm_type, adaptive->stream_type);
+  media_key = gss_vod_get_media_key (adaptive->content_id, adaptive->version,
+      gss_adaptive_stream_is_isoff (adaptive->stream_type));
+
+  g_mutex_lock (&vod->lock);
+  if (g_hash_table_lookup (vod->cache, hash_key) == NULL) {
+    if (g_hash_table_lookup (vod->media_cache, media_key) == NULL) {
+      gss_vod_cache_insert_media (vod, media_key, adaptive->media);
+    }
+    gss_vod_cache_insert (vod, hash_key, adaptive);
+  }
+  g_mutex_unlock (&vod->lock);
+
+  g_free (hash_key);
+  g_free (media_key);
+}
+
+/* Drops all cached streams using @media, and @media itself, so that
+ * the next request loads the title again.  Transactions still using
+ * the old streams keep their own references. */
+static void
+gss_vod_cache_invalidate_media (GssVod * vod, GssAdaptiveMedia * media)
+{
+  GList *g;
+  GList *next;
+
+  gss_adaptive_media_ref (media);
+  for (g = vod->cache_lru.head; g; g = next) {
+    GssVodCacheEntry *entry = g->data;
+
+    next = g_list_next (g);
+    if (entry->adaptive->media != media)
+      continue;
+
+    GST_DEBUG ("invalidating %s", entry->key);
+    g_queue_unlink (&vod->cache_lru, &entry->link);
+    vod->cache_bytes -= entry->size;
+    vod->cache_invalidations++;
+    g_hash_table_remove (vod->cache, entry->key);
+  }
+  gss_vod_cache_release_media (vod, media);
+  gss_adaptive_media_unref (media);
+}
+
+/**
+ * gss_vod_lookup_adaptive:
+ * @vod: a #GssVod
+ * @key: content ID of the title
+ * @version: version of the title
+ * @drm_type: a #GssDrmType
+ * @stream_type: a #GssAdaptiveStream
+ *
+ * Looks up a stream in the cache and marks it as recently used.  Once
+ * check-interval has passed, its files are checked on load_pool, and
+ * the stream is dropped from the cache if they changed; it is still
+ * returned until then.
+ *
+ * Returns: a reference to the cached stream, or %NULL if it has not
+ *   been loaded.  Free with gss_adaptive_unref().
+ */
+GssAdaptive *
+gss_vod_lookup_adaptive (GssVod * vod, const char *key, const char *version,
+    GssDrmType drm_type, GssAdaptiveStream stream_type)
+{
+  GssVodCacheEntry *entry;
   GssAdaptive *adaptive;
   char *hash_key;
 
-  hash_key = g_strdup_printf ("%s/%s/%s/%s",
-      key, version, gss_drm_get_drm_name (drm_type),
-      gss_adaptive_stream_get_name (stream_type));
+  hash_key = gss_vod_get_stream_key (key, version, drm_type, stream_type);
+  g_mutex_lock (&vod->lock);
+  entry = g_hash_table_lookup (vod->cache, hash_key);
+  g_free (hash_key);
+  if (entry == NULL) {
+    g_mutex_unlock (&vod->lock);
+    return NULL;
+  }
 
-  adaptive = g_hash_table_lookup (vod->cache, hash_key);
-  if (adaptive == NULL) {
-    char *dir;
-
-    switch (vod->dir_levels) {
-      case 0:
-        dir = g_strdup_printf ("%s/%s", vod->archive_dir, key);
-        break;
-      case 1:
-        dir = g_strdup_printf ("%s/%c/%s", vod->archive_dir, key[0], key);
-        break;
-      case 2:
-        dir =
-            g_strdup_printf ("%s/%c/%c/%s", vod->archive_dir, key[0], key[1],
-            key);
-        break;
-      case 3:
-        dir =
-            g_strdup_printf ("%s/%c/%c/%c/%s", vod->archive_dir, key[0], key[1],
-            key[2], key);
-        break;
-      default:
-        g_assert_not_reached ();
+  if (vod->check_interval > 0) {
+    gint64 now = g_get_monotonic_time ();
+
+    if (now >= entry->check_time) {
+      GssVodLoad *check;
+
+      entry->check_time = now + (gint64) vod->check_interval * G_USEC_PER_SEC;
+      check = gss_vod_load_new (vod, vod->load_pool, g_strdup (entry->key),
+          key, version, FALSE);
+      check->is_check = TRUE;
+      check->media = gss_adaptive_media_ref (entry->adaptive->media);
+      g_thread_pool_push (vod->load_pool, check, NULL);
     }
+  }
 
-    adaptive =
-        gss_adaptive_load (GSS_OBJECT_SERVER (vod), key, dir, version, drm_type,
-        stream_type);
-    g_free (dir);
-    if (adaptive == NULL) {
-      g_free (hash_key);
-      return NULL;
+  g_queue_unlink (&vod->cache_lru, &entry->link);
+  g_queue_push_head_link (&vod->cache_lru, &entry->link);
+  vod->cache_hits++;
+  adaptive = gss_adaptive_ref (entry->adaptive);
+  g_mutex_unlock (&vod->lock);
+
+  return adaptive;
+}
+
+static GssVodLoad *
+gss_vod_load_new (GssVod * vod, GThreadPool * pool, char *hash_key,
+    const char *key, const char *version, gboolean is_isoff)
+{
+  GssVodLoad *load;
+
+  load = g_malloc0 (sizeof (GssVodLoad));
+  load->vod = g_object_ref (vod);
+  load->pool = pool;
+  load->hash_key = hash_key;
+  load->key = g_strdup (key);
+  load->version = g_strdup (version);
+  load->is_isoff = is_isoff;
+
+  return load;
+}
+
+static void
+gss_vod_load_free (GssVodLoad * load)
+{
+  if (load->media) {
+    gss_adaptive_media_unref (load->media);
+  }
+  if (load->adaptive) {
+    gss_adaptive_unref (load->adaptive);
+  }
+  g_list_free (load->streams);
+  g_free (load->hash_key);
+  g_free (load->key);
+  g_free (load->version);
+  g_free (load->dir);
+  g_free (load->license_url);
+  g_object_unref (load->vod);
+  g_free (load);
+}
+
+static void
+gss_vod_load_task (gpointer data, gpointer user_data)
+{
+  GssVodLoad *load = data;
+  GssVod *vod = load->vod;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  if (load->is_check) {
+    GST_DEBUG ("checking %s", load->hash_key);
+    load->is_current = gss_adaptive_media_is_current (load->media);
+  } else if (load->is_media) {
+    GST_DEBUG ("loading media %s", load->hash_key);
+    load->media = gss_adaptive_media_load (load->dir, load->version,
+        load->is_isoff);
+    gss_histogram_add (vod->media_load_time,
+        g_get_monotonic_time () - start);
+  } else {
+    GST_DEBUG ("creating stream %s", load->hash_key);
+    load->adaptive = gss_adaptive_new_from_media (GSS_OBJECT_SERVER (vod),
+        load->key, load->version, load->media, load->drm_type,
+        load->stream_type, load->key_seed, load->license_url);
+    gss_histogram_add (vod->stream_load_time,
+        g_get_monotonic_time () - start);
+  }
+
+  g_idle_add (gss_vod_load_finish, load);
+}
+
+static gboolean
+gss_vod_waiter_call (gpointer data)
+{
+  GssVodWaiter *waiter = data;
+
+  waiter->callback (waiter->vod, waiter->adaptive, waiter->user_data);
+
+  if (waiter->adaptive) {
+    gss_adaptive_unref (waiter->adaptive);
+  }
+  g_main_context_unref (waiter->context);
+  g_free (waiter);
+
+  return FALSE;
+}
+
+static void
+gss_vod_load_finish_stream (GssVodLoad * load)
+{
+  GssVod *vod = load->vod;
+  GssAdaptive *adaptive = load->adaptive;
+  GssAdaptiveMedia *media = NULL;
+  GList *g;
+
+  g_mutex_lock (&vod->lock);
+  g_hash_table_remove (vod->loads, load->hash_key);
+
+  if (adaptive) {
+    char *media_key;
+
+    /* ms to 100 ns units */
+    adaptive->chunk_duration = (guint64) vod->chunk_duration * 10000;
+    adaptive->store = gss_vod_get_store (vod);
+
+    media_key = gss_vod_get_media_key (load->key, load->version,
+        load->is_isoff);
+    media = g_hash_table_lookup (vod->media_cache, media_key);
+    g_free (media_key);
+  }
+
+  if (adaptive && media != load->media) {
+    /* The files changed, or the media was evicted, while the stream was
+     * loading.  The waiters still get the stream, but it is not cached,
+     * so that the next request loads the title again. */
+    GST_DEBUG ("not caching %s, media changed", load->hash_key);
+  } else if (adaptive) {
+    gss_vod_cache_insert (vod, load->hash_key, adaptive);
+  } else {
+    GST_WARNING ("failed to load %s", load->hash_key);
+  }
+  g_mutex_unlock (&vod->lock);
+
+  /* no more waiters can be added once the load is out of vod->loads.
+   * Waiters in the main loop are called right away, and so are those
+   * of frontends stopped since they were added. */
+  for (g = load->waiters; g; g = g_list_next (g)) {
+    GssVodWaiter *waiter = g->data;
+
+    waiter->vod = vod;
+    waiter->adaptive = adaptive ? gss_adaptive_ref (adaptive) : NULL;
+    if (gss_server_is_running_context (GSS_OBJECT_SERVER (vod),
+            waiter->context)) {
+      g_main_context_invoke (waiter->context, gss_vod_waiter_call, waiter);
+    } else {
+      gss_vod_waiter_call (waiter);
     }
-    g_hash_table_replace (vod->cache, hash_key, adaptive);
+  }
+  g_list_free (load->waiters);
+  load->waiters = NULL;
+
+  gss_vod_load_free (load);
+}
+
+static void
+gss_vod_load_finish_media (GssVodLoad * load)
+{
+  GssVod *vod = load->vod;
+  GList *g;
+
+  g_mutex_lock (&vod->lock);
+  g_hash_table_remove (vod->media_loads, load->hash_key);
+
+  if (load->media) {
+    gss_vod_cache_insert_media (vod, load->hash_key, load->media);
+  }
+  g_mutex_unlock (&vod->lock);
+
+  for (g = load->streams; g; g = g_list_next (g)) {
+    GssVodLoad *stream_load = g->data;
+
+    if (load->media) {
+      stream_load->media = gss_adaptive_media_ref (load->media);
+      g_thread_pool_push (stream_load->pool, stream_load, NULL);
+    } else {
+      gss_vod_load_finish_stream (stream_load);
+    }
+  }
+
+  gss_vod_load_free (load);
+}
+
+static void
+gss_vod_load_finish_check (GssVodLoad * load)
+{
+  GssVod *vod = load->vod;
+
+  if (!load->is_current) {
+    g_mutex_lock (&vod->lock);
+    gss_vod_cache_invalidate_media (vod, load->media);
+    g_mutex_unlock (&vod->lock);
+  }
+
+  gss_vod_load_free (load);
+}
+
+static gboolean
+gss_vod_load_finish (gpointer data)
+{
+  GssVodLoad *load = data;
+
+  if (load->is_check) {
+    gss_vod_load_finish_check (load);
+  } else if (load->is_media) {
+    gss_vod_load_finish_media (load);
   } else {
+    gss_vod_load_finish_stream (load);
+  }
+
+  return FALSE;
+}
+
+/* Loads a stream on @pool and calls @callback from the calling
+ * thread's loop when done, with NULL if the title could not be loaded.
+ * Loads of the same stream, and of streams using the same media, are
+ * shared, and run on the pool of the load that started them. */
+static void
+gss_vod_load_adaptive (GssVod * vod, GThreadPool * pool, const char *key,
+    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type,
+    GssVodLoadCallback callback, gpointer user_data)
+{
+  GssPlayready *playready = GSS_OBJECT_SERVER (vod)->playready;
+  GssVodWaiter *waiter;
+  GssVodLoad *load;
+  GssAdaptiveMedia *media;
+  gboolean is_isoff;
+  char *hash_key;
+  char *media_key;
+
+  waiter = g_malloc0 (sizeof (GssVodWaiter));
+  waiter->callback = callback;
+  waiter->user_data = user_data;
+  waiter->context = g_main_context_ref_thread_default ();
+
+  hash_key = gss_vod_get_stream_key (key, version, drm_type, stream_type);
+  g_mutex_lock (&vod->lock);
+  load = g_hash_table_lookup (vod->loads, hash_key);
+  if (load) {
     g_free (hash_key);
+    load->waiters = g_list_append (load->waiters, waiter);
+    g_mutex_unlock (&vod->lock);
+    return;
+  }
+  vod->cache_misses++;
+
+  is_isoff = gss_adaptive_stream_is_isoff (stream_type);
+  load = gss_vod_load_new (vod, pool, hash_key, key, version, is_isoff);
+  load->drm_type = drm_type;
+  load->stream_type = stream_type;
+  gss_playready_get_key_seed (playready, load->key_seed);
+  load->license_url = gss_playready_get_license_url (playready);
+  load->waiters = g_list_append (load->waiters, waiter);
+  g_hash_table_insert (vod->loads, load->hash_key, load);
+
+  media_key = gss_vod_get_media_key (key, version, is_isoff);
+  media = g_hash_table_lookup (vod->media_cache, media_key);
+  if (media) {
+    g_free (media_key);
+    load->media = gss_adaptive_media_ref (media);
+    g_thread_pool_push (pool, load, NULL);
+  } else {
+    GssVodLoad *media_load;
+
+    media_load = g_hash_table_lookup (vod->media_loads, media_key);
+    if (media_load) {
+      g_free (media_key);
+    } else {
+      media_load = gss_vod_load_new (vod, pool, media_key, key, version,
+          is_isoff);
+      media_load->is_media = TRUE;
+      media_load->dir = gss_vod_get_dir (vod, key);
+      g_hash_table_insert (vod->media_loads, media_load->hash_key,
+          media_load);
+      g_thread_pool_push (pool, media_load, NULL);
+    }
+    media_load->streams = g_list_append (media_load->streams, load);
+  }
+  g_mutex_unlock (&vod->lock);
+}
+
+/* Parses @stream, in the same content-id/version/drm/stream-type form
+ * as the stream URLs, and queues it for loading. */
+static gboolean
+gss_vod_preload_add (GssVod * vod, const char *stream)
+{
+  GssVodPreload *preload;
+  const char *s = stream;
+  char *drm;
+  char *stream_type;
+
+  preload = g_malloc0 (sizeof (GssVodPreload));
+  preload->key = chomp (&s);
+  preload->version = chomp (&s);
+  drm = chomp (&s);
+  preload->drm_type = gss_drm_get_drm_type (drm);
+  stream_type = chomp (&s);
+  preload->stream_type = gss_adaptive_get_stream_type (stream_type);
+  g_free (drm);
+  g_free (stream_type);
+
+  if (preload->key[0] == 0 || preload->version[0] == 0 || s[0] != 0 ||
+      preload->drm_type == GSS_DRM_UNKNOWN ||
+      preload->stream_type == GSS_ADAPTIVE_STREAM_UNKNOWN) {
+    GST_WARNING ("invalid preload stream \"%s\"", stream);
+    gss_vod_preload_free (preload);
+    return FALSE;
+  }
+
+  g_mutex_lock (&vod->lock);
+  g_queue_push_tail (vod->preload_queue, preload);
+  vod->preload_total++;
+  g_mutex_unlock (&vod->lock);
+
+  return TRUE;
+}
+
+static void
+gss_vod_preload_file (GssVod * vod)
+{
+  GError *error = NULL;
+  char *contents;
+  char **lines;
+  int i;
+
+  if (vod->preload_file == NULL || vod->preload_file[0] == 0)
+    return;
+
+  if (!g_file_get_contents (vod->preload_file, &contents, NULL, &error)) {
+    GST_WARNING ("failed to read preload file: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  lines = g_strsplit (contents, "\n", 0);
+  for (i = 0; lines[i]; i++) {
+    g_strstrip (lines[i]);
+    if (lines[i][0] == 0 || lines[i][0] == '#')
+      continue;
+    gss_vod_preload_add (vod, lines[i]);
+  }
+  g_strfreev (lines);
+  g_free (contents);
+
+  GST_DEBUG ("preloading %d streams", vod->preload_total);
+}
+
+static gboolean
+gss_vod_preload_start (gpointer data)
+{
+  gss_vod_preload_next (GSS_VOD (data));
+
+  return FALSE;
+}
+
+static void
+gss_vod_preload_loaded (GssVod * vod, GssAdaptive * adaptive,
+    gpointer user_data)
+{
+  g_mutex_lock (&vod->lock);
+  vod->preload_running--;
+  vod->preload_done++;
+  if (adaptive == NULL) {
+    vod->preload_failed++;
+  }
+  if (vod->preload_done == vod->preload_total) {
+    GST_DEBUG ("preload done, %d failed", vod->preload_failed);
+  }
+  g_mutex_unlock (&vod->lock);
+
+  gss_vod_preload_next (vod);
+}
+
+/* Starts queued preloads, up to preload-concurrency at a time.  They
+ * run on preload_pool, so that a long preload list never holds up the
+ * load_pool threads loading titles for viewers. */
+static void
+gss_vod_preload_next (GssVod * vod)
+{
+  while (TRUE) {
+    GssVodPreload *preload;
+    GssAdaptive *adaptive;
+
+    g_mutex_lock (&vod->lock);
+    if (vod->preload_running >= vod->preload_concurrency ||
+        g_queue_is_empty (vod->preload_queue)) {
+      g_mutex_unlock (&vod->lock);
+      break;
+    }
+    preload = g_queue_pop_head (vod->preload_queue);
+    vod->preload_running++;
+    g_mutex_unlock (&vod->lock);
+
+    adaptive = gss_vod_lookup_adaptive (vod, preload->key, preload->version,
+        preload->drm_type, preload->stream_type);
+    if (adaptive) {
+      gss_adaptive_unref (adaptive);
+      g_mutex_lock (&vod->lock);
+      vod->preload_running--;
+      vod->preload_done++;
+      g_mutex_unlock (&vod->lock);
+    } else {
+      gss_vod_load_adaptive (vod, vod->preload_pool, preload->key,
+          preload->version, preload->drm_type, preload->stream_type,
+          gss_vod_preload_loaded, NULL);
+    }
+    gss_vod_preload_free (preload);
+  }
+}
+
+/**
+ * gss_vod_is_ready:
+ * @vod: a #GssVod
+ *
+ * Returns: TRUE once the preload-ready percentage of the streams
+ * queued for preloading have been loaded or have failed to load.
+ */
+gboolean
+gss_vod_is_ready (GssVod * vod)
+{
+  gboolean ready;
+
+  g_return_val_if_fail (GSS_IS_VOD (vod), FALSE);
+
+  g_mutex_lock (&vod->lock);
+  ready = (gint64) vod->preload_done * 100 >=
+      (gint64) vod->preload_ready * vod->preload_total;
+  g_mutex_unlock (&vod->lock);
+
+  return ready;
+}
+
+/* For load balancer health checks: 503 until gss_vod_is_ready() */
+static void
+gss_vod_get_ready_resource (GssTransaction * t)
+{
+  GssVod *vod = GSS_VOD (t->resource->priv);
+  GString *s = g_string_new ("");
+  int preload_done;
+  int preload_total;
+  gboolean ready;
+
+  t->s = s;
+
+  /* served on frontend threads */
+  g_mutex_lock (&vod->lock);
+  preload_done = vod->preload_done;
+  preload_total = vod->preload_total;
+  ready = (gint64) preload_done * 100 >=
+      (gint64) vod->preload_ready * preload_total;
+  g_mutex_unlock (&vod->lock);
+
+  if (ready) {
+    GSS_A ("ready\n");
+  } else {
+    soup_message_set_status (t->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+    GSS_P ("preloading %d of %d\n", preload_done, preload_total);
   }
-  return adaptive;
 }
 
 static void
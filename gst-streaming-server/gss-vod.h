@@ -26,6 +26,8 @@
 #include <glib/gstdio.h>
 
 #include "gss-server.h"
+#include "gss-adaptive.h"
+#include "gss-fragment-store.h"
 
 #define GSS_TYPE_VOD \
   (gss_vod_get_type())
@@ -45,13 +47,52 @@ typedef struct _GssVodClass GssVodClass;
 
 struct _GssVod {
   GssModule module;
+  /* protects the cache, loads and preload progress, which frontend
+   * threads use too */
+  GMutex lock;
+  /* adaptive streams by content ID, version, DRM and stream type, with
+   * the most recently used at the head of cache_lru */
   GHashTable *cache;
+  GQueue cache_lru;
+  /* parsed media shared by the variants in cache */
+  GHashTable *media_cache;
+  /* memory used by cache and media_cache */
+  gsize cache_bytes;
+  guint64 cache_hits;
+  guint64 cache_misses;
+  guint64 cache_evictions;
+  guint64 cache_invalidations;
+  /* loads running on load_pool or preload_pool, by cache and
+   * media_cache key */
+  GHashTable *loads;
+  GHashTable *media_loads;
+  GThreadPool *load_pool;
+  GThreadPool *preload_pool;
+  GssFragmentStore *store;
+  GThreadPool *fill_pool;
+  /* streams waiting to be preloaded, and progress */
+  GQueue *preload_queue;
+  int preload_total;
+  int preload_done;
+  int preload_failed;
+  int preload_running;
+  /* time taken by load_pool, in microseconds */
+  GssHistogram *media_load_time;
+  GssHistogram *stream_load_time;
 
   /* properties */
   char *endpoint;
   char *archive_dir;
   int dir_levels;
   int cache_size;
+  int cache_memory;
+  int check_interval;
+  int chunk_duration;
+  char *store_dir;
+  int store_size;
+  char *preload_file;
+  int preload_concurrency;
+  int preload_ready;
 };
 
 struct _GssVodClass {
@@ -62,6 +103,10 @@ struct _GssVodClass {
 GType gss_vod_get_type (void);
 
 GssVod *gss_vod_new (void);
+gboolean gss_vod_is_ready (GssVod *vod);
+GssAdaptive * gss_vod_lookup_adaptive (GssVod *vod, const char *key,
+    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type);
+void gss_vod_add_adaptive (GssVod *vod, GssAdaptive *adaptive);
 
 #endif
 
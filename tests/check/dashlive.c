@@ -0,0 +1,524 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-server.h"
+#include "gst-streaming-server/gss-program.h"
+#include "gst-streaming-server/gss-stream.h"
+#include "gst-streaming-server/gss-dash-live.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+#define GSS_ISM_SECOND 10000000
+
+/* 25 fps, a keyframe every 2 seconds */
+#define FRAME_RATE 25
+#define KEYFRAME_INTERVAL 50
+#define N_SEGMENTS 3
+
+/* avcC with one SPS and one PPS, 4-byte NAL lengths */
+static const guint8 avcc[] = {
+  0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x04,
+  0x67, 0x42, 0xc0, 0x1e, 0x01, 0x00, 0x02, 0x68,
+  0xce
+};
+
+static const guint8 key_frame[] = {
+  0x00, 0x00, 0x00, 0x05, 0x65, 0x88, 0x84, 0x00, 0x10
+};
+
+static const guint8 delta_frame[] = {
+  0x00, 0x00, 0x00, 0x03, 0x41, 0x9a, 0x00
+};
+
+#if GST_CHECK_VERSION(1,0,0)
+static gboolean
+accept_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  gst_event_unref (event);
+  return TRUE;
+}
+
+/* Sets the parser's caps on the pad handed to the handoff signal */
+static void
+set_video_caps (GstPad * pad, int width, int height)
+{
+  GstBuffer *codec_data;
+  GstCaps *caps;
+
+  codec_data = gst_buffer_new_wrapped (g_memdup (avcc, sizeof (avcc)),
+      sizeof (avcc));
+  caps = gst_caps_new_simple ("video/x-h264",
+      "stream-format", G_TYPE_STRING, "avc",
+      "alignment", G_TYPE_STRING, "au",
+      "width", G_TYPE_INT, width, "height", G_TYPE_INT, height,
+      "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+  gst_buffer_unref (codec_data);
+
+  gst_pad_send_event (pad, gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+}
+
+static GstPad *
+create_video_pad (void)
+{
+  GstPad *pad;
+
+  pad = gst_pad_new ("sink", GST_PAD_SINK);
+  gst_pad_set_event_function (pad, accept_event);
+  gst_pad_set_active (pad, TRUE);
+  gst_pad_send_event (pad, gst_event_new_stream_start ("dashlive"));
+  set_video_caps (pad, 640, 360);
+
+  return pad;
+}
+
+static void
+push_video_frame (GstElement * sink, GstPad * pad, int frame)
+{
+  GstBuffer *buffer;
+  gboolean is_sync = (frame % KEYFRAME_INTERVAL == 0);
+
+  if (is_sync) {
+    buffer = gst_buffer_new_wrapped (g_memdup (key_frame,
+            sizeof (key_frame)), sizeof (key_frame));
+  } else {
+    buffer = gst_buffer_new_wrapped (g_memdup (delta_frame,
+            sizeof (delta_frame)), sizeof (delta_frame));
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+  GST_BUFFER_DTS (buffer) = gst_util_uint64_scale (frame, GST_SECOND,
+      FRAME_RATE);
+  GST_BUFFER_PTS (buffer) = GST_BUFFER_DTS (buffer);
+
+  g_signal_emit_by_name (sink, "handoff", buffer, pad);
+  gst_buffer_unref (buffer);
+}
+
+static guint64
+get_tfdt (SoupBuffer * buffer)
+{
+  const guint8 *data = (const guint8 *) buffer->data;
+  gsize i;
+
+  for (i = 0; i + 16 <= buffer->length; i++) {
+    if (memcmp (data + i, "tfdt", 4) == 0) {
+      fail_unless (data[i + 4] == 1);
+      return GST_READ_UINT64_BE (data + i + 8);
+    }
+  }
+  fail ("no tfdt");
+  return 0;
+}
+
+static guint32
+get_sequence_number (SoupBuffer * buffer)
+{
+  const guint8 *data = (const guint8 *) buffer->data;
+  gsize i;
+
+  for (i = 0; i + 12 <= buffer->length; i++) {
+    if (memcmp (data + i, "mfhd", 4) == 0) {
+      return GST_READ_UINT32_BE (data + i + 8);
+    }
+  }
+  fail ("no mfhd");
+  return 0;
+}
+
+static int
+get_free_port (void)
+{
+  GInetAddress *inet_address;
+  GSocketAddress *address;
+  GSocket *socket;
+  int port;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  fail_unless (socket != NULL);
+  inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (inet_address, 0);
+  fail_unless (g_socket_bind (socket, address, TRUE, NULL));
+  g_object_unref (address);
+  g_object_unref (inet_address);
+
+  address = g_socket_get_local_address (socket, NULL);
+  port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+  g_object_unref (address);
+  g_object_unref (socket);
+
+  return port;
+}
+
+static void
+got_chunk (SoupMessage * msg, SoupBuffer * chunk, gpointer user_data)
+{
+  (*(int *) user_data)++;
+}
+
+static void
+request_done (SoupSession * session, SoupMessage * msg, gpointer user_data)
+{
+  *(gboolean *) user_data = TRUE;
+}
+
+/* Runs the main loop until *flag is set, for at most 10 seconds */
+static void
+wait_for (const int *flag)
+{
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (!*flag && g_get_monotonic_time () < end_time) {
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+}
+
+/* Segments are published at their MPD timeline position: the segment
+ * name, the SegmentTimeline entry and the tfdt in the segment all
+ * carry the same time.  Stopping the program unpublishes them along
+ * with the MPD. */
+GST_START_TEST (test_live_segments)
+{
+  GssServer *server;
+  GssProgram *program;
+  GssStream *stream;
+  GssDashLive *dash;
+  GssTransaction t = { 0 };
+  GstElement *pipeline;
+  GstElement *sink;
+  GstPad *pad;
+  char *expected;
+  int i;
+
+  gss_init ();
+
+  server = gss_server_new ();
+  program = gss_server_add_program (server, "live");
+  stream = gss_stream_new (GSS_STREAM_TYPE_M2TS_H264MAIN_AAC, 640, 360,
+      1000000);
+  gss_program_add_stream (program, stream);
+
+  pipeline = gst_parse_launch ("fakesink name=dashvideo "
+      "fakesink name=dashaudio", NULL);
+  fail_unless (pipeline != NULL);
+  gss_stream_add_dash (stream, pipeline);
+  dash = stream->dash_live;
+  fail_unless (dash != NULL);
+  fail_unless (program->dash.mpd_location != NULL);
+
+  pad = create_video_pad ();
+  fail_unless (gst_pad_has_current_caps (pad));
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "dashvideo");
+  /* the keyframe after the last segment finishes it */
+  for (i = 0; i <= N_SEGMENTS * KEYFRAME_INTERVAL; i++) {
+    push_video_frame (sink, pad, i);
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  fail_unless (program->dash.have_offset);
+  fail_unless (dash->video.init_buffer != NULL);
+  fail_unless (dash->video.n_segments == N_SEGMENTS);
+  for (i = 0; i < N_SEGMENTS; i++) {
+    GssDashLiveSegment *segment = &dash->video.segments[i];
+
+    fail_unless (segment->timestamp == program->dash.offset + i * 2 * GSS_ISM_SECOND);
+    fail_unless (segment->duration == 2 * GSS_ISM_SECOND);
+    fail_unless (segment->complete);
+    fail_unless (segment->chunks->len == 1);
+    fail_unless (g_hash_table_lookup (server->resources,
+            segment->location) != NULL);
+    fail_unless (get_tfdt (g_ptr_array_index (segment->chunks, 0)) ==
+        segment->timestamp);
+  }
+
+  t.server = server;
+  t.msg = soup_message_new ("GET", "http://localhost/live.mpd");
+  t.resource = g_hash_table_lookup (server->resources,
+      program->dash.mpd_location);
+  fail_unless (t.resource != NULL);
+  t.resource->get_callback (&t);
+  fail_unless (t.msg->status_code == SOUP_STATUS_OK);
+  expected = g_strdup_printf ("<S t=\"%" G_GUINT64_FORMAT "\" d=\"%d\" />",
+      dash->video.segments[0].timestamp, 2 * GSS_ISM_SECOND);
+  fail_unless (strstr (t.s->str, expected) != NULL);
+  g_free (expected);
+  g_string_free (t.s, TRUE);
+  g_object_unref (t.msg);
+
+  gss_program_set_state (program, GSS_PROGRAM_STATE_RUNNING);
+  gss_program_stop (program);
+  fail_unless (program->dash.mpd_location == NULL);
+  fail_unless (program->dash.availability_start_time == 0);
+  fail_unless (g_hash_table_lookup (server->resources, "/live.mpd") == NULL);
+  fail_unless (dash->video.n_segments == 0);
+  for (i = 0; i < N_SEGMENTS; i++) {
+    fail_unless (dash->video.segments[i].location == NULL);
+    fail_unless (dash->video.segments[i].chunks == NULL);
+  }
+
+  g_object_unref (sink);
+  g_object_unref (pad);
+  gst_object_unref (pipeline);
+  g_object_unref (server);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* All streams of a program share its timeline, so segments cut at the
+ * same timestamp get the same time in every representation, even when
+ * they are packaged at different times.  New caps replace the track. */
+GST_START_TEST (test_live_timeline)
+{
+  GssServer *server;
+  GssProgram *program;
+  GssStream *streams[2];
+  GstElement *pipelines[2];
+  GstElement *sinks[2];
+  GstPad *pad;
+  int i, j;
+
+  gss_init ();
+
+  server = gss_server_new ();
+  program = gss_server_add_program (server, "live");
+  pad = create_video_pad ();
+  for (j = 0; j < 2; j++) {
+    streams[j] = gss_stream_new (GSS_STREAM_TYPE_M2TS_H264MAIN_AAC, 640, 360,
+        1000000 * (j + 1));
+    gss_program_add_stream (program, streams[j]);
+    pipelines[j] = gst_parse_launch ("fakesink name=dashvideo "
+        "fakesink name=dashaudio", NULL);
+    fail_unless (pipelines[j] != NULL);
+    gss_stream_add_dash (streams[j], pipelines[j]);
+    sinks[j] = gst_bin_get_by_name (GST_BIN (pipelines[j]), "dashvideo");
+  }
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i <= N_SEGMENTS * KEYFRAME_INTERVAL; i++) {
+      push_video_frame (sinks[j], pad, i);
+    }
+    while (g_main_context_iteration (NULL, FALSE));
+    /* the second stream is packaged later */
+    g_usleep (50000);
+  }
+
+  fail_unless (program->dash.have_offset);
+  for (i = 0; i < N_SEGMENTS; i++) {
+    GssDashLiveSegment *segment = &streams[0]->dash_live->video.segments[i];
+    GssDashLiveSegment *other = &streams[1]->dash_live->video.segments[i];
+
+    fail_unless (segment->timestamp ==
+        program->dash.offset + i * 2 * GSS_ISM_SECOND);
+    fail_unless (other->timestamp == segment->timestamp);
+    fail_unless (strcmp (segment->location, other->location) != 0);
+  }
+
+  /* renegotiation */
+  fail_unless (streams[0]->dash_live->width == 640);
+  set_video_caps (pad, 1280, 720);
+  push_video_frame (sinks[0], pad, i);
+  while (g_main_context_iteration (NULL, FALSE));
+  fail_unless (streams[0]->dash_live->width == 1280);
+  fail_unless (streams[0]->dash_live->video.track->tkhd.width ==
+      (guint32) 1280 << 16);
+
+  for (j = 0; j < 2; j++) {
+    g_object_unref (sinks[j]);
+    gst_object_unref (pipelines[j]);
+  }
+  g_object_unref (pad);
+  g_object_unref (server);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* With a chunk duration of 500 ms, a segment is published as soon as
+ * its first 500 ms have been packaged instead of after the whole 2
+ * seconds, and a client requesting it then gets the rest of it as it
+ * is packaged, before the segment is complete. */
+GST_START_TEST (test_live_chunks)
+{
+  GssServer *server;
+  GssProgram *program;
+  GssStream *stream;
+  GssDashLive *dash;
+  GssDashLiveSegment *segment;
+  GssTransaction t = { 0 };
+  GstElement *pipeline;
+  GstElement *sink;
+  GstPad *pad;
+  SoupMessage *msg;
+  SoupBuffer *body;
+  char *expected;
+  char *url;
+  gboolean done = FALSE;
+  int n_chunks = 0;
+  guint32 last_sequence_number = 0;
+  gsize offset;
+  int frame;
+  guint i;
+
+  gss_init ();
+
+  server = g_object_new (GSS_TYPE_SERVER, "http-port", get_free_port (),
+      NULL);
+  fail_unless (server->server != NULL);
+  program = gss_server_add_program (server, "live");
+  g_object_set (program, "dash-chunk-duration", 500, NULL);
+  stream = gss_stream_new (GSS_STREAM_TYPE_M2TS_H264MAIN_AAC, 640, 360,
+      1000000);
+  gss_program_add_stream (program, stream);
+
+  pipeline = gst_parse_launch ("fakesink name=dashvideo "
+      "fakesink name=dashaudio", NULL);
+  fail_unless (pipeline != NULL);
+  gss_stream_add_dash (stream, pipeline);
+  dash = stream->dash_live;
+  fail_unless (dash->chunk_duration == GSS_ISM_SECOND / 2);
+
+  pad = create_video_pad ();
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "dashvideo");
+
+  /* the frame at 520 ms closes the first chunk */
+  for (frame = 0; frame <= 13; frame++) {
+    push_video_frame (sink, pad, frame);
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  fail_unless (dash->video.n_segments == 1);
+  segment = &dash->video.segments[0];
+  fail_if (segment->complete);
+  fail_unless (segment->chunks->len == 1);
+  fail_unless (segment->duration == 13 * GSS_ISM_SECOND / FRAME_RATE);
+  fail_unless (g_hash_table_lookup (server->resources,
+          segment->location) != NULL);
+
+  /* announced with its shortest duration, available one chunk into it */
+  t.server = server;
+  t.msg = soup_message_new ("GET", "http://localhost/live.mpd");
+  t.resource = g_hash_table_lookup (server->resources,
+      program->dash.mpd_location);
+  t.resource->get_callback (&t);
+  fail_unless (t.msg->status_code == SOUP_STATUS_OK);
+  fail_unless (strstr (t.s->str, "availabilityTimeOffset=\"1.500\"") != NULL);
+  expected = g_strdup_printf ("<S t=\"%" G_GUINT64_FORMAT "\" d=\"%d\" />",
+      segment->timestamp, 2 * GSS_ISM_SECOND);
+  fail_unless (strstr (t.s->str, expected) != NULL);
+  g_free (expected);
+  g_string_free (t.s, TRUE);
+  g_object_unref (t.msg);
+
+  url = g_strdup_printf ("http://127.0.0.1:%d%s", server->http_port,
+      segment->location);
+  msg = soup_message_new ("GET", url);
+  g_free (url);
+  g_signal_connect (msg, "got-chunk", G_CALLBACK (got_chunk), &n_chunks);
+  soup_session_queue_message (server->client_session, g_object_ref (msg),
+      request_done, &done);
+
+  /* the first chunk arrives while the segment is still being packaged */
+  wait_for (&n_chunks);
+  fail_unless (n_chunks > 0);
+  fail_if (done);
+  fail_if (segment->complete);
+  fail_unless (segment->waiters != NULL);
+
+  /* the keyframe at 2 s completes the segment */
+  for (; frame <= KEYFRAME_INTERVAL; frame++) {
+    push_video_frame (sink, pad, frame);
+  }
+  wait_for (&done);
+  fail_unless (done);
+  fail_unless (segment->complete);
+  fail_unless (segment->waiters == NULL);
+  fail_unless (segment->duration == 2 * GSS_ISM_SECOND);
+  fail_unless (segment->chunks->len == 4);
+
+  fail_unless (msg->status_code == SOUP_STATUS_OK);
+  body = soup_message_body_flatten (msg->response_body);
+  fail_unless (body->length == segment->size);
+  offset = 0;
+  for (i = 0; i < segment->chunks->len; i++) {
+    SoupBuffer *chunk = g_ptr_array_index (segment->chunks, i);
+    guint32 sequence_number = get_sequence_number (chunk);
+
+    fail_unless (memcmp ((const guint8 *) body->data + offset, chunk->data,
+            chunk->length) == 0);
+    offset += chunk->length;
+
+    fail_unless (i == 0 || sequence_number > last_sequence_number);
+    last_sequence_number = sequence_number;
+  }
+  fail_unless (get_tfdt (g_ptr_array_index (segment->chunks, 0)) ==
+      segment->timestamp);
+  soup_buffer_free (body);
+  g_object_unref (msg);
+
+  /* the first chunk of the next segment continues the numbering */
+  for (; frame <= KEYFRAME_INTERVAL + 13; frame++) {
+    push_video_frame (sink, pad, frame);
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+  fail_unless (dash->video.n_segments == 2);
+  segment = &dash->video.segments[1];
+  fail_unless (segment->timestamp == program->dash.offset + 2 * GSS_ISM_SECOND);
+  fail_unless (get_sequence_number (g_ptr_array_index (segment->chunks,
+              0)) > last_sequence_number);
+
+  g_object_unref (sink);
+  g_object_unref (pad);
+  gst_object_unref (pipeline);
+  g_object_unref (server);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+#endif
+
+static Suite *
+gss_dash_live_suite (void)
+{
+  Suite *s = suite_create ("GssDashLive");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+#if GST_CHECK_VERSION(1,0,0)
+  tcase_add_test (tc_chain, test_live_segments);
+  tcase_add_test (tc_chain, test_live_timeline);
+  tcase_add_test (tc_chain, test_live_chunks);
+#endif
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_dash_live);
@@ -0,0 +1,147 @@
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_VALGRIND_H
+# include <valgrind/valgrind.h>
+#else
+# define RUNNING_ON_VALGRIND FALSE
+#endif
+
+#include "gst-streaming-server/gss-fragment-store.h"
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+static char *
+create_store_dir (void)
+{
+  char *dir;
+
+  dir = g_dir_make_tmp ("gss-store-XXXXXX", NULL);
+  fail_unless (dir != NULL);
+
+  return dir;
+}
+
+static void
+remove_store_dir (const char *path)
+{
+  GDir *dir;
+  const char *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return;
+  while ((name = g_dir_read_name (dir))) {
+    char *child = g_build_filename (path, name, NULL);
+    if (g_file_test (child, G_FILE_TEST_IS_DIR)) {
+      remove_store_dir (child);
+    } else {
+      g_unlink (child);
+    }
+    g_free (child);
+  }
+  g_dir_close (dir);
+  g_rmdir (path);
+}
+
+static void
+check_lookup (GssFragmentStore * store, const char *key, guint8 fill,
+    gsize size)
+{
+  GMappedFile *mapped;
+  const guint8 *data;
+  gsize i;
+
+  mapped = gss_fragment_store_lookup (store, key);
+  fail_unless (mapped != NULL);
+  fail_unless (g_mapped_file_get_length (mapped) == size);
+  data = (const guint8 *) g_mapped_file_get_contents (mapped);
+  for (i = 0; i < size; i++) {
+    fail_unless (data[i] == fill);
+  }
+  g_mapped_file_unref (mapped);
+}
+
+GST_START_TEST (test_store)
+{
+  GssFragmentStore *store;
+  guint8 data[1000];
+  guint8 *big;
+  guint64 size;
+  guint64 hits;
+  guint64 misses;
+  int n_files;
+  char *dir;
+
+  dir = create_store_dir ();
+  store = gss_fragment_store_new (dir, 2500);
+
+  fail_unless (gss_fragment_store_lookup (store, "a") == NULL);
+
+  memset (data, 'a', sizeof (data));
+  gss_fragment_store_add (store, "a", data, sizeof (data));
+  memset (data, 'b', sizeof (data));
+  gss_fragment_store_add (store, "b", data, sizeof (data));
+  fail_unless (gss_fragment_store_contains (store, "a"));
+  fail_unless (gss_fragment_store_contains (store, "b"));
+  check_lookup (store, "a", 'a', sizeof (data));
+
+  /* "b" is now the least recently used */
+  memset (data, 'c', sizeof (data));
+  gss_fragment_store_add (store, "c", data, sizeof (data));
+  fail_unless (gss_fragment_store_contains (store, "a"));
+  fail_if (gss_fragment_store_contains (store, "b"));
+  fail_unless (gss_fragment_store_contains (store, "c"));
+
+  /* larger than the whole store */
+  big = g_malloc0 (3000);
+  gss_fragment_store_add (store, "big", big, 3000);
+  fail_if (gss_fragment_store_contains (store, "big"));
+  fail_unless (gss_fragment_store_contains (store, "a"));
+  g_free (big);
+
+  gss_fragment_store_get_stats (store, &n_files, &size, &hits, &misses);
+  fail_unless (n_files == 2);
+  fail_unless (size == 2000);
+  fail_unless (hits == 1);
+  fail_unless (misses == 1);
+  gss_fragment_store_free (store);
+
+  /* contents survive a restart */
+  store = gss_fragment_store_new (dir, 2500);
+  check_lookup (store, "a", 'a', sizeof (data));
+  check_lookup (store, "c", 'c', sizeof (data));
+  fail_if (gss_fragment_store_contains (store, "b"));
+  gss_fragment_store_free (store);
+
+  /* and are trimmed to a smaller budget */
+  store = gss_fragment_store_new (dir, 1500);
+  gss_fragment_store_get_stats (store, &n_files, &size, NULL, NULL);
+  fail_unless (size <= 1500);
+  gss_fragment_store_free (store);
+
+  remove_store_dir (dir);
+  g_free (dir);
+}
+
+GST_END_TEST;
+
+
+static Suite *
+gss_fragment_store_suite (void)
+{
+  Suite *s = suite_create ("GssFragmentStore");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_store);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_fragment_store);
@@ -0,0 +1,110 @@
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-histogram.h"
+#include <gst/check/gstcheck.h>
+
+static void
+check_percentile (GssHistogram * histogram, double percentile,
+    gint64 expected)
+{
+  gint64 value;
+
+  gss_histogram_get_percentiles (histogram, 1, &percentile, &value);
+  /* values are rounded up to the end of their bucket */
+  fail_unless (value >= expected);
+  fail_unless (value <= expected + expected / 16);
+}
+
+GST_START_TEST (test_histogram)
+{
+  GssHistogram *histogram;
+  const double percentiles[] = { 50, 100 };
+  gint64 values[2];
+  int i;
+
+  histogram = gss_histogram_new ();
+
+  fail_unless (gss_histogram_get_percentiles (histogram, 2, percentiles,
+          values) == 0);
+  fail_unless (values[0] == 0);
+  fail_unless (values[1] == 0);
+
+  /* small values are exact */
+  for (i = 0; i < 10; i++) {
+    gss_histogram_add (histogram, i);
+  }
+  check_percentile (histogram, 50, 4);
+  fail_unless (gss_histogram_get_percentiles (histogram, 2, percentiles,
+          values) == 10);
+  fail_unless (values[0] == 4);
+  fail_unless (values[1] == 9);
+  fail_unless (gss_histogram_get_sum (histogram) == 45);
+  gss_histogram_free (histogram);
+
+  histogram = gss_histogram_new ();
+  for (i = 1; i <= 100000; i++) {
+    gss_histogram_add (histogram, i);
+  }
+  check_percentile (histogram, 50, 50000);
+  check_percentile (histogram, 90, 90000);
+  check_percentile (histogram, 99, 99000);
+  check_percentile (histogram, 99.9, 99900);
+  check_percentile (histogram, 100, 100000);
+
+  /* out of range values are clamped */
+  gss_histogram_add (histogram, -1);
+  gss_histogram_add (histogram, G_GINT64_CONSTANT (1) << 50);
+  fail_unless (gss_histogram_get_percentiles (histogram, 2, percentiles,
+          values) == 100002);
+  fail_unless (values[1] > 100000);
+  gss_histogram_free (histogram);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_latency)
+{
+  GssLatency *latency;
+
+  latency = gss_latency_new ("/vod/");
+  fail_unless (latency->total[1] == NULL);
+
+  gss_latency_add (latency, 200, 1000, 100, 0);
+  gss_latency_add (latency, 206, 2000, 100, 1500);
+  gss_latency_add (latency, 503, 10, 10, 0);
+  /* transport errors */
+  gss_latency_add (latency, 7, 10, 10, 0);
+
+  fail_unless (latency->total[0] == NULL);
+  fail_unless (latency->total[1] != NULL);
+  fail_unless (latency->total[2] == NULL);
+  fail_unless (latency->total[4] != NULL);
+  fail_unless (latency->async != NULL);
+  check_percentile (latency->total[1], 100, 2000);
+  check_percentile (latency->async, 50, 1500);
+  check_percentile (latency->sync, 100, 100);
+
+  gss_latency_free (latency);
+}
+
+GST_END_TEST;
+
+
+static Suite *
+gss_histogram_suite (void)
+{
+  Suite *s = suite_create ("GssHistogram");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_histogram);
+  tcase_add_test (tc_chain, test_latency);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_histogram);
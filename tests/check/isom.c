@@ -0,0 +1,149 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-isom.h"
+#include <gst/check/gstcheck.h>
+
+#define GSS_ISM_SECOND 10000000
+
+/* 25 fps */
+#define FRAME_DURATION (GSS_ISM_SECOND / 25)
+#define FRAGMENT_DURATION (2 * GSS_ISM_SECOND)
+#define CHUNK_DURATION (GSS_ISM_SECOND / 5)
+
+static GssIsomFragment *
+create_fragment (int n_samples, guint64 timestamp)
+{
+  GssIsomFragment *fragment;
+  GRand *rand;
+  int i;
+
+  rand = g_rand_new_with_seed (n_samples);
+
+  fragment = gss_isom_fragment_new ();
+  fragment->tfhd.track_id = 1;
+  fragment->tfhd.default_sample_flags = 0x000100c0;
+  fragment->tfdt.present = TRUE;
+  fragment->tfdt.version = 1;
+  fragment->tfdt.start_time = timestamp;
+  fragment->timestamp = timestamp;
+  fragment->trun.version = 1;
+  fragment->trun.flags = 0x0b01;
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
+  fragment->sglist = gss_sglist_new (n_samples);
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->trun.samples[i].duration = FRAME_DURATION;
+    fragment->trun.samples[i].size = g_rand_int_range (rand, 1000, 30000);
+    fragment->sglist->chunks[i].size = fragment->trun.samples[i].size;
+    fragment->duration += FRAME_DURATION;
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+
+  g_rand_free (rand);
+
+  return fragment;
+}
+
+/* The packager adds one chunk duration of latency instead of one
+ * fragment duration: the first chunk can be sent once its own samples
+ * are available, not the whole fragment. */
+GST_START_TEST (test_chunk_latency)
+{
+  GssIsomFragment *fragment;
+  guint64 timestamp = 5 * GSS_ISM_SECOND;
+  guint64 first_chunk_latency = 0;
+  guint64 duration = 0;
+  gsize mdat_size = 8;
+  int first_sample;
+  int n_chunks = 0;
+
+  fragment = create_fragment (FRAGMENT_DURATION / FRAME_DURATION, timestamp);
+
+  first_sample = 0;
+  while (first_sample < fragment->trun.sample_count) {
+    GssIsomFragment *chunk;
+    int n_samples;
+
+    n_samples = gss_isom_fragment_get_chunk_length (fragment, first_sample,
+        CHUNK_DURATION);
+    fail_unless (n_samples > 0);
+
+    chunk = gss_isom_fragment_new_chunk (fragment, first_sample, n_samples);
+    fail_unless (chunk->timestamp == timestamp + duration);
+    fail_unless (chunk->tfdt.start_time == chunk->timestamp);
+    fail_unless (chunk->trun.sample_count == n_samples);
+    /* only the last chunk may be short */
+    if (first_sample + n_samples < fragment->trun.sample_count) {
+      fail_unless (chunk->duration >= CHUNK_DURATION);
+      fail_unless (chunk->duration < CHUNK_DURATION + FRAME_DURATION);
+    }
+    if (n_chunks == 0) {
+      first_chunk_latency = chunk->duration;
+    }
+
+    gss_isom_fragment_serialize (chunk, &chunk->moof_data, &chunk->moof_size,
+        TRUE);
+    fail_unless (chunk->moof_data != NULL);
+    fail_unless (chunk->moof_size > 8);
+
+    duration += chunk->duration;
+    mdat_size += chunk->mdat_size - 8;
+    n_chunks++;
+    first_sample += n_samples;
+    gss_isom_fragment_free_chunk (chunk);
+  }
+
+  fail_unless (duration == fragment->duration);
+  fail_unless (mdat_size == fragment->mdat_size);
+  fail_unless (n_chunks == FRAGMENT_DURATION / CHUNK_DURATION);
+
+  GST_INFO ("first chunk after %" G_GUINT64_FORMAT " ms instead of %"
+      G_GUINT64_FORMAT " ms", first_chunk_latency / 10000,
+      (guint64) fragment->duration / 10000);
+  fail_unless (first_chunk_latency * 5 <= fragment->duration);
+
+  /* without a chunk duration, the fragment is one chunk */
+  fail_unless (gss_isom_fragment_get_chunk_length (fragment, 0,
+          fragment->duration) == fragment->trun.sample_count);
+
+  gss_isom_fragment_free (fragment);
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_isom_suite (void)
+{
+  Suite *s = suite_create ("GssIsom");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_chunk_latency);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_isom);
@@ -0,0 +1,209 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-server.h"
+#include "gst-streaming-server/gss-html.h"
+#include "gst-streaming-server/gss-log.h"
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+/* GSS_LOG_RING_SIZE in gss-log.c */
+#define RING_SIZE 4096
+
+static int n_flood;
+
+/* Logs the transaction n_flood times on top of the record written when
+ * it finishes */
+static void
+get_flood (GssTransaction * t)
+{
+  int i;
+
+  for (i = 0; i < n_flood; i++) {
+    gss_log_transaction (t);
+  }
+  t->s = g_string_new ("ok\n");
+}
+
+static int
+get_free_port (void)
+{
+  GInetAddress *inet_address;
+  GSocketAddress *address;
+  GSocket *socket;
+  int port;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  fail_unless (socket != NULL);
+  inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (inet_address, 0);
+  fail_unless (g_socket_bind (socket, address, TRUE, NULL));
+  g_object_unref (address);
+  g_object_unref (inet_address);
+
+  address = g_socket_get_local_address (socket, NULL);
+  port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+  g_object_unref (address);
+  g_object_unref (socket);
+
+  return port;
+}
+
+static void
+http_get_done (SoupSession * session, SoupMessage * msg, gpointer user_data)
+{
+  g_main_loop_quit ((GMainLoop *) user_data);
+}
+
+/* Requests path from the server over HTTP, running the main loop until
+ * the response is in, and returns the status code */
+static guint
+http_get (GssServer * server, const char *path)
+{
+  GMainLoop *loop;
+  SoupMessage *msg;
+  guint status;
+  char *url;
+
+  url = g_strdup_printf ("http://127.0.0.1:%d%s", server->http_port, path);
+  msg = soup_message_new ("GET", url);
+  g_free (url);
+  fail_unless (msg != NULL);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  soup_session_queue_message (server->client_session, g_object_ref (msg),
+      http_get_done, loop);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  status = msg->status_code;
+  g_object_unref (msg);
+
+  return status;
+}
+
+/* Waits for the writer thread to have either written or dropped
+ * n_records records */
+static void
+wait_records (guint64 n_records, guint64 * n_logged, guint64 * n_dropped)
+{
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (g_get_monotonic_time () < end_time) {
+    gss_log_get_access_log_stats (n_logged, n_dropped);
+    if (*n_logged + *n_dropped >= n_records)
+      return;
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+  fail ("%" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " records accounted for",
+      *n_logged + *n_dropped, n_records);
+}
+
+/* Records logged faster than the writer thread drains the ring are
+ * dropped and counted, and every record is either written or counted
+ * as dropped. */
+GST_START_TEST (test_ring_overflow)
+{
+  GssServer *server;
+  guint64 n_logged;
+  guint64 n_dropped;
+  guint64 n_records;
+  char *dir;
+  char *filename;
+  char *contents;
+  char *s;
+  guint64 n_lines;
+
+  gss_init ();
+
+  dir = g_dir_make_tmp ("gss-log-XXXXXX", NULL);
+  fail_unless (dir != NULL);
+  filename = g_build_filename (dir, "access.log", NULL);
+  gss_log_set_access_log (filename, 0);
+
+  server = g_object_new (GSS_TYPE_SERVER, "http-port", get_free_port (),
+      NULL);
+  fail_unless (server->server != NULL);
+  gss_server_add_resource (server, "/flood", 0, GSS_TEXT_PLAIN, get_flood,
+      NULL, NULL, NULL);
+
+  /* Once the writer has written a lone record, it sleeps for its flush
+   * interval, which is much longer than logging a few ring sizes takes */
+  n_flood = 0;
+  fail_unless (http_get (server, "/flood") == SOUP_STATUS_OK);
+  wait_records (1, &n_logged, &n_dropped);
+  fail_unless (n_logged == 1);
+  fail_unless (n_dropped == 0);
+
+  n_flood = 3 * RING_SIZE;
+  fail_unless (http_get (server, "/flood") == SOUP_STATUS_OK);
+  n_records = 1 + n_flood + 1;
+  wait_records (n_records, &n_logged, &n_dropped);
+  fail_unless (n_logged + n_dropped == n_records);
+  fail_unless (n_dropped > 0);
+  fail_unless (n_logged >= RING_SIZE, "%" G_GUINT64_FORMAT " logged",
+      n_logged);
+
+  /* only records that were written were counted as logged */
+  fail_unless (g_file_get_contents (filename, &contents, NULL, NULL));
+  n_lines = 0;
+  for (s = contents; *s; s++) {
+    if (*s == '\n')
+      n_lines++;
+  }
+  fail_unless (n_lines == n_logged, "%" G_GUINT64_FORMAT " lines",
+      n_lines);
+  g_free (contents);
+
+  g_object_unref (server);
+  gss_deinit ();
+
+  g_unlink (filename);
+  g_rmdir (dir);
+  g_free (filename);
+  g_free (dir);
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_log_suite (void)
+{
+  Suite *s = suite_create ("GssLog");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_ring_overflow);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_log);
@@ -0,0 +1,185 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-metrics.h"
+#include "gst-streaming-server/gss-histogram.h"
+#include <gst/check/gstcheck.h>
+
+#define N_THREADS 12
+#define N_ADDS 100000
+
+static GssCounter counter;
+
+static gpointer
+add_thread (gpointer data)
+{
+  int i;
+
+  for (i = 0; i < N_ADDS; i++) {
+    gss_counter_add (&counter, 3);
+    gss_counter_add (&counter, -1);
+  }
+
+  return NULL;
+}
+
+GST_START_TEST (test_counter)
+{
+  GThread *threads[N_THREADS];
+  int i;
+
+  /* all zeroes is a counter at 0 */
+  memset (&counter, 0, sizeof (counter));
+  fail_unless (gss_counter_get (&counter) == 0);
+
+  gss_counter_add (&counter, 10);
+  gss_counter_add (&counter, -4);
+  fail_unless (gss_counter_get (&counter) == 6);
+
+  /* more threads than shards, so some share one */
+  for (i = 0; i < N_THREADS; i++) {
+    threads[i] = g_thread_new ("add", add_thread, NULL);
+  }
+  for (i = 0; i < N_THREADS; i++) {
+    g_thread_join (threads[i]);
+  }
+  fail_unless (gss_counter_get (&counter) ==
+      6 + (gint64) N_THREADS * N_ADDS * 2);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_label)
+{
+  GString *s;
+
+  s = g_string_new ("");
+  gss_metrics_append_label (s, "resource", "/vod/");
+  fail_unless_equals_string (s->str, "resource=\"/vod/\"");
+
+  g_string_truncate (s, 0);
+  gss_metrics_append_label (s, "stream", "a \"b\"\\c\nd");
+  fail_unless_equals_string (s->str, "stream=\"a \\\"b\\\"\\\\c\\nd\"");
+
+  g_string_truncate (s, 0);
+  gss_metrics_append_label (s, "program", "");
+  fail_unless_equals_string (s->str, "program=\"\"");
+
+  g_string_free (s, TRUE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_quantiles)
+{
+  GssHistogram *histogram;
+  GString *s;
+
+  histogram = gss_histogram_new ();
+  gss_histogram_add (histogram, 1000000);
+  gss_histogram_add (histogram, 2000000);
+
+  s = g_string_new ("");
+  fail_unless (gss_metrics_append_quantiles (s, "t_seconds", "a=\"b\"",
+          histogram) == 2);
+  fail_unless (strstr (s->str, "t_seconds{a=\"b\",quantile=\"0.5\"} ")
+      != NULL);
+  fail_unless (strstr (s->str, "\nt_seconds_sum{a=\"b\"} 3\n") != NULL);
+  fail_unless (g_str_has_suffix (s->str, "\nt_seconds_count{a=\"b\"} 2\n"));
+
+  g_string_truncate (s, 0);
+  gss_metrics_append_quantiles (s, "t_seconds", "", histogram);
+  fail_unless (strstr (s->str, "t_seconds{quantile=\"0.999\"} ") != NULL);
+  fail_unless (strstr (s->str, "\nt_seconds_sum 3\n") != NULL);
+  fail_unless (g_str_has_suffix (s->str, "\nt_seconds_count 2\n"));
+
+  g_string_free (s, TRUE);
+  gss_histogram_free (histogram);
+}
+
+GST_END_TEST;
+
+/* more than 2^31 bits/s once a few clients are connected */
+#define CLIENT_BITRATE 1000000000
+#define N_CLIENTS_PER_THREAD 4
+#define N_CLIENT_ROUNDS 20000
+
+static GssMetrics *metrics;
+
+static gpointer
+client_thread (gpointer data)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < N_CLIENT_ROUNDS; i++) {
+    for (j = 0; j < N_CLIENTS_PER_THREAD; j++) {
+      gss_metrics_add_client (metrics, CLIENT_BITRATE);
+    }
+    for (j = 0; j < N_CLIENTS_PER_THREAD; j++) {
+      gss_metrics_remove_client (metrics, CLIENT_BITRATE);
+    }
+  }
+
+  return NULL;
+}
+
+GST_START_TEST (test_clients)
+{
+  GThread *threads[N_THREADS];
+  gint64 max_clients;
+  int i;
+
+  metrics = gss_metrics_new ();
+  for (i = 0; i < 3; i++) {
+    gss_metrics_add_client (metrics, CLIENT_BITRATE);
+  }
+  fail_unless (gss_metrics_get_n_clients (metrics) == 3);
+  fail_unless (gss_metrics_get_bitrate (metrics) ==
+      3 * (gint64) CLIENT_BITRATE);
+  for (i = 0; i < 3; i++) {
+    gss_metrics_remove_client (metrics, CLIENT_BITRATE);
+  }
+  fail_unless (gss_metrics_get_n_clients (metrics) == 0);
+  fail_unless (gss_metrics_get_bitrate (metrics) == 0);
+  fail_unless (gss_metrics_get_max_clients (metrics) == 3);
+  fail_unless (gss_metrics_get_max_bitrate (metrics) ==
+      3 * (gint64) CLIENT_BITRATE);
+
+  /* no update is lost, and the maxima match each other */
+  for (i = 0; i < N_THREADS; i++) {
+    threads[i] = g_thread_new ("client", client_thread, NULL);
+  }
+  for (i = 0; i < N_THREADS; i++) {
+    g_thread_join (threads[i]);
+  }
+  fail_unless (gss_metrics_get_n_clients (metrics) == 0);
+  fail_unless (gss_metrics_get_bitrate (metrics) == 0);
+  max_clients = gss_metrics_get_max_clients (metrics);
+  fail_unless (max_clients >= N_CLIENTS_PER_THREAD);
+  fail_unless (max_clients <= N_THREADS * N_CLIENTS_PER_THREAD);
+  fail_unless (gss_metrics_get_max_bitrate (metrics) ==
+      max_clients * CLIENT_BITRATE);
+
+  gss_metrics_free (metrics);
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_metrics_suite (void)
+{
+  Suite *s = suite_create ("GssMetrics");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_counter);
+  tcase_add_test (tc_chain, test_clients);
+  tcase_add_test (tc_chain, test_label);
+  tcase_add_test (tc_chain, test_quantiles);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_metrics);
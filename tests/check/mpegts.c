@@ -0,0 +1,349 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_VALGRIND_H
+# include <valgrind/valgrind.h>
+#else
+# define RUNNING_ON_VALGRIND FALSE
+#endif
+
+#include "gst-streaming-server/gss-mpegts.h"
+#include "gst-streaming-server/gss-sglist.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+/* avcC with one SPS and one PPS, 4-byte NAL lengths */
+static const guint8 avcc[] = {
+  0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x04,
+  0x67, 0x42, 0xc0, 0x1e, 0x01, 0x00, 0x02, 0x68,
+  0xce
+};
+
+/* AAC LC, 44.1 kHz, stereo */
+static const guint8 aac_config[] = { 0x12, 0x10 };
+
+static const guint8 video_samples[] = {
+  0x00, 0x00, 0x00, 0x05, 0x65, 0x88, 0x84, 0x00, 0x10,
+  0x00, 0x00, 0x00, 0x03, 0x41, 0x9a, 0x00
+};
+static const int video_sizes[] = { 9, 7 };
+
+static const guint8 audio_samples[] = {
+  0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c,
+  0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c
+};
+static const int audio_sizes[] = { 6, 6 };
+
+static GssIsomFragment *
+create_fragment (const int *sizes, int n_samples, guint32 duration)
+{
+  GssIsomFragment *fragment;
+  int i;
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (n_samples);
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->trun.samples[i].size = sizes[i];
+    fragment->trun.samples[i].duration = duration;
+    fragment->mdat_size += sizes[i];
+  }
+  fragment->duration = duration * n_samples;
+
+  return fragment;
+}
+
+static guint8 *
+mux_test_segment (gsize * size)
+{
+  GssIsomTrack video_track;
+  GssIsomTrack audio_track;
+  GssIsomFragment *video_fragment;
+  GssIsomFragment *audio_fragment;
+  guint8 *data;
+
+  memset (&video_track, 0, sizeof (video_track));
+  video_track.esds.codec_data = (guint8 *) avcc;
+  video_track.esds.codec_data_len = sizeof (avcc);
+  memset (&audio_track, 0, sizeof (audio_track));
+  audio_track.esds.codec_data = (guint8 *) aac_config;
+  audio_track.esds.codec_data_len = sizeof (aac_config);
+
+  /* 30 fps video, 1024 sample AAC frames, in 10 MHz units */
+  video_fragment = create_fragment (video_sizes, 2, 333333);
+  audio_fragment = create_fragment (audio_sizes, 2, 232199);
+
+  data = gss_mpegts_mux_fragments (&video_track, video_fragment,
+      video_samples, &audio_track, audio_fragment, audio_samples, size);
+
+  gss_isom_fragment_free (video_fragment);
+  gss_isom_fragment_free (audio_fragment);
+
+  return data;
+}
+
+static int
+packet_get_pid (const guint8 * packet)
+{
+  return ((packet[1] & 0x1f) << 8) | packet[2];
+}
+
+static const guint8 *
+packet_get_payload (const guint8 * packet)
+{
+  if (packet[3] & 0x20) {
+    return packet + 5 + packet[4];
+  }
+  return packet + 4;
+}
+
+GST_START_TEST (test_mpegts_packets)
+{
+  guint8 *data;
+  gsize size;
+  gsize i;
+  const guint8 *payload;
+  gboolean have_video = FALSE;
+  gboolean have_audio = FALSE;
+
+  data = mux_test_segment (&size);
+
+  fail_unless (data != NULL);
+  fail_unless (size > 0);
+  fail_unless (size % GSS_MPEGTS_PACKET_SIZE == 0);
+
+  for (i = 0; i < size; i += GSS_MPEGTS_PACKET_SIZE) {
+    fail_unless (data[i] == 0x47);
+  }
+
+  fail_unless (packet_get_pid (data) == 0);
+  fail_unless (packet_get_pid (data + GSS_MPEGTS_PACKET_SIZE) ==
+      GSS_MPEGTS_PID_PMT);
+
+  for (i = 2 * GSS_MPEGTS_PACKET_SIZE; i < size; i += GSS_MPEGTS_PACKET_SIZE) {
+    const guint8 *packet = data + i;
+
+    if (!(packet[1] & 0x40))
+      continue;
+    payload = packet_get_payload (packet);
+    fail_unless (payload[0] == 0x00 && payload[1] == 0x00 &&
+        payload[2] == 0x01);
+
+    if (packet_get_pid (packet) == GSS_MPEGTS_PID_VIDEO) {
+      if (!have_video) {
+        const guint8 *es = payload + 9 + payload[8];
+        /* first video PES is a keyframe: AUD, then SPS */
+        fail_unless (packet[3] & 0x20);
+        fail_unless (packet[5] & 0x40);
+        fail_unless (payload[3] == 0xe0);
+        fail_unless (memcmp (es, "\000\000\000\001\011", 5) == 0);
+        fail_unless (memcmp (es + 6, "\000\000\000\001\147", 5) == 0);
+      }
+      have_video = TRUE;
+    } else if (packet_get_pid (packet) == GSS_MPEGTS_PID_AUDIO) {
+      const guint8 *es = payload + 9 + payload[8];
+      fail_unless (payload[3] == 0xc0);
+      /* ADTS sync word */
+      fail_unless (es[0] == 0xff && (es[1] & 0xf0) == 0xf0);
+      have_audio = TRUE;
+    } else {
+      fail ("unexpected pid");
+    }
+  }
+
+  fail_unless (have_video);
+  fail_unless (have_audio);
+
+  g_free (data);
+}
+
+GST_END_TEST;
+
+/* A fragment with a keyframe in the middle, as cut from a live stream
+ * that carries per-sample flags */
+GST_START_TEST (test_mpegts_keyframes)
+{
+  static const guint8 samples[] = {
+    0x00, 0x00, 0x00, 0x03, 0x41, 0x9a, 0x00,
+    0x00, 0x00, 0x00, 0x03, 0x41, 0x9a, 0x01,
+    0x00, 0x00, 0x00, 0x05, 0x65, 0x88, 0x84, 0x00, 0x10
+  };
+  static const int sizes[] = { 7, 7, 9 };
+  /* the first sample is only flagged non-sync, and still gets SPS/PPS
+   * since it starts the segment */
+  static const gboolean expected[] = { TRUE, FALSE, TRUE };
+  GssIsomTrack video_track;
+  GssIsomFragment *fragment;
+  guint8 *data;
+  gsize size;
+  gsize i;
+  int n = 0;
+
+  memset (&video_track, 0, sizeof (video_track));
+  video_track.esds.codec_data = (guint8 *) avcc;
+  video_track.esds.codec_data_len = sizeof (avcc);
+
+  fragment = create_fragment (sizes, 3, 333333);
+  fragment->trun.flags = TR_SAMPLE_FLAGS;
+  fragment->trun.samples[0].flags = 0x00010000;
+  fragment->trun.samples[1].flags = 0x00010000;
+  fragment->trun.samples[2].flags = 0x02000000;
+
+  data = gss_mpegts_mux_fragments (&video_track, fragment, samples,
+      NULL, NULL, NULL, &size);
+  fail_unless (data != NULL);
+
+  for (i = 2 * GSS_MPEGTS_PACKET_SIZE; i < size; i += GSS_MPEGTS_PACKET_SIZE) {
+    const guint8 *packet = data + i;
+    const guint8 *payload;
+    const guint8 *es;
+    gboolean random_access;
+    gboolean has_sps;
+
+    if (!(packet[1] & 0x40))
+      continue;
+    fail_unless (packet_get_pid (packet) == GSS_MPEGTS_PID_VIDEO);
+    fail_unless (n < 3);
+
+    payload = packet_get_payload (packet);
+    es = payload + 9 + payload[8];
+    random_access = (packet[3] & 0x20) && packet[4] > 0 && (packet[5] & 0x40);
+    has_sps = memcmp (es + 6, "\000\000\000\001\147", 5) == 0;
+    fail_unless (random_access == expected[n]);
+    fail_unless (has_sps == expected[n]);
+    n++;
+  }
+  fail_unless (n == 3);
+
+  g_free (data);
+  gss_isom_fragment_free (fragment);
+}
+
+GST_END_TEST;
+
+#if GST_CHECK_VERSION(1,0,0)
+static void
+demux_pad_added (GstElement * demux, GstPad * pad, gpointer user_data)
+{
+  GstElement *pipeline = GST_ELEMENT (user_data);
+  GstElement *sink;
+  GstPad *sinkpad;
+  int *n_pads;
+
+  n_pads = g_object_get_data (G_OBJECT (pipeline), "n-pads");
+  (*n_pads)++;
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "async", FALSE, NULL);
+  gst_bin_add (GST_BIN (pipeline), sink);
+  gst_element_sync_state_with_parent (sink);
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+GST_START_TEST (test_mpegts_demux)
+{
+  GstElement *pipeline;
+  GstElement *src;
+  GstElement *demux;
+  GstCaps *caps;
+  GstBus *bus;
+  GstMessage *msg;
+  GstBuffer *buffer;
+  GstFlowReturn flow;
+  guint8 *data;
+  gsize size;
+  int n_pads = 0;
+
+  if (!gst_registry_check_feature_version (gst_registry_get (), "tsdemux",
+          1, 0, 0) ||
+      !gst_registry_check_feature_version (gst_registry_get (), "appsrc",
+          1, 0, 0)) {
+    GST_INFO ("tsdemux or appsrc not available, skipping");
+    return;
+  }
+
+  data = mux_test_segment (&size);
+  fail_unless (data != NULL);
+
+  pipeline = gst_pipeline_new (NULL);
+  src = gst_element_factory_make ("appsrc", NULL);
+  demux = gst_element_factory_make ("tsdemux", NULL);
+  caps = gst_caps_from_string ("video/mpegts,"
+      "systemstream=(boolean)true,packetsize=(int)188");
+  g_object_set (src, "caps", caps, NULL);
+  gst_caps_unref (caps);
+  gst_bin_add_many (GST_BIN (pipeline), src, demux, NULL);
+  fail_unless (gst_element_link (src, demux));
+
+  g_object_set_data (G_OBJECT (pipeline), "n-pads", &n_pads);
+  g_signal_connect (demux, "pad-added", G_CALLBACK (demux_pad_added),
+      pipeline);
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  buffer = gst_buffer_new_wrapped (data, size);
+  g_signal_emit_by_name (src, "push-buffer", buffer, &flow);
+  gst_buffer_unref (buffer);
+  g_signal_emit_by_name (src, "end-of-stream", &flow);
+
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, 5 * GST_SECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (msg != NULL);
+  fail_unless (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+
+  fail_unless (n_pads == 2);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+}
+
+GST_END_TEST;
+#endif
+
+
+static Suite *
+gss_mpegts_suite (void)
+{
+  Suite *s = suite_create ("GssMpegts");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_mpegts_packets);
+  tcase_add_test (tc_chain, test_mpegts_keyframes);
+#if GST_CHECK_VERSION(1,0,0)
+  tcase_add_test (tc_chain, test_mpegts_demux);
+#endif
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_mpegts);
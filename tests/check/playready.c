@@ -0,0 +1,498 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_VALGRIND_H
+# include <valgrind/valgrind.h>
+#else
+# define RUNNING_ON_VALGRIND FALSE
+#endif
+
+#include "gst-streaming-server/gss-playready.h"
+#include "gst-streaming-server/gss-sglist.h"
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+
+#include <openssl/evp.h>
+#include <string.h>
+#include <unistd.h>
+
+static const guint8 content_key[16] = {
+  0x9c, 0x2f, 0x40, 0x0e, 0x5a, 0x71, 0xd3, 0x18,
+  0x66, 0xb1, 0x07, 0xe4, 0x2d, 0x8a, 0xc5, 0x93
+};
+
+/* Each sample encrypted separately, counter starting at zero */
+static void
+reference_encrypt (GssIsomFragment * fragment, guint8 * mdat_data)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  EVP_CIPHER_CTX *ctx;
+  guint64 offset = 8;
+  int i;
+
+  ctx = EVP_CIPHER_CTX_new ();
+  for (i = 0; i < trun->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+    guint8 raw_iv[16];
+    guint64 o = offset;
+    int len;
+    int j;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    memset (raw_iv, 0, 16);
+    GST_WRITE_UINT64_BE (raw_iv, sample.iv);
+    EVP_EncryptInit_ex (ctx, EVP_aes_128_ctr (), NULL, content_key, raw_iv);
+    if (sample.num_entries == 0) {
+      EVP_EncryptUpdate (ctx, mdat_data + o, &len, mdat_data + o,
+          trun->samples[i].size);
+    }
+    for (j = 0; j < sample.num_entries; j++) {
+      o += sample.entries[j].bytes_of_clear_data;
+      EVP_EncryptUpdate (ctx, mdat_data + o, &len, mdat_data + o,
+          sample.entries[j].bytes_of_encrypted_data);
+      o += sample.entries[j].bytes_of_encrypted_data;
+    }
+    offset += trun->samples[i].size;
+  }
+  EVP_CIPHER_CTX_free (ctx);
+}
+
+static void
+check_encrypt_threads (int n_samples, int min_size, int max_size,
+    gboolean is_video, int n_threads)
+{
+  GssIsomFragment *fragment;
+  GRand *rand;
+  guint8 *data;
+  guint8 *expected;
+  int i;
+
+  rand = g_rand_new_with_seed (n_samples);
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (n_samples);
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->trun.samples[i].size =
+        g_rand_int_range (rand, min_size, max_size + 1);
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+  gss_isom_fragment_set_sample_encryption (fragment,
+      G_GUINT64_CONSTANT (0xfedcba9800000000), is_video);
+
+  data = g_malloc (fragment->mdat_size);
+  for (i = 0; i < fragment->mdat_size; i++) {
+    data[i] = g_rand_int (rand);
+  }
+  expected = g_memdup (data, fragment->mdat_size);
+
+  reference_encrypt (fragment, expected);
+  if (n_threads > 1) {
+    GssPlayready *playready;
+
+    playready = gss_playready_new ();
+    g_object_set (playready, "encrypt-threads", n_threads, NULL);
+    gss_playready_encrypt_fragment (playready, fragment, data,
+        (guint8 *) content_key);
+    g_object_unref (playready);
+  } else {
+    gss_playready_encrypt_samples (fragment, data, (guint8 *) content_key);
+  }
+
+  fail_unless (memcmp (data, expected, fragment->mdat_size) == 0);
+
+  g_free (data);
+  g_free (expected);
+  gss_isom_fragment_free (fragment);
+  g_rand_free (rand);
+}
+
+static void
+check_encrypt (int n_samples, int min_size, int max_size, gboolean is_video)
+{
+  check_encrypt_threads (n_samples, min_size, max_size, is_video, 1);
+}
+
+GST_START_TEST (test_encrypt_small_samples)
+{
+  check_encrypt (1, 1, 15, FALSE);
+  check_encrypt (100, 1, 40, FALSE);
+  check_encrypt (3000, 100, 400, FALSE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_encrypt_mixed_samples)
+{
+  check_encrypt (200, 10, 10000, FALSE);
+  check_encrypt (200, 10, 10000, TRUE);
+  check_encrypt (20, 1000, 200000, TRUE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_encrypt_parallel)
+{
+  /* large enough to be split into several ranges */
+  check_encrypt_threads (100, 20000, 80000, TRUE, 4);
+  check_encrypt_threads (20000, 100, 400, FALSE, 3);
+  /* fewer samples than threads */
+  check_encrypt_threads (2, 1000000, 2000000, TRUE, 8);
+}
+
+GST_END_TEST;
+
+/* Writes the samples to a file in reverse order, so that loading has
+ * to follow the scatter/gather list, then loads them back with a clear
+ * copy on the side. */
+static void
+check_load (int n_samples, int min_size, int max_size, gboolean is_video,
+    int n_threads)
+{
+  GssPlayready *playready;
+  GssIsomFragment *fragment;
+  GError *error = NULL;
+  GRand *rand;
+  guint8 *data;
+  guint8 *clear_data;
+  guint8 *mdat_data;
+  gchar *filename;
+  gsize file_offset;
+  int fd;
+  int i;
+
+  rand = g_rand_new_with_seed (n_samples);
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (n_samples);
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->trun.samples[i].size =
+        g_rand_int_range (rand, min_size, max_size + 1);
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+  gss_isom_fragment_set_sample_encryption (fragment,
+      G_GUINT64_CONSTANT (0x0123456700000000), is_video);
+
+  data = g_malloc (fragment->mdat_size);
+  for (i = 0; i < fragment->mdat_size; i++) {
+    data[i] = g_rand_int (rand);
+  }
+
+  fd = g_file_open_tmp ("gss-playready-XXXXXX", &filename, NULL);
+  fail_unless (fd >= 0);
+  file_offset = 0;
+  for (i = n_samples - 1; i >= 0; i--) {
+    fragment->sglist->chunks[i].offset = file_offset;
+    fragment->sglist->chunks[i].size = fragment->trun.samples[i].size;
+    file_offset += fragment->trun.samples[i].size;
+  }
+  file_offset = 8;
+  for (i = 0; i < n_samples; i++) {
+    fail_unless (pwrite (fd, data + file_offset,
+            fragment->trun.samples[i].size,
+            fragment->sglist->chunks[i].offset) ==
+        fragment->trun.samples[i].size);
+    file_offset += fragment->trun.samples[i].size;
+  }
+
+  playready = gss_playready_new ();
+  g_object_set (playready, "encrypt-threads", n_threads, NULL);
+
+  clear_data = g_malloc0 (fragment->mdat_size);
+  mdat_data = g_malloc0 (fragment->mdat_size);
+  fail_unless (gss_playready_load_fragment (playready, fragment, fd,
+          clear_data, mdat_data, (guint8 *) content_key, &error));
+  fail_unless (memcmp (clear_data + 8, data + 8,
+          fragment->mdat_size - 8) == 0);
+  reference_encrypt (fragment, data);
+  fail_unless (memcmp (mdat_data + 8, data + 8,
+          fragment->mdat_size - 8) == 0);
+
+  /* in place */
+  memset (mdat_data, 0, fragment->mdat_size);
+  fail_unless (gss_playready_load_fragment (playready, fragment, fd,
+          NULL, mdat_data, (guint8 *) content_key, &error));
+  fail_unless (memcmp (mdat_data + 8, data + 8,
+          fragment->mdat_size - 8) == 0);
+
+  /* a short file is an error, not a partial fragment */
+  fail_unless (ftruncate (fd, file_offset / 2) == 0);
+  fail_if (gss_playready_load_fragment (playready, fragment, fd,
+          NULL, mdat_data, (guint8 *) content_key, &error));
+  fail_unless (error != NULL);
+  g_clear_error (&error);
+
+  close (fd);
+  g_unlink (filename);
+  g_free (filename);
+  g_object_unref (playready);
+  g_free (clear_data);
+  g_free (mdat_data);
+  g_free (data);
+  gss_isom_fragment_free (fragment);
+  g_rand_free (rand);
+}
+
+GST_START_TEST (test_load_fragment)
+{
+  check_load (300, 100, 400, FALSE, 1);
+  check_load (100, 10, 30000, TRUE, 1);
+  check_load (100, 20000, 80000, TRUE, 4);
+}
+
+GST_END_TEST;
+
+static void
+reference_encrypt_cbcs (GssIsomFragment * fragment, const GssBoxTenc * tenc,
+    guint8 * mdat_data)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  EVP_CIPHER_CTX *ctx;
+  guint64 offset = 8;
+  int i, j, k;
+
+  ctx = EVP_CIPHER_CTX_new ();
+  EVP_EncryptInit_ex (ctx, EVP_aes_128_ecb (), NULL, content_key, NULL);
+  EVP_CIPHER_CTX_set_padding (ctx, 0);
+  for (i = 0; i < trun->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+    guint64 o = offset;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    for (j = 0; j < MAX (sample.num_entries, 1); j++) {
+      guint8 chain[16];
+      int len;
+      int n_blocks;
+
+      if (sample.num_entries == 0) {
+        len = trun->samples[i].size;
+      } else {
+        o += sample.entries[j].bytes_of_clear_data;
+        len = sample.entries[j].bytes_of_encrypted_data;
+      }
+
+      memcpy (chain, tenc->constant_iv, 16);
+      n_blocks = len / 16;
+      for (k = 0; k < n_blocks; k++) {
+        int l;
+        int out_len;
+
+        if (tenc->crypt_byte_block != 0 &&
+            k % (tenc->crypt_byte_block + tenc->skip_byte_block) >=
+            tenc->crypt_byte_block)
+          continue;
+        for (l = 0; l < 16; l++) {
+          mdat_data[o + k * 16 + l] ^= chain[l];
+        }
+        EVP_EncryptUpdate (ctx, mdat_data + o + k * 16, &out_len,
+            mdat_data + o + k * 16, 16);
+        memcpy (chain, mdat_data + o + k * 16, 16);
+      }
+      o += len;
+    }
+    offset += trun->samples[i].size;
+  }
+  EVP_CIPHER_CTX_free (ctx);
+}
+
+static const guint8 *
+find_box (const guint8 * data, gsize size, const char *type)
+{
+  gsize i;
+
+  for (i = 4; i + 4 <= size; i++) {
+    if (memcmp (data + i, type, 4) == 0)
+      return data + i - 4;
+  }
+  return NULL;
+}
+
+static void
+check_encrypt_cbcs (int n_samples, int min_size, int max_size,
+    gboolean is_video)
+{
+  GssIsomFragment *fragment;
+  GssBoxTenc tenc;
+  GRand *rand;
+  guint8 *data;
+  guint8 *expected;
+  int i;
+
+  rand = g_rand_new_with_seed (n_samples);
+
+  memset (&tenc, 0, sizeof (tenc));
+  tenc.present = TRUE;
+  tenc.version = 1;
+  tenc.scheme_type = GST_MAKE_FOURCC ('c', 'b', 'c', 's');
+  if (is_video) {
+    tenc.crypt_byte_block = 1;
+    tenc.skip_byte_block = 9;
+  }
+  tenc.is_protected = 1;
+  tenc.constant_iv_size = 16;
+  for (i = 0; i < 16; i++) {
+    tenc.constant_iv[i] = g_rand_int (rand);
+  }
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (n_samples);
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->trun.samples[i].size =
+        g_rand_int_range (rand, min_size, max_size + 1);
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+  gss_isom_fragment_set_sample_encryption (fragment, 0, is_video);
+  gss_isom_fragment_set_pattern_encryption (fragment, &tenc);
+
+  fail_unless (fragment->sample_encryption.present == FALSE);
+  fail_unless (fragment->senc.present == is_video);
+  for (i = 0; i < n_samples && is_video; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    fail_unless ((sample.entries[0].bytes_of_encrypted_data & 0xf) == 0);
+  }
+
+  data = g_malloc (fragment->mdat_size);
+  for (i = 0; i < fragment->mdat_size; i++) {
+    data[i] = g_rand_int (rand);
+  }
+  expected = g_memdup (data, fragment->mdat_size);
+
+  reference_encrypt_cbcs (fragment, &tenc, expected);
+  gss_playready_encrypt_samples (fragment, data, (guint8 *) content_key);
+  fail_unless (memcmp (data, expected, fragment->mdat_size) == 0);
+
+  if (is_video) {
+    const guint8 *saio;
+    const guint8 *senc;
+    guint8 *moof;
+    gsize moof_size;
+
+    /* saio must point at the first sample entry in senc */
+    gss_isom_fragment_serialize (fragment, &moof, &moof_size, TRUE);
+    saio = find_box (moof, moof_size, "saio");
+    senc = find_box (moof, moof_size, "senc");
+    fail_unless (saio != NULL);
+    fail_unless (senc != NULL);
+    fail_unless (GST_READ_UINT32_BE (saio + 16) == senc + 16 - moof);
+    fail_unless (GST_READ_UINT32_BE (senc + 12) == n_samples);
+    fail_unless (GST_READ_UINT16_BE (senc + 16) == 1);
+    g_free (moof);
+  }
+
+  g_free (data);
+  g_free (expected);
+  gss_isom_fragment_free (fragment);
+  g_rand_free (rand);
+}
+
+GST_START_TEST (test_encrypt_cbcs)
+{
+  check_encrypt_cbcs (50, 10, 400, FALSE);
+  check_encrypt_cbcs (50, 10, 40000, TRUE);
+  check_encrypt_cbcs (1, 1, 15, TRUE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_derived_sample_encryption)
+{
+  GssIsomFragment *fragment;
+  GssIsomFragment *chunk;
+  GssBoxUUIDSampleEncryptionSample sample;
+  GssBoxUUIDSampleEncryptionSampleEntry entry;
+  int i;
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (10);
+  fragment->trun.sample_count = 10;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * 10);
+  for (i = 0; i < 10; i++) {
+    fragment->trun.samples[i].size = 20 + 300 * i;
+  }
+  fragment->trun.samples[0].size = 5000;
+  gss_isom_fragment_set_sample_encryption (fragment, 1000, TRUE);
+  fail_unless (fragment->sample_encryption.samples == NULL);
+
+  gss_isom_fragment_get_sample_encryption (fragment, 0, &sample, &entry);
+  fail_unless (sample.iv == 1000);
+  fail_unless (sample.num_entries == 1);
+  fail_unless (sample.entries[0].bytes_of_clear_data == 1000);
+  fail_unless (sample.entries[0].bytes_of_encrypted_data == 4000);
+  for (i = 1; i < 10; i++) {
+    int size = fragment->trun.samples[i].size;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    fail_unless (sample.iv == 1000 + i);
+    fail_unless (sample.entries[0].bytes_of_clear_data == MIN (48, size));
+    fail_unless (sample.entries[0].bytes_of_encrypted_data ==
+        size - MIN (48, size));
+  }
+
+  /* a chunk starts part way through the IVs and without the long
+   * clear header */
+  chunk = gss_isom_fragment_new_chunk (fragment, 4, 3);
+  fail_unless (chunk->sample_encryption.sample_count == 3);
+  gss_isom_fragment_get_sample_encryption (chunk, 0, &sample, &entry);
+  fail_unless (sample.iv == 1004);
+  fail_unless (sample.entries[0].bytes_of_clear_data == 48);
+  fail_unless (sample.entries[0].bytes_of_encrypted_data == 1220 - 48);
+  gss_isom_fragment_free_chunk (chunk);
+
+  gss_isom_fragment_free (fragment);
+}
+
+GST_END_TEST;
+
+
+static Suite *
+gss_playready_suite (void)
+{
+  Suite *s = suite_create ("GssPlayready");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_encrypt_small_samples);
+  tcase_add_test (tc_chain, test_encrypt_mixed_samples);
+  tcase_add_test (tc_chain, test_encrypt_parallel);
+  tcase_add_test (tc_chain, test_encrypt_cbcs);
+  tcase_add_test (tc_chain, test_load_fragment);
+  tcase_add_test (tc_chain, test_derived_sample_encryption);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_playready);
@@ -0,0 +1,161 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-server.h"
+#include "gst-streaming-server/gss-html.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+static int n_called;
+
+static void
+get_resource (GssTransaction * t)
+{
+  g_atomic_int_inc (&n_called);
+  t->s = g_string_new ("ok\n");
+}
+
+static int
+get_free_port (void)
+{
+  GInetAddress *inet_address;
+  GSocketAddress *address;
+  GSocket *socket;
+  int port;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  fail_unless (socket != NULL);
+  inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (inet_address, 0);
+  fail_unless (g_socket_bind (socket, address, TRUE, NULL));
+  g_object_unref (address);
+  g_object_unref (inet_address);
+
+  address = g_socket_get_local_address (socket, NULL);
+  port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+  g_object_unref (address);
+  g_object_unref (socket);
+
+  return port;
+}
+
+static void
+http_get_done (SoupSession * session, SoupMessage * msg, gpointer user_data)
+{
+  g_main_loop_quit ((GMainLoop *) user_data);
+}
+
+/* Requests path on port over HTTP, running the main loop until the
+ * response is in, and returns the status code */
+static guint
+http_get (GssServer * server, int port, const char *path)
+{
+  GMainLoop *loop;
+  SoupMessage *msg;
+  guint status;
+  char *url;
+
+  url = g_strdup_printf ("http://127.0.0.1:%d%s", port, path);
+  msg = soup_message_new ("GET", url);
+  g_free (url);
+  fail_unless (msg != NULL);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  soup_session_queue_message (server->client_session, g_object_ref (msg),
+      http_get_done, loop);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  status = msg->status_code;
+  g_object_unref (msg);
+
+  return status;
+}
+
+/* Frontend threads only serve resources flagged thread-safe.  Others
+ * are not found there, and their handlers are never called off the main
+ * loop, while the main port serves both. */
+GST_START_TEST (test_frontend_threadsafe)
+{
+  GssServer *server;
+  int http_port;
+  int frontend_port;
+
+  gss_init ();
+
+  http_port = get_free_port ();
+  frontend_port = get_free_port ();
+  server = g_object_new (GSS_TYPE_SERVER, "http-port", http_port,
+      "frontend-port", frontend_port, "frontend-threads", 2, NULL);
+  fail_unless (server->server != NULL);
+  if (server->frontends->len == 0) {
+    GST_INFO ("frontend threads not available, skipping");
+    g_object_unref (server);
+    gss_deinit ();
+    return;
+  }
+
+  gss_server_add_resource (server, "/threadsafe", GSS_RESOURCE_THREADSAFE,
+      GSS_TEXT_PLAIN, get_resource, NULL, NULL, NULL);
+  gss_server_add_resource (server, "/main-loop-only", 0,
+      GSS_TEXT_PLAIN, get_resource, NULL, NULL, NULL);
+
+  fail_unless (http_get (server, frontend_port, "/threadsafe") ==
+      SOUP_STATUS_OK);
+  fail_unless (g_atomic_int_get (&n_called) == 1);
+
+  fail_unless (http_get (server, frontend_port, "/main-loop-only") ==
+      SOUP_STATUS_NOT_FOUND);
+  fail_unless (http_get (server, frontend_port, "/nonexistent") ==
+      SOUP_STATUS_NOT_FOUND);
+  fail_unless (g_atomic_int_get (&n_called) == 1);
+
+  fail_unless (http_get (server, http_port, "/main-loop-only") ==
+      SOUP_STATUS_OK);
+  fail_unless (g_atomic_int_get (&n_called) == 2);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_object_unref (server);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_server_suite (void)
+{
+  Suite *s = suite_create ("GssServer");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_frontend_threadsafe);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_server);
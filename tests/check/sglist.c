@@ -10,9 +10,14 @@
 # define RUNNING_ON_VALGRIND FALSE
 #endif
 
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-log.h"
 #include "gst-streaming-server/gss-sglist.h"
 #include <gst/check/gstcheck.h>
 
+#include <string.h>
+#include <unistd.h>
+
 GST_START_TEST (test_sglist)
 {
   GssSGList *sglist;
@@ -42,6 +47,54 @@ GST_START_TEST (test_sglist)
 
 GST_END_TEST;
 
+/* A range is read across chunks, and a file that ends before the
+ * chunks do is reported as a short read, not as an I/O error. */
+GST_START_TEST (test_load_range)
+{
+  GssSGList *sglist;
+  GError *error = NULL;
+  guint8 data[0x180];
+  guint8 dest[0x200];
+  char *filename;
+  int fd;
+  int i;
+
+  gss_init ();
+
+  for (i = 0; i < sizeof (data); i++) {
+    data[i] = i & 0xff;
+  }
+  fd = g_file_open_tmp ("gss-sglist-XXXXXX", &filename, NULL);
+  fail_unless (fd >= 0);
+  fail_unless (write (fd, data, sizeof (data)) == sizeof (data));
+
+  sglist = gss_sglist_new (2);
+  sglist->chunks[0].offset = 0x100;
+  sglist->chunks[0].size = 0x80;
+  sglist->chunks[1].offset = 0;
+  sglist->chunks[1].size = 0x100;
+
+  fail_unless (gss_sglist_load_range (sglist, fd, dest, 0x40, 0x80, NULL));
+  fail_unless (memcmp (dest, data + 0x140, 0x40) == 0);
+  fail_unless (memcmp (dest + 0x40, data, 0x40) == 0);
+
+  sglist->chunks[1].offset = 0x100;
+  fail_if (gss_sglist_load_range (sglist, fd, dest, 0, 0x180, &error));
+  fail_unless (error != NULL);
+  fail_unless (g_error_matches (error, _gss_error_quark, GSS_ERROR_FILE_READ));
+  fail_unless (strcmp (error->message, "unexpected end of file") == 0);
+  g_error_free (error);
+
+  gss_sglist_free (sglist);
+  close (fd);
+  unlink (filename);
+  g_free (filename);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
 
 static Suite *
 gss_sglist_suite (void)
@@ -51,6 +104,7 @@ gss_sglist_suite (void)
 
   suite_add_tcase (s, tc_chain);
   tcase_add_test (tc_chain, test_sglist);
+  tcase_add_test (tc_chain, test_load_range);
 
   return s;
 }
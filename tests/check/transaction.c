@@ -0,0 +1,505 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-transaction.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+#define N_TRANSACTIONS 2000
+#define N_INVOKES 3
+
+typedef struct _Job Job;
+struct _Job
+{
+  GssTransaction *t;
+  GThread *process_thread;
+  int n_invoked;
+  gboolean finished;
+};
+
+static GThread *main_thread;
+static GMainLoop *main_loop;
+static int n_finished;
+
+static GssTransaction *
+transaction_new (void)
+{
+  GssTransaction *t;
+
+  t = g_new0 (GssTransaction, 1);
+  t->msg = soup_message_new ("GET", "http://localhost/");
+  t->total_time = -g_get_real_time ();
+  t->priority = GSS_TRANSACTION_PRIORITY_NORMAL;
+
+  return t;
+}
+
+static void
+transaction_free (GssTransaction * t)
+{
+  g_object_unref (t->msg);
+  g_free (t);
+}
+
+static gboolean
+invoked (gpointer data)
+{
+  Job *job = data;
+
+  fail_unless (g_thread_self () == main_thread);
+  fail_if (job->finished);
+  job->n_invoked++;
+
+  return FALSE;
+}
+
+static void
+process (GssTransaction * t, gpointer priv)
+{
+  Job *job = priv;
+  int i;
+
+  job->process_thread = g_thread_self ();
+  for (i = 0; i < N_INVOKES; i++) {
+    gss_transaction_invoke (t, invoked, job);
+  }
+}
+
+static void
+finish (GssTransaction * t, gpointer priv)
+{
+  Job *job = priv;
+
+  fail_unless (g_thread_self () == main_thread);
+  fail_unless (job->process_thread != NULL);
+  fail_unless (job->process_thread != main_thread);
+  /* calls made with gss_transaction_invoke() come first */
+  fail_unless (job->n_invoked == N_INVOKES);
+  fail_if (job->finished);
+  job->finished = TRUE;
+
+  n_finished++;
+  if (n_finished == N_TRANSACTIONS) {
+    g_main_loop_quit (main_loop);
+  }
+}
+
+/* Finished transactions come back to the loop that queued them in
+ * batches through the completion source; every one must be finished
+ * exactly once, after its invoked calls, on that loop. */
+GST_START_TEST (test_completion)
+{
+  Job *jobs;
+  int i;
+
+  gss_init ();
+  gss_transaction_set_worker_threads (4, FALSE);
+
+  main_thread = g_thread_self ();
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_finished = 0;
+
+  jobs = g_new0 (Job, N_TRANSACTIONS);
+  for (i = 0; i < N_TRANSACTIONS; i++) {
+    jobs[i].t = transaction_new ();
+    gss_transaction_process_async (jobs[i].t, process, finish, &jobs[i]);
+  }
+
+  g_main_loop_run (main_loop);
+
+  for (i = 0; i < N_TRANSACTIONS; i++) {
+    fail_unless (jobs[i].finished);
+    fail_unless (jobs[i].n_invoked == N_INVOKES);
+    transaction_free (jobs[i].t);
+  }
+  g_free (jobs);
+  g_main_loop_unref (main_loop);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+static GMutex block_lock;
+static GCond block_cond;
+static gboolean blocked;
+static gboolean released;
+static GThread *block_thread;
+
+static void
+block_process (GssTransaction * t, gpointer priv)
+{
+  g_mutex_lock (&block_lock);
+  blocked = TRUE;
+  block_thread = g_thread_self ();
+  g_cond_signal (&block_cond);
+  while (!released) {
+    g_cond_wait (&block_cond, &block_lock);
+  }
+  g_mutex_unlock (&block_lock);
+}
+
+static void
+count_finish (GssTransaction * t, gpointer priv)
+{
+  int *n = priv;
+
+  (*n)++;
+  if (*n == 3) {
+    g_main_loop_quit (main_loop);
+  }
+}
+
+/* With the only worker stuck, transactions pile up in the queue:
+ * admission refuses them past max_queued, and past max_wait even
+ * though no transaction has been taken to update the average wait. */
+GST_START_TEST (test_admission)
+{
+  GssTransaction *queued[3];
+  GssTransaction *t;
+  const char *retry_after;
+  int n_done = 0;
+  int i;
+
+  gss_init ();
+  gss_transaction_set_worker_threads (1, FALSE);
+  gss_transaction_set_admission_limits (GSS_TRANSACTION_PRIORITY_NORMAL, 2,
+      0);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  blocked = FALSE;
+  released = FALSE;
+
+  for (i = 0; i < 3; i++) {
+    queued[i] = transaction_new ();
+    fail_unless (gss_transaction_admit (queued[i]));
+    gss_transaction_process_async (queued[i], (i == 0) ? block_process : NULL,
+        count_finish, &n_done);
+    if (i == 0) {
+      g_mutex_lock (&block_lock);
+      while (!blocked) {
+        g_cond_wait (&block_cond, &block_lock);
+      }
+      g_mutex_unlock (&block_lock);
+    }
+  }
+
+  /* two waiting at normal priority */
+  t = transaction_new ();
+  fail_if (gss_transaction_admit (t));
+  gss_transaction_shed (t);
+  fail_unless (t->msg->status_code == SOUP_STATUS_SERVICE_UNAVAILABLE);
+  fail_unless (soup_message_headers_get_one (t->msg->response_headers,
+          "Retry-After") != NULL);
+  transaction_free (t);
+
+  /* other priorities have their own limits */
+  t = transaction_new ();
+  t->priority = GSS_TRANSACTION_PRIORITY_HIGH;
+  fail_unless (gss_transaction_admit (t));
+  transaction_free (t);
+
+  gss_transaction_set_admission_limits (GSS_TRANSACTION_PRIORITY_NORMAL, 0,
+      50);
+  g_usleep (100 * 1000);
+  t = transaction_new ();
+  fail_if (gss_transaction_admit (t));
+  gss_transaction_shed (t);
+  retry_after = soup_message_headers_get_one (t->msg->response_headers,
+      "Retry-After");
+  fail_unless (retry_after != NULL);
+  fail_unless (strcmp (retry_after, "1") == 0);
+  transaction_free (t);
+
+  g_mutex_lock (&block_lock);
+  released = TRUE;
+  g_cond_signal (&block_cond);
+  g_mutex_unlock (&block_lock);
+  g_main_loop_run (main_loop);
+  fail_unless (n_done == 3);
+
+  /* the queue has drained */
+  t = transaction_new ();
+  fail_unless (gss_transaction_admit (t));
+  transaction_free (t);
+
+  for (i = 0; i < 3; i++) {
+    transaction_free (queued[i]);
+  }
+  g_main_loop_unref (main_loop);
+  gss_transaction_set_admission_limits (GSS_TRANSACTION_PRIORITY_NORMAL, 0,
+      0);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* Queues a transaction that keeps its worker busy until
+ * release_blocker() */
+static GssTransaction *
+start_blocker (GssTransactionFunc finish)
+{
+  GssTransaction *t;
+
+  blocked = FALSE;
+  released = FALSE;
+  t = transaction_new ();
+  gss_transaction_process_async (t, block_process, finish, NULL);
+  g_mutex_lock (&block_lock);
+  while (!blocked) {
+    g_cond_wait (&block_cond, &block_lock);
+  }
+  g_mutex_unlock (&block_lock);
+
+  return t;
+}
+
+static void
+release_blocker (void)
+{
+  g_mutex_lock (&block_lock);
+  released = TRUE;
+  g_cond_signal (&block_cond);
+  g_mutex_unlock (&block_lock);
+}
+
+static int n_expected;
+
+static void
+quit_finish (GssTransaction * t, gpointer priv)
+{
+  n_finished++;
+  if (n_finished == n_expected) {
+    g_main_loop_quit (main_loop);
+  }
+}
+
+static void
+thread_process (GssTransaction * t, gpointer priv)
+{
+  GThread **thread = priv;
+
+  *thread = g_thread_self ();
+}
+
+#define N_STOLEN 10
+
+/* Transactions are queued round-robin, so half of these land in the
+ * queue of the stuck worker, and only finish if the other one steals
+ * them. */
+GST_START_TEST (test_stealing)
+{
+  GssTransaction *blocker;
+  GssTransaction *queued[N_STOLEN];
+  GThread *threads[N_STOLEN];
+  int i;
+
+  gss_init ();
+  gss_transaction_set_worker_threads (2, FALSE);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_finished = 0;
+  blocker = start_blocker (quit_finish);
+
+  n_expected = N_STOLEN;
+  for (i = 0; i < N_STOLEN; i++) {
+    threads[i] = NULL;
+    queued[i] = transaction_new ();
+    gss_transaction_process_async (queued[i], thread_process, quit_finish,
+        &threads[i]);
+  }
+  g_main_loop_run (main_loop);
+
+  for (i = 0; i < N_STOLEN; i++) {
+    fail_unless (threads[i] != NULL);
+    fail_unless (threads[i] != block_thread);
+    fail_unless (threads[i] == threads[0]);
+  }
+
+  n_expected = N_STOLEN + 1;
+  release_blocker ();
+  g_main_loop_run (main_loop);
+
+  transaction_free (blocker);
+  for (i = 0; i < N_STOLEN; i++) {
+    transaction_free (queued[i]);
+  }
+  g_main_loop_unref (main_loop);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* high, normal and low transactions per round */
+#define ROUND_LENGTH (8 + 4 + 1)
+#define N_ROUNDS 6
+
+static GssTransactionPriority order[ROUND_LENGTH * N_ROUNDS];
+static int n_order;
+
+static void
+order_process (GssTransaction * t, gpointer priv)
+{
+  /* only one worker */
+  order[n_order++] = t->priority;
+}
+
+/* With all three priorities waiting, the worker takes 8 high, 4 normal
+ * and 1 low transactions per round, whatever order they were queued
+ * in.  The worker may have credit left from earlier work, so its first
+ * round can be partial; after that, any ROUND_LENGTH consecutive
+ * transactions taken while no queue is empty make up a whole round. */
+GST_START_TEST (test_priority_order)
+{
+  static const GssTransactionPriority priorities[] = {
+    GSS_TRANSACTION_PRIORITY_LOW, GSS_TRANSACTION_PRIORITY_NORMAL,
+    GSS_TRANSACTION_PRIORITY_HIGH
+  };
+  static const int n_per_round[] = { 1, 4, 8 };
+  GssTransaction *blocker;
+  GssTransaction *queued[ROUND_LENGTH * N_ROUNDS];
+  int n = 0;
+  int i;
+  int j;
+
+  gss_init ();
+  gss_transaction_set_worker_threads (1, FALSE);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_finished = 0;
+  n_order = 0;
+  blocker = start_blocker (quit_finish);
+
+  /* lowest priority first */
+  for (i = 0; i < G_N_ELEMENTS (priorities); i++) {
+    for (j = 0; j < n_per_round[i] * N_ROUNDS; j++) {
+      queued[n] = transaction_new ();
+      gss_transaction_set_priority (queued[n], priorities[i]);
+      gss_transaction_process_async (queued[n], order_process, quit_finish,
+          NULL);
+      n++;
+    }
+  }
+
+  n_expected = n + 1;
+  release_blocker ();
+  g_main_loop_run (main_loop);
+  fail_unless (n_order == n);
+
+  /* Up to one partial round and N_ROUNDS - 2 whole ones leave every
+   * queue non-empty */
+  for (i = ROUND_LENGTH; i + ROUND_LENGTH <= ROUND_LENGTH * (N_ROUNDS - 1);
+      i++) {
+    int counts[GSS_TRANSACTION_N_PRIORITIES] = { 0 };
+
+    for (j = i; j < i + ROUND_LENGTH; j++) {
+      counts[order[j]]++;
+    }
+    fail_unless (counts[GSS_TRANSACTION_PRIORITY_HIGH] == 8 &&
+        counts[GSS_TRANSACTION_PRIORITY_NORMAL] == 4 &&
+        counts[GSS_TRANSACTION_PRIORITY_LOW] == 1,
+        "%d high, %d normal, %d low from %d",
+        counts[GSS_TRANSACTION_PRIORITY_HIGH],
+        counts[GSS_TRANSACTION_PRIORITY_NORMAL],
+        counts[GSS_TRANSACTION_PRIORITY_LOW], i);
+  }
+
+  transaction_free (blocker);
+  for (i = 0; i < n; i++) {
+    transaction_free (queued[i]);
+  }
+  g_main_loop_unref (main_loop);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* A transaction still queued past its deadline is moved to low
+ * priority and counted as late, but is still processed and finished
+ * rather than shed. */
+GST_START_TEST (test_late)
+{
+  GssTransactionQueueStats before;
+  GssTransactionQueueStats after;
+  GssTransaction *blocker;
+  GssTransaction *t;
+  GThread *thread = NULL;
+
+  gss_init ();
+  gss_transaction_set_worker_threads (1, FALSE);
+  gss_transaction_get_queue_stats (GSS_TRANSACTION_PRIORITY_HIGH, &before);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_finished = 0;
+  blocker = start_blocker (quit_finish);
+
+  /* arrived two seconds ago, past the one second high deadline */
+  t = transaction_new ();
+  t->total_time = -(g_get_real_time () - 2 * G_USEC_PER_SEC);
+  gss_transaction_set_priority (t, GSS_TRANSACTION_PRIORITY_HIGH);
+  gss_transaction_process_async (t, thread_process, quit_finish, &thread);
+
+  n_expected = 2;
+  release_blocker ();
+  g_main_loop_run (main_loop);
+
+  fail_unless (thread != NULL);
+  fail_unless (t->priority == GSS_TRANSACTION_PRIORITY_LOW);
+  fail_unless (t->queue_priority == GSS_TRANSACTION_PRIORITY_HIGH);
+  fail_if (t->msg->status_code == SOUP_STATUS_SERVICE_UNAVAILABLE);
+  gss_transaction_get_queue_stats (GSS_TRANSACTION_PRIORITY_HIGH, &after);
+  fail_unless (after.n_late == before.n_late + 1);
+  fail_unless (after.n_shed == before.n_shed);
+
+  transaction_free (blocker);
+  transaction_free (t);
+  g_main_loop_unref (main_loop);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_transaction_suite (void)
+{
+  Suite *s = suite_create ("GssTransaction");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_completion);
+  tcase_add_test (tc_chain, test_admission);
+  tcase_add_test (tc_chain, test_stealing);
+  tcase_add_test (tc_chain, test_priority_order);
+  tcase_add_test (tc_chain, test_late);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_transaction);
@@ -0,0 +1,575 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-server.h"
+#include "gst-streaming-server/gss-vod.h"
+#include "gst-streaming-server/gss-playready.h"
+#include "gst-streaming-server/gss-adaptive.h"
+#include "gst-streaming-server/gss-histogram.h"
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+#include <utime.h>
+
+static const char *const aac_encoders[] = {
+  "avenc_aac", "voaacenc", "fdkaacenc", "faac"
+};
+
+static const char preload_list[] =
+    "# streams to load at startup\n"
+    "\n"
+    "title1/0/clear/isoff-live\n"
+    "title2/0/pr/ism\n"
+    "title3/0/bogus/ism\n";
+
+/* Fetches /vod-ready and returns its status code */
+static guint
+get_ready (GssServer * server, char **body)
+{
+  GssTransaction t = { 0 };
+  guint status;
+
+  t.server = server;
+  t.msg = soup_message_new ("GET", "http://localhost/vod-ready");
+  t.resource = g_hash_table_lookup (server->resources, "/vod-ready");
+  fail_unless (t.resource != NULL);
+  soup_message_set_status (t.msg, SOUP_STATUS_OK);
+  t.resource->get_callback (&t);
+  status = t.msg->status_code;
+  *body = g_string_free (t.s, FALSE);
+  g_object_unref (t.msg);
+
+  return status;
+}
+
+/* Encodes a two second H.264/AAC title into <archive_dir>/<key>, with
+ * the manifest listing it as version "0".  Returns FALSE if the encoders
+ * aren't available. */
+static gboolean
+create_title (const char *archive_dir, const char *key)
+{
+  GstElementFactory *factory = NULL;
+  GstElement *pipeline;
+  GstMessage *message;
+  GstBus *bus;
+  char *dir;
+  char *filename;
+  char *manifest;
+  char *s;
+  gboolean ret;
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (aac_encoders) && factory == NULL; i++) {
+    factory = gst_element_factory_find (aac_encoders[i]);
+  }
+  if (factory == NULL ||
+      !gst_registry_check_feature_version (gst_registry_get (), "x264enc",
+          1, 0, 0) ||
+      !gst_registry_check_feature_version (gst_registry_get (), "mp4mux",
+          1, 0, 0)) {
+    if (factory)
+      gst_object_unref (factory);
+    return FALSE;
+  }
+
+  dir = g_build_filename (archive_dir, key, NULL);
+  fail_unless (g_mkdir_with_parents (dir, 0755) == 0);
+  filename = g_build_filename (dir, "title.mp4", NULL);
+
+  s = g_strdup_printf ("mp4mux name=mux ! filesink location=\"%s\" "
+      "videotestsrc num-buffers=50 ! "
+      "video/x-raw,width=160,height=120,framerate=25/1 ! "
+      "x264enc key-int-max=25 bframes=0 ! h264parse ! mux. "
+      "audiotestsrc num-buffers=94 samplesperbuffer=1024 ! "
+      "audio/x-raw,rate=48000,channels=2 ! audioconvert ! %s ! "
+      "aacparse ! mux.", filename,
+      gst_plugin_feature_get_name (GST_PLUGIN_FEATURE (factory)));
+  gst_object_unref (factory);
+  pipeline = gst_parse_launch (s, NULL);
+  g_free (s);
+  fail_unless (pipeline != NULL);
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 30 * GST_SECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (message != NULL);
+  fail_unless (GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS);
+  gst_message_unref (message);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  manifest = g_build_filename (dir, "gss-manifest", NULL);
+  ret = g_file_set_contents (manifest, "{\"manifest_version\":0,"
+      "\"versions\":[{\"version\":\"0\",\"files\":[\"title.mp4\"]}]}",
+      -1, NULL);
+  fail_unless (ret);
+
+  g_free (manifest);
+  g_free (filename);
+  g_free (dir);
+
+  return TRUE;
+}
+
+static void
+remove_title (const char *archive_dir, const char *key)
+{
+  char *dir;
+  char *filename;
+
+  dir = g_build_filename (archive_dir, key, NULL);
+  filename = g_build_filename (dir, "title.mp4", NULL);
+  g_unlink (filename);
+  g_free (filename);
+  filename = g_build_filename (dir, "gss-manifest", NULL);
+  g_unlink (filename);
+  g_free (filename);
+  g_rmdir (dir);
+  g_free (dir);
+}
+
+static int
+get_free_port (void)
+{
+  GInetAddress *inet_address;
+  GSocketAddress *address;
+  GSocket *socket;
+  int port;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  fail_unless (socket != NULL);
+  inet_address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new (inet_address, 0);
+  fail_unless (g_socket_bind (socket, address, TRUE, NULL));
+  g_object_unref (address);
+  g_object_unref (inet_address);
+
+  address = g_socket_get_local_address (socket, NULL);
+  port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+  g_object_unref (address);
+  g_object_unref (socket);
+
+  return port;
+}
+
+static void
+http_get_done (SoupSession * session, SoupMessage * msg, gpointer user_data)
+{
+  g_main_loop_quit ((GMainLoop *) user_data);
+}
+
+/* Requests path from the server over HTTP, running the main loop until
+ * the response is in */
+static SoupMessage *
+http_get (GssServer * server, const char *path)
+{
+  GMainLoop *loop;
+  SoupMessage *msg;
+  char *url;
+
+  url = g_strdup_printf ("http://127.0.0.1:%d%s", server->http_port, path);
+  msg = soup_message_new ("GET", url);
+  g_free (url);
+  fail_unless (msg != NULL);
+
+  loop = g_main_loop_new (NULL, FALSE);
+  soup_session_queue_message (server->client_session, g_object_ref (msg),
+      http_get_done, loop);
+  g_main_loop_run (loop);
+  g_main_loop_unref (loop);
+
+  return msg;
+}
+
+/* A server on a free port with the VOD and PlayReady modules, serving
+ * titles from archive_dir */
+static GssServer *
+create_server (const char *archive_dir, int check_interval, GssVod ** vod)
+{
+  GssServer *server;
+  GssPlayready *playready;
+
+  server = g_object_new (GSS_TYPE_SERVER, "http-port", get_free_port (),
+      NULL);
+  fail_unless (server->server != NULL);
+  *vod = gss_vod_new ();
+  g_object_set (*vod, "archive-dir", archive_dir, "check-interval",
+      check_interval, NULL);
+  gss_server_add_module (server, GSS_MODULE (*vod));
+  playready = gss_playready_new ();
+  g_object_set (playready, "allow-clear", TRUE, NULL);
+  gss_server_add_module (server, GSS_MODULE (playready));
+
+  return server;
+}
+
+/* Requests path over HTTP and checks that it is served */
+static void
+http_get_ok (GssServer * server, const char *path)
+{
+  SoupMessage *msg;
+
+  msg = http_get (server, path);
+  fail_unless (msg->status_code == SOUP_STATUS_OK, "%s: status %d", path,
+      msg->status_code);
+  fail_unless (msg->response_body->length > 0);
+  g_object_unref (msg);
+}
+
+/* Waits for the server to account for n_requests requests to location,
+ * which it does once the response has been written */
+static GssLatency *
+wait_latency (GssServer * server, const char *location, guint64 n_requests)
+{
+  GssLatency *latency = NULL;
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (g_get_monotonic_time () < end_time) {
+    g_mutex_lock (&server->latencies_lock);
+    latency = g_hash_table_lookup (server->latencies, location);
+    g_mutex_unlock (&server->latencies_lock);
+    if (latency && latency->sync &&
+        gss_histogram_get_percentiles (latency->sync, 0, NULL,
+            NULL) >= n_requests)
+      return latency;
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+  fail ("request to %s not accounted for", location);
+
+  return NULL;
+}
+
+/* Preloads are read when the module is attached, but only start once
+ * the main loop runs, after the PlayReady module they take their DRM
+ * configuration from has been attached as well. */
+GST_START_TEST (test_preload)
+{
+  GssServer *server;
+  GssVod *vod;
+  char *archive_dir;
+  char *preload_file;
+  char *body;
+  gint64 end_time;
+
+  gss_init ();
+
+  archive_dir = g_dir_make_tmp ("gss-vod-XXXXXX", NULL);
+  fail_unless (archive_dir != NULL);
+  preload_file = g_build_filename (archive_dir, "preload", NULL);
+  fail_unless (g_file_set_contents (preload_file, preload_list, -1, NULL));
+
+  server = gss_server_new ();
+  vod = gss_vod_new ();
+  g_object_set (vod, "archive-dir", archive_dir, "preload-file",
+      preload_file, "preload-ready", 100, NULL);
+
+  /* in the order the server tool creates them */
+  gss_server_add_module (server, GSS_MODULE (vod));
+  fail_unless (vod->preload_total == 2);
+  fail_unless (vod->preload_running == 0);
+  fail_if (gss_vod_is_ready (vod));
+  fail_unless (get_ready (server, &body) == SOUP_STATUS_SERVICE_UNAVAILABLE);
+  fail_unless (strcmp (body, "preloading 0 of 2\n") == 0);
+  g_free (body);
+
+  gss_server_add_module (server, GSS_MODULE (gss_playready_new ()));
+  fail_unless (server->playready != NULL);
+
+  /* the titles don't exist, so both loads fail */
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (!gss_vod_is_ready (vod) && g_get_monotonic_time () < end_time) {
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+  fail_unless (gss_vod_is_ready (vod));
+  fail_unless (vod->preload_done == 2);
+  fail_unless (vod->preload_failed == 2);
+  fail_unless (get_ready (server, &body) == SOUP_STATUS_OK);
+  fail_unless (strcmp (body, "ready\n") == 0);
+  g_free (body);
+
+  /* let the finished loads release the module */
+  while (g_main_context_iteration (NULL, FALSE));
+  g_object_unref (server);
+
+  g_unlink (preload_file);
+  g_rmdir (archive_dir);
+  g_free (preload_file);
+  g_free (archive_dir);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* A request for a title that isn't loaded yet is paused until the load
+ * finishes.  Only the time spent handling it counts as synchronous
+ * processing time, not the wait for the load. */
+GST_START_TEST (test_deferred_request)
+{
+  GssServer *server;
+  GssVod *vod;
+  GssPlayready *playready;
+  GssAdaptive *adaptive;
+  GssLatency *latency;
+  SoupMessage *msg;
+  char *archive_dir;
+  char *dir;
+  char *path;
+  gint64 sync_time;
+
+  gss_init ();
+
+  archive_dir = g_dir_make_tmp ("gss-vod-XXXXXX", NULL);
+  fail_unless (archive_dir != NULL);
+  if (!create_title (archive_dir, "title1")) {
+    GST_INFO ("H.264 or AAC encoder not available, skipping");
+    g_rmdir (archive_dir);
+    g_free (archive_dir);
+    gss_deinit ();
+    return;
+  }
+
+  server = g_object_new (GSS_TYPE_SERVER, "http-port", get_free_port (),
+      NULL);
+  fail_unless (server->server != NULL);
+  vod = gss_vod_new ();
+  g_object_set (vod, "archive-dir", archive_dir, NULL);
+  gss_server_add_module (server, GSS_MODULE (vod));
+  playready = gss_playready_new ();
+  g_object_set (playready, "allow-clear", TRUE, NULL);
+  gss_server_add_module (server, GSS_MODULE (playready));
+
+  /* the first video fragment, found separately from the server */
+  dir = g_build_filename (archive_dir, "title1", NULL);
+  adaptive = gss_adaptive_load (server, "title1", dir, "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (adaptive != NULL);
+  fail_unless (adaptive->n_video_levels > 0);
+  path = g_strdup_printf ("/vod/title1/0/clear/isoff-live/"
+      "content?stream=video&bitrate=%d&start_time=%" G_GUINT64_FORMAT,
+      adaptive->video_levels[0].bitrate,
+      gss_isom_track_get_fragment (adaptive->video_levels[0].track,
+          0)->timestamp);
+  gss_adaptive_unref (adaptive);
+  g_free (dir);
+
+  msg = http_get (server, path);
+  fail_unless (msg->status_code == SOUP_STATUS_OK);
+  fail_unless (msg->response_body->length > 0);
+  g_object_unref (msg);
+  g_free (path);
+
+  latency = wait_latency (server, "/vod/", 1);
+  sync_time = gss_histogram_get_sum (latency->sync);
+  fail_unless (sync_time >= 0 && sync_time < 10 * G_USEC_PER_SEC,
+      "sync time %" G_GINT64_FORMAT, sync_time);
+
+  /* a load that fails resumes the request as well */
+  msg = http_get (server, "/vod/title2/0/clear/isoff-live/manifest.mpd");
+  fail_unless (msg->status_code == SOUP_STATUS_NOT_FOUND);
+  g_object_unref (msg);
+
+  latency = wait_latency (server, "/vod/", 2);
+  sync_time = gss_histogram_get_sum (latency->sync);
+  fail_unless (sync_time >= 0 && sync_time < 10 * G_USEC_PER_SEC,
+      "sync time %" G_GINT64_FORMAT, sync_time);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_object_unref (server);
+
+  remove_title (archive_dir, "title1");
+  g_rmdir (archive_dir);
+  g_free (archive_dir);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* The clear and PlayReady variants of a title are made from the same
+ * parsed media, which is loaded only once */
+GST_START_TEST (test_shared_media)
+{
+  GssServer *server;
+  GssVod *vod;
+  GssAdaptive *clear;
+  GssAdaptive *pr;
+  char *archive_dir;
+
+  gss_init ();
+
+  archive_dir = g_dir_make_tmp ("gss-vod-XXXXXX", NULL);
+  fail_unless (archive_dir != NULL);
+  if (!create_title (archive_dir, "title1")) {
+    GST_INFO ("H.264 or AAC encoder not available, skipping");
+    g_rmdir (archive_dir);
+    g_free (archive_dir);
+    gss_deinit ();
+    return;
+  }
+
+  server = create_server (archive_dir, 0, &vod);
+  http_get_ok (server, "/vod/title1/0/clear/isoff-live/manifest.mpd");
+  http_get_ok (server, "/vod/title1/0/pr/isoff-live/manifest.mpd");
+
+  clear = gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  pr = gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_PLAYREADY,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (clear != NULL);
+  fail_unless (pr != NULL);
+  fail_unless (clear != pr);
+  fail_unless (clear->media != NULL);
+  fail_unless (clear->media == pr->media);
+  fail_unless (g_hash_table_size (vod->media_cache) == 1);
+  fail_unless (gss_histogram_get_percentiles (vod->media_load_time, 0, NULL,
+          NULL) == 1);
+  fail_unless (gss_histogram_get_percentiles (vod->stream_load_time, 0, NULL,
+          NULL) == 2);
+  gss_adaptive_unref (clear);
+  gss_adaptive_unref (pr);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_object_unref (server);
+
+  remove_title (archive_dir, "title1");
+  g_rmdir (archive_dir);
+  g_free (archive_dir);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* Once check-interval has passed, a title whose file has a new mtime is
+ * dropped from the cache and loaded again by the next request.  A
+ * request still holding the old stream can keep using it. */
+GST_START_TEST (test_invalidate)
+{
+  GssServer *server;
+  GssVod *vod;
+  GssAdaptive *old;
+  GssAdaptive *adaptive;
+  struct utimbuf utb;
+  GStatBuf sb;
+  char *archive_dir;
+  char *filename;
+  gint64 end_time;
+
+  gss_init ();
+
+  archive_dir = g_dir_make_tmp ("gss-vod-XXXXXX", NULL);
+  fail_unless (archive_dir != NULL);
+  if (!create_title (archive_dir, "title1")) {
+    GST_INFO ("H.264 or AAC encoder not available, skipping");
+    g_rmdir (archive_dir);
+    g_free (archive_dir);
+    gss_deinit ();
+    return;
+  }
+
+  server = create_server (archive_dir, 1, &vod);
+  http_get_ok (server, "/vod/title1/0/clear/isoff-live/manifest.mpd");
+  old = gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (old != NULL);
+
+  /* only the mtime changes, not the size or inode */
+  filename = g_build_filename (archive_dir, "title1", "title.mp4", NULL);
+  fail_unless (g_stat (filename, &sb) == 0);
+  utb.actime = sb.st_atime;
+  utb.modtime = sb.st_mtime - 60;
+  fail_unless (g_utime (filename, &utb) == 0);
+  g_free (filename);
+
+  /* the lookup that starts the check still returns the cached stream */
+  g_usleep (1100 * 1000);
+  adaptive = gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (adaptive == old);
+  gss_adaptive_unref (adaptive);
+
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (vod->cache_invalidations == 0 &&
+      g_get_monotonic_time () < end_time) {
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+  fail_unless (vod->cache_invalidations == 1);
+  fail_unless (gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_CLEAR,
+          GSS_ADAPTIVE_STREAM_ISOFF_LIVE) == NULL);
+  fail_unless (g_hash_table_size (vod->media_cache) == 0);
+
+  /* the old stream holds the only reference to the old media */
+  fail_unless (old->refcount == 1);
+  fail_unless (old->media->refcount == 1);
+  fail_unless (old->n_video_levels > 0);
+
+  http_get_ok (server, "/vod/title1/0/clear/isoff-live/manifest.mpd");
+  adaptive = gss_vod_lookup_adaptive (vod, "title1", "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (adaptive != NULL);
+  fail_unless (adaptive != old);
+  fail_unless (adaptive->media != old->media);
+  fail_unless (gss_histogram_get_percentiles (vod->media_load_time, 0, NULL,
+          NULL) == 2);
+  gss_adaptive_unref (adaptive);
+  gss_adaptive_unref (old);
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_object_unref (server);
+
+  remove_title (archive_dir, "title1");
+  g_rmdir (archive_dir);
+  g_free (archive_dir);
+
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_vod_suite (void)
+{
+  Suite *s = suite_create ("GssVod");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_preload);
+  tcase_add_test (tc_chain, test_deferred_request);
+  tcase_add_test (tc_chain, test_shared_media);
+  tcase_add_test (tc_chain, test_invalidate);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_vod);
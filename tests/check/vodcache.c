@@ -0,0 +1,283 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2013 Rdio Inc <ingestions@rd.io>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-config.h"
+#include "gst-streaming-server/gss-vod.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+#define MB (1024 * 1024)
+
+static GssVod *
+create_vod (int cache_size, int cache_memory)
+{
+  GssVod *vod;
+
+  vod = gss_vod_new ();
+  g_object_set (vod, "cache-size", cache_size, "cache-memory", cache_memory,
+      "check-interval", 0, NULL);
+
+  return vod;
+}
+
+static GssAdaptiveMedia *
+create_media (void)
+{
+  GssAdaptiveMedia *media;
+
+  media = g_malloc0 (sizeof (GssAdaptiveMedia));
+  media->refcount = 1;
+  media->is_isoff = TRUE;
+
+  return media;
+}
+
+/* A stream of @media whose variant state takes about @size bytes */
+static GssAdaptive *
+create_adaptive (const char *content_id, GssAdaptiveStream stream_type,
+    GssAdaptiveMedia * media, gsize size)
+{
+  GssAdaptive *adaptive;
+
+  adaptive = gss_adaptive_new ();
+  adaptive->content_id = g_strdup (content_id);
+  adaptive->version = g_strdup ("0");
+  adaptive->drm_type = GSS_DRM_CLEAR;
+  adaptive->stream_type = stream_type;
+  adaptive->media = gss_adaptive_media_ref (media);
+  adaptive->drm_info.drm_type = GSS_DRM_CLEAR;
+  adaptive->drm_info.data_len = size;
+  adaptive->drm_info.data = g_malloc0 (size);
+
+  return adaptive;
+}
+
+/* Adds a stream of @content_id with its own media */
+static void
+add_stream (GssVod * vod, const char *content_id, gsize size)
+{
+  GssAdaptiveMedia *media;
+  GssAdaptive *adaptive;
+
+  media = create_media ();
+  adaptive = create_adaptive (content_id, GSS_ADAPTIVE_STREAM_ISOFF_LIVE,
+      media, size);
+  gss_vod_add_adaptive (vod, adaptive);
+  gss_adaptive_unref (adaptive);
+  gss_adaptive_media_unref (media);
+}
+
+static gboolean
+is_cached (GssVod * vod, const char *content_id,
+    GssAdaptiveStream stream_type)
+{
+  GssAdaptive *adaptive;
+
+  adaptive = gss_vod_lookup_adaptive (vod, content_id, "0", GSS_DRM_CLEAR,
+      stream_type);
+  if (adaptive == NULL)
+    return FALSE;
+  gss_adaptive_unref (adaptive);
+  return TRUE;
+}
+
+GST_START_TEST (test_evict_lru)
+{
+  GssVod *vod;
+
+  gss_init ();
+
+  vod = create_vod (2, 1024);
+  add_stream (vod, "a", 0);
+  add_stream (vod, "b", 0);
+  fail_unless (vod->cache_lru.length == 2);
+
+  /* a is used again, so b is the least recently used */
+  fail_unless (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  add_stream (vod, "c", 0);
+  fail_unless (vod->cache_lru.length == 2);
+  fail_unless (vod->cache_evictions == 1);
+  fail_if (is_cached (vod, "b", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (is_cached (vod, "c", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (g_hash_table_size (vod->media_cache) == 2);
+
+  /* lowering the limit evicts at once, keeping the most recent */
+  g_object_set (vod, "cache-size", 1, NULL);
+  fail_unless (vod->cache_lru.length == 1);
+  fail_unless (is_cached (vod, "c", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (g_hash_table_size (vod->media_cache) == 1);
+
+  g_object_unref (vod);
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_evict_memory)
+{
+  GssVod *vod;
+  GssAdaptiveMedia *media;
+  GssAdaptive *adaptive;
+  gsize size;
+
+  gss_init ();
+
+  vod = create_vod (100, 2);
+  add_stream (vod, "a", MB * 3 / 4);
+  add_stream (vod, "b", MB * 3 / 4);
+  fail_unless (vod->cache_lru.length == 2);
+  fail_unless (vod->cache_evictions == 0);
+
+  add_stream (vod, "c", MB * 3 / 4);
+  fail_unless (vod->cache_lru.length == 2);
+  fail_unless (vod->cache_evictions == 1);
+  fail_unless (vod->cache_bytes <= 2 * MB);
+  fail_if (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+
+  /* a stream over the limit by itself is still cached */
+  media = create_media ();
+  adaptive = create_adaptive ("d", GSS_ADAPTIVE_STREAM_ISOFF_LIVE, media,
+      3 * MB);
+  gss_vod_add_adaptive (vod, adaptive);
+  fail_unless (vod->cache_lru.length == 1);
+  fail_unless (vod->cache_evictions == 3);
+  fail_unless (is_cached (vod, "d", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+
+  /* only d and its media are accounted for */
+  size = gss_adaptive_get_memory_size (adaptive) +
+      gss_adaptive_media_get_memory_size (media);
+  fail_unless (vod->cache_bytes == size);
+  fail_unless (g_hash_table_size (vod->media_cache) == 1);
+  gss_adaptive_unref (adaptive);
+  gss_adaptive_media_unref (media);
+
+  g_object_unref (vod);
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* Media is shared by the streams of a title, and only dropped with the
+ * last of them */
+GST_START_TEST (test_release_media)
+{
+  GssVod *vod;
+  GssAdaptiveMedia *media;
+  GssAdaptive *live;
+  GssAdaptive *ondemand;
+
+  gss_init ();
+
+  vod = create_vod (2, 1024);
+  media = create_media ();
+  live = create_adaptive ("a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE, media, 0);
+  ondemand = create_adaptive ("a", GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND, media,
+      0);
+  gss_vod_add_adaptive (vod, live);
+  gss_vod_add_adaptive (vod, ondemand);
+  gss_adaptive_unref (live);
+  gss_adaptive_unref (ondemand);
+  fail_unless (g_hash_table_size (vod->media_cache) == 1);
+  /* ours, media_cache's and one per stream */
+  fail_unless (media->refcount == 4);
+
+  /* the live stream is the least recently used */
+  add_stream (vod, "b", 0);
+  fail_if (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (g_hash_table_size (vod->media_cache) == 2);
+  fail_unless (media->refcount == 3);
+
+  /* then the on-demand stream */
+  add_stream (vod, "c", 0);
+  fail_if (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND));
+  fail_unless (is_cached (vod, "b", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (g_hash_table_size (vod->media_cache) == 2);
+  fail_unless (media->refcount == 1);
+  gss_adaptive_media_unref (media);
+
+  g_object_unref (vod);
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+/* A request holding a stream keeps it, and its media, usable after the
+ * stream is evicted */
+GST_START_TEST (test_evict_in_use)
+{
+  GssVod *vod;
+  GssAdaptive *adaptive;
+  gsize i;
+
+  gss_init ();
+
+  vod = create_vod (1, 1024);
+  add_stream (vod, "a", 1000);
+  adaptive = gss_vod_lookup_adaptive (vod, "a", "0", GSS_DRM_CLEAR,
+      GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+  fail_unless (adaptive != NULL);
+  fail_unless (adaptive->refcount == 2);
+
+  add_stream (vod, "b", 0);
+  fail_if (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (g_hash_table_size (vod->media_cache) == 1);
+  fail_unless (adaptive->refcount == 1);
+  fail_unless (adaptive->media != NULL);
+  fail_unless (adaptive->media->refcount == 1);
+  for (i = 0; i < adaptive->drm_info.data_len; i++) {
+    fail_unless (adaptive->drm_info.data[i] == 0);
+  }
+
+  /* re-adding it while in use caches it again */
+  gss_vod_add_adaptive (vod, adaptive);
+  fail_unless (is_cached (vod, "a", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_if (is_cached (vod, "b", GSS_ADAPTIVE_STREAM_ISOFF_LIVE));
+  fail_unless (adaptive->refcount == 2);
+  fail_unless (adaptive->media->refcount == 2);
+  gss_adaptive_unref (adaptive);
+
+  g_object_unref (vod);
+  gss_deinit ();
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_vod_cache_suite (void)
+{
+  Suite *s = suite_create ("GssVodCache");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_evict_lru);
+  tcase_add_test (tc_chain, test_evict_memory);
+  tcase_add_test (tc_chain, test_release_media);
+  tcase_add_test (tc_chain, test_evict_in_use);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_vod_cache);
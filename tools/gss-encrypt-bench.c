@@ -0,0 +1,298 @@
+
+#include "config.h"
+
+#include <gst-streaming-server/gss-isom.h>
+#include <gst-streaming-server/gss-playready.h>
+#include <gst-streaming-server/gss-sglist.h>
+
+#include <openssl/evp.h>
+
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+
+int iterations = 20;
+int fragment_bytes = 4 * 1024 * 1024;
+int threads = 0;
+
+static GOptionEntry entries[] = {
+  {"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+      "Number of times each fragment is encrypted", "N"},
+  {"fragment-size", 's', 0, G_OPTION_ARG_INT, &fragment_bytes,
+      "Approximate size of each fragment in bytes", "BYTES"},
+  {"threads", 't', 0, G_OPTION_ARG_INT, &threads,
+      "Threads used for parallel encryption (0 = one per CPU)", "N"},
+  {NULL}
+};
+
+typedef struct _Distribution Distribution;
+struct _Distribution
+{
+  const char *name;
+  int min_size;
+  int max_size;
+  gboolean is_video;
+};
+
+/* Sample size ranges typical of the content we serve */
+static const Distribution distributions[] = {
+  {"aac-lc-64k", 150, 250, FALSE},
+  {"aac-lc-128k", 300, 450, FALSE},
+  {"he-aac-32k", 60, 120, FALSE},
+  {"h264-sd", 1000, 30000, TRUE},
+  {"h264-hd", 10000, 200000, TRUE},
+};
+
+static guint64
+get_ticks (void)
+{
+#ifdef HAVE_RDTSC
+  return __rdtsc ();
+#else
+  return g_get_monotonic_time () * 1000;
+#endif
+}
+
+static GssIsomFragment *
+create_fragment (const Distribution * dist, GRand * rand)
+{
+  GssIsomFragment *fragment;
+  GArray *sizes;
+  int total = 0;
+  int i;
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (int));
+  while (total < fragment_bytes) {
+    int size = g_rand_int_range (rand, dist->min_size, dist->max_size + 1);
+    g_array_append_val (sizes, size);
+    total += size;
+  }
+
+  fragment = gss_isom_fragment_new ();
+  fragment->sglist = gss_sglist_new (sizes->len);
+  fragment->trun.sample_count = sizes->len;
+  fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) * sizes->len);
+  fragment->mdat_size = 8 + total;
+  total = 0;
+  for (i = 0; i < sizes->len; i++) {
+    fragment->trun.samples[i].size = g_array_index (sizes, int, i);
+    /* laid out in order in the file used by the loaded modes */
+    fragment->sglist->chunks[i].offset = total;
+    fragment->sglist->chunks[i].size = fragment->trun.samples[i].size;
+    total += fragment->trun.samples[i].size;
+  }
+  g_array_free (sizes, TRUE);
+
+  gss_isom_fragment_set_sample_encryption (fragment,
+      G_GUINT64_CONSTANT (0x0123456789abcdef), dist->is_video);
+
+  return fragment;
+}
+
+/* The previous implementation: a full cipher init for each sample */
+static void
+encrypt_per_sample (GssIsomFragment * fragment, guint8 * mdat_data,
+    guint8 * content_key)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  EVP_CIPHER_CTX *ctx;
+  guint64 sample_offset = 8;
+  int i;
+
+  ctx = EVP_CIPHER_CTX_new ();
+  for (i = 0; i < trun->sample_count; i++) {
+    GssBoxUUIDSampleEncryptionSample sample;
+    GssBoxUUIDSampleEncryptionSampleEntry entry;
+    unsigned char raw_iv[16];
+    guint64 offset = sample_offset;
+    int len;
+    int j;
+
+    gss_isom_fragment_get_sample_encryption (fragment, i, &sample, &entry);
+    memset (raw_iv, 0, 16);
+    GST_WRITE_UINT64_BE (raw_iv, sample.iv);
+    EVP_EncryptInit_ex (ctx, EVP_aes_128_ctr (), NULL, content_key, raw_iv);
+
+    if (sample.num_entries == 0) {
+      EVP_EncryptUpdate (ctx, mdat_data + offset, &len, mdat_data + offset,
+          trun->samples[i].size);
+    }
+    for (j = 0; j < sample.num_entries; j++) {
+      offset += sample.entries[j].bytes_of_clear_data;
+      EVP_EncryptUpdate (ctx, mdat_data + offset, &len, mdat_data + offset,
+          sample.entries[j].bytes_of_encrypted_data);
+      offset += sample.entries[j].bytes_of_encrypted_data;
+    }
+    sample_offset += trun->samples[i].size;
+  }
+  EVP_CIPHER_CTX_free (ctx);
+}
+
+enum
+{
+  MODE_PER_SAMPLE,
+  MODE_BATCHED,
+  MODE_PARALLEL,
+  MODE_READ,
+  MODE_LOADED
+};
+
+/* The loaded modes read the samples from fd in pieces, as fragments are
+ * served, without (read) and with (loaded) encryption; the file is in
+ * the page cache after the first pass. */
+static double
+run (GssPlayready * playready, GssIsomFragment * fragment, guint8 * data,
+    guint8 * key, int fd, int mode)
+{
+  guint64 ticks = 0;
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    guint64 start = get_ticks ();
+    if (mode == MODE_READ) {
+      gss_playready_load_fragment (playready, fragment, fd, NULL, data,
+          NULL, NULL);
+    } else if (mode == MODE_LOADED) {
+      gss_playready_load_fragment (playready, fragment, fd, NULL, data, key,
+          NULL);
+    } else if (mode == MODE_PARALLEL) {
+      gss_playready_encrypt_fragment (playready, fragment, data, key);
+    } else if (mode == MODE_BATCHED) {
+      gss_playready_encrypt_samples (fragment, data, key);
+    } else {
+      encrypt_per_sample (fragment, data, key);
+    }
+    ticks += get_ticks () - start;
+  }
+
+  return (double) ticks / ((double) iterations * (fragment->mdat_size - 8));
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GssPlayready *playready;
+  GRand *rand;
+  guint8 key[16];
+  int i;
+
+  context = g_option_context_new ("- sample encryption benchmark");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+  g_type_init ();
+#endif
+  playready = gss_playready_new ();
+  g_object_set (playready, "encrypt-threads", threads, NULL);
+
+  rand = g_rand_new_with_seed (0);
+  for (i = 0; i < 16; i++) {
+    key[i] = g_rand_int (rand);
+  }
+
+#ifdef HAVE_RDTSC
+  g_print ("%-12s %8s %14s %14s %14s %14s %14s\n", "content", "samples",
+      "per-sample c/B", "batched c/B", "parallel c/B", "read c/B",
+      "loaded c/B");
+#else
+  g_print ("%-12s %8s %14s %14s %14s %14s %14s\n", "content", "samples",
+      "per-sample ns/B", "batched ns/B", "parallel ns/B", "read ns/B",
+      "loaded ns/B");
+#endif
+
+  for (i = 0; i < G_N_ELEMENTS (distributions); i++) {
+    GssIsomFragment *fragment;
+    guint8 *data;
+    guint8 *check;
+    char *filename;
+    double before;
+    double after;
+    double parallel;
+    double read;
+    double loaded;
+    int fd;
+    int j;
+
+    fragment = create_fragment (&distributions[i], rand);
+    data = g_malloc (fragment->mdat_size);
+    for (j = 0; j < fragment->mdat_size; j++) {
+      data[j] = g_rand_int (rand);
+    }
+
+    /* An even number of passes leaves the data unchanged, and both
+     * implementations must agree on the keystream. */
+    check = g_memdup (data, fragment->mdat_size);
+    encrypt_per_sample (fragment, check, key);
+    gss_playready_encrypt_samples (fragment, check, key);
+    if (memcmp (check, data, fragment->mdat_size) != 0) {
+      g_print ("%s: batched output does not match\n", distributions[i].name);
+      exit (1);
+    }
+    encrypt_per_sample (fragment, check, key);
+    gss_playready_encrypt_fragment (playready, fragment, check, key);
+    if (memcmp (check, data, fragment->mdat_size) != 0) {
+      g_print ("%s: parallel output does not match\n", distributions[i].name);
+      exit (1);
+    }
+
+    fd = g_file_open_tmp ("gss-encrypt-bench-XXXXXX", &filename, &error);
+    if (fd < 0) {
+      g_print ("%s\n", error->message);
+      exit (1);
+    }
+    if (write (fd, data + 8, fragment->mdat_size - 8) !=
+        fragment->mdat_size - 8) {
+      g_print ("failed to write %s\n", filename);
+      exit (1);
+    }
+    memcpy (check, data, 8);
+    if (!gss_playready_load_fragment (playready, fragment, fd, NULL, check,
+            key, &error)) {
+      g_print ("%s: %s\n", distributions[i].name, error->message);
+      exit (1);
+    }
+    encrypt_per_sample (fragment, check, key);
+    if (memcmp (check, data, fragment->mdat_size) != 0) {
+      g_print ("%s: loaded output does not match\n", distributions[i].name);
+      exit (1);
+    }
+    g_free (check);
+
+    before = run (playready, fragment, data, key, fd, MODE_PER_SAMPLE);
+    after = run (playready, fragment, data, key, fd, MODE_BATCHED);
+    parallel = run (playready, fragment, data, key, fd, MODE_PARALLEL);
+    read = run (playready, fragment, data, key, fd, MODE_READ);
+    loaded = run (playready, fragment, data, key, fd, MODE_LOADED);
+
+    g_print ("%-12s %8d %14.2f %14.2f %14.2f %14.2f %14.2f\n",
+        distributions[i].name, fragment->trun.sample_count, before, after,
+        parallel, read, loaded);
+
+    close (fd);
+    g_unlink (filename);
+    g_free (filename);
+    g_free (data);
+    gss_isom_fragment_free (fragment);
+  }
+
+  g_rand_free (rand);
+  g_object_unref (playready);
+
+  return 0;
+}
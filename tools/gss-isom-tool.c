@@ -2,23 +2,121 @@
 #include "config.h"
 
 #include <gst-streaming-server/gss-isom.h>
+#include <gst-streaming-server/gss-mpegts.h>
+#include <gst-streaming-server/gss-sglist.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 
 
 gboolean verbose = FALSE;
 gboolean dump = FALSE;
 gboolean fragment = FALSE;
+gboolean mpegts = FALSE;
 
 static GOptionEntry entries[] = {
   {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
   {"dump", 'd', 0, G_OPTION_ARG_NONE, &dump, "Dump file to readable output",
       NULL},
   {"fragment", 'd', 0, G_OPTION_ARG_NONE, &fragment, "Fragment file", NULL},
+  {"mpegts", 0, 0, G_OPTION_ARG_NONE, &mpegts,
+      "Package file as MPEG-TS segments and report throughput", NULL},
   {NULL}
 };
 
+static guint8 *
+load_fragment (GssIsomFragment * fragment, int fd)
+{
+  GError *error = NULL;
+  guint8 *data;
+
+  data = g_malloc (fragment->mdat_size);
+  if (!gss_sglist_load (fragment->sglist, fd, data + 8, &error)) {
+    g_print ("load failed: %s\n", error->message);
+    g_error_free (error);
+    g_free (data);
+    return NULL;
+  }
+  return data;
+}
+
+static void
+package_mpegts (GssIsomParser * file, const char *filename)
+{
+  GssIsomTrack *video_track;
+  GssIsomTrack *audio_track;
+  FILE *out;
+  guint64 in_bytes = 0;
+  guint64 out_bytes = 0;
+  gint64 mux_time = 0;
+  int fd;
+  int j;
+
+  gss_isom_parser_fragmentize (file, FALSE);
+
+  video_track = gss_isom_movie_get_video_track (file->movie);
+  audio_track = gss_isom_movie_get_audio_track (file->movie);
+  if (video_track == NULL || audio_track == NULL) {
+    g_print ("need both audio and video tracks\n");
+    return;
+  }
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0) {
+    g_print ("failed to open %s\n", filename);
+    return;
+  }
+  out = fopen ("out.ts", "w");
+
+  for (j = 0; j < video_track->n_fragments; j++) {
+    GssIsomFragment *video_fragment = video_track->fragments[j];
+    GssIsomFragment *audio_fragment = audio_track->fragments[j];
+    guint8 *video_data;
+    guint8 *audio_data;
+    guint8 *data;
+    gsize size;
+    gint64 start;
+
+    video_data = load_fragment (video_fragment, fd);
+    audio_data = load_fragment (audio_fragment, fd);
+    if (video_data == NULL || audio_data == NULL) {
+      g_free (video_data);
+      g_free (audio_data);
+      break;
+    }
+
+    start = g_get_monotonic_time ();
+    data = gss_mpegts_mux_fragments (video_track, video_fragment,
+        video_data + 8, audio_track, audio_fragment, audio_data + 8, &size);
+    mux_time += g_get_monotonic_time () - start;
+
+    in_bytes += video_fragment->mdat_size + audio_fragment->mdat_size - 16;
+    out_bytes += size;
+    if (out) {
+      fwrite (data, 1, size, out);
+    }
+
+    g_free (data);
+    g_free (video_data);
+    g_free (audio_data);
+  }
+
+  if (out) {
+    fclose (out);
+  }
+  close (fd);
+
+  g_print ("segments: %d\n", j);
+  g_print ("input: %" G_GUINT64_FORMAT " bytes\n", in_bytes);
+  g_print ("output: %" G_GUINT64_FORMAT " bytes (%.1f%% overhead)\n",
+      out_bytes, in_bytes ? 100.0 * (out_bytes - in_bytes) / in_bytes : 0.0);
+  g_print ("mux time: %" G_GINT64_FORMAT " us (%.1f MB/s)\n", mux_time,
+      mux_time ? (double) in_bytes / mux_time : 0.0);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -77,6 +175,8 @@ main (int argc, char *argv[])
 
       gss_isom_track_serialize_dash (track, &data, &size);
       g_file_set_contents ("out.mov", (gchar *) data, size, NULL);
+    } else if (mpegts) {
+      package_mpegts (file, argv[i]);
     }
 
     gss_isom_parser_free (file);
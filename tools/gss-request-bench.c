@@ -0,0 +1,160 @@
+
+#include "config.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <gst-streaming-server/gss-config.h>
+#include <gst-streaming-server/gss-transaction.h>
+
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* Measures the per-request cost of the transaction machinery on a
+ * resource that does nothing but say hello, using one keep-alive
+ * client connection so the server loop sees back-to-back requests. */
+
+int n_requests = 20000;
+
+static GOptionEntry entries[] = {
+  {"requests", 'n', 0, G_OPTION_ARG_INT, &n_requests,
+      "Number of requests to make", "N"},
+  {NULL}
+};
+
+static const char hello[] = "Hello, world\n";
+
+static GMainLoop *main_loop;
+static int port;
+static gint64 server_cpu_time;
+
+static gint64
+get_thread_cpu_time (void)
+{
+  struct rusage usage;
+
+#ifdef RUSAGE_THREAD
+  getrusage (RUSAGE_THREAD, &usage);
+#else
+  getrusage (RUSAGE_SELF, &usage);
+#endif
+
+  return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+      G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void
+hello_callback (SoupServer * soupserver, SoupMessage * msg,
+    const char *path, GHashTable * query, SoupClientContext * client,
+    gpointer user_data)
+{
+  GssTransaction *t;
+
+  t = gss_transaction_new (NULL, soupserver, msg, path, query, client);
+  soup_message_set_response (t->msg, "text/plain", SOUP_MEMORY_STATIC,
+      hello, strlen (hello));
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+}
+
+static gboolean
+quit (gpointer data)
+{
+  server_cpu_time = get_thread_cpu_time () - server_cpu_time;
+  g_main_loop_quit (main_loop);
+
+  return FALSE;
+}
+
+static gpointer
+client_thread (gpointer data)
+{
+  SoupSession *session;
+  char *uri;
+  gint64 start = 0;
+  gint64 elapsed;
+  int n_failed = 0;
+  int i;
+
+  session = soup_session_sync_new ();
+  uri = g_strdup_printf ("http://127.0.0.1:%d/hello", port);
+
+  /* the first request opens the connection */
+  for (i = 0; i < n_requests + 1; i++) {
+    SoupMessage *msg;
+
+    if (i == 1)
+      start = g_get_monotonic_time ();
+    msg = soup_message_new ("GET", uri);
+    if (soup_session_send_message (session, msg) != SOUP_STATUS_OK)
+      n_failed++;
+    g_object_unref (msg);
+  }
+  elapsed = g_get_monotonic_time () - start;
+
+  g_idle_add (quit, NULL);
+
+  g_print ("%d requests, %d failed\n", n_requests, n_failed);
+  g_print ("%10.0f requests/s\n", n_requests * 1e6 / elapsed);
+  g_print ("%10.2f us per request\n", (double) elapsed / n_requests);
+
+  g_free (uri);
+  g_object_unref (session);
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  SoupServer *soupserver;
+  GThread *thread;
+
+  context = g_option_context_new ("- request overhead benchmark");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+  if (n_requests < 1) {
+    g_print ("need at least one request\n");
+    exit (1);
+  }
+
+  gst_init (&argc, &argv);
+  gss_init ();
+
+  soupserver = soup_server_new (SOUP_SERVER_PORT, 0, NULL);
+  if (soupserver == NULL) {
+    g_print ("failed to create server\n");
+    exit (1);
+  }
+  port = soup_server_get_port (soupserver);
+  soup_server_add_handler (soupserver, "/hello", hello_callback, NULL, NULL);
+  gss_transaction_connect_server (soupserver);
+  soup_server_run_async (soupserver);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  server_cpu_time = get_thread_cpu_time ();
+  thread = g_thread_new ("client", client_thread, NULL);
+  g_main_loop_run (main_loop);
+  g_thread_join (thread);
+
+  g_print ("%10.2f us of server loop CPU per request\n",
+      (double) server_cpu_time / n_requests);
+
+  g_main_loop_unref (main_loop);
+  g_object_unref (soupserver);
+  gss_deinit ();
+
+  return 0;
+}